@@ -423,3 +423,104 @@ int BRAddressHash160(void *md20, const char *addr)
     if (r) memcpy(md20, &data[1], 20);
     return r;
 }
+
+// writes the binary form of the address for a scriptPubKey to h, returns true if script has an address
+// the script bytes are matched directly, so this is much faster than BRAddressFromScriptPubKey()
+int BRScriptHashFromScriptPubKey(BRScriptHash *h, const uint8_t *script, size_t scriptLen)
+{
+    assert(h != NULL);
+    assert(script != NULL || scriptLen == 0);
+    memset(h, 0, sizeof(*h));
+    if (! script || scriptLen == 0 || scriptLen > MAX_SCRIPT_LENGTH) return 0;
+    
+    if (scriptLen == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG) { // pay-to-pubkey-hash scriptPubKey
+        h->type = SCRIPT_HASH_PUBKEY;
+        h->len = 20;
+        memcpy(h->data, &script[3], 20);
+    }
+    else if (scriptLen == 23 && script[0] == OP_HASH160 && script[1] == 20 && script[22] == OP_EQUAL) {
+        // pay-to-script-hash scriptPubKey
+        h->type = SCRIPT_HASH_SCRIPT;
+        h->len = 20;
+        memcpy(h->data, &script[2], 20);
+    }
+    else if ((script[0] == 65 || script[0] == 33) && scriptLen == script[0] + 2 &&
+             script[scriptLen - 1] == OP_CHECKSIG) { // pay-to-pubkey scriptPubKey, same address as pay-to-pubkey-hash
+        h->type = SCRIPT_HASH_PUBKEY;
+        h->len = 20;
+        BRHash160(h->data, &script[1], script[0]);
+    }
+    else if (scriptLen >= 4 && script[1] == scriptLen - 2 &&
+             ((script[0] == OP_0 && (script[1] == 20 || script[1] == 32)) ||
+              (script[0] >= OP_1 && script[0] <= OP_16 && script[1] <= 40))) { // pay-to-witness scriptPubKey
+        h->type = SCRIPT_HASH_WITNESS | ((script[0] == OP_0) ? 0 : script[0] - OP_1 + 1);
+        h->len = script[1];
+        memcpy(h->data, &script[2], script[1]);
+    }
+    
+    return (h->len > 0);
+}
+
+// writes the binary form of addr to h, returns true if addr is a valid bitcoin address
+int BRScriptHashFromAddress(BRScriptHash *h, const char *addr)
+{
+    uint8_t script[42];
+    
+    assert(h != NULL);
+    assert(addr != NULL);
+    return BRScriptHashFromScriptPubKey(h, script, BRAddressScriptPubKey(script, sizeof(script), addr));
+}
+
+// writes the scriptPubKey for h to script
+// returns the number of bytes written, or scriptLen needed if script is NULL
+size_t BRScriptHashScriptPubKey(uint8_t *script, size_t scriptLen, const BRScriptHash *h)
+{
+    size_t r = 0;
+    
+    assert(h != NULL);
+    
+    if (h->type == SCRIPT_HASH_PUBKEY && h->len == 20) {
+        if (script && 25 <= scriptLen) {
+            script[0] = OP_DUP;
+            script[1] = OP_HASH160;
+            script[2] = 20;
+            memcpy(&script[3], h->data, 20);
+            script[23] = OP_EQUALVERIFY;
+            script[24] = OP_CHECKSIG;
+        }
+        
+        r = (! script || 25 <= scriptLen) ? 25 : 0;
+    }
+    else if (h->type == SCRIPT_HASH_SCRIPT && h->len == 20) {
+        if (script && 23 <= scriptLen) {
+            script[0] = OP_HASH160;
+            script[1] = 20;
+            memcpy(&script[2], h->data, 20);
+            script[22] = OP_EQUAL;
+        }
+        
+        r = (! script || 23 <= scriptLen) ? 23 : 0;
+    }
+    else if ((h->type & SCRIPT_HASH_WITNESS) && (h->type & ~SCRIPT_HASH_WITNESS) <= 16 && h->len >= 2 && h->len <= 40) {
+        if (script && h->len + 2 <= scriptLen) {
+            script[0] = (h->type == SCRIPT_HASH_WITNESS) ? OP_0 : OP_1 + (h->type & ~SCRIPT_HASH_WITNESS) - 1;
+            script[1] = h->len;
+            memcpy(&script[2], h->data, h->len);
+        }
+        
+        r = (! script || h->len + 2 <= scriptLen) ? h->len + 2 : 0;
+    }
+    
+    return r;
+}
+
+// writes the bitcoin address for h to addr
+// returns the number of bytes written, or addrLen needed if addr is NULL
+size_t BRScriptHashAddress(char *addr, size_t addrLen, const BRScriptHash *h)
+{
+    uint8_t script[42];
+    
+    assert(h != NULL);
+    return BRAddressFromScriptPubKey(addr, addrLen, script, BRScriptHashScriptPubKey(script, sizeof(script), h));
+}
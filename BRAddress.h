@@ -121,6 +121,51 @@ inline static int BRAddressEq(const void *addr, const void *otherAddr)
             strncmp((const char *)addr, (const char *)otherAddr, sizeof(BRAddress)) == 0);
 }
 
+#define SCRIPT_HASH_PUBKEY  0x01 // hash160 of the pubKey of a pay-to-pubkey-hash or pay-to-pubkey scriptPubKey
+#define SCRIPT_HASH_SCRIPT  0x02 // hash160 of the redeem script of a pay-to-script-hash scriptPubKey
+#define SCRIPT_HASH_WITNESS 0x80 // or'd with the witness version of a pay-to-witness scriptPubKey
+
+// binary form of an address, for indexing and matching addresses directly with scriptPubKeys, with no base58 or bech32
+// encoding, two scriptPubKeys have the same BRScriptHash if and only if they have the same address
+typedef struct {
+    uint8_t type; // SCRIPT_HASH_PUBKEY, SCRIPT_HASH_SCRIPT, or SCRIPT_HASH_WITNESS | witness version
+    uint8_t len; // length of data, 20 for a hash160, or the length of the witness program
+    uint8_t data[40];
+} BRScriptHash;
+
+// writes the binary form of the address for a scriptPubKey to h, returns true if script has an address
+// the script bytes are matched directly, so this is much faster than BRAddressFromScriptPubKey()
+int BRScriptHashFromScriptPubKey(BRScriptHash *h, const uint8_t *script, size_t scriptLen);
+
+// writes the binary form of addr to h, returns true if addr is a valid bitcoin address
+int BRScriptHashFromAddress(BRScriptHash *h, const char *addr);
+
+// writes the scriptPubKey for h to script
+// returns the number of bytes written, or scriptLen needed if script is NULL
+size_t BRScriptHashScriptPubKey(uint8_t *script, size_t scriptLen, const BRScriptHash *h);
+
+// writes the bitcoin address for h to addr
+// returns the number of bytes written, or addrLen needed if addr is NULL
+size_t BRScriptHashAddress(char *addr, size_t addrLen, const BRScriptHash *h);
+
+// returns a hash value for a BRScriptHash suitable for use in a hashtable, the data is already a uniformly distributed
+// hash or witness program, so its first bytes are used directly
+inline static size_t BRScriptHashHash(const void *h)
+{
+    const BRScriptHash *a = h;
+    
+    return ((size_t)a->data[0] | (size_t)a->data[1] << 8 | (size_t)a->data[2] << 16 | (size_t)a->data[3] << 24) ^
+           a->type;
+}
+
+// true if h and otherH are equal
+inline static int BRScriptHashEq(const void *h, const void *otherH)
+{
+    const BRScriptHash *a = h, *b = otherH;
+    
+    return (a == b || (a->type == b->type && a->len == b->len && memcmp(a->data, b->data, a->len) == 0));
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -49,7 +49,8 @@
 // - In case parse256(IL) >= n or ki = 0, the resulting key is invalid, and one should proceed with the next value for i
 //   (Note: this has probability lower than 1 in 2^127.)
 //
-static void _CKDpriv(UInt256 *k, UInt256 *c, uint32_t i)
+// K is optional, and if not NULL is the already computed public key point(k), needed for non-hardened children
+static void _CKDprivK(UInt256 *k, UInt256 *c, const BRECPoint *K, uint32_t i)
 {
     uint8_t buf[sizeof(BRECPoint) + sizeof(i)];
     UInt512 I;
@@ -58,6 +59,7 @@ static void _CKDpriv(UInt256 *k, UInt256 *c, uint32_t i)
         buf[0] = 0;
         UInt256Set(&buf[1], *k);
     }
+    else if (K) memcpy(buf, K, sizeof(*K));
     else BRSecp256k1PointGen((BRECPoint *)buf, k);
     
     UInt32SetBE(&buf[sizeof(BRECPoint)], i);
@@ -71,6 +73,11 @@ static void _CKDpriv(UInt256 *k, UInt256 *c, uint32_t i)
     mem_clean(buf, sizeof(buf));
 }
 
+static void _CKDpriv(UInt256 *k, UInt256 *c, uint32_t i)
+{
+    _CKDprivK(k, c, NULL, i);
+}
+
 // Public parent key -> public child key
 //
 // CKDpub((Kpar, cpar), i) -> (Ki, ci) computes a child extended public key from the parent extended public key.
@@ -154,6 +161,51 @@ size_t BRBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey mpk, uint
     return (! pubKey || sizeof(BRECPoint) <= pubKeyLen) ? sizeof(BRECPoint) : 0;
 }
 
+// writes the public keys for paths N(m/0H/chain/start) through N(m/0H/chain/start + pubKeysCount - 1) to pubKeys
+void BRBIP32PubKeyRange(BRECPoint pubKeys[], size_t pubKeysCount, BRMasterPubKey mpk, uint32_t chain, uint32_t start)
+{
+    BRMasterPubKey xpub;
+    
+    assert(pubKeys != NULL || pubKeysCount == 0);
+    
+    if (pubKeys && pubKeysCount > 0) {
+        xpub = BRBIP32ChainPubKey(mpk, chain);
+        BRBIP32ChildPubKeyRange(pubKeys, pubKeysCount, xpub, start);
+        var_clean(&xpub.chainCode);
+    }
+}
+
+// returns the extended public key for path N(m/0H/chain), which can be passed to BRBIP32ChildPubKeyRange() to derive
+// keys in the chain without repeating the N(m/0H/chain) derivation for each index
+BRMasterPubKey BRBIP32ChainPubKey(BRMasterPubKey mpk, uint32_t chain)
+{
+    BRMasterPubKey xpub = mpk;
+    UInt160 hash;
+    
+    assert(memcmp(&mpk, &BR_MASTER_PUBKEY_NONE, sizeof(mpk)) != 0);
+    BRHash160(&hash, mpk.pubKey, sizeof(mpk.pubKey));
+    xpub.fingerPrint = hash.u32[0]; // parent fingerprint, N(m/0H)
+    _CKDpub((BRECPoint *)xpub.pubKey, &xpub.chainCode, chain); // path N(m/0H/chain)
+    return xpub;
+}
+
+// writes the public keys for non-hardened children start through start + pubKeysCount - 1 of extended public key xpub
+void BRBIP32ChildPubKeyRange(BRECPoint pubKeys[], size_t pubKeysCount, BRMasterPubKey xpub, uint32_t start)
+{
+    UInt256 chainCode = UINT256_ZERO;
+    
+    assert(pubKeys != NULL || pubKeysCount == 0);
+    assert(memcmp(&xpub, &BR_MASTER_PUBKEY_NONE, sizeof(xpub)) != 0);
+    
+    for (size_t i = 0; pubKeys && i < pubKeysCount; i++) {
+        chainCode = xpub.chainCode;
+        pubKeys[i] = *(BRECPoint *)xpub.pubKey;
+        _CKDpub(&pubKeys[i], &chainCode, start + (uint32_t)i); // index'th key in chain
+    }
+    
+    var_clean(&chainCode);
+}
+
 // sets the private key for path m/0H/chain/index to key
 void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index)
 {
@@ -164,31 +216,61 @@ void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain
 void BRBIP32PrivKeyList(BRKey keys[], size_t keysCount, const void *seed, size_t seedLen, uint32_t chain,
                         const uint32_t indexes[])
 {
-    UInt512 I;
-    UInt256 secret, chainCode, s, c;
+    BRChainPrivKey chainKey;
     
     assert(keys != NULL || keysCount == 0);
     assert(seed != NULL || seedLen == 0);
     assert(indexes != NULL || keysCount == 0);
     
     if (keys && keysCount > 0 && (seed || seedLen == 0) && indexes) {
-        BRHMAC(&I, BRSHA512, sizeof(UInt512), BIP32_SEED_KEY, strlen(BIP32_SEED_KEY), seed, seedLen);
-        secret = *(UInt256 *)&I;
-        chainCode = *(UInt256 *)&I.u8[sizeof(UInt256)];
-        var_clean(&I);
+        BRBIP32ChainPrivKey(&chainKey, seed, seedLen, chain);
+        BRBIP32ChildPrivKeyList(keys, keysCount, &chainKey, indexes);
+        BRBIP32ChainPrivKeyClean(&chainKey);
+    }
+}
 
-        _CKDpriv(&secret, &chainCode, 0 | BIP32_HARD); // path m/0H
-        _CKDpriv(&secret, &chainCode, chain); // path m/0H/chain
+// sets chainKey to the extended private key for path m/0H/chain, which can be passed to BRBIP32ChildPrivKeyList() to
+// derive keys in the chain without repeating the m/0H/chain derivation from the seed, chainKey must be wiped by calling
+// BRBIP32ChainPrivKeyClean()
+void BRBIP32ChainPrivKey(BRChainPrivKey *chainKey, const void *seed, size_t seedLen, uint32_t chain)
+{
+    UInt512 I;
     
-        for (size_t i = 0; i < keysCount; i++) {
-            s = secret;
-            c = chainCode;
-            _CKDpriv(&s, &c, indexes[i]); // index'th key in chain
-            BRKeySetSecret(&keys[i], &s, 1);
-        }
-        
-        var_clean(&secret, &chainCode, &c, &s);
+    assert(chainKey != NULL);
+    assert(seed != NULL || seedLen == 0);
+    BRHMAC(&I, BRSHA512, sizeof(UInt512), BIP32_SEED_KEY, strlen(BIP32_SEED_KEY), seed, seedLen);
+    chainKey->secret = *(UInt256 *)&I;
+    chainKey->chainCode = *(UInt256 *)&I.u8[sizeof(UInt256)];
+    var_clean(&I);
+    _CKDpriv(&chainKey->secret, &chainKey->chainCode, 0 | BIP32_HARD); // path m/0H
+    _CKDpriv(&chainKey->secret, &chainKey->chainCode, chain); // path m/0H/chain
+    BRSecp256k1PointGen(&chainKey->pubKey, &chainKey->secret);
+}
+
+// sets the private key for non-hardened child indexes[i] of chainKey to each element in keys
+void BRBIP32ChildPrivKeyList(BRKey keys[], size_t keysCount, const BRChainPrivKey *chainKey, const uint32_t indexes[])
+{
+    UInt256 s, c;
+    
+    assert(keys != NULL || keysCount == 0);
+    assert(chainKey != NULL);
+    assert(indexes != NULL || keysCount == 0);
+    
+    for (size_t i = 0; keys && indexes && i < keysCount; i++) {
+        s = chainKey->secret;
+        c = chainKey->chainCode;
+        _CKDprivK(&s, &c, &chainKey->pubKey, indexes[i]); // index'th key in chain
+        BRKeySetSecret(&keys[i], &s, 1);
     }
+    
+    var_clean(&c, &s);
+}
+
+// wipes chainKey from memory
+void BRBIP32ChainPrivKeyClean(BRChainPrivKey *chainKey)
+{
+    assert(chainKey != NULL);
+    mem_clean(chainKey, sizeof(*chainKey));
 }
 
 // sets the private key for the specified path to key
@@ -51,6 +51,13 @@ typedef struct {
     uint8_t pubKey[33];
 } BRMasterPubKey;
 
+// extended private key for a chain, with its public key cached since it's needed to derive each non-hardened child
+typedef struct {
+    UInt256 secret;
+    UInt256 chainCode;
+    BRECPoint pubKey;
+} BRChainPrivKey;
+
 #define BR_MASTER_PUBKEY_NONE ((BRMasterPubKey) { 0, UINT256_ZERO, \
     { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } })
 
@@ -61,6 +68,16 @@ BRMasterPubKey BRBIP32MasterPubKey(const void *seed, size_t seedLen);
 // returns number of bytes written, or pubKeyLen needed if pubKey is NULL
 size_t BRBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey mpk, uint32_t chain, uint32_t index);
 
+// writes the public keys for paths N(m/0H/chain/start) through N(m/0H/chain/start + pubKeysCount - 1) to pubKeys
+void BRBIP32PubKeyRange(BRECPoint pubKeys[], size_t pubKeysCount, BRMasterPubKey mpk, uint32_t chain, uint32_t start);
+
+// returns the extended public key for path N(m/0H/chain), which can be passed to BRBIP32ChildPubKeyRange() to derive
+// keys in the chain without repeating the N(m/0H/chain) derivation for each index
+BRMasterPubKey BRBIP32ChainPubKey(BRMasterPubKey mpk, uint32_t chain);
+
+// writes the public keys for non-hardened children start through start + pubKeysCount - 1 of extended public key xpub
+void BRBIP32ChildPubKeyRange(BRECPoint pubKeys[], size_t pubKeysCount, BRMasterPubKey xpub, uint32_t start);
+
 // sets the private key for path m/0H/chain/index to key
 void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index);
 
@@ -68,6 +85,17 @@ void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain
 void BRBIP32PrivKeyList(BRKey keys[], size_t keysCount, const void *seed, size_t seedLen, uint32_t chain,
                         const uint32_t indexes[]);
     
+// sets chainKey to the extended private key for path m/0H/chain, which can be passed to BRBIP32ChildPrivKeyList() to
+// derive keys in the chain without repeating the m/0H/chain derivation from the seed, chainKey must be wiped by calling
+// BRBIP32ChainPrivKeyClean()
+void BRBIP32ChainPrivKey(BRChainPrivKey *chainKey, const void *seed, size_t seedLen, uint32_t chain);
+
+// sets the private key for non-hardened child indexes[i] of chainKey to each element in keys
+void BRBIP32ChildPrivKeyList(BRKey keys[], size_t keysCount, const BRChainPrivKey *chainKey, const uint32_t indexes[]);
+
+// wipes chainKey from memory
+void BRBIP32ChainPrivKeyClean(BRChainPrivKey *chainKey);
+
 // sets the private key for the specified path to key
 // depth is the number of arguments used to specify the path
 void BRBIP32PrivKeyPath(BRKey *key, const void *seed, size_t seedLen, int depth, ...);
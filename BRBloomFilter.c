@@ -39,6 +39,30 @@ inline static uint32_t _BRBloomFilterHash(const BRBloomFilter *filter, const uin
     return BRMurmur3_32(data, dataLen, hashNum*0xfba4c795 + filter->tweak) % (filter->length*8);
 }
 
+// writes the bit index for each of the filter's hash functions to idxs[], hashing data in a single pass
+inline static void _BRBloomFilterHashes(const BRBloomFilter *filter, const uint8_t *data, size_t dataLen,
+                                        uint32_t idxs[])
+{
+    uint32_t i, seeds[BLOOM_MAX_HASH_FUNCS], bits = (uint32_t)(filter->length*8);
+
+    for (i = 0; i < filter->hashFuncs; i++) seeds[i] = i*0xfba4c795 + filter->tweak;
+    BRMurmur3_32Seeds(idxs, seeds, filter->hashFuncs, data, dataLen);
+    for (i = 0; i < filter->hashFuncs; i++) idxs[i] %= bits;
+}
+
+// sets the bits at idxs[], returns true if they were all set already
+inline static int _BRBloomFilterTestAndSet(BRBloomFilter *filter, const uint32_t idxs[])
+{
+    uint8_t matched = 1;
+
+    for (uint32_t i = 0; i < filter->hashFuncs; i++) {
+        matched &= (filter->filter[idxs[i] >> 3] >> (7 & idxs[i])) & 1;
+        filter->filter[idxs[i] >> 3] |= (1 << (7 & idxs[i]));
+    }
+
+    return matched;
+}
+
 // returns a newly allocated bloom filter struct that must be freed by calling BRBloomFilterFree()
 BRBloomFilter *BRBloomFilterNew(double falsePositiveRate, size_t elemCount, uint32_t tweak, uint8_t flags)
 {
@@ -89,6 +113,11 @@ BRBloomFilter *BRBloomFilterParse(const uint8_t *buf, size_t bufLen)
         off += sizeof(uint8_t);
     }
     
+    if (filter->filter && filter->hashFuncs > BLOOM_MAX_HASH_FUNCS) { // BIP37 limits filters to 50 hash functions
+        free(filter->filter);
+        filter->filter = NULL;
+    }
+
     if (! filter->filter) {
         free(filter);
         filter = NULL;
@@ -140,17 +169,61 @@ int BRBloomFilterContainsData(const BRBloomFilter *filter, const uint8_t *data,
 // add data to filter
 void BRBloomFilterInsertData(BRBloomFilter *filter, const uint8_t *data, size_t dataLen)
 {
-    uint32_t i, idx;
+    uint32_t idxs[BLOOM_MAX_HASH_FUNCS];
     
     assert(filter != NULL);
     assert(data != NULL || dataLen == 0);
+    assert(filter->hashFuncs <= BLOOM_MAX_HASH_FUNCS);
     
-    for (i = 0; data && i < filter->hashFuncs; i++) {
-        idx = _BRBloomFilterHash(filter, data, dataLen, i);
-        filter->filter[idx >> 3] |= (1 << (7 & idx));
+    if (data) {
+        _BRBloomFilterHashes(filter, data, dataLen, idxs);
+        _BRBloomFilterTestAndSet(filter, idxs);
+        filter->elemCount++;
     }
-    
-    if (data) filter->elemCount++;
+}
+
+// adds data to filter unless it's already matched, hashing it only once, returns true if data was already matched
+int BRBloomFilterTestAndInsertData(BRBloomFilter *filter, const uint8_t *data, size_t dataLen)
+{
+    uint32_t idxs[BLOOM_MAX_HASH_FUNCS];
+    int matched = 0;
+
+    assert(filter != NULL);
+    assert(data != NULL || dataLen == 0);
+    assert(filter->hashFuncs <= BLOOM_MAX_HASH_FUNCS);
+
+    if (data) {
+        _BRBloomFilterHashes(filter, data, dataLen, idxs);
+        matched = _BRBloomFilterTestAndSet(filter, idxs); // setting bits that are already all set is a no-op
+        if (! matched) filter->elemCount++;
+    }
+
+    return matched;
+}
+
+// adds each of the items not already matched by filter, empty items are skipped, returns the number of items added
+size_t BRBloomFilterInsertBatch(BRBloomFilter *filter, const uint8_t *items[], const size_t itemLens[],
+                                size_t itemCount)
+{
+    uint32_t i, idxs[BLOOM_MAX_HASH_FUNCS], bits, seeds[BLOOM_MAX_HASH_FUNCS];
+    size_t j, count = 0;
+
+    assert(filter != NULL);
+    assert(items != NULL || itemCount == 0);
+    assert(itemLens != NULL || itemCount == 0);
+    assert(filter->hashFuncs <= BLOOM_MAX_HASH_FUNCS);
+    bits = (uint32_t)(filter->length*8);
+    for (i = 0; i < filter->hashFuncs; i++) seeds[i] = i*0xfba4c795 + filter->tweak; // seeds are the same for all items
+
+    for (j = 0; j < itemCount; j++) {
+        if (! items[j] || itemLens[j] == 0) continue;
+        BRMurmur3_32Seeds(idxs, seeds, filter->hashFuncs, items[j], itemLens[j]);
+        for (i = 0; i < filter->hashFuncs; i++) idxs[i] %= bits;
+        if (! _BRBloomFilterTestAndSet(filter, idxs)) count++;
+    }
+
+    filter->elemCount += count;
+    return count;
 }
 
 // frees memory allocated for filter
@@ -71,6 +71,13 @@ int BRBloomFilterContainsData(const BRBloomFilter *filter, const uint8_t *data,
 // add data to filter
 void BRBloomFilterInsertData(BRBloomFilter *filter, const uint8_t *data, size_t dataLen);
 
+// adds data to filter unless it's already matched, hashing it only once, returns true if data was already matched
+int BRBloomFilterTestAndInsertData(BRBloomFilter *filter, const uint8_t *data, size_t dataLen);
+
+// adds each of the items not already matched by filter, empty items are skipped, returns the number of items added
+size_t BRBloomFilterInsertBatch(BRBloomFilter *filter, const uint8_t *items[], const size_t itemLens[],
+                                size_t itemCount);
+
 // frees memory allocated for filter
 void BRBloomFilterFree(BRBloomFilter *filter);
 
@@ -0,0 +1,279 @@
+//
+//  BRCompactFilter.c
+//
+//  Copyright (c) 2026 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRCompactFilter.h"
+#include "BRCrypto.h"
+#include "BRAddress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+typedef struct {
+    const uint8_t *data;
+    size_t length, bitPos;
+} BRBitReader;
+
+// returns the next bit from the stream, or -1 at the end of the stream
+inline static int _BRBitReaderBit(BRBitReader *r)
+{
+    if (r->bitPos >= r->length*8) return -1;
+    r->bitPos++;
+    return (r->data[(r->bitPos - 1)/8] >> (7 - (r->bitPos - 1) % 8)) & 1;
+}
+
+// decodes the next golomb-rice coded value into *value, returns false at the end of the stream
+inline static int _BRBitReaderGolomb(BRBitReader *r, uint8_t p, uint64_t *value)
+{
+    uint64_t q = 0, rem = 0;
+    int bit;
+
+    while ((bit = _BRBitReaderBit(r)) == 1) q++;
+    if (bit < 0 || r->bitPos + p > r->length*8) return 0;
+
+    for (uint8_t i = 0; i < p; i++) rem = (rem << 1) | (uint64_t)_BRBitReaderBit(r);
+    *value = (q << p) | rem;
+    return 1;
+}
+
+inline static void _BRBitWriterBit(uint8_t *buf, size_t *bitPos, int bit)
+{
+    if (bit) buf[*bitPos/8] |= 0x80 >> (*bitPos % 8);
+    (*bitPos)++;
+}
+
+inline static void _BRBitWriterGolomb(uint8_t *buf, size_t *bitPos, uint8_t p, uint64_t value)
+{
+    for (uint64_t q = value >> p; q > 0; q--) _BRBitWriterBit(buf, bitPos, 1);
+    _BRBitWriterBit(buf, bitPos, 0);
+    for (uint8_t i = p; i > 0; i--) _BRBitWriterBit(buf, bitPos, (value >> (i - 1)) & 1);
+}
+
+// returns the high 64 bits of the 128bit product x*y, used to map a 64bit hash uniformly onto [0, y)
+inline static uint64_t _BRMulHigh64(uint64_t x, uint64_t y)
+{
+    uint64_t xl = (uint32_t)x, xh = x >> 32, yl = (uint32_t)y, yh = y >> 32,
+             m1 = xh*yl + ((xl*yl) >> 32), m2 = xl*yh + (uint32_t)m1;
+
+    return xh*yh + (m1 >> 32) + (m2 >> 32);
+}
+
+inline static uint8_t _BRCompactFilterP(uint8_t filterType)
+{
+    return COMPACT_FILTER_BASIC_P; // the basic filter is the only type defined by BIP158
+}
+
+inline static uint64_t _BRCompactFilterM(uint8_t filterType)
+{
+    return COMPACT_FILTER_BASIC_M;
+}
+
+static int _uint64Compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+} BRCompactFilterItem;
+
+static int _BRCompactFilterItemCompare(const void *a, const void *b)
+{
+    const BRCompactFilterItem *x = a, *y = b;
+
+    if (x->len != y->len) return (x->len < y->len) ? -1 : 1;
+    return memcmp(x->data, y->data, x->len);
+}
+
+// hashes items to the range [0, elemCount*M) and sorts them, returns the number of hashes written, which may be less
+// than itemCount since empty items are skipped
+static size_t _BRCompactFilterHashItems(uint8_t filterType, UInt256 blockHash, uint64_t elemCount,
+                                        uint64_t hashes[], const uint8_t *items[], const size_t itemLens[],
+                                        size_t itemCount)
+{
+    uint64_t f = elemCount*_BRCompactFilterM(filterType);
+    size_t i, count = 0;
+
+    for (i = 0; i < itemCount; i++) { // the siphash key is the first 16 bytes of the block hash
+        if (itemLens[i] > 0) hashes[count++] = _BRMulHigh64(BRSipHash24(blockHash.u8, items[i], itemLens[i]), f);
+    }
+
+    qsort(hashes, count, sizeof(*hashes), _uint64Compare);
+    return count;
+}
+
+// returns a newly allocated compact filter for blockHash containing the given items, empty items are skipped
+// result must be freed by calling BRCompactFilterFree()
+BRCompactFilter *BRCompactFilterNew(uint8_t filterType, UInt256 blockHash, const uint8_t *items[],
+                                    const size_t itemLens[], size_t itemCount)
+{
+    BRCompactFilter *filter = calloc(1, sizeof(*filter));
+    BRCompactFilterItem *set = malloc((itemCount ? itemCount : 1)*sizeof(*set));
+    const uint8_t **uniqItems = malloc((itemCount ? itemCount : 1)*sizeof(*uniqItems));
+    size_t *uniqLens = malloc((itemCount ? itemCount : 1)*sizeof(*uniqLens));
+    uint64_t *hashes = malloc((itemCount ? itemCount : 1)*sizeof(*hashes)), n = 0, last = 0;
+    uint8_t p = _BRCompactFilterP(filterType);
+    size_t i, count = 0, off, bitPos = 0;
+
+    assert(filter != NULL);
+    assert(set != NULL && uniqItems != NULL && uniqLens != NULL);
+    assert(hashes != NULL);
+    assert(items != NULL || itemCount == 0);
+    assert(itemLens != NULL || itemCount == 0);
+
+    for (i = 0; i < itemCount; i++) {
+        if (itemLens[i] > 0) set[count++] = (BRCompactFilterItem) { items[i], itemLens[i] };
+    }
+
+    // BIP158 defines N as the number of unique items, so duplicates must be removed before hashing to [0, N*M) or the
+    // range won't match the one derived from elemCount when the filter is queried
+    qsort(set, count, sizeof(*set), _BRCompactFilterItemCompare);
+
+    for (i = 0; i < count; i++) {
+        if (n > 0 && _BRCompactFilterItemCompare(&set[i], &set[i - 1]) == 0) continue;
+        uniqItems[n] = set[i].data;
+        uniqLens[n++] = set[i].len;
+    }
+
+    _BRCompactFilterHashItems(filterType, blockHash, n, hashes, uniqItems, uniqLens, n);
+    free(uniqLens);
+    free(uniqItems);
+    free(set);
+
+    // each value takes p + 1 bits plus one bit per 2^p of its delta, and the deltas sum to at most n*M
+    off = BRVarIntSize(n);
+    filter->filterType = filterType;
+    filter->blockHash = blockHash;
+    filter->elemCount = n;
+    filter->length = off + (n*(p + 1) + ((n*_BRCompactFilterM(filterType)) >> p) + 7)/8;
+    filter->data = calloc(filter->length, sizeof(*filter->data));
+    assert(filter->data != NULL);
+    BRVarIntSet(filter->data, off, n);
+
+    for (i = 0; i < n; i++) {
+        _BRBitWriterGolomb(&filter->data[off], &bitPos, p, hashes[i] - last);
+        last = hashes[i];
+    }
+
+    filter->length = off + (bitPos + 7)/8;
+    free(hashes);
+    return filter;
+}
+
+// buf must contain a serialized filter, as sent in a cfilter message
+// returns a compact filter struct that must be freed by calling BRCompactFilterFree()
+BRCompactFilter *BRCompactFilterParse(uint8_t filterType, UInt256 blockHash, const uint8_t *buf, size_t bufLen)
+{
+    BRCompactFilter *filter = NULL;
+    size_t off = 0;
+    uint64_t n;
+
+    assert(buf != NULL || bufLen == 0);
+
+    if (buf) n = BRVarInt(buf, bufLen, &off);
+
+    // every element takes at least p + 1 bits
+    if (buf && off > 0 && n <= (bufLen - off)*8/(_BRCompactFilterP(filterType) + 1)) {
+        filter = calloc(1, sizeof(*filter));
+        assert(filter != NULL);
+        filter->filterType = filterType;
+        filter->blockHash = blockHash;
+        filter->elemCount = n;
+        filter->length = bufLen;
+        filter->data = malloc(bufLen);
+        assert(filter->data != NULL);
+        memcpy(filter->data, buf, bufLen);
+    }
+
+    return filter;
+}
+
+// true if data is matched by filter
+int BRCompactFilterMatch(const BRCompactFilter *filter, const uint8_t *data, size_t dataLen)
+{
+    return BRCompactFilterMatchAny(filter, &data, &dataLen, 1);
+}
+
+// true if any of the items is matched by filter, decodes the filter only once, so it's much faster than calling
+// BRCompactFilterMatch() for each item
+int BRCompactFilterMatchAny(const BRCompactFilter *filter, const uint8_t *items[], const size_t itemLens[],
+                            size_t itemCount)
+{
+    uint64_t _hashes[(itemCount <= 0x200) ? itemCount : 0],
+             *hashes = (itemCount <= 0x200) ? _hashes : malloc(itemCount*sizeof(*hashes)), delta, value = 0;
+    size_t i = 0, count, off;
+    BRBitReader reader;
+    uint8_t p;
+    int r = 0;
+
+    assert(filter != NULL);
+    assert(items != NULL || itemCount == 0);
+    assert(itemLens != NULL || itemCount == 0);
+    assert(hashes != NULL || itemCount == 0);
+    p = _BRCompactFilterP(filter->filterType);
+    off = BRVarIntSize(filter->elemCount);
+    reader = (BRBitReader) { &filter->data[off], filter->length - off, 0 };
+    count = (filter->elemCount > 0) ? _BRCompactFilterHashItems(filter->filterType, filter->blockHash,
+                                                                 filter->elemCount, hashes, items, itemLens,
+                                                                 itemCount) : 0;
+
+    // walk the sorted item hashes and the sorted filter values together, like a merge
+    for (uint64_t n = 0; ! r && i < count && n < filter->elemCount; n++) {
+        if (! _BRBitReaderGolomb(&reader, p, &delta)) break;
+        value += delta;
+        while (i < count && hashes[i] < value) i++;
+        if (i < count && hashes[i] == value) r = 1;
+    }
+
+    if (hashes != _hashes) free(hashes);
+    return r;
+}
+
+// double-sha256 of the serialized filter
+UInt256 BRCompactFilterHash(const BRCompactFilter *filter)
+{
+    UInt256 hash;
+
+    assert(filter != NULL);
+    BRSHA256_2(&hash, filter->data, filter->length);
+    return hash;
+}
+
+// the filter header that commits to filter and all previous filters in the chain
+UInt256 BRCompactFilterHeader(UInt256 filterHash, UInt256 prevHeader)
+{
+    UInt256 header, buf[2] = { filterHash, prevHeader };
+
+    BRSHA256_2(&header, buf, sizeof(buf));
+    return header;
+}
+
+// frees memory allocated for filter
+void BRCompactFilterFree(BRCompactFilter *filter)
+{
+    assert(filter != NULL);
+    if (filter->data) free(filter->data);
+    free(filter);
+}
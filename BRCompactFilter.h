@@ -0,0 +1,80 @@
+//
+//  BRCompactFilter.h
+//
+//  Copyright (c) 2026 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRCompactFilter_h
+#define BRCompactFilter_h
+
+#include "BRInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// compact block filters are explained in BIP158: https://github.com/bitcoin/bips/blob/master/bip-0158.mediawiki
+// a filter is a golomb-rice coded set of the output scripts created, and previous output scripts spent, in a block
+
+#define COMPACT_FILTER_TYPE_BASIC 0x00
+#define COMPACT_FILTER_BASIC_P    19     // golomb-rice coding parameter
+#define COMPACT_FILTER_BASIC_M    784931 // inverse false positive rate
+
+typedef struct {
+    uint8_t filterType;
+    UInt256 blockHash;
+    uint64_t elemCount;
+    uint8_t *data; // serialized filter, elemCount as a varint followed by the golomb-rice coded set
+    size_t length;
+} BRCompactFilter;
+
+// returns a newly allocated compact filter for blockHash containing the given items, empty items are skipped
+// result must be freed by calling BRCompactFilterFree()
+BRCompactFilter *BRCompactFilterNew(uint8_t filterType, UInt256 blockHash, const uint8_t *items[],
+                                    const size_t itemLens[], size_t itemCount);
+
+// buf must contain a serialized filter, as sent in a cfilter message
+// returns a compact filter struct that must be freed by calling BRCompactFilterFree()
+BRCompactFilter *BRCompactFilterParse(uint8_t filterType, UInt256 blockHash, const uint8_t *buf, size_t bufLen);
+
+// true if data is matched by filter
+int BRCompactFilterMatch(const BRCompactFilter *filter, const uint8_t *data, size_t dataLen);
+
+// true if any of the items is matched by filter, decodes the filter only once, so it's much faster than calling
+// BRCompactFilterMatch() for each item
+int BRCompactFilterMatchAny(const BRCompactFilter *filter, const uint8_t *items[], const size_t itemLens[],
+                            size_t itemCount);
+
+// double-sha256 of the serialized filter
+UInt256 BRCompactFilterHash(const BRCompactFilter *filter);
+
+// the filter header that commits to filter and all previous filters in the chain
+UInt256 BRCompactFilterHeader(UInt256 filterHash, UInt256 prevHeader);
+
+// frees memory allocated for filter
+void BRCompactFilterFree(BRCompactFilter *filter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRCompactFilter_h
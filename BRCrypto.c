@@ -110,19 +110,23 @@ void BRSHA1(void *md20, const void *data, size_t len)
 #define s2(x) (ror32((x), 7) ^ ror32((x), 18) ^ ((x) >> 3))
 #define s3(x) (ror32((x), 17) ^ ror32((x), 19) ^ ((x) >> 10))
 
+static const uint32_t _sha256K[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t _sha256IV[] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
 static void _BRSHA256Compress(uint32_t *r, const uint32_t *x)
 {
-    static const uint32_t k[] = {
-        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-    };
-    
     int i;
     uint32_t a = r[0], b = r[1], c = r[2], d = r[3], e = r[4], f = r[5], g = r[6], h = r[7], t1, t2, w[64];
     
@@ -130,7 +134,7 @@ static void _BRSHA256Compress(uint32_t *r, const uint32_t *x)
     for (; i < 64; i++) w[i] = s3(w[i - 2]) + w[i - 7] + s2(w[i - 15]) + w[i - 16];
     
     for (i = 0; i < 64; i++) {
-        t1 = h + s1(e) + ch(e, f, g) + k[i] + w[i];
+        t1 = h + s1(e) + ch(e, f, g) + _sha256K[i] + w[i];
         t2 = s0(a) + maj(a, b, c);
         h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
     }
@@ -140,54 +144,165 @@ static void _BRSHA256Compress(uint32_t *r, const uint32_t *x)
     mem_clean(w, sizeof(w));
 }
 
-void BRSHA224(void *md28, const void *data, size_t len) {
-    size_t i;
-    uint32_t x[16], buf[] = { 0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511,
-                              0x64f98fa7, 0xbefa4fa4 }; // initial buffer values
+static void _BRSHA256BlocksPortable(uint32_t *r, const uint8_t *data, size_t count)
+{
+    uint32_t x[16];
+    
+    for (size_t i = 0; i < count; i++) {
+        memcpy(x, &data[i*64], sizeof(x));
+        _BRSHA256Compress(r, x);
+    }
+    
+    mem_clean(x, sizeof(x));
+}
 
-    assert(md28 != NULL);
-    assert(data != NULL || len == 0);
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define SHA256_HW_DISPATCH 1
 
-    for (i = 0; i < len; i += 64) { // process data in 64 byte blocks
-        memcpy(x, (const uint8_t *)data + i, (i + 64 < len) ? 64 : len - i);
-        if (i + 64 > len) break;
-        _BRSHA256Compress(buf, x);
+// x86 sha extensions: https://software.intel.com/en-us/articles/intel-sha-extensions
+// the state is kept as ABEF and CDGH word pairs, which is the layout the sha256rnds2 instruction works on
+__attribute__((target("sha,sse4.1")))
+static void _BRSHA256BlocksHW(uint32_t *r, const uint8_t *data, size_t count)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL); // big endian word loads
+    __m128i s0, s1, t, abef, cdgh, m[4];
+    
+    t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&r[0]), 0xb1); // CDAB
+    s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&r[4]), 0x1b); // EFGH
+    s0 = _mm_alignr_epi8(t, s1, 8); // ABEF
+    s1 = _mm_blend_epi16(s1, t, 0xf0); // CDGH
+    
+    for (size_t j = 0; j < count; j++, data += 64) {
+        abef = s0, cdgh = s1;
+        
+        for (int i = 0; i < 16; i++) { // four rounds per iteration, m[i & 3] holds message words i*4 to i*4 + 3
+            if (i < 4) m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[i*16]), mask);
+            else m[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]),
+                                                               _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4)),
+                                                 m[(i + 3) & 3]);
+            t = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)&_sha256K[i*4]));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, t);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(t, 0x0e));
+        }
+        
+        s0 = _mm_add_epi32(s0, abef);
+        s1 = _mm_add_epi32(s1, cdgh);
     }
+    
+    t = _mm_shuffle_epi32(s0, 0x1b); // FEBA
+    s1 = _mm_shuffle_epi32(s1, 0xb1); // DCHG
+    _mm_storeu_si128((__m128i *)&r[0], _mm_blend_epi16(t, s1, 0xf0)); // DCBA
+    _mm_storeu_si128((__m128i *)&r[4], _mm_alignr_epi8(s1, t, 8)); // HGFE
+    m[0] = m[1] = m[2] = m[3] = t = _mm_setzero_si128();
+}
 
-    memset((uint8_t *)x + (len - i), 0, 64 - (len - i)); // clear remainder of x
+// true if the cpu supports the sha extensions, and the ssse3 and sse4.1 instructions used alongside them
+static int _BRSHA256HWDetect(void)
+{
+    unsigned a, b, c, d;
+    
+    if (! __get_cpuid(1, &a, &b, &c, &d) || ! (c & bit_SSSE3) || ! (c & bit_SSE4_1)) return 0;
+    if (__get_cpuid_max(0, NULL) < 7) return 0;
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & (1 << 29)) ? 1 : 0; // CPUID.(EAX=7,ECX=0):EBX.SHA[bit 29]
+}
+
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#include <arm_neon.h>
+#define SHA256_HW 1
+
+// armv8 cryptography extensions, always present on 64bit apple devices, and enabled at compile time elsewhere
+static void _BRSHA256BlocksHW(uint32_t *r, const uint8_t *data, size_t count)
+{
+    uint32x4_t s0 = vld1q_u32(&r[0]), s1 = vld1q_u32(&r[4]), abcd, efgh, s, t, m[4];
+    
+    for (size_t j = 0; j < count; j++, data += 64) {
+        abcd = s0, efgh = s1;
+        
+        for (int i = 0; i < 16; i++) { // four rounds per iteration, m[i & 3] holds message words i*4 to i*4 + 3
+            if (i < 4) m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&data[i*16])));
+            else m[i & 3] = vsha256su1q_u32(vsha256su0q_u32(m[i & 3], m[(i + 1) & 3]), m[(i + 2) & 3],
+                                            m[(i + 3) & 3]);
+            t = vaddq_u32(m[i & 3], vld1q_u32(&_sha256K[i*4]));
+            s = s0;
+            s0 = vsha256hq_u32(s0, s1, t);
+            s1 = vsha256h2q_u32(s1, s, t);
+        }
+        
+        s0 = vaddq_u32(s0, abcd);
+        s1 = vaddq_u32(s1, efgh);
+    }
+    
+    vst1q_u32(&r[0], s0);
+    vst1q_u32(&r[4], s1);
+}
+#endif
+
+#if SHA256_HW_DISPATCH
+static int _sha256HW = -1; // -1 until the cpu has been checked for sha instructions
+
+inline static int _BRSHA256HasHW(void)
+{
+    int hw = __atomic_load_n(&_sha256HW, __ATOMIC_RELAXED);
+    
+    if (hw < 0) __atomic_store_n(&_sha256HW, (hw = _BRSHA256HWDetect()), __ATOMIC_RELAXED);
+    return hw;
+}
+#elif SHA256_HW
+#define _BRSHA256HasHW() 1
+#else
+#define _BRSHA256HasHW() 0
+#define _BRSHA256BlocksHW _BRSHA256BlocksPortable
+#endif
+
+// compresses count consecutive 64 byte blocks of data into the state r, using sha instructions if the cpu has them
+inline static void _BRSHA256Blocks(uint32_t *r, const uint8_t *data, size_t count)
+{
+    if (_BRSHA256HasHW()) _BRSHA256BlocksHW(r, data, count);
+    else _BRSHA256BlocksPortable(r, data, count);
+}
+
+// hashes len bytes of data, including the final padding and length blocks, into the state buf
+static void _BRSHA256Hash(uint32_t *buf, const void *data, size_t len)
+{
+    size_t i = len - len % 64, n = (len % 64 < 56) ? 16 : 32;
+    uint32_t x[32];
+    
+    _BRSHA256Blocks(buf, data, len/64); // process data in 64 byte blocks
+    memcpy(x, (const uint8_t *)data + i, len - i);
+    memset((uint8_t *)x + (len - i), 0, n*4 - (len - i)); // clear remainder of x
     ((uint8_t *)x)[len - i] = 0x80; // append padding
-    if (len - i >= 56) _BRSHA256Compress(buf, x), memset(x, 0, 64); // length goes to next block
-    x[14] = be32((uint32_t)(len >> 29)), x[15] = be32((uint32_t)(len << 3)); // append length in bits
-    _BRSHA256Compress(buf, x); // finalize
+    x[n - 2] = be32((uint32_t)(len >> 29)), x[n - 1] = be32((uint32_t)(len << 3)); // append length in bits
+    _BRSHA256Blocks(buf, (const uint8_t *)x, n/16); // finalize
+    mem_clean(x, sizeof(x));
+}
+
+void BRSHA224(void *md28, const void *data, size_t len) {
+    size_t i;
+    uint32_t buf[] = { 0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511,
+                       0x64f98fa7, 0xbefa4fa4 }; // initial buffer values
+
+    assert(md28 != NULL);
+    assert(data != NULL || len == 0);
+    _BRSHA256Hash(buf, data, len);
     for (i = 0; i < 7; i++) buf[i] = be32(buf[i]); // endian swap
     memcpy(md28, buf, 28); // write to md
-    mem_clean(x, sizeof(x));
     mem_clean(buf, sizeof(buf));
 }
 
 void BRSHA256(void *md32, const void *data, size_t len)
 {
     size_t i;
-    uint32_t x[16], buf[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
-                              0x1f83d9ab, 0x5be0cd19 }; // initial buffer values
+    uint32_t buf[8];
     
     assert(md32 != NULL);
     assert(data != NULL || len == 0);
-
-    for (i = 0; i < len; i += 64) { // process data in 64 byte blocks
-        memcpy(x, (const uint8_t *)data + i, (i + 64 < len) ? 64 : len - i);
-        if (i + 64 > len) break;
-        _BRSHA256Compress(buf, x);
-    }
-    
-    memset((uint8_t *)x + (len - i), 0, 64 - (len - i)); // clear remainder of x
-    ((uint8_t *)x)[len - i] = 0x80; // append padding
-    if (len - i >= 56) _BRSHA256Compress(buf, x), memset(x, 0, 64); // length goes to next block
-    x[14] = be32((uint32_t)(len >> 29)), x[15] = be32((uint32_t)(len << 3)); // append length in bits
-    _BRSHA256Compress(buf, x); // finalize
+    memcpy(buf, _sha256IV, sizeof(buf)); // initial buffer values
+    _BRSHA256Hash(buf, data, len);
     for (i = 0; i < 8; i++) buf[i] = be32(buf[i]); // endian swap
     memcpy(md32, buf, 32); // write to md
-    mem_clean(x, sizeof(x));
     mem_clean(buf, sizeof(buf));
 }
 
@@ -202,6 +317,211 @@ void BRSHA256_2(void *md32, const void *data, size_t len)
     BRSHA256(md32, t, sizeof(t));
 }
 
+// initializes ctx to the sha-256 initial state
+void BRSHA256Init(BRSHA256Ctx *ctx)
+{
+    assert(ctx != NULL);
+    memcpy(ctx->h, _sha256IV, sizeof(ctx->h));
+    ctx->len = 0;
+}
+
+// absorbs len bytes of data into ctx
+void BRSHA256Update(BRSHA256Ctx *ctx, const void *data, size_t len)
+{
+    size_t off, n;
+    
+    assert(ctx != NULL);
+    assert(data != NULL || len == 0);
+    off = ctx->len % 64;
+    ctx->len += len;
+    
+    if (off > 0) { // fill the partial block left by earlier data first
+        n = (len < 64 - off) ? len : 64 - off;
+        memcpy(&ctx->buf[off], data, n);
+        data = (const uint8_t *)data + n, len -= n;
+        if (off + n < 64) return;
+        _BRSHA256Blocks(ctx->h, ctx->buf, 1);
+    }
+    
+    _BRSHA256Blocks(ctx->h, data, len/64); // process the rest of data in 64 byte blocks, straight from data
+    memcpy(ctx->buf, (const uint8_t *)data + (len - len % 64), len % 64);
+}
+
+// writes the sha-256 hash of all data absorbed by ctx to md32, and wipes ctx
+void BRSHA256Final(BRSHA256Ctx *ctx, void *md32)
+{
+    size_t i, off;
+    uint32_t x;
+    
+    assert(ctx != NULL);
+    assert(md32 != NULL);
+    off = ctx->len % 64;
+    ctx->buf[off++] = 0x80; // append padding
+    if (off > 56) memset(&ctx->buf[off], 0, 64 - off), _BRSHA256Blocks(ctx->h, ctx->buf, 1), off = 0;
+    memset(&ctx->buf[off], 0, 56 - off); // clear remainder of buf
+    x = be32((uint32_t)(ctx->len >> 29)), memcpy(&ctx->buf[56], &x, sizeof(x)); // append length in bits
+    x = be32((uint32_t)(ctx->len << 3)), memcpy(&ctx->buf[60], &x, sizeof(x));
+    _BRSHA256Blocks(ctx->h, ctx->buf, 1); // finalize
+    for (i = 0; i < 8; i++) x = be32(ctx->h[i]), memcpy((uint8_t *)md32 + i*4, &x, sizeof(x)); // write to md
+    mem_clean(ctx, sizeof(*ctx));
+}
+
+#define SHA256_LANES 4 // number of independent messages interleaved by BRSHA256Multi()
+
+// sha-256 compression of SHA256_LANES independent blocks into the states r, both stored word-interleaved so each
+// operation vectorizes across lanes, and the words of x already converted from big endian
+static void _BRSHA256CompressLanes(uint32_t r[8][SHA256_LANES], const uint32_t x[16][SHA256_LANES])
+{
+#if defined(__GNUC__) && SHA256_LANES == 4
+    // gcc/clang vector extensions compile to sse2 on x86-64 and neon on arm64, and to scalar code everywhere else
+    typedef uint32_t lane_t __attribute__((vector_size(16)));
+#define ror_lanes(a, b) (((a) >> (b)) | ((a) << (32 - (b))))
+    lane_t a, b, c, d, e, f, g, h, t1, t2, k, v[8], w[64];
+    int i;
+    
+    memcpy(w, x, 16*sizeof(*w));
+    memcpy(v, r, sizeof(v));
+    a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    
+    for (i = 16; i < 64; i++) {
+        w[i] = (ror_lanes(w[i - 2], 17) ^ ror_lanes(w[i - 2], 19) ^ (w[i - 2] >> 10)) + w[i - 7] +
+               (ror_lanes(w[i - 15], 7) ^ ror_lanes(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 16];
+    }
+    
+    for (i = 0; i < 64; i++) {
+        k = (lane_t) { _sha256K[i], _sha256K[i], _sha256K[i], _sha256K[i] };
+        t1 = h + (ror_lanes(e, 6) ^ ror_lanes(e, 11) ^ ror_lanes(e, 25)) + ((e & f) ^ (~e & g)) + k + w[i];
+        t2 = (ror_lanes(a, 2) ^ ror_lanes(a, 13) ^ ror_lanes(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+    }
+    
+    v[0] += a, v[1] += b, v[2] += c, v[3] += d, v[4] += e, v[5] += f, v[6] += g, v[7] += h;
+    memcpy(r, v, sizeof(v));
+    var_clean(&a, &b, &c, &d, &e, &f, &g, &h, &t1, &t2);
+    mem_clean(v, sizeof(v));
+    mem_clean(w, sizeof(w));
+#undef ror_lanes
+#else
+    uint32_t a[SHA256_LANES], b[SHA256_LANES], c[SHA256_LANES], d[SHA256_LANES], e[SHA256_LANES], f[SHA256_LANES],
+             g[SHA256_LANES], h[SHA256_LANES], t1, t2, w[64][SHA256_LANES];
+    unsigned i, l;
+    
+    memcpy(w, x, 16*sizeof(*w));
+    memcpy(a, r[0], sizeof(a)), memcpy(b, r[1], sizeof(b)), memcpy(c, r[2], sizeof(c)), memcpy(d, r[3], sizeof(d));
+    memcpy(e, r[4], sizeof(e)), memcpy(f, r[5], sizeof(f)), memcpy(g, r[6], sizeof(g)), memcpy(h, r[7], sizeof(h));
+    
+    for (i = 16; i < 64; i++) {
+        for (l = 0; l < SHA256_LANES; l++) {
+            w[i][l] = s3(w[i - 2][l]) + w[i - 7][l] + s2(w[i - 15][l]) + w[i - 16][l];
+        }
+    }
+    
+    for (i = 0; i < 64; i++) {
+        for (l = 0; l < SHA256_LANES; l++) {
+            t1 = h[l] + s1(e[l]) + ch(e[l], f[l], g[l]) + _sha256K[i] + w[i][l];
+            t2 = s0(a[l]) + maj(a[l], b[l], c[l]);
+            h[l] = g[l], g[l] = f[l], f[l] = e[l], e[l] = d[l] + t1, d[l] = c[l], c[l] = b[l], b[l] = a[l];
+            a[l] = t1 + t2;
+        }
+    }
+    
+    for (l = 0; l < SHA256_LANES; l++) {
+        r[0][l] += a[l], r[1][l] += b[l], r[2][l] += c[l], r[3][l] += d[l];
+        r[4][l] += e[l], r[5][l] += f[l], r[6][l] += g[l], r[7][l] += h[l];
+    }
+    
+    var_clean(&a, &b, &c, &d, &e, &f, &g, &h);
+    var_clean(&t1, &t2);
+    mem_clean(w, sizeof(w));
+#endif
+}
+
+// hashes count messages, each of lens[i] bytes, or of len bytes if lens is NULL, SHA256_LANES at a time, starting the
+// next message in a lane as soon as the lane's previous message is done, each message is entirely read before its
+// hash is written, so md32[i] may be the same buffer as data[i]
+static void _BRSHA256MultiLanes(void *md32[], const void *data[], const size_t lens[], size_t len, size_t count)
+{
+    uint32_t r[8][SHA256_LANES], x[16][SHA256_LANES], word;
+    uint8_t tail[SHA256_LANES][128];
+    const uint8_t *p;
+    size_t msg[SHA256_LANES], block[SHA256_LANES], full[SHA256_LANES], blocks[SHA256_LANES], next = 0, active = 0,
+           i, l, n;
+    
+    for (l = 0; l < SHA256_LANES; l++) msg[l] = SIZE_MAX; // idle lanes hash a zero block that's never written out
+    
+    for (;;) {
+        for (l = 0; l < SHA256_LANES; l++) {
+            if (msg[l] == SIZE_MAX && next < count) { // start the next message in this lane
+                msg[l] = next++;
+                n = (lens) ? lens[msg[l]] : len;
+                block[l] = 0;
+                full[l] = n/64;
+                blocks[l] = full[l] + ((n % 64 < 56) ? 1 : 2);
+                memset(tail[l], 0, sizeof(tail[l]));
+                memcpy(tail[l], (const uint8_t *)data[msg[l]] + full[l]*64, n % 64);
+                tail[l][n % 64] = 0x80; // append padding
+                word = be32((uint32_t)(n >> 29)), memcpy(&tail[l][(blocks[l] - full[l])*64 - 8], &word, 4);
+                word = be32((uint32_t)(n << 3)), memcpy(&tail[l][(blocks[l] - full[l])*64 - 4], &word, 4);
+                for (i = 0; i < 8; i++) r[i][l] = _sha256IV[i];
+                active++;
+            }
+            
+            if (msg[l] != SIZE_MAX) {
+                p = (block[l] < full[l]) ? (const uint8_t *)data[msg[l]] + block[l]*64 :
+                    tail[l] + (block[l] - full[l])*64;
+                for (i = 0; i < 16; i++) memcpy(&word, &p[i*4], 4), x[i][l] = be32(word);
+            }
+            else for (i = 0; i < 16; i++) x[i][l] = 0;
+        }
+        
+        if (active == 0) break;
+        _BRSHA256CompressLanes(r, x);
+        
+        for (l = 0; l < SHA256_LANES; l++) {
+            if (msg[l] == SIZE_MAX || ++block[l] < blocks[l]) continue;
+            for (i = 0; i < 8; i++) word = be32(r[i][l]), memcpy((uint8_t *)md32[msg[l]] + i*4, &word, 4);
+            msg[l] = SIZE_MAX;
+            active--;
+        }
+    }
+    
+    mem_clean(r, sizeof(r));
+    mem_clean(x, sizeof(x));
+    mem_clean(tail, sizeof(tail));
+    var_clean(&word);
+}
+
+// sha-256 of count independent messages, md32[i] is set to the hash of lens[i] bytes of data[i]
+// without sha instructions, several messages are hashed at once in simd lanes, so this is much faster than calling
+// BRSHA256() for each message
+void BRSHA256Multi(void *md32[], const void *data[], const size_t lens[], size_t count)
+{
+    assert(md32 != NULL || count == 0);
+    assert(data != NULL || count == 0);
+    assert(lens != NULL || count == 0);
+    
+    if (_BRSHA256HasHW() || count < 2) { // sha instructions are faster than simd lanes, even for a single message
+        for (size_t i = 0; i < count; i++) BRSHA256(md32[i], data[i], lens[i]);
+    }
+    else _BRSHA256MultiLanes(md32, data, lens, 0, count);
+}
+
+// double-sha-256 of count independent messages, md32[i] is set to the hash of lens[i] bytes of data[i]
+void BRSHA256_2Multi(void *md32[], const void *data[], const size_t lens[], size_t count)
+{
+    assert(md32 != NULL || count == 0);
+    assert(data != NULL || count == 0);
+    assert(lens != NULL || count == 0);
+    
+    if (_BRSHA256HasHW() || count < 2) {
+        for (size_t i = 0; i < count; i++) BRSHA256_2(md32[i], data[i], lens[i]);
+    }
+    else {
+        _BRSHA256MultiLanes(md32, data, lens, 0, count);
+        _BRSHA256MultiLanes(md32, (const void **)md32, NULL, 32, count); // second pass hashes the first in place
+    }
+}
+
 // bitwise right rotation
 #define ror64(a, b) (((a) >> (b)) | ((a) << (64 - (b))))
 
@@ -249,6 +569,18 @@ static void _BRSHA512Compress(uint64_t *r, const uint64_t *x)
     mem_clean(w, sizeof(w));
 }
 
+static void _BRSHA512Blocks(uint64_t *r, const uint8_t *data, size_t count)
+{
+    uint64_t x[16];
+    
+    for (size_t i = 0; i < count; i++) {
+        memcpy(x, &data[i*128], sizeof(x));
+        _BRSHA512Compress(r, x);
+    }
+    
+    mem_clean(x, sizeof(x));
+}
+
 void BRSHA384(void *md48, const void *data, size_t len)
 {
     size_t i;
@@ -301,6 +633,58 @@ void BRSHA512(void *md64, const void *data, size_t len)
     mem_clean(buf, sizeof(buf));
 }
 
+// initializes ctx to the sha-512 initial state
+void BRSHA512Init(BRSHA512Ctx *ctx)
+{
+    static const uint64_t iv[] = { 0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
+                                   0x510e527fade682d1, 0x9b05688c2b3e6c1f, 0x1f83d9abfb41bd6b, 0x5be0cd19137e2179 };
+    
+    assert(ctx != NULL);
+    memcpy(ctx->h, iv, sizeof(ctx->h));
+    ctx->len = 0;
+}
+
+// absorbs len bytes of data into ctx
+void BRSHA512Update(BRSHA512Ctx *ctx, const void *data, size_t len)
+{
+    size_t off, n;
+    
+    assert(ctx != NULL);
+    assert(data != NULL || len == 0);
+    off = ctx->len % 128;
+    ctx->len += len;
+    
+    if (off > 0) { // fill the partial block left by earlier data first
+        n = (len < 128 - off) ? len : 128 - off;
+        memcpy(&ctx->buf[off], data, n);
+        data = (const uint8_t *)data + n, len -= n;
+        if (off + n < 128) return;
+        _BRSHA512Blocks(ctx->h, ctx->buf, 1);
+    }
+    
+    _BRSHA512Blocks(ctx->h, data, len/128); // process the rest of data in 128 byte blocks
+    memcpy(ctx->buf, (const uint8_t *)data + (len - len % 128), len % 128);
+}
+
+// writes the sha-512 hash of all data absorbed by ctx to md64, and wipes ctx
+void BRSHA512Final(BRSHA512Ctx *ctx, void *md64)
+{
+    size_t i, off;
+    uint64_t x;
+    
+    assert(ctx != NULL);
+    assert(md64 != NULL);
+    off = ctx->len % 128;
+    ctx->buf[off++] = 0x80; // append padding
+    if (off > 112) memset(&ctx->buf[off], 0, 128 - off), _BRSHA512Blocks(ctx->h, ctx->buf, 1), off = 0;
+    memset(&ctx->buf[off], 0, 112 - off); // clear remainder of buf
+    x = be64(ctx->len >> 61), memcpy(&ctx->buf[112], &x, sizeof(x)); // append length in bits
+    x = be64(ctx->len << 3), memcpy(&ctx->buf[120], &x, sizeof(x));
+    _BRSHA512Blocks(ctx->h, ctx->buf, 1); // finalize
+    for (i = 0; i < 8; i++) x = be64(ctx->h[i]), memcpy((uint8_t *)md64 + i*8, &x, sizeof(x)); // write to md
+    mem_clean(ctx, sizeof(*ctx));
+}
+
 // basic ripemd functions
 #define f(x, y, z) ((x) ^ (y) ^ (z))
 #define g(x, y, z) (((x) & (y)) | (~(x) & (z)))
@@ -595,6 +979,76 @@ uint32_t BRMurmur3_32(const void *data, size_t len, uint32_t seed)
     return h;
 }
 
+// murmurHash3 of data with each of seedCount seeds, written to hashes[], reads each block of data only once and mixes
+// it into all the seeded states, which is much faster than calling BRMurmur3_32() seedCount times
+void BRMurmur3_32Seeds(uint32_t hashes[], const uint32_t seeds[], size_t seedCount, const void *data, size_t len)
+{
+    uint32_t k = 0;
+    size_t i, j, count = len/4;
+
+    assert(hashes != NULL || seedCount == 0);
+    assert(seeds != NULL || seedCount == 0);
+    assert(data != NULL || len == 0);
+
+    for (j = 0; j < seedCount; j++) hashes[j] = seeds[j];
+
+    for (i = 0; i < count; i++) { // the block mixing doesn't depend on the seed
+        k = le32(((const uint32_t *)data)[i])*C1;
+        k = rol32(k, 15)*C2;
+        for (j = 0; j < seedCount; j++) hashes[j] ^= k, hashes[j] = rol32(hashes[j], 13)*5 + 0xe6546b64;
+    }
+
+    k = 0;
+
+    switch (len & 3) {
+        case 3: k ^= ((const uint8_t *)data)[i*4 + 2] << 16; // fall through
+        case 2: k ^= ((const uint8_t *)data)[i*4 + 1] << 8; // fall through
+        case 1: k ^= ((const uint8_t *)data)[i*4], k *= C1, k = rol32(k, 15)*C2;
+    }
+
+    for (j = 0; j < seedCount; j++) hashes[j] ^= k ^ (uint32_t)len, fmix32(hashes[j]);
+}
+
+// basic siphash round
+#define sipround(v0, v1, v2, v3) ((v0) += (v1), (v1) = rol64((v1), 13), (v1) ^= (v0), (v0) = rol64((v0), 32),\
+                                  (v2) += (v3), (v3) = rol64((v3), 16), (v3) ^= (v2),\
+                                  (v0) += (v3), (v3) = rol64((v3), 21), (v3) ^= (v0),\
+                                  (v2) += (v1), (v1) = rol64((v1), 17), (v1) ^= (v2), (v2) = rol64((v2), 32))
+
+// SipHash-2-4: https://131002.net/siphash/siphash.pdf - keyed 64bit hash, used for BIP158 compact block filters
+uint64_t BRSipHash24(const void *key16, const void *data, size_t len)
+{
+    uint64_t k0, k1, m, b = (uint64_t)len << 56;
+    size_t i, count = len/8;
+
+    assert(key16 != NULL);
+    assert(data != NULL || len == 0);
+    memcpy(&k0, key16, sizeof(k0));
+    memcpy(&k1, (const uint8_t *)key16 + 8, sizeof(k1));
+    k0 = le64(k0), k1 = le64(k1);
+
+    uint64_t v0 = k0 ^ 0x736f6d6570736575, v1 = k1 ^ 0x646f72616e646f6d, v2 = k0 ^ 0x6c7967656e657261,
+             v3 = k1 ^ 0x7465646279746573;
+
+    for (i = 0; i < count; i++) {
+        memcpy(&m, (const uint8_t *)data + i*8, sizeof(m));
+        m = le64(m);
+        v3 ^= m;
+        sipround(v0, v1, v2, v3);
+        sipround(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    for (i = len & 7; i > 0; i--) b |= (uint64_t)((const uint8_t *)data)[count*8 + i - 1] << ((i - 1)*8);
+    v3 ^= b;
+    sipround(v0, v1, v2, v3);
+    sipround(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    for (i = 0; i < 4; i++) sipround(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
 // HMAC(key, data) = hash((key xor opad) || hash((key xor ipad) || data))
 // opad = 0x5c5c5c...5c5c
 // ipad = 0x363636...3636
@@ -627,6 +1081,66 @@ void BRHMAC(void *mac, void (*hash)(void *, const void *, size_t), size_t hashLe
     mem_clean(kopad, blockLen);
 }
 
+// hmac inner and outer hash states after absorbing the padded key, for computing many macs with the same key
+typedef struct {
+    int is512; // true for hmac-sha512, false for hmac-sha256
+    union {
+        BRSHA256Ctx sha256;
+        BRSHA512Ctx sha512;
+    } inner, outer;
+} BRHMACPads;
+
+// returns true and sets pads for key if hash is BRSHA256 or BRSHA512, the only hashes with resumable states
+static int _BRHMACPadsInit(BRHMACPads *pads, void (*hash)(void *, const void *, size_t), const void *key,
+                           size_t keyLen)
+{
+    size_t i, blockLen = (hash == BRSHA512) ? 128 : 64;
+    uint8_t k[64], ipad[128], opad[128];
+    
+    if (hash != BRSHA256 && hash != BRSHA512) return 0;
+    pads->is512 = (hash == BRSHA512);
+    if (keyLen > blockLen) hash(k, key, keyLen), key = k, keyLen = (pads->is512) ? 64 : 32;
+    memset(ipad, 0, blockLen);
+    memcpy(ipad, key, keyLen);
+    memcpy(opad, ipad, blockLen);
+    for (i = 0; i < blockLen; i++) ipad[i] ^= 0x36, opad[i] ^= 0x5c;
+    
+    if (pads->is512) {
+        BRSHA512Init(&pads->inner.sha512), BRSHA512Update(&pads->inner.sha512, ipad, blockLen);
+        BRSHA512Init(&pads->outer.sha512), BRSHA512Update(&pads->outer.sha512, opad, blockLen);
+    }
+    else {
+        BRSHA256Init(&pads->inner.sha256), BRSHA256Update(&pads->inner.sha256, ipad, blockLen);
+        BRSHA256Init(&pads->outer.sha256), BRSHA256Update(&pads->outer.sha256, opad, blockLen);
+    }
+    
+    mem_clean(k, sizeof(k));
+    mem_clean(ipad, sizeof(ipad));
+    mem_clean(opad, sizeof(opad));
+    return 1;
+}
+
+// HMAC(key, data) resuming from the padded key states in pads, which saves hashing two blocks for each mac
+static void _BRHMACPadsMac(const BRHMACPads *pads, void *mac, const void *data, size_t dataLen)
+{
+    BRHMACPads p = *pads;
+    
+    if (p.is512) {
+        BRSHA512Update(&p.inner.sha512, data, dataLen);
+        BRSHA512Final(&p.inner.sha512, mac);
+        BRSHA512Update(&p.outer.sha512, mac, 64);
+        BRSHA512Final(&p.outer.sha512, mac);
+    }
+    else {
+        BRSHA256Update(&p.inner.sha256, data, dataLen);
+        BRSHA256Final(&p.inner.sha256, mac);
+        BRSHA256Update(&p.outer.sha256, mac, 32);
+        BRSHA256Final(&p.outer.sha256, mac);
+    }
+    
+    mem_clean(&p, sizeof(p));
+}
+
 // hmac-drbg with no prediction resistance or additional input
 // K and V must point to buffers of size hashLen, and ps (personalization string) may be NULL
 // to generate additional drbg output, use K and V from the previous call, and set seed, nonce and ps to NULL
@@ -884,6 +1398,8 @@ void BRPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
 {
     uint8_t s[saltLen + sizeof(uint32_t)];
     uint32_t i, j, U[hashLen/sizeof(uint32_t)], T[hashLen/sizeof(uint32_t)];
+    BRHMACPads pads;
+    int hasPads;
     
     assert(dk != NULL || dkLen == 0);
     assert(hash != NULL);
@@ -893,15 +1409,20 @@ void BRPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
     assert(rounds > 0);
     
     memcpy(s, salt, saltLen);
+    // for sha-256 and sha-512, the padded pw is only hashed once, and each round resumes from the saved states
+    hasPads = _BRHMACPadsInit(&pads, hash, pw, pwLen);
     
     for (i = 0; i < (dkLen + hashLen - 1)/hashLen; i++) {
         j = be32(i + 1);
         memcpy(s + saltLen, &j, sizeof(j));
-        BRHMAC(U, hash, hashLen, pw, pwLen, s, sizeof(s)); // U1 = hmac_hash(pw, salt || be32(i))
+        
+        if (hasPads) _BRHMACPadsMac(&pads, U, s, sizeof(s)); // U1 = hmac_hash(pw, salt || be32(i))
+        else BRHMAC(U, hash, hashLen, pw, pwLen, s, sizeof(s));
         memcpy(T, U, sizeof(U));
         
         for (unsigned r = 1; r < rounds; r++) {
-            BRHMAC(U, hash, hashLen, pw, pwLen, U, sizeof(U)); // Urounds = hmac_hash(pw, Urounds-1)
+            if (hasPads) _BRHMACPadsMac(&pads, U, U, sizeof(U)); // Urounds = hmac_hash(pw, Urounds-1)
+            else BRHMAC(U, hash, hashLen, pw, pwLen, U, sizeof(U));
             for (j = 0; j < hashLen/sizeof(uint32_t); j++) T[j] ^= U[j]; // Ti = U1 ^ U2 ^ ... ^ Urounds
         }
         
@@ -912,6 +1433,7 @@ void BRPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
     mem_clean(s, sizeof(s));
     mem_clean(U, sizeof(U));
     mem_clean(T, sizeof(T));
+    mem_clean(&pads, sizeof(pads));
 }
 
 // salsa20/8 stream cypher: http://cr.yp.to/snuffle.html
@@ -952,50 +1474,298 @@ static void _blockmix_salsa8(uint64_t *dest, const uint64_t *src, uint64_t *b, u
     }
 }
 
-// scrypt key derivation: http://www.tarsnap.com/scrypt.html
-void BRScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
-              unsigned n, unsigned r, unsigned p)
+#define SCRYPT_LANES 4 // number of independent scrypt instances interleaved by BRScryptBatch()
+
+// apply the salsa20/8 operation a ^= rol32(b + c, s) to the same words of every lane
+#define salsa_lanes(a, b, c, s) for (unsigned _l = 0; _l < SCRYPT_LANES; _l++)\
+    x[a][_l] ^= rol32(x[b][_l] + x[c][_l], s)
+
+// salsa20/8 on SCRYPT_LANES independent blocks, stored word-interleaved so each operation vectorizes across lanes
+static void _salsa20_8_lanes(uint32_t b[16][SCRYPT_LANES])
+{
+#if defined(__GNUC__) && SCRYPT_LANES == 4
+    // gcc/clang vector extensions compile to sse2 on x86-64 and neon on arm64, and to scalar code everywhere else
+    typedef uint32_t lane_t __attribute__((vector_size(16)));
+#define rol_lanes(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+    lane_t x[16], w[16];
+    
+    memcpy(w, b, sizeof(w));
+    memcpy(x, w, sizeof(x));
+    
+    for (unsigned i = 0; i < 8; i += 2) {
+        // operate on columns
+        x[4] ^= rol_lanes(x[0] + x[12], 7), x[8] ^= rol_lanes(x[4] + x[0], 9);
+        x[12] ^= rol_lanes(x[8] + x[4], 13), x[0] ^= rol_lanes(x[12] + x[8], 18);
+        x[9] ^= rol_lanes(x[5] + x[1], 7), x[13] ^= rol_lanes(x[9] + x[5], 9);
+        x[1] ^= rol_lanes(x[13] + x[9], 13), x[5] ^= rol_lanes(x[1] + x[13], 18);
+        x[14] ^= rol_lanes(x[10] + x[6], 7), x[2] ^= rol_lanes(x[14] + x[10], 9);
+        x[6] ^= rol_lanes(x[2] + x[14], 13), x[10] ^= rol_lanes(x[6] + x[2], 18);
+        x[3] ^= rol_lanes(x[15] + x[11], 7), x[7] ^= rol_lanes(x[3] + x[15], 9);
+        x[11] ^= rol_lanes(x[7] + x[3], 13), x[15] ^= rol_lanes(x[11] + x[7], 18);
+        
+        // operate on rows
+        x[1] ^= rol_lanes(x[0] + x[3], 7), x[2] ^= rol_lanes(x[1] + x[0], 9);
+        x[3] ^= rol_lanes(x[2] + x[1], 13), x[0] ^= rol_lanes(x[3] + x[2], 18);
+        x[6] ^= rol_lanes(x[5] + x[4], 7), x[7] ^= rol_lanes(x[6] + x[5], 9);
+        x[4] ^= rol_lanes(x[7] + x[6], 13), x[5] ^= rol_lanes(x[4] + x[7], 18);
+        x[11] ^= rol_lanes(x[10] + x[9], 7), x[8] ^= rol_lanes(x[11] + x[10], 9);
+        x[9] ^= rol_lanes(x[8] + x[11], 13), x[10] ^= rol_lanes(x[9] + x[8], 18);
+        x[12] ^= rol_lanes(x[15] + x[14], 7), x[13] ^= rol_lanes(x[12] + x[15], 9);
+        x[14] ^= rol_lanes(x[13] + x[12], 13), x[15] ^= rol_lanes(x[14] + x[13], 18);
+    }
+    
+    for (unsigned i = 0; i < 16; i++) w[i] += x[i];
+    memcpy(b, w, sizeof(w));
+#undef rol_lanes
+#else
+    uint32_t x[16][SCRYPT_LANES];
+    
+    memcpy(x, b, sizeof(x));
+    
+    for (unsigned i = 0; i < 8; i += 2) {
+        // operate on columns
+        salsa_lanes(4, 0, 12, 7); salsa_lanes(8, 4, 0, 9);
+        salsa_lanes(12, 8, 4, 13); salsa_lanes(0, 12, 8, 18);
+        salsa_lanes(9, 5, 1, 7); salsa_lanes(13, 9, 5, 9);
+        salsa_lanes(1, 13, 9, 13); salsa_lanes(5, 1, 13, 18);
+        salsa_lanes(14, 10, 6, 7); salsa_lanes(2, 14, 10, 9);
+        salsa_lanes(6, 2, 14, 13); salsa_lanes(10, 6, 2, 18);
+        salsa_lanes(3, 15, 11, 7); salsa_lanes(7, 3, 15, 9);
+        salsa_lanes(11, 7, 3, 13); salsa_lanes(15, 11, 7, 18);
+        
+        // operate on rows
+        salsa_lanes(1, 0, 3, 7); salsa_lanes(2, 1, 0, 9);
+        salsa_lanes(3, 2, 1, 13); salsa_lanes(0, 3, 2, 18);
+        salsa_lanes(6, 5, 4, 7); salsa_lanes(7, 6, 5, 9);
+        salsa_lanes(4, 7, 6, 13); salsa_lanes(5, 4, 7, 18);
+        salsa_lanes(11, 10, 9, 7); salsa_lanes(8, 11, 10, 9);
+        salsa_lanes(9, 8, 11, 13); salsa_lanes(10, 9, 8, 18);
+        salsa_lanes(12, 15, 14, 7); salsa_lanes(13, 12, 15, 9);
+        salsa_lanes(14, 13, 12, 13); salsa_lanes(15, 14, 13, 18);
+    }
+    
+    for (unsigned i = 0; i < 16; i++) {
+        for (unsigned l = 0; l < SCRYPT_LANES; l++) b[i][l] += x[i][l];
+    }
+#endif
+}
+
+static void _blockmix_salsa8_lanes(uint32_t (*dest)[SCRYPT_LANES], uint32_t (*src)[SCRYPT_LANES],
+                                   uint32_t b[16][SCRYPT_LANES], unsigned r)
+{
+    memcpy(b, src[(2*r - 1)*16], 16*sizeof(*b));
+    
+    for (unsigned i = 0; i < 2*r; i += 2) {
+        for (unsigned j = 0; j < 16; j++) {
+            for (unsigned l = 0; l < SCRYPT_LANES; l++) b[j][l] ^= src[i*16 + j][l];
+        }
+        
+        _salsa20_8_lanes(b);
+        memcpy(dest[i*8], b, 16*sizeof(*b));
+        
+        for (unsigned j = 0; j < 16; j++) {
+            for (unsigned l = 0; l < SCRYPT_LANES; l++) b[j][l] ^= src[i*16 + 16 + j][l];
+        }
+        
+        _salsa20_8_lanes(b);
+        memcpy(dest[i*8 + r*16], b, 16*sizeof(*b));
+    }
+}
+
+// runs scrypt's ROMix step on one 128*r byte block in x, using y and z as temporary space and 128*r*n bytes of scratch
+// space in v
+static void _BRScryptROMix(uint64_t *x, uint64_t *y, uint64_t *z, uint64_t *v, unsigned n, unsigned r)
+{
+    uint64_t m;
+    
+    for (unsigned j = 0; j < n; j += 2) {
+        memcpy(&v[j*(16*r)], x, 128*r);
+        _blockmix_salsa8(y, x, z, r);
+        memcpy(&v[(j + 1)*(16*r)], y, 128*r);
+        _blockmix_salsa8(x, y, z, r);
+    }
+    
+    for (unsigned j = 0; j < n; j += 2) {
+        m = le64(x[(2*r - 1)*8]) & (n - 1);
+        for (unsigned k = 0; k < 16*r; k++) x[k] ^= v[m*(16*r) + k];
+        _blockmix_salsa8(y, x, z, r);
+        m = le64(y[(2*r - 1)*8]) & (n - 1);
+        for (unsigned k = 0; k < 16*r; k++) y[k] ^= v[m*(16*r) + k];
+        _blockmix_salsa8(x, y, z, r);
+    }
+}
+
+// runs ROMix on SCRYPT_LANES independent word-interleaved blocks in x at once, v must be 128*r*n*SCRYPT_LANES bytes
+static void _BRScryptROMixLanes(uint32_t (*x)[SCRYPT_LANES], uint32_t (*y)[SCRYPT_LANES], uint32_t z[16][SCRYPT_LANES],
+                                uint32_t (*v)[SCRYPT_LANES], unsigned n, unsigned r)
+{
+    uint32_t m;
+    
+    for (unsigned j = 0; j < n; j += 2) {
+        memcpy(v[j*32*r], x, 32*r*sizeof(*x));
+        _blockmix_salsa8_lanes(y, x, z, r);
+        memcpy(v[(j + 1)*32*r], y, 32*r*sizeof(*y));
+        _blockmix_salsa8_lanes(x, y, z, r);
+    }
+    
+    for (unsigned j = 0; j < n; j += 2) {
+        for (unsigned l = 0; l < SCRYPT_LANES; l++) {
+            m = x[(2*r - 1)*16][l] & (n - 1);
+            for (unsigned k = 0; k < 32*r; k++) x[k][l] ^= v[m*32*r + k][l];
+        }
+        
+        _blockmix_salsa8_lanes(y, x, z, r);
+        
+        for (unsigned l = 0; l < SCRYPT_LANES; l++) {
+            m = y[(2*r - 1)*16][l] & (n - 1);
+            for (unsigned k = 0; k < 32*r; k++) y[k][l] ^= v[m*32*r + k][l];
+        }
+        
+        _blockmix_salsa8_lanes(x, y, z, r);
+    }
+}
+
+// returns at least len bytes of scratch memory from ctx, growing it if needed
+static void *_BRScryptCtxScratch(BRScryptCtx *ctx, size_t len)
+{
+    if (ctx->vLen < len) {
+        BRScryptCtxFree(ctx);
+        ctx->v = malloc(len);
+        assert(ctx->v != NULL);
+        ctx->vLen = len;
+    }
+    
+    return ctx->v;
+}
+
+// initializes ctx with no scratch memory, which is allocated on first use and then reused by later calls
+// set isPublic when the passwords aren't secret (i.e. proof-of-work hashing) to skip wiping scratch memory after use
+void BRScryptCtxInit(BRScryptCtx *ctx, int isPublic)
+{
+    assert(ctx != NULL);
+    ctx->v = NULL;
+    ctx->vLen = 0;
+    ctx->isPublic = isPublic;
+}
+
+// wipes (unless ctx->isPublic is set) and frees the scratch memory held by ctx, ctx may then be reused
+void BRScryptCtxFree(BRScryptCtx *ctx)
+{
+    assert(ctx != NULL);
+    if (ctx->v && ! ctx->isPublic) mem_clean(ctx->v, ctx->vLen);
+    if (ctx->v) free(ctx->v);
+    ctx->v = NULL;
+    ctx->vLen = 0;
+}
+
+// scrypt key derivation using the reusable scratch memory in ctx, so repeated calls don't need to allocate
+// the p parallel blocks are run through ROMix one after another in the same 128*r*n bytes, so memory use doesn't grow
+// with p (i.e. bip38 uses p = 8)
+void BRScryptCtxDerive(BRScryptCtx *ctx, void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt,
+                       size_t saltLen, unsigned n, unsigned r, unsigned p)
 {
-    uint64_t x[16*r], y[16*r], z[8], *v = malloc(128*r*n), m;
     uint32_t b[32*r*p];
+    uint64_t x[16*r], y[16*r], z[8], *v;
     
-    assert(v != NULL);
+    assert(ctx != NULL);
     assert(dk != NULL || dkLen == 0);
     assert(pw != NULL || pwLen == 0);
     assert(salt != NULL || saltLen == 0);
-    assert(n > 0);
+    assert(n > 0 && (n & (n - 1)) == 0);
     assert(r > 0);
     assert(p > 0);
     
     BRPBKDF2(b, sizeof(b), BRSHA256, 256/8, pw, pwLen, salt, saltLen, 1);
+    v = _BRScryptCtxScratch(ctx, 128*r*n);
     
-    for (int i = 0; i < p; i++) {
+    for (unsigned i = 0; i < p; i++) {
         for (unsigned j = 0; j < 32*r; j++) ((uint32_t *)x)[j] = le32(b[i*32*r + j]);
+        _BRScryptROMix(x, y, z, v, n, r);
+        for (unsigned j = 0; j < 32*r; j++) b[i*32*r + j] = le32(((uint32_t *)x)[j]);
+    }
+    
+    if (! ctx->isPublic) mem_clean(x, sizeof(x)), mem_clean(y, sizeof(y)), mem_clean(z, sizeof(z));
+    BRPBKDF2(dk, dkLen, BRSHA256, 256/8, pw, pwLen, b, sizeof(b), 1);
+    if (! ctx->isPublic) mem_clean(b, sizeof(b));
+}
+
+// scrypt key derivation: http://www.tarsnap.com/scrypt.html
+void BRScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
+              unsigned n, unsigned r, unsigned p)
+{
+    BRScryptCtx ctx;
+    
+    BRScryptCtxInit(&ctx, 0);
+    BRScryptCtxDerive(&ctx, dk, dkLen, pw, pwLen, salt, saltLen, n, r, p);
+    BRScryptCtxFree(&ctx);
+}
+
+// scrypt key derivation for count independent passwords and salts that share the same lengths and n, r, p parameters
+// dk, pw and salt are arrays of count pointers, with each dk[i] pointing to a buffer of dkLen bytes
+// ctx holds reusable scratch memory, or may be NULL to allocate and wipe scratch memory for just this call
+// instances are interleaved in groups of SCRYPT_LANES to keep the cpu's vector units busy, so throughput is several
+// times that of calling BRScrypt() count times (i.e. verifying litecoin proof-of-work for a batch of block headers)
+void BRScryptBatch(BRScryptCtx *ctx, void *dk[], size_t dkLen, const void *pw[], size_t pwLen, const void *salt[],
+                   size_t saltLen, size_t count, unsigned n, unsigned r, unsigned p)
+{
+    uint32_t x[32*r][SCRYPT_LANES], y[32*r][SCRYPT_LANES], z[16][SCRYPT_LANES], b[SCRYPT_LANES][32*r*p],
+             (*v)[SCRYPT_LANES];
+    BRScryptCtx tmp;
+    size_t i, lanes;
+    
+    assert(dk != NULL || count == 0);
+    assert(pw != NULL || count == 0);
+    assert(salt != NULL || count == 0);
+    assert(n > 0 && (n & (n - 1)) == 0);
+    assert(r > 0);
+    assert(p > 0);
+    
+    if (! ctx) BRScryptCtxInit(&tmp, 0), ctx = &tmp;
+    v = (count > 0) ? _BRScryptCtxScratch(ctx, 128*r*n*SCRYPT_LANES) : NULL;
+    
+    for (i = 0; i < count; i += SCRYPT_LANES) {
+        lanes = (count - i < SCRYPT_LANES) ? count - i : SCRYPT_LANES;
+        memset(b, 0, sizeof(b)); // unused lanes in the final group are hashed as zeros and discarded
         
-        for (unsigned j = 0; j < n; j += 2) {
-            memcpy(&v[j*(16*r)], x, 128*r);
-            _blockmix_salsa8(y, x, z, r);
-            memcpy(&v[(j + 1)*(16*r)], y, 128*r);
-            _blockmix_salsa8(x, y, z, r);
+        for (size_t l = 0; l < lanes; l++) {
+            BRPBKDF2(b[l], sizeof(b[l]), BRSHA256, 256/8, pw[i + l], pwLen, salt[i + l], saltLen, 1);
         }
         
-        for (unsigned j = 0; j < n; j += 2) {
-            m = le64(x[(2*r - 1)*8]) & (n - 1);
-            for (unsigned k = 0; k < 16*r; k++) x[k] ^= v[m*(16*r) + k];
-            _blockmix_salsa8(y, x, z, r);
-            m = le64(y[(2*r - 1)*8]) & (n - 1);
-            for (unsigned k = 0; k < 16*r; k++) y[k] ^= v[m*(16*r) + k];
-            _blockmix_salsa8(x, y, z, r);
+        for (unsigned k = 0; k < p; k++) {
+            for (unsigned j = 0; j < 32*r; j++) {
+                for (unsigned l = 0; l < SCRYPT_LANES; l++) x[j][l] = le32(b[l][k*32*r + j]);
+            }
+            
+            _BRScryptROMixLanes(x, y, z, v, n, r);
+            
+            for (unsigned j = 0; j < 32*r; j++) {
+                for (unsigned l = 0; l < SCRYPT_LANES; l++) b[l][k*32*r + j] = le32(x[j][l]);
+            }
         }
         
-        for (unsigned j = 0; j < 32*r; j++) b[i*32*r + j] = le32(((uint32_t *)x)[j]);
+        for (size_t l = 0; l < lanes; l++) {
+            BRPBKDF2(dk[i + l], dkLen, BRSHA256, 256/8, pw[i + l], pwLen, b[l], sizeof(b[l]), 1);
+        }
     }
     
-    BRPBKDF2(dk, dkLen, BRSHA256, 256/8, pw, pwLen, b, sizeof(b), 1);
-    mem_clean(b, sizeof(b));
-    mem_clean(x, sizeof(x));
-    mem_clean(y, sizeof(y));
-    mem_clean(z, sizeof(z));
-    mem_clean(v, 128*r*n);
-    free(v);
+    if (! ctx->isPublic) {
+        mem_clean(b, sizeof(b));
+        mem_clean(x, sizeof(x));
+        mem_clean(y, sizeof(y));
+        mem_clean(z, sizeof(z));
+    }
+    
+    if (ctx == &tmp) BRScryptCtxFree(&tmp);
+}
+
+// hw is 0 to use the portable sha256 code even if the cpu has sha instructions, or -1 to check the cpu again, returns
+// false if sha instructions are compiled in unconditionally
+int BRSHA256HWTest(int hw)
+{
+#if SHA256_HW_DISPATCH
+    __atomic_store_n(&_sha256HW, hw, __ATOMIC_RELAXED);
+    return 1;
+#else
+    return ! _BRSHA256HasHW();
+#endif
 }
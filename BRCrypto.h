@@ -44,10 +44,51 @@ void BRSHA224(void *md28, const void *data, size_t len);
 // double-sha-256 = sha-256(sha-256(x))
 void BRSHA256_2(void *md32, const void *data, size_t len);
 
+// sha-256 of count independent messages, md32[i] is set to the hash of lens[i] bytes of data[i]
+// without sha instructions, several messages are hashed at once in simd lanes, so this is much faster than calling
+// BRSHA256() for each message
+void BRSHA256Multi(void *md32[], const void *data[], const size_t lens[], size_t count);
+
+// double-sha-256 of count independent messages, md32[i] is set to the hash of lens[i] bytes of data[i]
+void BRSHA256_2Multi(void *md32[], const void *data[], const size_t lens[], size_t count);
+
+// resumable sha-256 state, for hashing data in pieces, or for saving the state after a common prefix and resuming from
+// a copy of it for each message that shares the prefix
+typedef struct {
+    uint32_t h[8];
+    uint64_t len; // total number of bytes absorbed
+    uint8_t buf[64]; // partial block not yet compressed
+} BRSHA256Ctx;
+
+// initializes ctx to the sha-256 initial state
+void BRSHA256Init(BRSHA256Ctx *ctx);
+
+// absorbs len bytes of data into ctx
+void BRSHA256Update(BRSHA256Ctx *ctx, const void *data, size_t len);
+
+// writes the sha-256 hash of all data absorbed by ctx to md32, and wipes ctx
+void BRSHA256Final(BRSHA256Ctx *ctx, void *md32);
+
 void BRSHA384(void *md48, const void *data, size_t len);
 
 void BRSHA512(void *md64, const void *data, size_t len);
 
+// resumable sha-512 state, same as BRSHA256Ctx
+typedef struct {
+    uint64_t h[8];
+    uint64_t len; // total number of bytes absorbed
+    uint8_t buf[128]; // partial block not yet compressed
+} BRSHA512Ctx;
+
+// initializes ctx to the sha-512 initial state
+void BRSHA512Init(BRSHA512Ctx *ctx);
+
+// absorbs len bytes of data into ctx
+void BRSHA512Update(BRSHA512Ctx *ctx, const void *data, size_t len);
+
+// writes the sha-512 hash of all data absorbed by ctx to md64, and wipes ctx
+void BRSHA512Final(BRSHA512Ctx *ctx, void *md64);
+
 // ripemd-160: http://homes.esat.kuleuven.be/~bosselae/ripemd160.html
 void BRRMD160(void *md20, const void *data, size_t len);
 
@@ -66,6 +107,13 @@ void BRMD5(void *md16, const void *data, size_t len);
 // murmurHash3 (x86_32): https://code.google.com/p/smhasher/ - for non cryptographic use only
 uint32_t BRMurmur3_32(const void *data, size_t len, uint32_t seed);
 
+// murmurHash3 of data with each of seedCount seeds, written to hashes[], reads each block of data only once and mixes
+// it into all the seeded states, which is much faster than calling BRMurmur3_32() seedCount times
+void BRMurmur3_32Seeds(uint32_t hashes[], const uint32_t seeds[], size_t seedCount, const void *data, size_t len);
+
+// SipHash-2-4: https://131002.net/siphash/siphash.pdf - keyed 64bit hash, for non cryptographic use only
+uint64_t BRSipHash24(const void *key16, const void *data, size_t len);
+
 void BRHMAC(void *mac, void (*hash)(void *, const void *, size_t), size_t hashLen, const void *key, size_t keyLen,
             const void *data, size_t dataLen);
 
@@ -96,6 +144,29 @@ void BRPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
 void BRScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
               unsigned n, unsigned r, unsigned p);
 
+// reusable scrypt scratch memory, to avoid allocating 128*r*n bytes on every call
+typedef struct {
+    void *v;
+    size_t vLen;
+    int isPublic; // true if passwords aren't secret (i.e. proof-of-work), so scratch memory isn't wiped after use
+} BRScryptCtx;
+
+// initializes ctx with no scratch memory, which is allocated on first use and then reused by later calls
+void BRScryptCtxInit(BRScryptCtx *ctx, int isPublic);
+
+// wipes (unless ctx->isPublic is set) and frees the scratch memory held by ctx, ctx may then be reused
+void BRScryptCtxFree(BRScryptCtx *ctx);
+
+// scrypt key derivation using the reusable scratch memory in ctx
+void BRScryptCtxDerive(BRScryptCtx *ctx, void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt,
+                       size_t saltLen, unsigned n, unsigned r, unsigned p);
+
+// scrypt key derivation for count independent passwords and salts that share the same lengths and n, r, p parameters
+// dk, pw and salt are arrays of count pointers, and each dk[i] must point to a buffer of dkLen bytes
+// ctx holds reusable scratch memory, or may be NULL to allocate and wipe scratch memory for just this call
+void BRScryptBatch(BRScryptCtx *ctx, void *dk[], size_t dkLen, const void *pw[], size_t pwLen, const void *salt[],
+                   size_t saltLen, size_t count, unsigned n, unsigned r, unsigned p);
+
 // zeros out memory in a way that can't be optimized out by the compiler
 inline static void mem_clean(void *ptr, size_t len)
 {
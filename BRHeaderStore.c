@@ -0,0 +1,282 @@
+//
+//  BRHeaderStore.c
+//
+//  Copyright (c) 2026 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "BRHeaderStore.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#define HEADER_STORE_MAGIC      0x53485242 // "BRHS"
+#define HEADER_STORE_HEADER_LEN 16
+#define HEADER_STORE_RECORD_LEN (80 + sizeof(UInt256))
+#define HEADER_STORE_GROWTH     4096 // minimum number of records to grow the file by when it's full
+
+struct BRHeaderStoreStruct {
+    int fd;
+    uint8_t *map;
+    size_t mapLen;
+    uint32_t startHeight;
+    size_t count;
+    size_t capacity;
+    uint32_t *index; // open addressed hash table of record number + 1, keyed by block hash, 0 for an empty slot
+    size_t indexSize; // power of 2
+};
+
+inline static uint8_t *_BRHeaderStoreRecord(const BRHeaderStore *store, size_t i)
+{
+    return &store->map[HEADER_STORE_HEADER_LEN + i*HEADER_STORE_RECORD_LEN];
+}
+
+inline static UInt256 _BRHeaderStoreHash(const BRHeaderStore *store, size_t i)
+{
+    return UInt256Get(&_BRHeaderStoreRecord(store, i)[80]);
+}
+
+static void _BRHeaderStoreIndexAdd(BRHeaderStore *store, size_t i)
+{
+    UInt256 hash = _BRHeaderStoreHash(store, i);
+    size_t slot = UInt32GetLE(hash.u8) & (store->indexSize - 1); // block hashes are already uniformly distributed
+
+    while (store->index[slot] != 0) slot = (slot + 1) & (store->indexSize - 1);
+    store->index[slot] = (uint32_t)(i + 1);
+}
+
+// rebuilds the hash index for the current records, sized for a load factor of at most 1/2 at full capacity
+static int _BRHeaderStoreIndexRebuild(BRHeaderStore *store)
+{
+    size_t size = 1;
+
+    while (size < store->capacity*2) size *= 2;
+
+    if (size != store->indexSize) {
+        uint32_t *index = realloc(store->index, size*sizeof(*index));
+
+        if (! index) return 0;
+        store->index = index;
+        store->indexSize = size;
+    }
+
+    memset(store->index, 0, store->indexSize*sizeof(*store->index));
+    for (size_t i = 0; i < store->count; i++) _BRHeaderStoreIndexAdd(store, i);
+    return 1;
+}
+
+// maps fileLen bytes of the store's file, which must already be that length
+static int _BRHeaderStoreMap(BRHeaderStore *store, size_t fileLen)
+{
+    uint8_t *map = mmap(NULL, fileLen, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+
+    if (map == MAP_FAILED) return 0;
+    if (store->map) munmap(store->map, store->mapLen);
+    store->map = map;
+    store->mapLen = fileLen;
+    store->capacity = (fileLen - HEADER_STORE_HEADER_LEN)/HEADER_STORE_RECORD_LEN;
+    return 1;
+}
+
+inline static void _BRHeaderStoreWriteHeader(BRHeaderStore *store)
+{
+    UInt32SetLE(&store->map[0], HEADER_STORE_MAGIC);
+    UInt32SetLE(&store->map[4], HEADER_STORE_VERSION);
+    UInt32SetLE(&store->map[8], store->startHeight);
+    UInt32SetLE(&store->map[12], (uint32_t)store->count);
+}
+
+// opens the header store at path, creating it if it doesn't exist
+// returns NULL and sets errno on failure, result must be closed by calling BRHeaderStoreClose()
+BRHeaderStore *BRHeaderStoreOpen(const char *path)
+{
+    BRHeaderStore *store = calloc(1, sizeof(*store));
+    size_t fileLen = HEADER_STORE_HEADER_LEN + HEADER_STORE_GROWTH*HEADER_STORE_RECORD_LEN;
+    struct stat st;
+    int error = 0;
+
+    assert(store != NULL);
+    assert(path != NULL);
+    store->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (store->fd < 0 || fstat(store->fd, &st) != 0) error = errno;
+
+    if (! error && st.st_size == 0) { // new file
+        if (ftruncate(store->fd, (off_t)fileLen) != 0 || ! _BRHeaderStoreMap(store, fileLen)) error = errno;
+        if (! error) _BRHeaderStoreWriteHeader(store);
+    }
+    else if (! error) {
+        if (st.st_size < HEADER_STORE_HEADER_LEN + HEADER_STORE_RECORD_LEN) error = EINVAL;
+        if (! error && ! _BRHeaderStoreMap(store, (size_t)st.st_size)) error = errno;
+
+        if (! error && (UInt32GetLE(&store->map[0]) != HEADER_STORE_MAGIC ||
+                        UInt32GetLE(&store->map[4]) != HEADER_STORE_VERSION)) error = EINVAL;
+
+        if (! error) {
+            store->startHeight = UInt32GetLE(&store->map[8]);
+            store->count = UInt32GetLE(&store->map[12]);
+            if (store->count > store->capacity) error = EINVAL;
+        }
+    }
+
+    if (! error && ! _BRHeaderStoreIndexRebuild(store)) error = ENOMEM;
+
+    if (error) {
+        if (store->map) munmap(store->map, store->mapLen);
+        if (store->fd >= 0) close(store->fd);
+        if (store->index) free(store->index);
+        free(store);
+        store = NULL;
+        errno = error;
+    }
+
+    return store;
+}
+
+// height of the first stored header, only meaningful if BRHeaderStoreCount() is greater than zero
+uint32_t BRHeaderStoreStartHeight(const BRHeaderStore *store)
+{
+    assert(store != NULL);
+    return store->startHeight;
+}
+
+// number of stored headers
+size_t BRHeaderStoreCount(const BRHeaderStore *store)
+{
+    assert(store != NULL);
+    return store->count;
+}
+
+// fills in block with the stored header at height without allocating memory, block->hashes and block->flags are set
+// to NULL, returns true if a header is stored at that height
+int BRHeaderStoreBlockAtHeight(const BRHeaderStore *store, uint32_t height, BRMerkleBlock *block)
+{
+    const uint8_t *rec;
+
+    assert(store != NULL);
+    assert(block != NULL);
+    if (height < store->startHeight || height - store->startHeight >= store->count) return 0;
+    rec = _BRHeaderStoreRecord(store, height - store->startHeight);
+    *block = BR_MERKLE_BLOCK_NONE;
+    block->version = UInt32GetLE(&rec[0]);
+    block->prevBlock = UInt256Get(&rec[4]);
+    block->merkleRoot = UInt256Get(&rec[36]);
+    block->timestamp = UInt32GetLE(&rec[68]);
+    block->target = UInt32GetLE(&rec[72]);
+    block->nonce = UInt32GetLE(&rec[76]);
+    block->blockHash = UInt256Get(&rec[80]);
+    block->height = height;
+    block->powVerified = 1; // headers are verified before they're stored
+    return 1;
+}
+
+// returns the height of the stored header with blockHash, or BLOCK_UNKNOWN_HEIGHT if it isn't stored
+uint32_t BRHeaderStoreHeightForHash(const BRHeaderStore *store, UInt256 blockHash)
+{
+    size_t slot;
+
+    assert(store != NULL);
+    slot = UInt32GetLE(blockHash.u8) & (store->indexSize - 1);
+
+    while (store->index[slot] != 0) {
+        if (UInt256Eq(_BRHeaderStoreHash(store, store->index[slot] - 1), blockHash)) {
+            return store->startHeight + store->index[slot] - 1;
+        }
+
+        slot = (slot + 1) & (store->indexSize - 1);
+    }
+
+    return BLOCK_UNKNOWN_HEIGHT;
+}
+
+// appends the header for block, which must be at the next height and connect to the last stored header, or may be at
+// any height if the store is empty, returns true on success
+int BRHeaderStoreAppend(BRHeaderStore *store, const BRMerkleBlock *block)
+{
+    uint8_t *rec;
+
+    assert(store != NULL);
+    assert(block != NULL);
+    assert(block->height != BLOCK_UNKNOWN_HEIGHT);
+
+    if (store->count > 0 && (block->height != store->startHeight + store->count ||
+                             ! UInt256Eq(block->prevBlock, _BRHeaderStoreHash(store, store->count - 1)))) return 0;
+    if (store->count >= UINT32_MAX - 1) return 0;
+
+    if (store->count == store->capacity) { // grow the file by half again and remap it
+        size_t grow = (store->capacity/2 > HEADER_STORE_GROWTH) ? store->capacity/2 : HEADER_STORE_GROWTH,
+               fileLen = store->mapLen + grow*HEADER_STORE_RECORD_LEN;
+
+        if (ftruncate(store->fd, (off_t)fileLen) != 0 || ! _BRHeaderStoreMap(store, fileLen)) return 0;
+        if (store->capacity*2 > store->indexSize && ! _BRHeaderStoreIndexRebuild(store)) return 0;
+    }
+
+    if (store->count == 0) store->startHeight = block->height;
+    rec = _BRHeaderStoreRecord(store, store->count);
+    UInt32SetLE(&rec[0], block->version);
+    UInt256Set(&rec[4], block->prevBlock);
+    UInt256Set(&rec[36], block->merkleRoot);
+    UInt32SetLE(&rec[68], block->timestamp);
+    UInt32SetLE(&rec[72], block->target);
+    UInt32SetLE(&rec[76], block->nonce);
+    UInt256Set(&rec[80], block->blockHash);
+    _BRHeaderStoreIndexAdd(store, store->count);
+    store->count++;
+    _BRHeaderStoreWriteHeader(store);
+    return 1;
+}
+
+// removes stored headers at or above height, as needed when the best chain is reorganized
+void BRHeaderStoreTruncate(BRHeaderStore *store, uint32_t height)
+{
+    size_t count;
+
+    assert(store != NULL);
+    count = (height > store->startHeight) ? height - store->startHeight : 0;
+
+    if (count < store->count) {
+        memset(_BRHeaderStoreRecord(store, count), 0, (store->count - count)*HEADER_STORE_RECORD_LEN);
+        store->count = count;
+        _BRHeaderStoreWriteHeader(store);
+        _BRHeaderStoreIndexRebuild(store); // open addressing doesn't support removal, but reorgs are rare
+    }
+}
+
+// writes changes through to disk, returns true on success, until then the kernel may write back mapped pages in any
+// order, so an interrupted append can leave the record count ahead of the records it covers
+int BRHeaderStoreSync(BRHeaderStore *store)
+{
+    assert(store != NULL);
+    return (msync(store->map, store->mapLen, MS_SYNC) == 0) ? 1 : 0;
+}
+
+// unmaps and closes store, and frees memory allocated for it
+void BRHeaderStoreClose(BRHeaderStore *store)
+{
+    assert(store != NULL);
+    munmap(store->map, store->mapLen);
+    close(store->fd);
+    free(store->index);
+    free(store);
+}
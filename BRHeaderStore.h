@@ -0,0 +1,84 @@
+//
+//  BRHeaderStore.h
+//
+//  Copyright (c) 2026 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef BRHeaderStore_h
+#define BRHeaderStore_h
+
+#include "BRMerkleBlock.h"
+#include "BRInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// an append-only, memory-mapped file of consecutive best chain block headers, so headers can be looked up by height or
+// hash without keeping a BRMerkleBlock in memory for each one
+//
+// file format (all integers little endian):
+// 16 byte file header: magic "BRHS", format version, height of the first record, number of records
+// followed by fixed 112 byte records: the 80 byte serialized block header, then its 32 byte block hash
+// the record for a given height is at a fixed offset, and records for unused capacity at the end are zero filled
+
+#define HEADER_STORE_VERSION 1
+
+typedef struct BRHeaderStoreStruct BRHeaderStore;
+
+// opens the header store at path, creating it if it doesn't exist
+// returns NULL and sets errno on failure, result must be closed by calling BRHeaderStoreClose()
+BRHeaderStore *BRHeaderStoreOpen(const char *path);
+
+// height of the first stored header, only meaningful if BRHeaderStoreCount() is greater than zero
+uint32_t BRHeaderStoreStartHeight(const BRHeaderStore *store);
+
+// number of stored headers
+size_t BRHeaderStoreCount(const BRHeaderStore *store);
+
+// fills in block with the stored header at height without allocating memory, block->hashes and block->flags are set
+// to NULL, returns true if a header is stored at that height
+int BRHeaderStoreBlockAtHeight(const BRHeaderStore *store, uint32_t height, BRMerkleBlock *block);
+
+// returns the height of the stored header with blockHash, or BLOCK_UNKNOWN_HEIGHT if it isn't stored
+uint32_t BRHeaderStoreHeightForHash(const BRHeaderStore *store, UInt256 blockHash);
+
+// appends the header for block, which must be at the next height and connect to the last stored header, or may be at
+// any height if the store is empty, returns true on success
+int BRHeaderStoreAppend(BRHeaderStore *store, const BRMerkleBlock *block);
+
+// removes stored headers at or above height, as needed when the best chain is reorganized
+void BRHeaderStoreTruncate(BRHeaderStore *store, uint32_t height);
+
+// writes changes through to disk, returns true on success, until then the kernel may write back mapped pages in any
+// order, so an interrupted append can leave the record count ahead of the records it covers
+int BRHeaderStoreSync(BRHeaderStore *store);
+
+// unmaps and closes store, and frees memory allocated for it
+void BRHeaderStoreClose(BRHeaderStore *store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRHeaderStore_h
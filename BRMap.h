@@ -0,0 +1,195 @@
+//
+//  BRMap.h
+//
+//  Copyright (c) 2026 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRMap_h
+#define BRMap_h
+
+#include "BRInt.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// typed hashtables with keys and values stored inline, and hash and equality functions called directly so they can
+// be inlined, for hot lookups where BRSet's function pointers and item dereferencing are too costly
+//
+// example:
+//
+// map_define(BRHeightMap, UInt256, uint32_t, BRUInt256Hash, BRUInt256Eq); // map of UInt256 -> uint32_t
+//
+// BRHeightMap *map = BRHeightMapNew(100);  // new map with capacity for 100 items
+// BRHeightMapSet(map, &hash, 5);           // map hash to 5, replacing any existing value
+// uint32_t *h = BRHeightMapGet(map, &hash); // pointer to the value stored for hash, or NULL if there is none
+// BRHeightMapRemove(map, &hash);           // remove hash from map, returns true if it was present
+// BRHeightMapFree(map);                    // free memory allocated for map
+//
+// NOTE: pointers returned by Get are invalidated by any later Set or Remove call
+//
+// linear probed, power-of-two sized tables with a maximum load factor of 2/3, each bucket caches its key's hash with
+// the low bit set, and a cached hash of 0 marks an empty bucket
+
+#define map_define(name, key_t, value_t, hash_func, eq_func)\
+typedef struct {\
+    size_t hash;\
+    key_t key;\
+    value_t value;\
+} name##Bucket;\
+\
+typedef struct {\
+    name##Bucket *table;\
+    size_t size, count;\
+} name;\
+\
+inline static size_t _##name##Index(const name *map, size_t hash)\
+{\
+    uint64_t x = (uint64_t)hash;\
+\
+    x ^= x >> 32;\
+    return (size_t)((x*0x9e3779b97f4a7c15ULL) >> 32) & (map->size - 1);\
+}\
+\
+inline static name *name##New(size_t capacity)\
+{\
+    name *map = calloc(1, sizeof(*map));\
+\
+    assert(map != NULL);\
+    map->size = 4;\
+    while (map->size < capacity + (capacity + 1)/2) map->size <<= 1;\
+    map->table = calloc(map->size, sizeof(*map->table));\
+    assert(map->table != NULL);\
+    return map;\
+}\
+\
+inline static size_t _##name##Find(const name *map, const key_t *key, size_t hash)\
+{\
+    size_t i = _##name##Index(map, hash);\
+\
+    while (map->table[i].hash != 0 && (map->table[i].hash != hash || ! eq_func(&map->table[i].key, key))) {\
+        i = (i + 1) & (map->size - 1);\
+    }\
+\
+    return i;\
+}\
+\
+inline static void name##Reserve(name *map, size_t capacity)\
+{\
+    name##Bucket *table = map->table;\
+    size_t i, j, size = map->size;\
+\
+    while (map->size < capacity + (capacity + 1)/2) map->size <<= 1;\
+    if (map->size == size) return;\
+    map->table = calloc(map->size, sizeof(*map->table));\
+    assert(map->table != NULL);\
+\
+    for (i = 0; i < size; i++) {\
+        if (table[i].hash == 0) continue;\
+        for (j = _##name##Index(map, table[i].hash); map->table[j].hash != 0; j = (j + 1) & (map->size - 1));\
+        map->table[j] = table[i];\
+    }\
+\
+    free(table);\
+}\
+\
+inline static value_t *name##Get(const name *map, const key_t *key)\
+{\
+    size_t i = _##name##Find(map, key, (size_t)hash_func(key) | 1);\
+\
+    return (map->table[i].hash != 0) ? &map->table[i].value : NULL;\
+}\
+\
+inline static void name##Set(name *map, const key_t *key, value_t value)\
+{\
+    size_t hash = (size_t)hash_func(key) | 1, i = _##name##Find(map, key, hash);\
+\
+    if (map->table[i].hash == 0) {\
+        if (map->count + 1 > (map->size/3)*2) {\
+            name##Reserve(map, map->size);\
+            i = _##name##Find(map, key, hash);\
+        }\
+\
+        map->table[i].hash = hash;\
+        map->table[i].key = *key;\
+        map->count++;\
+    }\
+\
+    map->table[i].value = value;\
+}\
+\
+inline static int name##Remove(name *map, const key_t *key)\
+{\
+    size_t i = _##name##Find(map, key, (size_t)hash_func(key) | 1), j = i, k, mask = map->size - 1;\
+\
+    if (map->table[i].hash == 0) return 0;\
+\
+    for (;;) { /* backward shift deletion, move later entries of the probe run into the hole */\
+        map->table[i].hash = 0;\
+\
+        do {\
+            j = (j + 1) & mask;\
+            if (map->table[j].hash == 0) { map->count--; return 1; }\
+            k = _##name##Index(map, map->table[j].hash);\
+        } while ((i <= j) ? (i < k && k <= j) : (i < k || k <= j));\
+\
+        map->table[i] = map->table[j];\
+        i = j;\
+    }\
+}\
+\
+inline static void name##Clear(name *map)\
+{\
+    memset(map->table, 0, map->size*sizeof(*map->table));\
+    map->count = 0;\
+}\
+\
+inline static size_t name##Count(const name *map)\
+{\
+    return map->count;\
+}\
+\
+inline static void name##Free(name *map)\
+{\
+    free(map->table);\
+    free(map);\
+}
+
+// hash function for UInt256 keys that are already uniformly distributed, such as tx and block hashes
+inline static size_t BRUInt256Hash(const void *u)
+{
+    return (size_t)((const UInt256 *)u)->u32[0];
+}
+
+// true if UInt256 keys u and otherU are equal
+inline static int BRUInt256Eq(const void *u, const void *otherU)
+{
+    return UInt256Eq(*(const UInt256 *)u, *(const UInt256 *)otherU);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRMap_h
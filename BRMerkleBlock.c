@@ -25,16 +25,23 @@
 #include "BRMerkleBlock.h"
 #include "BRCrypto.h"
 #include "BRAddress.h"
+#include "BRWorkPool.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <string.h>
+#include <pthread.h>
 #include <assert.h>
 
 #define MAX_PROOF_OF_WORK 0x1e0fffff    // highest value for difficulty target (higher values are less difficult)
 #define TARGET_TIMESPAN   302400        // = 3.5*24*60*60; the targeted timespan between difficulty target adjustments
+#define POW_BATCH_SIZE    32            // number of headers a proof-of-work worker thread hashes at a time
+#define POW_MAX_THREADS   8             // maximum number of threads, including the caller, hashing headers
+#define MERKLE_HASH_BATCH 16            // number of merkle tree sibling pairs hashed at a time
+#define MERKLE_NODE_NONE  SIZE_MAX      // missing child node in a partial merkle tree
+#define MERKLE_NODE_UNSET (SIZE_MAX - 1) // child node that hasn't been visited yet
 
-inline static int _ceil_log2(int x)
+inline static int _ceil_log2(uint32_t x)
 {
     int r = (x & (x - 1)) ? 1 : 0;
     
@@ -92,11 +99,117 @@ BRMerkleBlock *BRMerkleBlockCopy(const BRMerkleBlock *block)
     *cpy = *block;
     cpy->hashes = NULL;
     cpy->flags = NULL;
+    cpy->txHashes = NULL;
     BRMerkleBlockSetTxHashes(cpy, block->hashes, block->hashesCount, block->flags, block->flagsLen);
     return cpy;
 }
 
+typedef struct {
+    UInt256 hash;
+    size_t left, right; // child node indexes, or MERKLE_NODE_NONE if missing, both MERKLE_NODE_NONE for a leaf
+    int depth;
+    int isLeaf, isMatch;
+} BRMerkleNode;
+
+// hashes count sibling pairs and writes each result to the node mds[i]
+static void _BRMerkleNodesHash(BRMerkleNode *mds[], UInt256 pairs[][2], size_t count)
+{
+    void *md32[MERKLE_HASH_BATCH];
+    const void *data[MERKLE_HASH_BATCH];
+    size_t lens[MERKLE_HASH_BATCH];
+    
+    for (size_t i = 0; i < count; i++) md32[i] = &mds[i]->hash, data[i] = pairs[i], lens[i] = sizeof(pairs[i]);
+    BRSHA256_2Multi(md32, data, lens, count);
+}
+
+// walks the partial merkle tree in a single iterative pass, without recursion, to cache the matched tx hashes and the
+// merkle root in block->txHashes and block->txRoot, then hashes the tree one level at a time, deepest level first, so
+// sibling pairs can be hashed in batches
+// NOTE: this merkle tree design has a security vulnerability (CVE-2012-2459), which can be defended against by
+// considering the merkle root invalid if there are duplicate hashes in any rows with an even number of elements
+static void _BRMerkleBlockWalkTree(BRMerkleBlock *block)
+{
+    int height = _ceil_log2(block->totalTx), depth = 0, valid = 1;
+    size_t maxCount = block->hashesCount*(height + 1) + height + 1, count = 0, matchCount = 0, hashIdx = 0,
+           flagIdx = 0, sp = 0, i, j, n, idx, stack[sizeof(block->totalTx)*8 + 1];
+    
+    // every node takes a flag bit, and only the nodes along the last path from the root can be missing a leaf
+    if (maxCount > block->flagsLen*8) maxCount = block->flagsLen*8;
+
+    BRMerkleNode _nodes[(maxCount <= 0x100) ? maxCount : 0],
+                 *nodes = (maxCount <= 0x100) ? _nodes : malloc(maxCount*sizeof(*nodes)), *mds[MERKLE_HASH_BATCH];
+    UInt256 pairs[MERKLE_HASH_BATCH][2];
+    
+    assert(nodes != NULL || maxCount == 0);
+    if (block->txHashes) free(block->txHashes);
+    block->txHashes = NULL;
+    block->txHashesCount = 0;
+    block->txRoot = UINT256_ZERO;
+    
+    for (;;) { // visit the next node in depth first order, if there are flags and hashes left
+        idx = MERKLE_NODE_NONE;
+        
+        if (flagIdx/8 < block->flagsLen && hashIdx < block->hashesCount && count < maxCount) {
+            idx = count++;
+            nodes[idx] = (BRMerkleNode) { UINT256_ZERO, MERKLE_NODE_NONE, MERKLE_NODE_NONE, depth, 0, 0 };
+            nodes[idx].isMatch = (block->flags[flagIdx/8] & (1 << (flagIdx % 8))) ? 1 : 0;
+            flagIdx++;
+            
+            if (nodes[idx].isMatch && depth != height) { // descend into the left branch
+                nodes[idx].left = MERKLE_NODE_UNSET;
+                stack[sp++] = idx;
+                depth++;
+                continue;
+            }
+            
+            nodes[idx].isLeaf = 1;
+            nodes[idx].hash = block->hashes[hashIdx++];
+            if (nodes[idx].isMatch) matchCount++;
+        }
+        
+        // attach the node to its parent, and each finished parent to its own parent, until reaching a right branch
+        while (sp > 0 && nodes[stack[sp - 1]].left != MERKLE_NODE_UNSET) {
+            nodes[stack[--sp]].right = idx;
+            idx = stack[sp];
+        }
+        
+        if (sp == 0) break; // back at the root
+        nodes[stack[sp - 1]].left = idx;
+        if (idx == MERKLE_NODE_NONE) valid = 0; // left branch can only be missing in a malformed tree
+        depth = nodes[stack[sp - 1]].depth + 1; // visit the right branch next
+    }
+    
+    if (matchCount > 0) {
+        block->txHashes = malloc(matchCount*sizeof(*block->txHashes));
+        assert(block->txHashes != NULL);
+        
+        for (i = 0; i < count; i++) {
+            if (nodes[i].isLeaf && nodes[i].isMatch) block->txHashes[block->txHashesCount++] = nodes[i].hash;
+        }
+    }
+    
+    for (depth = height - 1; valid && depth >= 0; depth--) { // nodes below depth are all hashed at this point
+        for (i = 0, n = 0; valid && i < count; i++) {
+            if (nodes[i].isLeaf || nodes[i].depth != depth) continue;
+            j = nodes[i].right;
+            pairs[n][0] = nodes[nodes[i].left].hash;
+            pairs[n][1] = (j != MERKLE_NODE_NONE) ? nodes[j].hash : UINT256_ZERO;
+            if (UInt256IsZero(pairs[n][0]) || UInt256Eq(pairs[n][0], pairs[n][1])) valid = 0; // defend (CVE-2012-2459)
+            if (UInt256IsZero(pairs[n][1])) pairs[n][1] = pairs[n][0]; // if right branch is missing, dup left branch
+            mds[n++] = &nodes[i];
+            if (n == MERKLE_HASH_BATCH) _BRMerkleNodesHash(mds, pairs, n), n = 0;
+        }
+        
+        if (valid && n > 0) _BRMerkleNodesHash(mds, pairs, n);
+    }
+    
+    if (valid && count > 0) block->txRoot = nodes[0].hash;
+    if (nodes != _nodes) free(nodes);
+}
+
 // buf must contain either a serialized merkleblock or header
+// proof-of-work is not hashed until needed by BRMerkleBlockPowHash() or BRMerkleBlockIsValid(), so blocks loaded from
+// a trusted persistent store can be parsed without paying for scrypt
 // returns a merkle block struct that must be freed by calling BRMerkleBlockFree()
 BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen)
 {
@@ -133,15 +246,64 @@ BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen)
             len = block->flagsLen;
             block->flags = (off + len <= bufLen) ? malloc(len) : NULL;
             if (block->flags) memcpy(block->flags, &buf[off], len);
+            if (! block->hashes) block->hashesCount = 0;
+            if (! block->flags) block->flagsLen = 0;
+            _BRMerkleBlockWalkTree(block);
         }
         
         BRSHA256_2(&block->blockHash, buf, 80);
-        BRScrypt(&block->powHash, sizeof(block->powHash), buf, 80, buf, 80, 1024, 1, 1);
     }
     
     return block;
 }
 
+typedef struct {
+    BRMerkleBlock **blocks;
+    const uint8_t *buf;
+} BRPowBatch;
+
+static void _powWorker(void *info, BRWorkPool *pool)
+{
+    BRPowBatch *batch = info;
+    BRScryptCtx ctx;
+    void *dk[POW_BATCH_SIZE];
+    const void *pw[POW_BATCH_SIZE];
+    size_t i, j, n;
+    
+    BRScryptCtxInit(&ctx, 1); // block headers are public, so scratch memory is reused without wiping
+    
+    while ((n = BRWorkPoolNext(pool, &i)) > 0) {
+        for (j = 0; j < n; j++) {
+            dk[j] = &batch->blocks[i + j]->powHash;
+            pw[j] = &batch->buf[(i + j)*81];
+        }
+        
+        BRScryptBatch(&ctx, dk, sizeof(UInt256), pw, 80, pw, 80, n, 1024, 1, 1);
+    }
+    
+    BRScryptCtxFree(&ctx);
+}
+
+// buf must contain the serialized headers from a headers message, each 80 bytes followed by a zero tx count byte
+// proof-of-work hashes for the headers are calculated in parallel using a pool of worker threads
+// returns number of blocks written to blocks, each of which must be freed by calling BRMerkleBlockFree()
+size_t BRMerkleBlockParseHeaders(BRMerkleBlock *blocks[], size_t blocksCount, const uint8_t *buf, size_t bufLen)
+{
+    BRPowBatch batch = { blocks, buf };
+    size_t i, count = bufLen/81;
+    
+    assert(blocks != NULL || blocksCount == 0);
+    assert(buf != NULL || bufLen == 0);
+    if (count > blocksCount) count = blocksCount;
+    
+    for (i = 0; i < count; i++) { // proof-of-work is hashed below for the whole batch at once
+        blocks[i] = BRMerkleBlockParse(&buf[i*81], 81);
+    }
+    
+    BRWorkPoolRun(count, POW_BATCH_SIZE, POW_MAX_THREADS, &batch, _powWorker);
+    return count;
+}
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL (block->height is not serialized)
 size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t bufLen)
 {
@@ -183,44 +345,20 @@ size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t b
     return (! buf || len <= bufLen) ? len : 0;
 }
 
-static size_t _BRMerkleBlockTxHashesR(const BRMerkleBlock *block, UInt256 *txHashes, size_t hashesCount, size_t *idx,
-                                      size_t *hashIdx, size_t *flagIdx, int depth)
-{
-    uint8_t flag;
-    
-    if (*flagIdx/8 < block->flagsLen && *hashIdx < block->hashesCount) {
-        flag = (block->flags[*flagIdx/8] & (1 << (*flagIdx % 8)));
-        (*flagIdx)++;
-    
-        if (! flag || depth == _ceil_log2(block->totalTx)) {
-            if (flag && *idx < hashesCount) {
-                if (txHashes) txHashes[*idx] = block->hashes[*hashIdx]; // leaf
-                (*idx)++;
-            }
-        
-            (*hashIdx)++;
-        }
-        else {
-            _BRMerkleBlockTxHashesR(block, txHashes, hashesCount, idx, hashIdx, flagIdx, depth + 1); // left branch
-            _BRMerkleBlockTxHashesR(block, txHashes, hashesCount, idx, hashIdx, flagIdx, depth + 1); // right branch
-        }
-    }
-
-    return *idx;
-}
-
 // populates txHashes with the matched tx hashes in the block
 // returns number of hashes written, or the total hashesCount needed if txHashes is NULL
 size_t BRMerkleBlockTxHashes(const BRMerkleBlock *block, UInt256 *txHashes, size_t hashesCount)
 {
-    size_t idx = 0, hashIdx = 0, flagIdx = 0;
-
-    assert(block != NULL);
+    size_t count;
     
-    return _BRMerkleBlockTxHashesR(block, txHashes, (txHashes) ? hashesCount : SIZE_MAX, &idx, &hashIdx, &flagIdx, 0);
+    assert(block != NULL);
+    count = (! txHashes || block->txHashesCount < hashesCount) ? block->txHashesCount : hashesCount;
+    if (txHashes && count > 0) memcpy(txHashes, block->txHashes, count*sizeof(*txHashes));
+    return count;
 }
 
-// sets the hashes and flags fields for a block created with BRMerkleBlockNew()
+// sets the hashes and flags fields for a block created with BRMerkleBlockNew(), block->totalTx must already be set
+// the partial merkle tree is walked once here, caching its merkle root in txRoot and its matched tx hashes in txHashes
 void BRMerkleBlockSetTxHashes(BRMerkleBlock *block, const UInt256 hashes[], size_t hashesCount,
                               const uint8_t *flags, size_t flagsLen)
 {
@@ -231,43 +369,71 @@ void BRMerkleBlockSetTxHashes(BRMerkleBlock *block, const UInt256 hashes[], size
     if (block->hashes) free(block->hashes);
     block->hashes = (hashesCount > 0) ? malloc(hashesCount*sizeof(UInt256)) : NULL;
     if (block->hashes) memcpy(block->hashes, hashes, hashesCount*sizeof(UInt256));
+    block->hashesCount = (block->hashes) ? hashesCount : 0;
     if (block->flags) free(block->flags);
     block->flags = (flagsLen > 0) ? malloc(flagsLen) : NULL;
     if (block->flags) memcpy(block->flags, flags, flagsLen);
+    block->flagsLen = (block->flags) ? flagsLen : 0;
+    _BRMerkleBlockWalkTree(block);
 }
 
-// recursively walks the merkle tree to calculate the merkle root
-// NOTE: this merkle tree design has a security vulnerability (CVE-2012-2459), which can be defended against by
-// considering the merkle root invalid if there are duplicate hashes in any rows with an even number of elements
-static UInt256 _BRMerkleBlockRootR(const BRMerkleBlock *block, size_t *hashIdx, size_t *flagIdx, int depth)
+static pthread_key_t _powCtxKey;
+static pthread_once_t _powCtxOnce = PTHREAD_ONCE_INIT;
+
+static void _powCtxFree(void *ctx)
 {
-    uint8_t flag;
-    UInt256 hashes[2], md = UINT256_ZERO;
+    BRScryptCtxFree(ctx);
+    free(ctx);
+}
 
-    if (*flagIdx/8 < block->flagsLen && *hashIdx < block->hashesCount) {
-        flag = (block->flags[*flagIdx/8] & (1 << (*flagIdx % 8)));
-        (*flagIdx)++;
+static void _powCtxKeyInit(void)
+{
+    pthread_key_create(&_powCtxKey, _powCtxFree);
+}
 
-        if (flag && depth != _ceil_log2(block->totalTx)) {
-            hashes[0] = _BRMerkleBlockRootR(block, hashIdx, flagIdx, depth + 1); // left branch
-            hashes[1] = _BRMerkleBlockRootR(block, hashIdx, flagIdx, depth + 1); // right branch
+// scrypt context for hashing proof-of-work one block at a time, one per thread so its scratch memory is allocated only
+// once, and freed when the thread exits
+static BRScryptCtx *_BRPowCtx(void)
+{
+    BRScryptCtx *ctx;
+    
+    pthread_once(&_powCtxOnce, _powCtxKeyInit);
+    ctx = pthread_getspecific(_powCtxKey);
+    
+    if (! ctx) {
+        ctx = malloc(sizeof(*ctx));
+        assert(ctx != NULL);
+        BRScryptCtxInit(ctx, 1); // block headers are public, so scratch memory is reused without wiping
+        pthread_setspecific(_powCtxKey, ctx);
+    }
+    
+    return ctx;
+}
 
-            if (! UInt256IsZero(hashes[0]) && ! UInt256Eq(hashes[0], hashes[1])) {
-                if (UInt256IsZero(hashes[1])) hashes[1] = hashes[0]; // if right branch is missing, dup left branch
-                BRSHA256_2(&md, hashes, sizeof(hashes));
-            }
-            else *hashIdx = SIZE_MAX; // defend against (CVE-2012-2459)
-        }
-        else md = block->hashes[(*hashIdx)++]; // leaf
+// returns the scrypt proof-of-work hash of the block header, calculating it on first use and caching it in powHash
+UInt256 BRMerkleBlockPowHash(BRMerkleBlock *block)
+{
+    uint8_t buf[80];
+    
+    assert(block != NULL);
+    
+    if (UInt256IsZero(block->powHash)) {
+        UInt32SetLE(&buf[0], block->version);
+        UInt256Set(&buf[4], block->prevBlock);
+        UInt256Set(&buf[36], block->merkleRoot);
+        UInt32SetLE(&buf[68], block->timestamp);
+        UInt32SetLE(&buf[72], block->target);
+        UInt32SetLE(&buf[76], block->nonce);
+        BRScryptCtxDerive(_BRPowCtx(), &block->powHash, sizeof(block->powHash), buf, sizeof(buf), buf, sizeof(buf),
+                          1024, 1, 1);
     }
     
-    return md;
+    return block->powHash;
 }
 
-// true if merkle tree and timestamp are valid, and proof-of-work matches the stated difficulty target
-// NOTE: this only checks if the block difficulty matches the difficulty target in the header, it does not check if the
-// target is correct for the block's height in the chain - use BRMerkleBlockVerifyDifficulty() for that
-int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime)
+// true if merkle tree, timestamp and difficulty target are well formed, without checking proof-of-work
+// use BRMerkleBlockIsValid() before trusting that the block was actually mined
+int BRMerkleBlockIsWellFormed(const BRMerkleBlock *block, uint32_t currentTime)
 {
     assert(block != NULL);
     
@@ -275,12 +441,10 @@ int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime)
     // bit is the sign, and the remaining 23bits is the value after having been right shifted by (size - 3)*8 bits
     static const uint32_t maxsize = MAX_PROOF_OF_WORK >> 24, maxtarget = MAX_PROOF_OF_WORK & 0x00ffffff;
     const uint32_t size = block->target >> 24, target = block->target & 0x00ffffff;
-    size_t hashIdx = 0, flagIdx = 0;
-    UInt256 merkleRoot = _BRMerkleBlockRootR(block, &hashIdx, &flagIdx, 0), t = UINT256_ZERO;
     int r = 1;
     
-    // check if merkle root is correct
-    if (block->totalTx > 0 && ! UInt256Eq(merkleRoot, block->merkleRoot)) r = 0;
+    // check if merkle root is correct, as calculated from the partial merkle tree when hashes and flags were set
+    if (block->totalTx > 0 && ! UInt256Eq(block->txRoot, block->merkleRoot)) r = 0;
     
     // check if timestamp is too far in future
     if (block->timestamp > currentTime + BLOCK_MAX_TIME_DRIFT) r = 0;
@@ -288,12 +452,33 @@ int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime)
     // check if proof-of-work target is out of range
     if (target == 0 || target & 0x00800000 || size > maxsize || (size == maxsize && target > maxtarget)) r = 0;
     
-    if (size > 3) UInt32SetLE(&t.u8[size - 3], target);
-    else UInt32SetLE(t.u8, target >> (3 - size)*8);
+    return r;
+}
+
+// true if merkle tree and timestamp are valid, and proof-of-work matches the stated difficulty target
+// proof-of-work is hashed on first use, and is not checked again once block->powVerified is set
+// NOTE: this only checks if the block difficulty matches the difficulty target in the header, it does not check if the
+// target is correct for the block's height in the chain - use BRMerkleBlockVerifyDifficulty() for that
+int BRMerkleBlockIsValid(BRMerkleBlock *block, uint32_t currentTime)
+{
+    assert(block != NULL);
     
-    for (int i = sizeof(t) - 1; r && i >= 0; i--) { // check proof-of-work
-        if (block->powHash.u8[i] < t.u8[i]) break;
-        if (block->powHash.u8[i] > t.u8[i]) r = 0;
+    // target is in "compact" format, see BRMerkleBlockIsWellFormed()
+    const uint32_t size = block->target >> 24, target = block->target & 0x00ffffff;
+    UInt256 powHash, t = UINT256_ZERO;
+    int r = BRMerkleBlockIsWellFormed(block, currentTime);
+    
+    if (r && ! block->powVerified) {
+        powHash = BRMerkleBlockPowHash(block);
+        if (size > 3) UInt32SetLE(&t.u8[size - 3], target);
+        else UInt32SetLE(t.u8, target >> (3 - size)*8);
+        
+        for (int i = sizeof(t) - 1; r && i >= 0; i--) { // check proof-of-work
+            if (powHash.u8[i] < t.u8[i]) break;
+            if (powHash.u8[i] > t.u8[i]) r = 0;
+        }
+        
+        block->powVerified = r;
     }
     
     return r;
@@ -370,5 +555,6 @@ void BRMerkleBlockFree(BRMerkleBlock *block)
     
     if (block->hashes) free(block->hashes);
     if (block->flags) free(block->flags);
+    if (block->txHashes) free(block->txHashes);
     free(block);
 }
@@ -52,10 +52,15 @@ typedef struct {
     uint8_t *flags;
     size_t flagsLen;
     uint32_t height;
+    int powVerified; // true once proof-of-work has been checked, or if the block came from a trusted source
+    UInt256 txRoot; // merkle root calculated from hashes and flags, or zero if they aren't a well formed merkle tree
+    UInt256 *txHashes; // matched tx hashes from hashes and flags
+    size_t txHashesCount;
 } BRMerkleBlock;
 
 #define BR_MERKLE_BLOCK_NONE\
-    ((BRMerkleBlock) { UINT256_ZERO, 0, UINT256_ZERO, UINT256_ZERO, 0, 0, 0, 0, NULL, 0, NULL, 0, 0 })
+    ((BRMerkleBlock) { UINT256_ZERO, UINT256_ZERO, 0, UINT256_ZERO, UINT256_ZERO, 0, 0, 0, 0, NULL, 0, NULL, 0, 0, 0,\
+                       UINT256_ZERO, NULL, 0 })
 
 // returns a newly allocated merkle block struct that must be freed by calling BRMerkleBlockFree()
 BRMerkleBlock *BRMerkleBlockNew(void);
@@ -64,9 +69,16 @@ BRMerkleBlock *BRMerkleBlockNew(void);
 BRMerkleBlock *BRMerkleBlockCopy(const BRMerkleBlock *block);
 
 // buf must contain either a serialized merkleblock or header
+// proof-of-work is not hashed until needed by BRMerkleBlockPowHash() or BRMerkleBlockIsValid(), so blocks loaded from
+// a trusted persistent store can be parsed without paying for scrypt
 // returns a merkle block struct that must be freed by calling BRMerkleBlockFree()
 BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen);
 
+// buf must contain the serialized headers from a headers message, each 80 bytes followed by a zero tx count byte
+// proof-of-work hashes for the headers are calculated in parallel using a pool of worker threads
+// returns number of blocks written to blocks, each of which must be freed by calling BRMerkleBlockFree()
+size_t BRMerkleBlockParseHeaders(BRMerkleBlock *blocks[], size_t blocksCount, const uint8_t *buf, size_t bufLen);
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL (block->height is not serialized)
 size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t bufLen);
 
@@ -74,14 +86,23 @@ size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t b
 // returns number of tx hashes written, or the total hashesCount needed if txHashes is NULL
 size_t BRMerkleBlockTxHashes(const BRMerkleBlock *block, UInt256 *txHashes, size_t hashesCount);
 
-// sets the hashes and flags fields for a block created with BRMerkleBlockNew()
+// sets the hashes and flags fields for a block created with BRMerkleBlockNew(), block->totalTx must already be set
+// the partial merkle tree is walked once here, caching its merkle root in txRoot and its matched tx hashes in txHashes
 void BRMerkleBlockSetTxHashes(BRMerkleBlock *block, const UInt256 hashes[], size_t hashesCount,
                               const uint8_t *flags, size_t flagsLen);
 
+// returns the scrypt proof-of-work hash of the block header, calculating it on first use and caching it in powHash
+UInt256 BRMerkleBlockPowHash(BRMerkleBlock *block);
+
+// true if merkle tree, timestamp and difficulty target are well formed, without checking proof-of-work
+// use BRMerkleBlockIsValid() before trusting that the block was actually mined
+int BRMerkleBlockIsWellFormed(const BRMerkleBlock *block, uint32_t currentTime);
+
 // true if merkle tree and timestamp are valid, and proof-of-work matches the stated difficulty target
+// proof-of-work is hashed on first use, and is not checked again once block->powVerified is set
 // NOTE: this only checks if the block difficulty matches the difficulty target in the header, it does not check if the
 // target is correct for the block's height in the chain - use BRMerkleBlockVerifyDifficulty() for that
-int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime);
+int BRMerkleBlockIsValid(BRMerkleBlock *block, uint32_t currentTime);
 
 // true if the given tx hash is known to be included in the block
 int BRMerkleBlockContainsTxHash(const BRMerkleBlock *block, UInt256 txHash);
@@ -41,7 +41,17 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <netinet/in.h>	
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define PEER_EVENT_EPOLL   1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#include <sys/event.h>
+#define PEER_EVENT_KQUEUE  1
+#endif
 
 #define HEADER_LENGTH      24
 #define MAX_MSG_LENGTH     0x02000000
@@ -52,6 +62,10 @@
 #define LOCAL_HOST         ((UInt128) { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 })
 #define CONNECT_TIMEOUT    3.0
 #define MESSAGE_TIMEOUT    10.0
+#define RECV_BUFFER_SIZE   0x8000 // initial receive buffer size, grows as needed to hold the largest pending message
+#define SEND_QUEUE_SIZE    0x1000 // initial outbound queue size, trimmed back down to this after a large burst
+#define LOOP_MAX_EVENTS    64
+#define LOOP_POLL_INTERVAL 1000 // milliseconds, same resolution as the one second socket timeout used by threads
 
 // the standard blockchain download protocol works as follows (for SPV mode):
 // - local peer sends getblocks
@@ -80,6 +94,9 @@
 // - if at any point tx messages consume enough wallet addresses to drop below the bip32 chain gap limit, more addresses
 //   are generated and local peer sends filterload with an updated bloom filter
 // - after filterload is sent, getdata is sent to re-request recent blocks that may contain new tx matching the filter
+//
+// in headers-first mode getheaders is repeated all the way to the tip of the chain instead of switching to getblocks,
+// and the peer manager then sends getdata for the merkleblocks it needs
 
 typedef enum {
     inv_undefined = 0,
@@ -88,6 +105,8 @@ typedef enum {
     inv_filtered_block = 3
 } inv_type;
 
+typedef struct BRPeerIOThreadStruct BRPeerIOThread;
+
 typedef struct {
     BRPeer peer; // superstruct on top of BRPeer
     uint32_t magicNumber;
@@ -98,6 +117,7 @@ typedef struct {
     uint64_t nonce, feePerKb;
     char *useragent;
     uint32_t version, lastblock, earliestKeyTime, currentBlockHeight;
+    int headersFirst;
     double startTime, pingTime;
     volatile double disconnectTime, mempoolTime;
     int sentVerack, gotVerack, sentGetaddr, sentFilter, sentGetdata, sentMempool, sentGetblocks;
@@ -111,9 +131,12 @@ typedef struct {
     void (*disconnected)(void *info, int error);
     void (*relayedPeers)(void *info, const BRPeer peers[], size_t peersCount);
     void (*relayedTx)(void *info, BRTransaction *tx);
+    int (*relayedTxIsRelevant)(void *info, const BRTransactionView *view);
+    int (*requestBlocks)(void *info, const UInt256 blockHashes[], size_t blockCount);
     void (*hasTx)(void *info, UInt256 txHash);
     void (*rejectedTx)(void *info, UInt256 txHash, uint8_t code);
     void (*relayedBlock)(void *info, BRMerkleBlock *block);
+    void (*headersDone)(void *info);
     void (*notfound)(void *info, const UInt256 txHashes[], size_t txCount, const UInt256 blockHashes[],
                      size_t blockCount);
     void (*setFeePerKb)(void *info, uint64_t feePerKb);
@@ -125,12 +148,53 @@ typedef struct {
     void *volatile mempoolInfo;
     void (*volatile mempoolCallback)(void *info, int success);
     pthread_t thread;
+    BRPeerEventLoop *loop;
+    BRPeerIOThread *ioThread; // BRPeerDisconnect() reads this from other threads, so it is accessed atomically
+    int loopSocket, loopFlags, loopConnecting, loopError;
+    uint8_t *recvBuf;
+    size_t recvStart, recvEnd, recvSize;
+    double recvTimeout;
+    uint8_t *sendQueue;
+    int corkCount;
+    pthread_mutex_t sendLock;
+    BRPeerStats stats;
 } BRPeerContext;
 
+struct BRPeerIOThreadStruct {
+    BRPeerEventLoop *loop;
+    pthread_t thread;
+    int started, pollFd, wakeFd[2];
+    volatile size_t peerCount;
+    BRPeer **pending, **peers;
+    pthread_mutex_t lock;
+};
+
+struct BRPeerEventLoopStruct {
+    BRPeerIOThread *threads;
+    size_t threadCount;
+    volatile int stop;
+    pthread_mutex_t lock;
+};
+
 void BRPeerSendVersionMessage(BRPeer *peer);
 void BRPeerSendVerackMessage(BRPeer *peer);
 void BRPeerSendAddr(BRPeer *peer);
 
+static const char *_BRPeerStatsTypes[PEER_STATS_MSG_TYPES - 1] = {
+    MSG_VERSION, MSG_VERACK, MSG_ADDR, MSG_INV, MSG_GETDATA, MSG_NOTFOUND, MSG_GETBLOCKS, MSG_GETHEADERS, MSG_TX,
+    MSG_BLOCK, MSG_HEADERS, MSG_GETADDR, MSG_MEMPOOL, MSG_PING, MSG_PONG, MSG_FILTERLOAD, MSG_FILTERADD,
+    MSG_FILTERCLEAR, MSG_MERKLEBLOCK, MSG_ALERT, MSG_REJECT, MSG_FEEFILTER
+};
+
+// index of the BRPeerStats counters for message type
+static size_t _BRPeerStatsTypeIndex(const char *type)
+{
+    size_t i;
+
+    for (i = 0; i < PEER_STATS_MSG_TYPES - 1 && strncmp(_BRPeerStatsTypes[i], type, 12) != 0; i++);
+    return i;
+}
+
 inline static int _BRPeerIsIPv4(const BRPeer *peer)
 {
     return (peer->address.u64[0] == 0 && peer->address.u16[4] == 0 && peer->address.u16[5] == 0xffff);
@@ -268,7 +332,7 @@ static int _BRPeerAcceptAddrMessage(BRPeer *peer, const uint8_t *msg, size_t msg
         peer_log(peer, "dropping addr message, %zu is too many addresses, max is 1000", count);
     }
     else if (ctx->sentGetaddr) { // simple anti-tarpitting tactic, don't accept unsolicited addresses
-        BRPeer peers[count], p;
+        BRPeer peers[count], p = BR_PEER_NONE;
         size_t peersCount = 0;
         time_t now = time(NULL);
         
@@ -374,7 +438,11 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
             }
             
             _BRPeerAddKnownTxHashes(peer, txHashes, j);
-            if (j > 0 || blockCount > 0) BRPeerSendGetdata(peer, txHashes, j, blockHashes, blockCount);
+            
+            if (blockCount > 0 && ctx->requestBlocks && ctx->requestBlocks(ctx->info, blockHashes, blockCount)) {
+                if (j > 0) BRPeerSendGetdata(peer, txHashes, j, NULL, 0); // blocks were requested by the callback
+            }
+            else if (j > 0 || blockCount > 0) BRPeerSendGetdata(peer, txHashes, j, blockHashes, blockCount);
     
             // to improve chain download performance, if we received 500 block hashes, request the next 500 block hashes
             if (blockCount >= 500) {
@@ -398,27 +466,28 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
 static int _BRPeerAcceptTxMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
-    BRTransaction *tx = BRTransactionParse(msg, msgLen);
+    BRTransactionView view;
+    BRTransaction *tx;
     UInt256 txHash;
     int r = 1;
 
-    if (! tx) {
+    if (! BRTransactionViewInit(&view, msg, msgLen)) {
         peer_log(peer, "malformed tx message with length: %zu", msgLen);
         r = 0;
     }
     else if (! ctx->sentFilter && ! ctx->sentGetdata) {
         peer_log(peer, "got tx message before loading filter");
-        BRTransactionFree(tx);
         r = 0;
     }
     else {
-        txHash = tx->txHash;
+        txHash = view.txHash;
         peer_log(peer, "got tx: %s", u256hex(txHash));
 
-        if (ctx->relayedTx) {
-            ctx->relayedTx(ctx->info, tx);
+        // only materialize the tx if it might be relevant, bloom filter false positives are dropped unparsed
+        if (ctx->relayedTx && (! ctx->relayedTxIsRelevant || ctx->relayedTxIsRelevant(ctx->info, &view))) {
+            tx = BRTransactionParse(msg, msgLen);
+            if (tx) ctx->relayedTx(ctx->info, tx);
         }
-        else BRTransactionFree(tx);
 
         if (ctx->currentBlock) { // we're collecting tx messages for a merkleblock
             for (size_t i = array_count(ctx->currentBlockTxHashes); i > 0; i--) {
@@ -455,17 +524,18 @@ static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t
     
         // To improve chain download performance, if this message contains 2000 headers then request the next 2000
         // headers immediately, and switch to requesting blocks when we receive a header newer than earliestKeyTime
+        // (in headers-first mode, keep requesting headers until a message with fewer than 2000 reaches the tip)
         uint32_t timestamp = (count > 0) ? UInt32GetLE(&msg[off + 81*(count - 1) + 68]) : 0;
+        int keyTimeReached = (! ctx->headersFirst && timestamp > 0 &&
+                              timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime);
     
-        if (count >= 2000 || (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime)) {
+        if (count >= 2000 || keyTimeReached || ctx->headersFirst) {
+            int headersDone = (ctx->headersFirst && count < 2000); // the peer has sent the last of its header chain
             size_t last = 0;
             time_t now = time(NULL);
             UInt256 locators[2];
             
-            BRSHA256_2(&locators[0], &msg[off + 81*(count - 1)], 80);
-            BRSHA256_2(&locators[1], &msg[off], 80);
-
-            if (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime) {
+            if (keyTimeReached) {
                 // request blocks for the remainder of the chain
                 timestamp = (++last < count) ? UInt32GetLE(&msg[off + 81*last + 68]) : 0;
 
@@ -474,14 +544,27 @@ static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t
                 }
                 
                 BRSHA256_2(&locators[0], &msg[off + 81*(last - 1)], 80);
+                BRSHA256_2(&locators[1], &msg[off], 80);
                 BRPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
             }
-            else BRPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
+            else if (count >= 2000) {
+                BRSHA256_2(&locators[0], &msg[off + 81*(count - 1)], 80);
+                BRSHA256_2(&locators[1], &msg[off], 80);
+                BRPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
+            }
+
+            BRMerkleBlock **blocks = malloc(count*sizeof(*blocks));
+            
+            assert(blocks != NULL || count == 0);
+            count = BRMerkleBlockParseHeaders(blocks, count, &msg[off], msgLen - off); // hash proof-of-work in parallel
 
-            for (size_t i = 0; r && i < count; i++) {
-                BRMerkleBlock *block = BRMerkleBlockParse(&msg[off + 81*i], 81);
+            for (size_t i = 0; i < count; i++) {
+                BRMerkleBlock *block = blocks[i];
                 
-                if (! BRMerkleBlockIsValid(block, (uint32_t)now)) {
+                if (! r) {
+                    BRMerkleBlockFree(block);
+                }
+                else if (! BRMerkleBlockIsValid(block, (uint32_t)now)) {
                     peer_log(peer, "invalid block header: %s", u256hex(block->blockHash));
                     BRMerkleBlockFree(block);
                     r = 0;
@@ -491,6 +574,9 @@ static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t
                 }
                 else BRMerkleBlockFree(block);
             }
+            
+            if (blocks) free(blocks);
+            if (r && headersDone && ctx->headersDone) ctx->headersDone(ctx->info);
         }
         else {
             peer_log(peer, "non-standard headers message, %zu is fewer header(s) than expected", count);
@@ -697,7 +783,7 @@ static int _BRPeerAcceptMerkleblockMessage(BRPeer *peer, const uint8_t *msg, siz
         peer_log(peer, "malformed merkleblock message with length: %zu", msgLen);
         r = 0;
     }
-    else if (! BRMerkleBlockIsValid(block, (uint32_t)time(NULL))) {
+    else if (! BRMerkleBlockIsWellFormed(block, (uint32_t)time(NULL))) { // proof-of-work is checked by relayedBlock()
         peer_log(peer, "invalid merkleblock: %s", u256hex(block->blockHash));
         BRMerkleBlockFree(block);
         block = NULL;
@@ -710,19 +796,10 @@ static int _BRPeerAcceptMerkleblockMessage(BRPeer *peer, const uint8_t *msg, siz
         r = 0;
     }
     else {
-        size_t count = BRMerkleBlockTxHashes(block, NULL, 0);
-        UInt256 _hashes[(sizeof(UInt256)*count <= 0x1000) ? count : 0],
-                *hashes = (sizeof(UInt256)*count <= 0x1000) ? _hashes : malloc(count*sizeof(*hashes));
-        
-        assert(hashes != NULL);
-        count = BRMerkleBlockTxHashes(block, hashes, count);
-
-        for (size_t i = count; i > 0; i--) { // reverse order for more efficient removal as tx arrive
-            if (BRSetContains(ctx->knownTxHashSet, &hashes[i - 1])) continue;
-            array_add(ctx->currentBlockTxHashes, hashes[i - 1]);
+        for (size_t i = block->txHashesCount; i > 0; i--) { // reverse order for more efficient removal as tx arrive
+            if (BRSetContains(ctx->knownTxHashSet, &block->txHashes[i - 1])) continue;
+            array_add(ctx->currentBlockTxHashes, block->txHashes[i - 1]);
         }
-
-        if (hashes != _hashes) free(hashes);
     }
 
     if (block) {
@@ -810,6 +887,8 @@ static int _BRPeerAcceptFeeFilterMessage(BRPeer *peer, const uint8_t *msg, size_
 static int _BRPeerAcceptMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
+    size_t idx = _BRPeerStatsTypeIndex(type);
+    uint64_t start = BRPeerStatsTime(), micros;
     int r = 1;
     
     if (ctx->currentBlock && strncmp(MSG_TX, type, 12) != 0) { // if we receive a non-tx message, merkleblock is done
@@ -835,77 +914,185 @@ static int _BRPeerAcceptMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen,
     else if (strncmp(MSG_FEEFILTER, type, 12) == 0) r = _BRPeerAcceptFeeFilterMessage(peer, msg, msgLen);
     else peer_log(peer, "dropping %s, length %zu, not implemented", type, msgLen);
 
+    micros = BRPeerStatsTime() - start;
+    BRPeerStatsAdd(&ctx->stats.recvCount[idx], 1);
+    BRPeerStatsAdd(&ctx->stats.recvBytes[idx], HEADER_LENGTH + msgLen);
+    BRPeerStatsAdd(&ctx->stats.handlerTime[idx], micros);
+    BRPeerStatsAddLatency(ctx->stats.handlerLatency[idx], micros);
     return r;
 }
 
-static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *error)
+// true if the receive buffer holds the header of a message whose payload hasn't fully arrived yet
+inline static int _BRPeerRecvPending(const BRPeerContext *ctx)
+{
+    return (ctx->recvEnd - ctx->recvStart >= HEADER_LENGTH);
+}
+
+// reads as much socket data as fits in the receive buffer with a single recv() call, first moving any partial message
+// to the front of the buffer if it wouldn't fit where it is, returns the result of recv()
+static ssize_t _BRPeerRecv(BRPeer *peer, int socket, int flags)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
-    struct sockaddr_storage addr;
-    struct timeval tv;
-    fd_set fds;
-    socklen_t addrLen, optLen;
-    int count, arg = 0, err = 0, on = 1, r = 1;
+    size_t len = ctx->recvEnd - ctx->recvStart, need = HEADER_LENGTH;
 
-    ctx->socket = socket(domain, SOCK_STREAM, 0);
-    
-    if (ctx->socket < 0) {
-        err = errno;
-        r = 0;
+    // the header of a buffered partial message was already validated by _BRPeerProcessRecvBuf()
+    if (len >= HEADER_LENGTH) need += UInt32GetLE(&ctx->recvBuf[ctx->recvStart + 16]);
+
+    if (len == 0) {
+        ctx->recvStart = ctx->recvEnd = 0;
+
+        if (ctx->recvSize > RECV_BUFFER_SIZE) { // shrink back down after a large message
+            ctx->recvBuf = realloc(ctx->recvBuf, (ctx->recvSize = RECV_BUFFER_SIZE));
+            assert(ctx->recvBuf != NULL);
+        }
     }
-    else {
-        tv.tv_sec = 1; // one second timeout for send/receive, so thread doesn't block for too long
-        tv.tv_usec = 0;
-        setsockopt(ctx->socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-        setsockopt(ctx->socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-        setsockopt(ctx->socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
-#ifdef SO_NOSIGPIPE // BSD based systems have a SO_NOSIGPIPE socket option to supress SIGPIPE signals
-        setsockopt(ctx->socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
-#endif
-        arg = fcntl(ctx->socket, F_GETFL, NULL);
-        if (arg < 0 || fcntl(ctx->socket, F_SETFL, arg | O_NONBLOCK) < 0) r = 0; // temporarily set socket non-blocking
-        if (! r) err = errno;
+    else if (ctx->recvStart + need > ctx->recvSize) { // wrap the partial message around to the front
+        memmove(ctx->recvBuf, &ctx->recvBuf[ctx->recvStart], len);
+        ctx->recvStart = 0;
+        ctx->recvEnd = len;
     }
 
-    if (r) {
-        memset(&addr, 0, sizeof(addr));
-        
-        if (domain == PF_INET6) {
-            ((struct sockaddr_in6 *)&addr)->sin6_family = AF_INET6;
-            ((struct sockaddr_in6 *)&addr)->sin6_addr = *(struct in6_addr *)&peer->address;
-            ((struct sockaddr_in6 *)&addr)->sin6_port = htons(peer->port);
-            addrLen = sizeof(struct sockaddr_in6);
+    if (need > ctx->recvSize) {
+        ctx->recvBuf = realloc(ctx->recvBuf, (ctx->recvSize = need));
+        assert(ctx->recvBuf != NULL);
+    }
+
+    ssize_t n = recv(socket, &ctx->recvBuf[ctx->recvEnd], ctx->recvSize - ctx->recvEnd, flags);
+
+    if (n > 0) ctx->recvEnd += n;
+    return n;
+}
+
+// frames and dispatches every complete message in the receive buffer, passing _BRPeerAcceptMessage() a pointer to the
+// payload in place, any trailing partial message is left in the buffer, returns an errno.h code on protocol error
+static int _BRPeerProcessRecvBuf(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    const uint8_t *buf = ctx->recvBuf;
+    size_t off = ctx->recvStart, end = ctx->recvEnd;
+    uint32_t msgLen, checksum;
+    UInt256 hash;
+    int error = 0;
+
+    while (! error && ctx->socket >= 0 && off + sizeof(uint32_t) <= end) {
+        if (UInt32GetLE(&buf[off]) != ctx->magicNumber) { // skip ahead to the next magic number
+            for (off++; off + sizeof(uint32_t) <= end && UInt32GetLE(&buf[off]) != ctx->magicNumber; off++);
+            continue;
         }
-        else {
-            ((struct sockaddr_in *)&addr)->sin_family = AF_INET;
-            ((struct sockaddr_in *)&addr)->sin_addr = *(struct in_addr *)&peer->address.u32[3];
-            ((struct sockaddr_in *)&addr)->sin_port = htons(peer->port);
-            addrLen = sizeof(struct sockaddr_in);
+
+        if (off + HEADER_LENGTH > end) break;
+
+        const char *type = (const char *)&buf[off + 4];
+
+        msgLen = UInt32GetLE(&buf[off + 16]);
+        checksum = UInt32GetLE(&buf[off + 20]);
+
+        if (buf[off + 15] != 0) { // verify header type field is NULL terminated
+            peer_log(peer, "malformed message header: type not NULL terminated");
+            error = EPROTO;
         }
-        
-        if (connect(ctx->socket, (struct sockaddr *)&addr, addrLen) < 0) err = errno;
-        
-        if (err == EINPROGRESS) {
-            err = 0;
-            optLen = sizeof(err);
-            tv.tv_sec = timeout;
-            tv.tv_usec = (long)(timeout*1000000) % 1000000;
-            FD_ZERO(&fds);
-            FD_SET(ctx->socket, &fds);
-            count = select(ctx->socket + 1, NULL, &fds, NULL, &tv);
-
-            if (count <= 0 || getsockopt(ctx->socket, SOL_SOCKET, SO_ERROR, &err, &optLen) < 0 || err) {
-                if (count == 0) err = ETIMEDOUT;
-                if (count < 0 || ! err) err = errno;
-                r = 0;
+        else if (msgLen > MAX_MSG_LENGTH) { // check message length
+            peer_log(peer, "error reading %s, message length %"PRIu32" is too long", type, msgLen);
+            error = EPROTO;
+        }
+        else if (off + HEADER_LENGTH + msgLen > end) {
+            break; // wait for the rest of the payload
+        }
+        else {
+            BRSHA256_2(&hash, &buf[off + HEADER_LENGTH], msgLen);
+            
+            if (UInt32GetLE(&hash) != checksum) { // verify checksum
+                peer_log(peer, "error reading %s, invalid checksum %x, expected %x, payload length:%"PRIu32
+                         ", SHA256_2:%s", type, UInt32GetLE(&hash), checksum, msgLen, u256hex(hash));
+                error = EPROTO;
             }
+            else if (! _BRPeerAcceptMessage(peer, &buf[off + HEADER_LENGTH], msgLen, type)) error = EPROTO;
+
+            off += HEADER_LENGTH + msgLen;
         }
-        else if (err && domain == PF_INET6 && _BRPeerIsIPv4(peer)) {
-            return _BRPeerOpenSocket(peer, PF_INET, timeout, error); // fallback to IPv4
+    }
+
+    ctx->recvStart = off;
+    return error;
+}
+
+// creates a non-blocking socket and starts connecting to peer, falling back to IPv4 if needed, the original socket
+// flags are returned in flags, returns an errno.h code, EINPROGRESS if the connection is still being established
+static int _BRPeerStartConnect(BRPeer *peer, int domain, int *flags)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    struct sockaddr_storage addr;
+    struct timeval tv;
+    socklen_t addrLen;
+    int on = 1, err = 0;
+
+    ctx->socket = socket(domain, SOCK_STREAM, 0);
+    if (ctx->socket < 0) return errno;
+    tv.tv_sec = 1; // one second timeout for send/receive, so thread doesn't block for too long
+    tv.tv_usec = 0;
+    setsockopt(ctx->socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(ctx->socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(ctx->socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    // messages are already coalesced by BRPeerCork(), so nagle's algorithm would only add latency
+    setsockopt(ctx->socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE // BSD based systems have a SO_NOSIGPIPE socket option to supress SIGPIPE signals
+    setsockopt(ctx->socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    *flags = fcntl(ctx->socket, F_GETFL, NULL);
+    // temporarily set socket non-blocking
+    if (*flags < 0 || fcntl(ctx->socket, F_SETFL, *flags | O_NONBLOCK) < 0) return errno;
+    memset(&addr, 0, sizeof(addr));
+
+    if (domain == PF_INET6) {
+        ((struct sockaddr_in6 *)&addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)&addr)->sin6_addr = *(struct in6_addr *)&peer->address;
+        ((struct sockaddr_in6 *)&addr)->sin6_port = htons(peer->port);
+        addrLen = sizeof(struct sockaddr_in6);
+    }
+    else {
+        ((struct sockaddr_in *)&addr)->sin_family = AF_INET;
+        ((struct sockaddr_in *)&addr)->sin_addr = *(struct in_addr *)&peer->address.u32[3];
+        ((struct sockaddr_in *)&addr)->sin_port = htons(peer->port);
+        addrLen = sizeof(struct sockaddr_in);
+    }
+
+    if (connect(ctx->socket, (struct sockaddr *)&addr, addrLen) < 0) err = errno;
+
+    if (err && err != EINPROGRESS && domain == PF_INET6 && _BRPeerIsIPv4(peer)) {
+        close(ctx->socket);
+        return _BRPeerStartConnect(peer, PF_INET, flags); // fallback to IPv4
+    }
+
+    return err;
+}
+
+static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *error)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    struct timeval tv;
+    fd_set fds;
+    socklen_t optLen;
+    int count, arg = 0, err = _BRPeerStartConnect(peer, domain, &arg), r = 1;
+
+    if (err == EINPROGRESS) {
+        err = 0;
+        optLen = sizeof(err);
+        tv.tv_sec = timeout;
+        tv.tv_usec = (long)(timeout*1000000) % 1000000;
+        FD_ZERO(&fds);
+        FD_SET(ctx->socket, &fds);
+        count = select(ctx->socket + 1, NULL, &fds, NULL, &tv);
+
+        if (count <= 0 || getsockopt(ctx->socket, SOL_SOCKET, SO_ERROR, &err, &optLen) < 0 || err) {
+            if (count == 0) err = ETIMEDOUT;
+            if (count < 0 || ! err) err = errno;
+            r = 0;
         }
-        else if (err) r = 0;
+    }
+    else if (err) r = 0;
 
-        if (r) peer_log(peer, "socket connected");
+    if (r) {
+        peer_log(peer, "socket connected");
         fcntl(ctx->socket, F_SETFL, arg); // restore socket non-blocking status
     }
 
@@ -914,6 +1101,31 @@ static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *erro
     return r;
 }
 
+// closes the socket and fails any pending pong and mempool callbacks before calling disconnected(), which may free peer
+static void _BRPeerDidDisconnect(BRPeer *peer, int error)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    int socket = ctx->socket;
+
+    ctx->socket = -1;
+    ctx->status = BRPeerStatusDisconnected;
+    if (socket >= 0) close(socket);
+    peer_log(peer, "disconnected");
+    
+    while (array_count(ctx->pongCallback) > 0) {
+        void (*pongCallback)(void *, int) = ctx->pongCallback[0];
+        void *pongInfo = ctx->pongInfo[0];
+        
+        array_rm(ctx->pongCallback, 0);
+        array_rm(ctx->pongInfo, 0);
+        if (pongCallback) pongCallback(pongInfo, 0);
+    }
+
+    if (ctx->mempoolCallback) ctx->mempoolCallback(ctx->mempoolInfo, 0);
+    ctx->mempoolCallback = NULL;
+    if (ctx->disconnected) ctx->disconnected(ctx->info, error);
+}
+
 static void *_peerThreadRoutine(void *arg)
 {
     BRPeer *peer = arg;
@@ -924,119 +1136,375 @@ static void *_peerThreadRoutine(void *arg)
     
     if (_BRPeerOpenSocket(peer, PF_INET6, CONNECT_TIMEOUT, &error)) {
         struct timeval tv;
-        double time = 0, msgTimeout;
-        uint8_t header[HEADER_LENGTH], *payload = malloc(0x1000);
-        size_t len = 0, payloadLen = 0x1000;
+        double time = 0;
         ssize_t n = 0;
 
-        assert(payload != NULL);
+        ctx->recvBuf = malloc((ctx->recvSize = RECV_BUFFER_SIZE));
+        assert(ctx->recvBuf != NULL);
+        ctx->recvStart = ctx->recvEnd = 0;
         gettimeofday(&tv, NULL);
         ctx->startTime = tv.tv_sec + (double)tv.tv_usec/1000000;
         BRPeerSendVersionMessage(peer);
         
         while (ctx->socket >= 0 && ! error) {
-            len = 0;
             socket = ctx->socket;
-            
-            while (socket >= 0 && ! error && len < HEADER_LENGTH) {
-                n = read(socket, &header[len], sizeof(header) - len);
-                if (n > 0) len += n;
-                if (n == 0) error = ECONNRESET;
-                if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                gettimeofday(&tv, NULL);
-                time = tv.tv_sec + (double)tv.tv_usec/1000000;
-                if (! error && time >= ctx->disconnectTime) error = ETIMEDOUT;
-
-                if (! error && time >= ctx->mempoolTime) {
-                    peer_log(peer, "done waiting for mempool response");
-                    BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
-                    ctx->mempoolCallback = NULL;
-                    ctx->mempoolTime = DBL_MAX;
-                }
-                
-                while (sizeof(uint32_t) <= len && UInt32GetLE(header) != ctx->magicNumber) {
-                    memmove(header, &header[1], --len); // consume one byte at a time until we find the magic number
-                }
-                
-                socket = ctx->socket;
-            }
-            
+            n = _BRPeerRecv(peer, socket, 0);
+            if (n == 0) error = ECONNRESET;
+            if (n < 0 && errno != EWOULDBLOCK) error = errno;
+            gettimeofday(&tv, NULL);
+            time = tv.tv_sec + (double)tv.tv_usec/1000000;
+
             if (error) {
                 peer_log(peer, "%s", strerror(error));
+                break;
             }
-            else if (header[15] != 0) { // verify header type field is NULL terminated
-                peer_log(peer, "malformed message header: type not NULL terminated");
-                error = EPROTO;
+
+            if (n > 0) {
+                ctx->recvTimeout = time + MESSAGE_TIMEOUT;
+                error = _BRPeerProcessRecvBuf(peer);
             }
-            else if (len == HEADER_LENGTH) {
-                const char *type = (const char *)(&header[4]);
-                uint32_t msgLen = UInt32GetLE(&header[16]);
-                uint32_t checksum = UInt32GetLE(&header[20]);
-                UInt256 hash;
-                
-                if (msgLen > MAX_MSG_LENGTH) { // check message length
-                    peer_log(peer, "error reading %s, message length %"PRIu32" is too long", type, msgLen);
-                    error = EPROTO;
-                }
-                else {
-                    if (msgLen > payloadLen) payload = realloc(payload, (payloadLen = msgLen));
-                    assert(payload != NULL);
-                    len = 0;
-                    socket = ctx->socket;
-                    msgTimeout = time + MESSAGE_TIMEOUT;
-                    
-                    while (socket >= 0 && ! error && len < msgLen) {
-                        n = read(socket, &payload[len], msgLen - len);
-                        if (n > 0) len += n;
-                        if (n == 0) error = ECONNRESET;
-                        if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                        gettimeofday(&tv, NULL);
-                        time = tv.tv_sec + (double)tv.tv_usec/1000000;
-                        if (n > 0) msgTimeout = time + MESSAGE_TIMEOUT;
-                        if (! error && time >= msgTimeout) error = ETIMEDOUT;
-                        socket = ctx->socket;
-                    }
-                    
-                    if (error) {
-                        peer_log(peer, "%s", strerror(error));
-                    }
-                    else if (len == msgLen) {
-                        BRSHA256_2(&hash, payload, msgLen);
-                        
-                        if (UInt32GetLE(&hash) != checksum) { // verify checksum
-                            peer_log(peer, "error reading %s, invalid checksum %x, expected %x, payload length:%"PRIu32
-                                     ", SHA256_2:%s", type, UInt32GetLE(&hash), checksum, msgLen, u256hex(hash));
-                            error = EPROTO;
-                        }
-                        else if (! _BRPeerAcceptMessage(peer, payload, msgLen, type)) error = EPROTO;
-                    }
-                }
+
+            if (! error && (time >= ctx->disconnectTime || (_BRPeerRecvPending(ctx) && time >= ctx->recvTimeout))) {
+                error = ETIMEDOUT;
+                peer_log(peer, "%s", strerror(error));
+            }
+
+            if (! error && time >= ctx->mempoolTime) {
+                peer_log(peer, "done waiting for mempool response");
+                BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
+                ctx->mempoolCallback = NULL;
+                ctx->mempoolTime = DBL_MAX;
             }
         }
         
-        free(payload);
+        free(ctx->recvBuf);
+        ctx->recvBuf = NULL;
+        ctx->recvSize = ctx->recvStart = ctx->recvEnd = 0;
     }
     
-    socket = ctx->socket;
-    ctx->socket = -1;
-    ctx->status = BRPeerStatusDisconnected;
-    if (socket >= 0) close(socket);
-    peer_log(peer, "disconnected");
+    _BRPeerDidDisconnect(peer, error);
+    pthread_cleanup_pop(1);
+    return NULL; // detached threads don't need to return a value
+}
+
+#define BR_POLL_READ  0x01
+#define BR_POLL_WRITE 0x02
+
+typedef struct {
+    void *ptr;
+    int flags;
+} BRPollEvent;
+
+// returns a new epoll/kqueue file descriptor, or -1 with errno set to ENOSYS if neither is available
+static int _BRPollNew(void)
+{
+#if defined(PEER_EVENT_EPOLL)
+    return epoll_create1(EPOLL_CLOEXEC);
+#elif defined(PEER_EVENT_KQUEUE)
+    return kqueue();
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// sets which of BR_POLL_READ/BR_POLL_WRITE will be reported for fd, with ptr returned in each event, add must be true
+// the first time fd is set, returns -1 on failure (closing fd removes it from the poll set)
+static int _BRPollSet(int pollFd, int fd, void *ptr, int flags, int add)
+{
+#if defined(PEER_EVENT_EPOLL)
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((flags & BR_POLL_READ) ? EPOLLIN | EPOLLRDHUP : 0) | ((flags & BR_POLL_WRITE) ? EPOLLOUT : 0);
+    ev.data.ptr = ptr;
+    return epoll_ctl(pollFd, (add) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+#elif defined(PEER_EVENT_KQUEUE)
+    struct kevent ev[2];
+
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD | ((flags & BR_POLL_READ) ? EV_ENABLE : EV_DISABLE), 0, 0, ptr);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | ((flags & BR_POLL_WRITE) ? EV_ENABLE : EV_DISABLE), 0, 0, ptr);
+    return kevent(pollFd, ev, 2, NULL, 0, NULL);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// waits up to timeout milliseconds for events, returns the number of events written to events[]
+static int _BRPollWait(int pollFd, BRPollEvent events[], int count, int timeout)
+{
+    int i, n = 0;
+#if defined(PEER_EVENT_EPOLL)
+    struct epoll_event ev[count];
+
+    n = epoll_wait(pollFd, ev, count, timeout);
+
+    for (i = 0; i < n; i++) {
+        events[i].ptr = ev[i].data.ptr;
+        events[i].flags = ((ev[i].events & ~EPOLLOUT) ? BR_POLL_READ : 0) |
+                          ((ev[i].events & EPOLLOUT) ? BR_POLL_WRITE : 0);
+    }
+#elif defined(PEER_EVENT_KQUEUE)
+    struct kevent ev[count];
+    struct timespec ts = { timeout/1000, (timeout % 1000)*1000000 };
+
+    n = kevent(pollFd, NULL, 0, ev, count, &ts);
+
+    for (i = 0; i < n; i++) {
+        events[i].ptr = ev[i].udata;
+        events[i].flags = (ev[i].filter == EVFILT_WRITE) ? BR_POLL_WRITE : BR_POLL_READ;
+    }
+#endif
+    return (n < 0) ? 0 : n;
+}
+
+static void _BRPeerIOThreadWake(BRPeerIOThread *io)
+{
+    uint8_t b = 0;
+
+    if (write(io->wakeFd[1], &b, sizeof(b)) < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
+        peer_log(&BR_PEER_NONE, "event loop wake error: %s", strerror(errno));
+    }
+}
+
+// hands peer to the least busy i/o thread of loop, which opens the socket and performs the handshake
+static void _BRPeerEventLoopAdd(BRPeerEventLoop *loop, BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRPeerIOThread *io = &loop->threads[0];
+
+    pthread_mutex_lock(&loop->lock);
+
+    for (size_t i = 1; i < loop->threadCount; i++) {
+        if (loop->threads[i].peerCount < io->peerCount) io = &loop->threads[i];
+    }
+
+    pthread_mutex_lock(&io->lock);
+    __atomic_store_n(&ctx->ioThread, io, __ATOMIC_RELEASE);
+    io->peerCount++;
+    array_add(io->pending, peer);
+    pthread_mutex_unlock(&io->lock);
+    pthread_mutex_unlock(&loop->lock);
+    _BRPeerIOThreadWake(io);
+}
+
+static void _BRPeerLoopConnect(BRPeerIOThread *io, BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    int err = _BRPeerStartConnect(peer, PF_INET6, &ctx->loopFlags);
+
+    ctx->loopSocket = ctx->socket;
+    ctx->loopConnecting = 1;
+    ctx->recvBuf = malloc((ctx->recvSize = RECV_BUFFER_SIZE));
+    assert(ctx->recvBuf != NULL);
+    ctx->recvStart = ctx->recvEnd = 0;
+    if (err == EINPROGRESS) err = 0;
+
+    // a socket that connected immediately is writable right away, so either way the next step is a write event
+    if (! err && _BRPollSet(io->pollFd, ctx->loopSocket, peer, BR_POLL_WRITE, 1) < 0) err = errno;
+    if (err) peer_log(peer, "connect error: %s", strerror(err));
+    ctx->loopError = err;
+}
+
+// reads available socket data and dispatches every complete message, returns an errno.h code, the poll set is level
+// triggered so a single recv() per read event is enough, any data left in the socket buffer triggers another event
+static int _BRPeerLoopRead(BRPeer *peer, double time)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    ssize_t n = _BRPeerRecv(peer, ctx->loopSocket, MSG_DONTWAIT);
+    int error = 0;
+
+    if (n < 0 && (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR)) return 0;
+    if (n == 0) error = ECONNRESET;
+    if (n < 0) error = errno;
+
+    if (error) {
+        peer_log(peer, "%s", strerror(error));
+    }
+    else {
+        ctx->recvTimeout = time + MESSAGE_TIMEOUT;
+        error = _BRPeerProcessRecvBuf(peer);
+    }
+
+    return error;
+}
+
+static void _BRPeerLoopEvent(BRPeerIOThread *io, BRPeer *peer, int flags, double time)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    socklen_t optLen = sizeof(int);
+    int err = 0;
+
+    if (ctx->loopError || ctx->socket < 0) return; // already waiting to be removed from the loop
+
+    if (ctx->loopConnecting) {
+        if (getsockopt(ctx->loopSocket, SOL_SOCKET, SO_ERROR, &err, &optLen) < 0) err = errno;
+        if (! err && _BRPollSet(io->pollFd, ctx->loopSocket, peer, BR_POLL_READ, 0) < 0) err = errno;
+
+        if (err) {
+            peer_log(peer, "connect error: %s", strerror(err));
+            ctx->loopError = err;
+        }
+        else {
+            peer_log(peer, "socket connected");
+            fcntl(ctx->loopSocket, F_SETFL, ctx->loopFlags); // restore socket non-blocking status
+            ctx->loopConnecting = 0;
+            ctx->startTime = time;
+            BRPeerSendVersionMessage(peer);
+        }
+    }
+    else if (flags & BR_POLL_READ) ctx->loopError = _BRPeerLoopRead(peer, time);
+}
+
+// checks timeouts, and if the connection is finished removes peer from the i/o thread and calls disconnected()
+static void _BRPeerLoopCheck(BRPeerIOThread *io, size_t idx, double time)
+{
+    BRPeer *peer = io->peers[idx];
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    void (*threadCleanup)(void *info) = ctx->threadCleanup;
+    void *info = ctx->info;
+    int socket, error = ctx->loopError;
+
+    if (! error && ctx->socket >= 0) {
+        if (time >= ctx->disconnectTime || (_BRPeerRecvPending(ctx) && time >= ctx->recvTimeout)) {
+            error = ETIMEDOUT;
+            if (ctx->loopConnecting) peer_log(peer, "connect error: %s", strerror(error));
+            else peer_log(peer, "%s", strerror(error));
+        }
+        else if (! ctx->loopConnecting && time >= ctx->mempoolTime) {
+            peer_log(peer, "done waiting for mempool response");
+            BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
+            ctx->mempoolCallback = NULL;
+            ctx->mempoolTime = DBL_MAX;
+        }
+    }
+
+    if (error || ctx->socket < 0) {
+        socket = ctx->loopSocket;
+        ctx->socket = ctx->loopSocket = -1;
+        if (socket >= 0) close(socket); // also removes it from the poll set
+        free(ctx->recvBuf);
+        ctx->recvBuf = NULL;
+        ctx->recvSize = ctx->recvStart = ctx->recvEnd = 0;
+        array_rm(io->peers, idx);
+        pthread_mutex_lock(&io->lock);
+        io->peerCount--;
+        __atomic_store_n(&ctx->ioThread, NULL, __ATOMIC_RELEASE); // socket is already closed and set to -1 by here
+        pthread_mutex_unlock(&io->lock);
+        _BRPeerDidDisconnect(peer, error);
+        threadCleanup(info); // peer may have been freed by the disconnected callback
+    }
+}
+
+static void *_loopThreadRoutine(void *arg)
+{
+    BRPeerIOThread *io = arg;
+    BRPollEvent events[LOOP_MAX_EVENTS];
+    BRPeer **added;
+    struct timeval tv;
+    double time;
+    uint8_t buf[64];
+    size_t i;
+    int n;
+
+    array_new(added, 10);
     
-    while (array_count(ctx->pongCallback) > 0) {
-        void (*pongCallback)(void *, int) = ctx->pongCallback[0];
-        void *pongInfo = ctx->pongInfo[0];
+    while (! io->loop->stop) {
+        n = _BRPollWait(io->pollFd, events, LOOP_MAX_EVENTS, LOOP_POLL_INTERVAL);
+        gettimeofday(&tv, NULL);
+        time = tv.tv_sec + (double)tv.tv_usec/1000000;
+
+        for (int j = 0; j < n; j++) {
+            if (events[j].ptr) _BRPeerLoopEvent(io, events[j].ptr, events[j].flags, time);
+            else while (read(io->wakeFd[0], buf, sizeof(buf)) > 0); // drain wakeup pipe
+        }
+
+        pthread_mutex_lock(&io->lock);
+        array_add_array(added, io->pending, array_count(io->pending));
+        array_clear(io->pending);
+        pthread_mutex_unlock(&io->lock);
+
+        for (i = 0; i < array_count(added); i++) {
+            array_add(io->peers, added[i]);
+            _BRPeerLoopConnect(io, added[i]);
+        }
+
+        array_clear(added);
+        for (i = array_count(io->peers); i > 0; i--) _BRPeerLoopCheck(io, i - 1, time);
+    }
+
+    array_free(added);
+    return NULL;
+}
+
+// returns a newly allocated event loop that services the sockets of any number of peers from threadCount i/o threads,
+// or NULL if no event notification backend (epoll/kqueue) is available, must be freed by calling BRPeerEventLoopFree()
+BRPeerEventLoop *BRPeerEventLoopNew(size_t threadCount)
+{
+    BRPeerEventLoop *loop = calloc(1, sizeof(*loop));
+    BRPeerIOThread *io;
+    int r = 1;
+
+    assert(loop != NULL);
+    assert(threadCount > 0);
+    if (threadCount < 1) threadCount = 1;
+    loop->threadCount = threadCount;
+    loop->threads = calloc(threadCount, sizeof(*loop->threads));
+    assert(loop->threads != NULL);
+    pthread_mutex_init(&loop->lock, NULL);
+
+    for (size_t i = 0; i < threadCount; i++) {
+        io = &loop->threads[i];
+        io->loop = loop;
+        io->wakeFd[0] = io->wakeFd[1] = -1;
+        io->pollFd = _BRPollNew();
+        array_new(io->pending, 10);
+        array_new(io->peers, 10);
+        pthread_mutex_init(&io->lock, NULL);
         
-        array_rm(ctx->pongCallback, 0);
-        array_rm(ctx->pongInfo, 0);
-        if (pongCallback) pongCallback(pongInfo, 0);
+        if (r && (io->pollFd < 0 || pipe(io->wakeFd) < 0 || fcntl(io->wakeFd[0], F_SETFL, O_NONBLOCK) < 0 ||
+                  fcntl(io->wakeFd[1], F_SETFL, O_NONBLOCK) < 0 ||
+                  _BRPollSet(io->pollFd, io->wakeFd[0], NULL, BR_POLL_READ, 1) < 0)) {
+            peer_log(&BR_PEER_NONE, "error creating event loop: %s", strerror(errno));
+            r = 0;
+        }
+        else if (r && pthread_create(&io->thread, NULL, _loopThreadRoutine, io) != 0) {
+            peer_log(&BR_PEER_NONE, "error creating event loop thread");
+            r = 0;
+        }
+        else io->started = r;
     }
 
-    if (ctx->mempoolCallback) ctx->mempoolCallback(ctx->mempoolInfo, 0);
-    ctx->mempoolCallback = NULL;
-    if (ctx->disconnected) ctx->disconnected(ctx->info, error);
-    pthread_cleanup_pop(1);
-    return NULL; // detached threads don't need to return a value
+    if (! r) BRPeerEventLoopFree(loop);
+    return (r) ? loop : NULL;
+}
+
+// frees memory allocated for loop and stops its threads (all peers using it must be disconnected first)
+void BRPeerEventLoopFree(BRPeerEventLoop *loop)
+{
+    BRPeerIOThread *io;
+    size_t i;
+
+    assert(loop != NULL);
+    loop->stop = 1;
+    for (i = 0; i < loop->threadCount; i++) if (loop->threads[i].started) _BRPeerIOThreadWake(&loop->threads[i]);
+    
+    for (i = 0; i < loop->threadCount; i++) {
+        io = &loop->threads[i];
+        if (io->started) pthread_join(io->thread, NULL);
+        assert(array_count(io->peers) == 0 && array_count(io->pending) == 0);
+        if (io->pollFd >= 0) close(io->pollFd);
+        if (io->wakeFd[0] >= 0) close(io->wakeFd[0]);
+        if (io->wakeFd[1] >= 0) close(io->wakeFd[1]);
+        array_free(io->pending);
+        array_free(io->peers);
+        pthread_mutex_destroy(&io->lock);
+    }
+
+    pthread_mutex_destroy(&loop->lock);
+    free(loop->threads);
+    free(loop);
 }
 
 static void _dummyThreadCleanup(void *info)
@@ -1057,10 +1525,13 @@ BRPeer *BRPeerNew(uint32_t magicNumber)
     ctx->knownTxHashSet = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
     array_new(ctx->pongInfo, 10);
     array_new(ctx->pongCallback, 10);
+    array_new(ctx->sendQueue, SEND_QUEUE_SIZE);
+    pthread_mutex_init(&ctx->sendLock, NULL);
     ctx->pingTime = DBL_MAX;
     ctx->mempoolTime = DBL_MAX;
     ctx->disconnectTime = DBL_MAX;
     ctx->socket = -1;
+    ctx->loopSocket = -1;
     ctx->threadCleanup = _dummyThreadCleanup;
     return &ctx->peer;
 }
@@ -1109,12 +1580,46 @@ void BRPeerSetCallbacks(BRPeer *peer, void *info,
     ctx->threadCleanup = (threadCleanup) ? threadCleanup : _dummyThreadCleanup;
 }
 
+// int relayedTxIsRelevant(void *, const BRTransactionView *) - called for each "tx" message before it's parsed, if it
+//   returns false the tx is skipped instead of being parsed and passed to relayedTx()
+void BRPeerSetRelayedTxFilter(BRPeer *peer, int (*relayedTxIsRelevant)(void *info, const BRTransactionView *view))
+{
+    ((BRPeerContext *)peer)->relayedTxIsRelevant = relayedTxIsRelevant;
+}
+
+// int requestBlocks(void *, const UInt256[], size_t) - called with the block hashes from each "inv" message before they
+//   are requested with getdata, if it returns true the blocks were already requested (possibly from other peers) and
+//   peer doesn't request them itself
+void BRPeerSetBlockRequestHandler(BRPeer *peer,
+                                  int (*requestBlocks)(void *info, const UInt256 blockHashes[], size_t blockCount))
+{
+    ((BRPeerContext *)peer)->requestBlocks = requestBlocks;
+}
+
 // set earliestKeyTime to wallet creation time in order to speed up initial sync
 void BRPeerSetEarliestKeyTime(BRPeer *peer, uint32_t earliestKeyTime)
 {
     ((BRPeerContext *)peer)->earliestKeyTime = earliestKeyTime;
 }
 
+// if headersFirst is true, getheaders is repeated up to the tip of the chain instead of switching to getblocks once
+// earliestKeyTime is reached
+// void headersDone(void *) - called once a headers message with fewer than 2000 headers has been passed to
+//   relayedBlock(), the peer has then sent the last of its header chain
+void BRPeerSetHeadersFirst(BRPeer *peer, int headersFirst, void (*headersDone)(void *info))
+{
+    ((BRPeerContext *)peer)->headersFirst = headersFirst;
+    ((BRPeerContext *)peer)->headersDone = headersDone;
+}
+
+// drives the peer connection from the given event loop instead of a dedicated thread, set loop to NULL to revert to
+// the default thread-per-peer behavior, takes effect on the next call to BRPeerConnect()
+// callbacks are then made from the loop's i/o threads, and threadCleanup() is called once the connection is torn down
+void BRPeerSetEventLoop(BRPeer *peer, BRPeerEventLoop *loop)
+{
+    ((BRPeerContext *)peer)->loop = loop;
+}
+
 // call this when local block height changes (helps detect tarpit nodes)
 void BRPeerSetCurrentBlockHeight(BRPeer *peer, uint32_t currentBlockHeight)
 {
@@ -1148,7 +1653,10 @@ void BRPeerConnect(BRPeer *peer)
             gettimeofday(&tv, NULL);
             ctx->disconnectTime = tv.tv_sec + (double)tv.tv_usec/1000000 + CONNECT_TIMEOUT;
 
-            if (pthread_attr_init(&attr) != 0) {
+            if (ctx->loop) {
+                _BRPeerEventLoopAdd(ctx->loop, peer);
+            }
+            else if (pthread_attr_init(&attr) != 0) {
                 error = ENOMEM;
                 peer_log(peer, "error creating thread");
                 ctx->status = BRPeerStatusDisconnected;
@@ -1170,12 +1678,16 @@ void BRPeerConnect(BRPeer *peer)
 void BRPeerDisconnect(BRPeer *peer)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRPeerIOThread *io = __atomic_load_n(&ctx->ioThread, __ATOMIC_ACQUIRE); // NULL here means socket is seen as -1
     int socket = ctx->socket;
 
     if (socket >= 0) {
         ctx->socket = -1;
         if (shutdown(socket, SHUT_RDWR) < 0) peer_log(peer, "%s", strerror(errno));
-        close(socket);
+
+        // an event loop closes the socket itself once it's done with it, so the descriptor can't be reused under it
+        if (io) _BRPeerIOThreadWake(io);
+        else close(socket);
     }
 }
 
@@ -1240,10 +1752,57 @@ uint64_t BRPeerFeePerKb(BRPeer *peer)
     return ((BRPeerContext *)peer)->feePerKb;
 }
 
+// message type counted at index i of the BRPeerStats arrays, or "" for the index that counts unknown types
+const char *BRPeerStatsMessageType(size_t i)
+{
+    assert(i < PEER_STATS_MSG_TYPES);
+    return (i < PEER_STATS_MSG_TYPES - 1) ? _BRPeerStatsTypes[i] : "";
+}
+
+// copies the message counters and handler latency histograms for peer into stats, safe to call from any thread
+void BRPeerGetStats(BRPeer *peer, BRPeerStats *stats)
+{
+    assert(peer != NULL);
+    assert(stats != NULL);
+    memset(stats, 0, sizeof(*stats));
+    BRPeerStatsSum(stats, &((BRPeerContext *)peer)->stats);
+}
+
 #ifndef MSG_NOSIGNAL   // linux based systems have a MSG_NOSIGNAL send flag, useful for supressing SIGPIPE signals
 #define MSG_NOSIGNAL 0 // set to 0 if undefined (BSD has the SO_NOSIGPIPE sockopt, and windows has no signals at all)
 #endif
 
+// writes the buffers in iov to the socket using as few sendmsg() calls as possible, returns an errno.h code
+static int _BRPeerWritev(BRPeer *peer, struct iovec *iov, int iovCount)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    struct msghdr hdr;
+    struct timeval tv;
+    ssize_t n = 0;
+    int socket = ctx->socket, error = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (socket < 0) error = ENOTCONN;
+    
+    while (socket >= 0 && ! error && iovCount > 0) {
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = iovCount;
+        n = sendmsg(socket, &hdr, MSG_NOSIGNAL);
+        if (n < 0 && errno != EWOULDBLOCK) error = errno;
+
+        if (n >= 0) { // skip past whatever was written
+            for (; iovCount > 0 && iov[0].iov_len <= (size_t)n; iov++, iovCount--) n -= iov[0].iov_len;
+            if (iovCount > 0) iov[0].iov_base = (uint8_t *)iov[0].iov_base + n, iov[0].iov_len -= n;
+        }
+
+        gettimeofday(&tv, NULL);
+        if (! error && tv.tv_sec + (double)tv.tv_usec/1000000 >= ctx->disconnectTime) error = ETIMEDOUT;
+        socket = ctx->socket;
+    }
+
+    return error;
+}
+
 // sends a bitcoin protocol message to peer
 void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type)
 {
@@ -1252,35 +1811,38 @@ void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const ch
     }
     else {
         BRPeerContext *ctx = (BRPeerContext *)peer;
-        uint8_t buf[HEADER_LENGTH + msgLen], hash[32];
-        size_t off = 0;
-        ssize_t n = 0;
-        struct timeval tv;
-        int socket, error = 0;
+        uint8_t header[HEADER_LENGTH], hash[32];
+        struct iovec iov[2];
+        size_t off = 0, idx = _BRPeerStatsTypeIndex(type);
+        int error = 0;
         
-        UInt32SetLE(&buf[off], ctx->magicNumber);
+        UInt32SetLE(&header[off], ctx->magicNumber);
         off += sizeof(uint32_t);
-        strncpy((char *)&buf[off], type, 12);
+        strncpy((char *)&header[off], type, 12);
         off += 12;
-        UInt32SetLE(&buf[off], (uint32_t)msgLen);
+        UInt32SetLE(&header[off], (uint32_t)msgLen);
         off += sizeof(uint32_t);
         BRSHA256_2(hash, msg, msgLen);
-        memcpy(&buf[off], hash, sizeof(uint32_t));
+        memcpy(&header[off], hash, sizeof(uint32_t));
         off += sizeof(uint32_t);
-        memcpy(&buf[off], msg, msgLen);
         peer_log(peer, "sending %s", type);
-        msgLen = 0;
-        socket = ctx->socket;
-        if (socket < 0) error = ENOTCONN;
-        
-        while (socket >= 0 && ! error && msgLen < sizeof(buf)) {
-            n = send(socket, &buf[msgLen], sizeof(buf) - msgLen, MSG_NOSIGNAL);
-            if (n >= 0) msgLen += n;
-            if (n < 0 && errno != EWOULDBLOCK) error = errno;
-            gettimeofday(&tv, NULL);
-            if (! error && tv.tv_sec + (double)tv.tv_usec/1000000 >= ctx->disconnectTime) error = ETIMEDOUT;
-            socket = ctx->socket;
+        BRPeerStatsAdd(&ctx->stats.sentCount[idx], 1);
+        BRPeerStatsAdd(&ctx->stats.sentBytes[idx], HEADER_LENGTH + msgLen);
+        pthread_mutex_lock(&ctx->sendLock);
+
+        if (ctx->corkCount > 0) { // queue message to go out with the rest of the burst when peer is uncorked
+            array_add_array(ctx->sendQueue, header, sizeof(header));
+            if (msgLen > 0) array_add_array(ctx->sendQueue, msg, msgLen);
+        }
+        else { // header and payload go out together in one write, without copying the payload
+            iov[0].iov_base = header;
+            iov[0].iov_len = sizeof(header);
+            iov[1].iov_base = (void *)msg;
+            iov[1].iov_len = msgLen;
+            error = _BRPeerWritev(peer, iov, 2);
         }
+
+        pthread_mutex_unlock(&ctx->sendLock);
         
         if (error) {
             peer_log(peer, "%s", strerror(error));
@@ -1289,6 +1851,47 @@ void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const ch
     }
 }
 
+// queues messages sent to peer until the matching call to BRPeerUncork(), so a burst of messages goes out in one write
+void BRPeerCork(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+
+    pthread_mutex_lock(&ctx->sendLock);
+    ctx->corkCount++;
+    pthread_mutex_unlock(&ctx->sendLock);
+}
+
+// sends all messages queued since BRPeerCork(), calls may be nested and the queue is sent by the outermost uncork
+void BRPeerUncork(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    struct iovec iov;
+    int error = 0;
+
+    pthread_mutex_lock(&ctx->sendLock);
+    assert(ctx->corkCount > 0);
+    if (ctx->corkCount > 0) ctx->corkCount--;
+
+    if (ctx->corkCount == 0 && array_count(ctx->sendQueue) > 0) {
+        iov.iov_base = ctx->sendQueue;
+        iov.iov_len = array_count(ctx->sendQueue);
+        error = _BRPeerWritev(peer, &iov, 1);
+        array_clear(ctx->sendQueue);
+
+        if (array_capacity(ctx->sendQueue) > SEND_QUEUE_SIZE) { // don't hold on to memory from an unusually large burst
+            array_free(ctx->sendQueue);
+            array_new(ctx->sendQueue, SEND_QUEUE_SIZE);
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->sendLock);
+
+    if (error) {
+        peer_log(peer, "%s", strerror(error));
+        BRPeerDisconnect(peer);
+    }
+}
+
 void BRPeerSendVersionMessage(BRPeer *peer)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
@@ -1347,6 +1950,18 @@ void BRPeerSendFilterload(BRPeer *peer, const uint8_t *filter, size_t filterLen)
     BRPeerSendMessage(peer, filter, filterLen, MSG_FILTERLOAD);
 }
 
+// described in BIP37: https://github.com/bitcoin/bips/blob/master/bip-0037.mediawiki
+void BRPeerSendFilteradd(BRPeer *peer, const uint8_t *data, size_t dataLen)
+{
+    uint8_t msg[BRVarIntSize(dataLen) + dataLen];
+    size_t off = BRVarIntSet(msg, sizeof(msg), dataLen);
+
+    assert(data != NULL || dataLen == 0);
+    assert(dataLen <= 520); // max script element size
+    memcpy(&msg[off], data, dataLen);
+    BRPeerSendMessage(peer, msg, sizeof(msg), MSG_FILTERADD);
+}
+
 void BRPeerSendMempool(BRPeer *peer, const UInt256 knownTxHashes[], size_t knownTxCount, void *info,
                        void (*completionCallback)(void *info, int success))
 {
@@ -1528,6 +2143,9 @@ void BRPeerFree(BRPeer *peer)
     if (ctx->knownTxHashSet) BRSetFree(ctx->knownTxHashSet);
     if (ctx->pongInfo) array_free(ctx->pongInfo);
     if (ctx->pongCallback) array_free(ctx->pongCallback);
+    if (ctx->recvBuf) free(ctx->recvBuf);
+    if (ctx->sendQueue) array_free(ctx->sendQueue);
+    pthread_mutex_destroy(&ctx->sendLock);
     free(ctx);
 }
 
@@ -31,6 +31,7 @@
 #include "BRInt.h"
 #include <stddef.h>
 #include <inttypes.h>
+#include <time.h>
 
 #define peer_log(peer, ...) _peer_log("%s:%"PRIu16" " _va_first(__VA_ARGS__, NULL) "\n", BRPeerHost(peer),\
                                       (peer)->port, _va_rest(__VA_ARGS__, NULL))
@@ -101,9 +102,60 @@ typedef struct {
     uint64_t services; // bitcoin network services supported by peer
     uint64_t timestamp; // timestamp reported by peer
     uint8_t flags; // scratch variable
+    uint16_t pingTime; // milliseconds, average ping time measured on earlier connections to peer, 0 if unknown
+    uint16_t syncRate; // blocks per second downloaded the last time peer was the download peer, 0 if unknown
 } BRPeer;
 
-#define BR_PEER_NONE ((BRPeer) { UINT128_ZERO, 0, 0, 0, 0 })
+#define BR_PEER_NONE ((BRPeer) { UINT128_ZERO, 0, 0, 0, 0, 0, 0 })
+
+#define PEER_STATS_MSG_TYPES       23 // message types counted separately, the last one counts any unknown type
+#define PEER_STATS_LATENCY_BUCKETS 24 // bucket i counts latencies under 2^i microseconds, the last one also the rest
+
+// running counters for a peer connection, every field is a uint64_t updated with relaxed atomic adds, so counting is
+// cheap enough to leave on and never takes a lock, use BRPeerStatsMessageType() for the message type of each index
+typedef struct {
+    uint64_t recvCount[PEER_STATS_MSG_TYPES], recvBytes[PEER_STATS_MSG_TYPES]; // bytes include message headers
+    uint64_t sentCount[PEER_STATS_MSG_TYPES], sentBytes[PEER_STATS_MSG_TYPES];
+    uint64_t handlerTime[PEER_STATS_MSG_TYPES]; // total microseconds spent handling received messages
+    uint64_t handlerLatency[PEER_STATS_MSG_TYPES][PEER_STATS_LATENCY_BUCKETS]; // histogram of handler latencies
+} BRPeerStats;
+
+// monotonic time in microseconds, used for the latencies counted in stats
+inline static uint64_t BRPeerStatsTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + (uint64_t)ts.tv_nsec/1000;
+}
+
+// adds n to a stats counter
+inline static void BRPeerStatsAdd(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// counts a latency of the given number of microseconds in histogram
+inline static void BRPeerStatsAddLatency(uint64_t histogram[PEER_STATS_LATENCY_BUCKETS], uint64_t micros)
+{
+    size_t i = (micros > 0) ? 64 - __builtin_clzll(micros) : 0; // number of significant bits
+
+    BRPeerStatsAdd(&histogram[(i < PEER_STATS_LATENCY_BUCKETS) ? i : PEER_STATS_LATENCY_BUCKETS - 1], 1);
+}
+
+// adds each counter of stats to the matching counter of total, reading stats with atomic loads
+inline static void BRPeerStatsSum(BRPeerStats *total, const BRPeerStats *stats)
+{
+    uint64_t *t = (uint64_t *)total;
+    const uint64_t *s = (const uint64_t *)stats;
+
+    for (size_t i = 0; i < sizeof(*stats)/sizeof(*s); i++) t[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+// message type counted at index i of the BRPeerStats arrays, or "" for the index that counts unknown types
+const char *BRPeerStatsMessageType(size_t i);
+
+typedef struct BRPeerEventLoopStruct BRPeerEventLoop;
 
 // NOTE: BRPeer functions are not thread-safe
 
@@ -140,6 +192,27 @@ void BRPeerSetCallbacks(BRPeer *peer, void *info,
 // set earliestKeyTime to wallet creation time in order to speed up initial sync
 void BRPeerSetEarliestKeyTime(BRPeer *peer, uint32_t earliestKeyTime);
 
+// if headersFirst is true, getheaders is repeated up to the tip of the chain instead of switching to getblocks once
+// earliestKeyTime is reached
+// void headersDone(void *) - called once a headers message with fewer than 2000 headers has been passed to
+//   relayedBlock(), the peer has then sent the last of its header chain
+void BRPeerSetHeadersFirst(BRPeer *peer, int headersFirst, void (*headersDone)(void *info));
+
+// int relayedTxIsRelevant(void *, const BRTransactionView *) - called for each "tx" message before it's parsed, if it
+//   returns false the tx is skipped instead of being parsed and passed to relayedTx()
+void BRPeerSetRelayedTxFilter(BRPeer *peer, int (*relayedTxIsRelevant)(void *info, const BRTransactionView *view));
+
+// int requestBlocks(void *, const UInt256[], size_t) - called with the block hashes from each "inv" message before they
+//   are requested with getdata, if it returns true the blocks were already requested (possibly from other peers) and
+//   peer doesn't request them itself
+void BRPeerSetBlockRequestHandler(BRPeer *peer,
+                                  int (*requestBlocks)(void *info, const UInt256 blockHashes[], size_t blockCount));
+
+// drives the peer connection from the given event loop instead of a dedicated thread, set loop to NULL to revert to
+// the default thread-per-peer behavior, takes effect on the next call to BRPeerConnect()
+// callbacks are then made from the loop's i/o threads, and threadCleanup() is called once the connection is torn down
+void BRPeerSetEventLoop(BRPeer *peer, BRPeerEventLoop *loop);
+
 // call this when local best block height changes (helps detect tarpit nodes)
 void BRPeerSetCurrentBlockHeight(BRPeer *peer, uint32_t currentBlockHeight);
 
@@ -176,9 +249,19 @@ uint64_t BRPeerFeePerKb(BRPeer *peer);
 // average ping time for connected peer
 double BRPeerPingTime(BRPeer *peer);
 
+// copies the message counters and handler latency histograms for peer into stats, safe to call from any thread
+void BRPeerGetStats(BRPeer *peer, BRPeerStats *stats);
+
+// queues messages sent to peer until the matching call to BRPeerUncork(), so a burst of messages goes out in one write
+void BRPeerCork(BRPeer *peer);
+
+// sends all messages queued since BRPeerCork(), calls may be nested and the queue is sent by the outermost uncork
+void BRPeerUncork(BRPeer *peer);
+
 // sends a bitcoin protocol message to peer
 void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type);
 void BRPeerSendFilterload(BRPeer *peer, const uint8_t *filter, size_t filterLen);
+void BRPeerSendFilteradd(BRPeer *peer, const uint8_t *data, size_t dataLen);
 void BRPeerSendMempool(BRPeer *peer, const UInt256 knownTxHashes[], size_t knownTxCount, void *info,
                        void (*completionCallback)(void *info, int success));
 void BRPeerSendGetheaders(BRPeer *peer, const UInt256 locators[], size_t locatorsCount, UInt256 hashStop);
@@ -212,6 +295,13 @@ inline static int BRPeerEq(const void *peer, const void *otherPeer)
 // frees memory allocated for peer
 void BRPeerFree(BRPeer *peer);
 
+// returns a newly allocated event loop that services the sockets of any number of peers from threadCount i/o threads,
+// or NULL if no event notification backend (epoll/kqueue) is available, must be freed by calling BRPeerEventLoopFree()
+BRPeerEventLoop *BRPeerEventLoopNew(size_t threadCount);
+
+// frees memory allocated for loop and stops its threads (all peers using it must be disconnected first)
+void BRPeerEventLoopFree(BRPeerEventLoop *loop);
+
 #ifdef __cplusplus
 }
 #endif
@@ -25,6 +25,7 @@
 #include "BRPeerManager.h"
 #include "BRBloomFilter.h"
 #include "BRSet.h"
+#include "BRMap.h"
 #include "BRArray.h"
 #include "BRInt.h"
 #include <stdlib.h>
@@ -43,6 +44,22 @@
 #define MAX_CONNECT_FAILURES  20 // notify user of network problems after this many connect failures in a row
 #define PEER_FLAG_SYNCED      0x01
 #define PEER_FLAG_NEEDSUPDATE 0x02
+#define PEER_FLAG_SYNCHELPER  0x04 // peer has the sync filter loaded and can be sent a window of merkleblock requests
+#define SYNC_WINDOW_MIN       50   // don't split block requests into windows smaller than this
+#define SYNC_MAX_PEER_WINDOWS 4    // maximum number of outstanding sync windows per helper peer
+#define SYNC_WINDOW_TIMEOUT   5    // seconds without progress before a helper's window is handed to the download peer
+#define FETCH_BATCH_SIZE      2000 // number of merkleblocks per getdata batch in headers-first mode
+#define MAX_ORPHAN_BLOCKS     2000 // the oldest orphans are dropped beyond this many
+#define BLOCK_FORK_DEPTH      500  // main chain blocks kept in memory beyond one difficulty interval, to resolve forks
+#define BLOCK_PRUNE_INTERVAL  500  // minimum number of blocks to add before pruning again
+#define BLOOM_SPARE_CAPACITY  4    // size filters for 1/4 more elements than loaded, so filteradd can extend them
+#define TX_PEER_LIST_SLOTS    64   // peers a tx peer list tracks at once before reusing the oldest peer's slot
+#define TX_PEER_LIST_MAX_AGE  (24*60*60) // peers re-announce tx still in their mempools when next asked for them
+#define PEER_EXTRA_CONNECTS   2    // connection attempts raced beyond maxConnectCount, the last to connect are dropped
+#define PEER_DEFAULT_PING     0.5  // seconds, ping time assumed for peers that don't have one measured yet
+#define PEER_DEFAULT_SYNC_RATE 100 // blocks per second assumed for peers that haven't been a download peer yet
+#define PEER_SCORE_BLOCKS     500  // blocks per getblocks round, used to weigh sync rate against ping time
+#define PEER_MIN_SYNC_TIME    10   // seconds, sync rates measured over less time than this are too noisy to keep
 
 #define genesis_block_hash(params) UInt256Reverse((params)->checkpoints[0].hash)
 
@@ -50,12 +67,14 @@ typedef struct {
     BRPeerManager *manager;
     const char *hostname;
     uint64_t services;
+    int isPrimary; // addresses from the first seed are timestamped now, those from the others 1 to 3 days ago
 } BRFindPeersInfo;
 
 typedef struct {
     BRPeer *peer;
     BRPeerManager *manager;
     UInt256 hash;
+    int lostRace; // peer connected after enough others already had, so its disconnect isn't scored
 } BRPeerCallbackInfo;
 
 typedef struct {
@@ -64,73 +83,203 @@ typedef struct {
     void (*callback)(void *info, int error);
 } BRPublishedTx;
 
+typedef struct {
+    BRPeer *peer;
+    UInt256 *blockHashes; // requested blocks not yet received
+    time_t progressTime;
+} BRSyncWindow;
+
+typedef struct {
+    UInt256 prevBlock;
+    BRPeer peer; // the peer that relayed the orphan, so it's credited with the block once the chain reaches it
+} BROrphanEntry;
+
+typedef struct {
+    UInt256 *txHashes; // NULL to mark all tx confirmed after blockHeight as unconfirmed
+    size_t txCount;
+    uint32_t blockHeight, timestamp;
+} BRWalletUpdate;
+
+typedef struct {
+    uint64_t peers; // bit i is set if the peer in slot i is associated with the tx
+    time_t time; // when a peer was last added for the tx
+} BRTxPeers;
+
+map_define(BRTxPeersMap, UInt256, BRTxPeers, BRUInt256Hash, BRUInt256Eq);
+
 typedef struct {
     UInt256 txHash;
-    BRPeer *peers;
+    time_t time;
+} BRTxPeerListEntry;
+
+typedef struct {
+    BRTxPeersMap *txs;
+    BRTxPeerListEntry *queue; // tx in the order peers were last added for them, for expiry, may include stale entries
+    BRPeer slots[TX_PEER_LIST_SLOTS]; // peer for each bit of BRTxPeers.peers
+    uint64_t usedSlots; // bit i is set if slot i is assigned to a peer, slots are released when their peer disconnects
+    size_t nextSlot; // the next slot to reuse if they're all in use
 } BRTxPeerList;
 
-// true if peer is contained in the list of peers associated with txHash
-static int _BRTxPeerListHasPeer(const BRTxPeerList *list, UInt256 txHash, const BRPeer *peer)
+static BRTxPeerList *_BRTxPeerListNew(size_t capacity)
 {
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (! UInt256Eq(list[i - 1].txHash, txHash)) continue;
+    BRTxPeerList *list = calloc(1, sizeof(*list));
 
-        for (size_t j = array_count(list[i - 1].peers); j > 0; j--) {
-            if (BRPeerEq(&list[i - 1].peers[j - 1], peer)) return 1;
-        }
+    assert(list != NULL);
+    list->txs = BRTxPeersMapNew(capacity);
+    array_new(list->queue, capacity);
+    return list;
+}
 
-        break;
+static void _BRTxPeerListFree(BRTxPeerList *list)
+{
+    BRTxPeersMapFree(list->txs);
+    array_free(list->queue);
+    free(list);
+}
+
+// number of bits set in peers
+inline static size_t _BRTxPeersCount(uint64_t peers)
+{
+    size_t count = 0;
+
+    for (; peers; peers &= peers - 1) count++;
+    return count;
+}
+
+// returns the bit for peer's slot, or 0 if peer doesn't have one
+static uint64_t _BRTxPeerListPeerBit(const BRTxPeerList *list, const BRPeer *peer)
+{
+    for (size_t i = 0; i < TX_PEER_LIST_SLOTS; i++) {
+        if ((list->usedSlots & ((uint64_t)1 << i)) && BRPeerEq(&list->slots[i], peer)) return (uint64_t)1 << i;
     }
 
     return 0;
 }
 
+// clears the given slot bits for every tx in the list
+static void _BRTxPeerListClearBits(BRTxPeerList *list, uint64_t bits)
+{
+    BRTxPeers *txPeers;
+
+    for (size_t i = 0; i < array_count(list->queue); i++) {
+        txPeers = BRTxPeersMapGet(list->txs, &list->queue[i].txHash);
+        if (txPeers) txPeers->peers &= ~bits;
+    }
+}
+
+// returns the bit for peer's slot, assigning it a free one if needed, and reusing the oldest assigned slot only when
+// there are more than TX_PEER_LIST_SLOTS peers tracked at once
+static uint64_t _BRTxPeerListAddSlot(BRTxPeerList *list, const BRPeer *peer)
+{
+    uint64_t bit = _BRTxPeerListPeerBit(list, peer);
+    size_t i = 0;
+
+    if (bit) return bit;
+
+    if (~list->usedSlots) {
+        while (list->usedSlots & ((uint64_t)1 << i)) i++;
+    }
+    else {
+        i = list->nextSlot;
+        list->nextSlot = (i + 1) % TX_PEER_LIST_SLOTS;
+        _BRTxPeerListClearBits(list, (uint64_t)1 << i); // the slot's previous peer is no longer tracked
+    }
+
+    list->slots[i] = *peer;
+    list->usedSlots |= (uint64_t)1 << i;
+    return (uint64_t)1 << i;
+}
+
+// removes tx that no peer was added for in the last TX_PEER_LIST_MAX_AGE seconds
+static void _BRTxPeerListExpire(BRTxPeerList *list, time_t now)
+{
+    size_t i = 0, j, count = array_count(list->queue);
+    BRTxPeers *txPeers;
+
+    while (i < count && list->queue[i].time + TX_PEER_LIST_MAX_AGE < now) {
+        txPeers = BRTxPeersMapGet(list->txs, &list->queue[i].txHash);
+
+        // a tx that was added again, or removed and added again, has a later entry, and is expired from there
+        if (txPeers && txPeers->time == list->queue[i].time) BRTxPeersMapRemove(list->txs, &list->queue[i].txHash);
+        i++;
+    }
+
+    if (i > 0) array_rm_range(list->queue, 0, i);
+    count -= i;
+
+    if (count > BRTxPeersMapCount(list->txs)*2 + 100) { // compact out entries for tx that have since been removed
+        for (i = 0, j = 0; i < count; i++) {
+            txPeers = BRTxPeersMapGet(list->txs, &list->queue[i].txHash);
+            if (txPeers && txPeers->time == list->queue[i].time) list->queue[j++] = list->queue[i];
+        }
+
+        array_set_count(list->queue, j);
+    }
+}
+
+// true if peer is contained in the list of peers associated with txHash
+static int _BRTxPeerListHasPeer(const BRTxPeerList *list, UInt256 txHash, const BRPeer *peer)
+{
+    const BRTxPeers *txPeers = BRTxPeersMapGet(list->txs, &txHash);
+
+    return (txPeers && (txPeers->peers & _BRTxPeerListPeerBit(list, peer)) != 0);
+}
+
 // number of peers associated with txHash
 static size_t _BRTxPeerListCount(const BRTxPeerList *list, UInt256 txHash)
 {
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (UInt256Eq(list[i - 1].txHash, txHash)) return array_count(list[i - 1].peers);
-    }
+    const BRTxPeers *txPeers = BRTxPeersMapGet(list->txs, &txHash);
 
-    return 0;
+    return (txPeers) ? _BRTxPeersCount(txPeers->peers) : 0;
 }
 
 // adds peer to the list of peers associated with txHash and returns the new total number of peers
-static size_t _BRTxPeerListAddPeer(BRTxPeerList **list, UInt256 txHash, const BRPeer *peer)
+static size_t _BRTxPeerListAddPeer(BRTxPeerList *list, UInt256 txHash, const BRPeer *peer)
 {
-    for (size_t i = array_count(*list); i > 0; i--) {
-        if (! UInt256Eq((*list)[i - 1].txHash, txHash)) continue;
+    time_t now = time(NULL);
+    uint64_t bit;
+    BRTxPeers *txPeers;
 
-        for (size_t j = array_count((*list)[i - 1].peers); j > 0; j--) {
-            if (BRPeerEq(&(*list)[i - 1].peers[j - 1], peer)) return array_count((*list)[i - 1].peers);
-        }
+    _BRTxPeerListExpire(list, now);
+    bit = _BRTxPeerListAddSlot(list, peer);
+    txPeers = BRTxPeersMapGet(list->txs, &txHash);
 
-        array_add((*list)[i - 1].peers, *peer);
-        return array_count((*list)[i - 1].peers);
+    if (txPeers) { // refresh the tx, so one that's still being announced isn't expired
+        txPeers->peers |= bit;
+        if (txPeers->time != now) array_add(list->queue, ((BRTxPeerListEntry) { txHash, now }));
+        txPeers->time = now;
+        return _BRTxPeersCount(txPeers->peers);
     }
 
-    array_add(*list, ((BRTxPeerList) { txHash, NULL }));
-    array_new((*list)[array_count(*list) - 1].peers, PEER_MAX_CONNECTIONS);
-    array_add((*list)[array_count(*list) - 1].peers, *peer);
+    BRTxPeersMapSet(list->txs, &txHash, ((BRTxPeers) { bit, now }));
+    array_add(list->queue, ((BRTxPeerListEntry) { txHash, now }));
     return 1;
 }
 
 // removes peer from the list of peers associated with txHash, returns true if peer was found
 static int _BRTxPeerListRemovePeer(BRTxPeerList *list, UInt256 txHash, const BRPeer *peer)
 {
-    for (size_t i = array_count(list); i > 0; i--) {
-        if (! UInt256Eq(list[i - 1].txHash, txHash)) continue;
+    BRTxPeers *txPeers = BRTxPeersMapGet(list->txs, &txHash);
+    uint64_t bit = _BRTxPeerListPeerBit(list, peer);
 
-        for (size_t j = array_count(list[i - 1].peers); j > 0; j--) {
-            if (! BRPeerEq(&list[i - 1].peers[j - 1], peer)) continue;
-            array_rm(list[i - 1].peers, j - 1);
-            return 1;
-        }
+    if (! txPeers || (txPeers->peers & bit) == 0) return 0;
+    txPeers->peers &= ~bit;
+    return 1;
+}
 
-        break;
-    }
+// removes peer from the list of peers associated with each tx, and releases its slot for another peer
+static void _BRTxPeerListRemovePeerAll(BRTxPeerList *list, const BRPeer *peer)
+{
+    uint64_t bit = _BRTxPeerListPeerBit(list, peer);
 
-    return 0;
+    if (bit) _BRTxPeerListClearBits(list, bit);
+    list->usedSlots &= ~bit;
+}
+
+// removes txHash and its associated peers from the list
+static void _BRTxPeerListRemove(BRTxPeerList *list, UInt256 txHash)
+{
+    BRTxPeersMapRemove(list->txs, &txHash);
 }
 
 // comparator for sorting peers by timestamp, most recent first
@@ -141,6 +290,24 @@ inline static int _peerTimestampCompare(const void *peer, const void *otherPeer)
     return 0;
 }
 
+// estimated seconds for peer to deliver a round of getblocks at the given ping time, from its recorded sync rate
+inline static double _BRPeerCost(const BRPeer *peer, double pingTime)
+{
+    return pingTime + (double)PEER_SCORE_BLOCKS/((peer->syncRate > 0) ? peer->syncRate : PEER_DEFAULT_SYNC_RATE);
+}
+
+// comparator for sorting peers by the cost of their recorded ping time and sync rate, lowest first, then by timestamp
+inline static int _peerCostCompare(const void *peer, const void *otherPeer)
+{
+    const BRPeer *p = peer, *o = otherPeer;
+    double cost = _BRPeerCost(p, (p->pingTime > 0) ? p->pingTime/1000.0 : PEER_DEFAULT_PING),
+           otherCost = _BRPeerCost(o, (o->pingTime > 0) ? o->pingTime/1000.0 : PEER_DEFAULT_PING);
+
+    if (cost < otherCost) return -1;
+    if (cost > otherCost) return 1;
+    return _peerTimestampCompare(peer, otherPeer);
+}
+
 // returns a hash value for a block's prevBlock value suitable for use in a hashtable
 inline static size_t _BRPrevBlockHash(const void *block)
 {
@@ -168,16 +335,28 @@ inline static int _BRBlockHeightEq(const void *block, const void *otherBlock)
 
 struct BRPeerManagerStruct {
     const BRChainParams *params;
-    BRWallet *wallet;
+    BRWallet **wallets; // wallets[0] is the one passed to BRPeerManagerNew(), changed only holding lock and walletLock
     int isConnected, connectFailureCount, misbehavinCount, dnsThreadCount, maxConnectCount;
     BRPeer *peers, *downloadPeer, fixedPeer, **connectedPeers;
+    BRPeerEventLoop *eventLoop;
+    int headersFirst;
+    BRHeaderStore *headerStore;
     char downloadPeerName[INET6_ADDRSTRLEN + 6];
     uint32_t earliestKeyTime, syncStartHeight, filterUpdateHeight, estimatedHeight;
     BRBloomFilter *bloomFilter;
+    size_t bloomFilterCapacity; // number of elements bloomFilter was sized for
     double fpRate, averageTxPerBlock;
     BRSet *blocks, *orphans, *checkpoints;
     BRMerkleBlock *lastBlock, *lastOrphan;
+    BRMerkleBlock **mainChain; // lastBlock and its ancestors in blocks, indexed by height - mainChainStart
+    uint32_t mainChainStart;
+    BROrphanEntry *orphanQueue; // each orphan in the order they were added, may include stale entries
+    size_t pruneCount; // block count at which to prune blocks again
     BRTxPeerList *txRelays, *txRequests;
+    BRSyncWindow *syncWindows;
+    UInt256 *fetchHashes; // headers-first: main chain headers that still need merkleblocks, ascending from fetchHeight
+    size_t fetchIdx, fetchNext; // first hash without a merkleblock yet, and first hash not yet requested
+    uint32_t fetchHeight;
     BRPublishedTx *publishedTx;
     UInt256 *publishedTxHashes;
     void *info;
@@ -189,6 +368,13 @@ struct BRPeerManagerStruct {
     int (*networkIsReachable)(void *info);
     void (*threadCleanup)(void *info);
     pthread_mutex_t lock;
+    BRPeerManagerStats stats; // counters are updated with atomic adds, peers holds those of disconnected peers
+    uint64_t syncStartTime, syncStopTime; // BRPeerStatsTime() when the current or most recent sync started and stopped
+    uint64_t downloadStartTime; // BRPeerStatsTime() when downloadPeer began syncing
+    uint64_t downloadStartBlocks, downloadStartHeaders; // merkleblock and headers messages from downloadPeer by then
+    BRWalletUpdate *walletUpdates; // wallet updates queued while holding lock, applied in order after it's released
+    pthread_mutex_t walletLock; // held while applying walletUpdates or using wallet tx, taken after lock if both are
+    pthread_mutex_t updatesLock; // guards walletUpdates, no other lock is taken while it's held
 };
 
 static void _BRPeerManagerPeerMisbehavin(BRPeerManager *manager, BRPeer *peer)
@@ -205,9 +391,156 @@ static void _BRPeerManagerPeerMisbehavin(BRPeerManager *manager, BRPeer *peer)
     BRPeerDisconnect(peer);
 }
 
+// number of outstanding sync windows requested from peer
+static size_t _BRPeerManagerSyncWindowCount(BRPeerManager *manager, const BRPeer *peer)
+{
+    size_t count = 0;
+
+    for (size_t i = array_count(manager->syncWindows); i > 0; i--) {
+        if (manager->syncWindows[i - 1].peer == peer) count++;
+    }
+
+    return count;
+}
+
+static void _BRPeerManagerRequestSyncWindow(BRPeerManager *manager, BRPeer *peer, const UInt256 blockHashes[],
+                                            size_t blockCount)
+{
+    BRSyncWindow window = { peer, NULL, time(NULL) };
+
+    array_new(window.blockHashes, blockCount);
+    array_add_array(window.blockHashes, blockHashes, blockCount);
+    array_add(manager->syncWindows, window);
+    BRPeerSendGetdata(peer, NULL, 0, blockHashes, blockCount);
+}
+
+// hands the remaining blocks of a stalled or disconnected helper's window over to the download peer
+static void _BRPeerManagerReassignSyncWindow(BRPeerManager *manager, size_t idx)
+{
+    BRSyncWindow *window = &manager->syncWindows[idx];
+
+    if (manager->downloadPeer && window->peer != manager->downloadPeer) {
+        peer_log(window->peer, "re-requesting %zu block(s) from download peer", array_count(window->blockHashes));
+        window->peer = manager->downloadPeer;
+        window->progressTime = time(NULL);
+        BRPeerSendGetdata(window->peer, NULL, 0, window->blockHashes, array_count(window->blockHashes));
+    }
+    else if (! manager->downloadPeer) {
+        array_free(window->blockHashes);
+        array_rm(manager->syncWindows, idx);
+    }
+}
+
+static void _BRPeerManagerClearSyncWindows(BRPeerManager *manager, int clearHelpers)
+{
+    for (size_t i = array_count(manager->syncWindows); i > 0; i--) array_free(manager->syncWindows[i - 1].blockHashes);
+    array_clear(manager->syncWindows);
+
+    for (size_t i = array_count(manager->connectedPeers); clearHelpers && i > 0; i--) {
+        manager->connectedPeers[i - 1]->flags &= ~PEER_FLAG_SYNCHELPER;
+    }
+}
+
+// removes blockHash from the outstanding sync windows and reassigns any that have stalled, returns true if the block
+// was requested as part of a window
+static int _BRPeerManagerSyncWindowsRemove(BRPeerManager *manager, UInt256 blockHash)
+{
+    time_t now = time(NULL);
+    int r = 0;
+
+    for (size_t i = array_count(manager->syncWindows); ! r && i > 0; i--) {
+        BRSyncWindow *window = &manager->syncWindows[i - 1];
+
+        for (size_t j = 0; j < array_count(window->blockHashes); j++) {
+            if (! UInt256Eq(window->blockHashes[j], blockHash)) continue;
+            array_rm(window->blockHashes, j);
+            window->progressTime = now;
+            r = 1;
+            break;
+        }
+
+        if (array_count(window->blockHashes) == 0) {
+            array_free(window->blockHashes);
+            array_rm(manager->syncWindows, i - 1);
+        }
+    }
+
+    for (size_t i = array_count(manager->syncWindows); i > 0; i--) {
+        if (manager->syncWindows[i - 1].progressTime + SYNC_WINDOW_TIMEOUT >= now) continue;
+        _BRPeerManagerReassignSyncWindow(manager, i - 1);
+    }
+
+    return r;
+}
+
+// number of messages of the given type received from peer
+static uint64_t _BRPeerRecvCount(BRPeer *peer, const char *type)
+{
+    BRPeerStats stats;
+    size_t i;
+
+    for (i = 0; i < PEER_STATS_MSG_TYPES - 1 && strcmp(BRPeerStatsMessageType(i), type) != 0; i++);
+    BRPeerGetStats(peer, &stats);
+    return stats.recvCount[i];
+}
+
+// starts measuring downloadPeer's sync rate for the scoreboard
+static void _BRPeerManagerScoreStart(BRPeerManager *manager)
+{
+    manager->downloadStartTime = BRPeerStatsTime();
+    manager->downloadStartBlocks = _BRPeerRecvCount(manager->downloadPeer, MSG_MERKLEBLOCK);
+    manager->downloadStartHeaders = _BRPeerRecvCount(manager->downloadPeer, MSG_HEADERS);
+}
+
+// records the ping time measured on peer's connection, and its sync rate if it's been downloading the chain, in the
+// matching entries of manager->peers so they're saved along with it, returns true if either of them changed
+static int _BRPeerManagerScorePeer(BRPeerManager *manager, BRPeer *peer)
+{
+    uint64_t now = BRPeerStatsTime(), blocks;
+    double pingTime = BRPeerPingTime(peer), rate = 0;
+    uint16_t ping, sync;
+    int r = 0;
+
+    if (peer == manager->downloadPeer && manager->downloadStartTime > 0) {
+        blocks = _BRPeerRecvCount(peer, MSG_MERKLEBLOCK) - manager->downloadStartBlocks;
+
+        // the rate is only recorded for merkleblock downloads, a headers message carries up to 2000 headers, so time
+        // spent downloading headers would skew it
+        if (_BRPeerRecvCount(peer, MSG_HEADERS) == manager->downloadStartHeaders &&
+            now - manager->downloadStartTime >= PEER_MIN_SYNC_TIME*1000000ULL) {
+            rate = blocks*1000000.0/(now - manager->downloadStartTime);
+        }
+
+        manager->downloadStartTime = 0;
+    }
+
+    for (size_t i = array_count(manager->peers); i > 0; i--) {
+        BRPeer *p = &manager->peers[i - 1];
+
+        if (! BRPeerEq(p, peer)) continue;
+        ping = p->pingTime, sync = p->syncRate;
+
+        if (pingTime < 60) { // DBL_MAX until a ping time's been measured
+            uint16_t ms = (uint16_t)(pingTime*1000) + 1;
+
+            p->pingTime = (p->pingTime > 0) ? (p->pingTime + ms)/2 : ms;
+        }
+
+        if (rate > 0) p->syncRate = (rate < UINT16_MAX) ? (uint16_t)rate + 1 : UINT16_MAX;
+        peer->pingTime = p->pingTime, peer->syncRate = p->syncRate;
+        if (p->pingTime != ping || p->syncRate != sync) r = 1;
+    }
+
+    return r;
+}
+
 static void _BRPeerManagerSyncStopped(BRPeerManager *manager)
 {
+    if (manager->syncStartHeight > 0) manager->syncStopTime = BRPeerStatsTime();
+    if (manager->syncStartHeight > 0 && manager->headerStore) BRHeaderStoreSync(manager->headerStore);
+    if (manager->downloadPeer) _BRPeerManagerScorePeer(manager, manager->downloadPeer); // stop measuring sync rate
     manager->syncStartHeight = 0;
+    _BRPeerManagerClearSyncWindows(manager, 1);
 
     if (manager->downloadPeer) {
         // don't cancel timeout if there's a pending tx publish callback
@@ -219,6 +552,136 @@ static void _BRPeerManagerSyncStopped(BRPeerManager *manager)
     }
 }
 
+// takes manager->lock, counting the time spent waiting for it when it's contended
+static void _BRPeerManagerLock(BRPeerManager *manager)
+{
+    uint64_t start, micros;
+
+    if (pthread_mutex_trylock(&manager->lock) == 0) return;
+    start = BRPeerStatsTime();
+    pthread_mutex_lock(&manager->lock);
+    micros = BRPeerStatsTime() - start;
+    BRPeerStatsAdd(&manager->stats.lockWaits, 1);
+    BRPeerStatsAdd(&manager->stats.lockWaitTime, micros);
+    BRPeerStatsAddLatency(manager->stats.lockWaitLatency, micros);
+}
+
+// queues a wallet update to be applied once manager->lock is released, so the chain isn't held up by wallet balance
+// updates and callbacks, txHashes may be NULL to mark all tx confirmed after blockHeight as unconfirmed
+static void _BRPeerManagerQueueWalletUpdate(BRPeerManager *manager, const UInt256 txHashes[], size_t txCount,
+                                            uint32_t blockHeight, uint32_t timestamp)
+{
+    BRWalletUpdate update = { NULL, txCount, blockHeight, timestamp };
+
+    if (txHashes && txCount == 0) return;
+
+    if (txHashes) {
+        update.txHashes = malloc(txCount*sizeof(*txHashes));
+        assert(update.txHashes != NULL);
+        memcpy(update.txHashes, txHashes, txCount*sizeof(*txHashes));
+    }
+
+    pthread_mutex_lock(&manager->updatesLock);
+    array_add(manager->walletUpdates, update);
+    pthread_mutex_unlock(&manager->updatesLock);
+}
+
+// applies queued wallet updates in the order they were queued, manager->walletLock must be held
+static void _BRPeerManagerApplyWalletUpdates(BRPeerManager *manager)
+{
+    BRWalletUpdate update;
+
+    pthread_mutex_lock(&manager->updatesLock);
+
+    while (array_count(manager->walletUpdates) > 0) {
+        update = manager->walletUpdates[0];
+        array_rm(manager->walletUpdates, 0);
+        pthread_mutex_unlock(&manager->updatesLock);
+
+        for (size_t i = 0; i < array_count(manager->wallets); i++) {
+            if (update.txHashes) {
+                BRWalletUpdateTransactions(manager->wallets[i], update.txHashes, update.txCount, update.blockHeight,
+                                           update.timestamp);
+            }
+            else BRWalletSetTxUnconfirmedAfter(manager->wallets[i], update.blockHeight);
+        }
+
+        if (update.txHashes) free(update.txHashes);
+
+        pthread_mutex_lock(&manager->updatesLock);
+    }
+
+    pthread_mutex_unlock(&manager->updatesLock);
+}
+
+// takes manager->walletLock, must be called before using wallet tx, since applying updates frees confirmed non-wallet
+// tx, queued updates aren't applied here since callers usually hold manager->lock
+static void _BRPeerManagerLockWallet(BRPeerManager *manager)
+{
+    pthread_mutex_lock(&manager->walletLock);
+}
+
+// applies any queued wallet updates and releases manager->walletLock, only call this after releasing manager->lock,
+// code that still holds it unlocks walletLock directly, the thread that queued the updates applies them once it's done
+// with manager->lock, so they're never applied while the chain is locked
+static void _BRPeerManagerUnlockWallet(BRPeerManager *manager)
+{
+    _BRPeerManagerApplyWalletUpdates(manager);
+    pthread_mutex_unlock(&manager->walletLock);
+}
+
+// tx with txHash from the first wallet that has it, including non-wallet tx kept for invalid/unverified input checks
+static BRTransaction *_BRPeerManagerTransactionForHash(BRPeerManager *manager, UInt256 txHash)
+{
+    BRTransaction *tx = NULL;
+
+    for (size_t i = 0; ! tx && i < array_count(manager->wallets); i++) {
+        tx = BRWalletTransactionForHash(manager->wallets[i], txHash);
+    }
+
+    return tx;
+}
+
+// the first wallet that contains tx, or NULL if tx isn't a wallet tx for any of them
+static BRWallet *_BRPeerManagerTxWallet(BRPeerManager *manager, const BRTransaction *tx)
+{
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        if (BRWalletContainsTransaction(manager->wallets[i], tx)) return manager->wallets[i];
+    }
+
+    return NULL;
+}
+
+// true if the address of output was generated by any of the wallets
+static int _BRPeerManagerContainsOutput(BRPeerManager *manager, const BRTxOutput *output)
+{
+    BRScriptHash h;
+
+    if (! BRScriptHashFromScriptPubKey(&h, output->script, output->scriptLen)) return 0;
+
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        if (BRWalletContainsAddrHash(manager->wallets[i], &h)) return 1;
+    }
+
+    return 0;
+}
+
+// registers tx with the first wallet that contains it, or with wallets[0] so non-wallet tx are still kept track of,
+// and registers a copy with each other wallet that contains it, returns the result of the first registration
+static int _BRPeerManagerRegisterTransaction(BRPeerManager *manager, BRTransaction *tx)
+{
+    BRWallet *wallet = _BRPeerManagerTxWallet(manager, tx);
+    int r = BRWalletRegisterTransaction((wallet) ? wallet : manager->wallets[0], tx);
+
+    for (size_t i = 0; wallet && i < array_count(manager->wallets); i++) { // each wallet frees its own tx
+        if (manager->wallets[i] == wallet || BRWalletTransactionForHash(manager->wallets[i], tx->txHash) ||
+            ! BRWalletContainsTransaction(manager->wallets[i], tx)) continue;
+        BRWalletRegisterTransaction(manager->wallets[i], BRTransactionCopy(tx));
+    }
+
+    return r;
+}
+
 // adds transaction to list of tx to be published, along with any unconfirmed inputs
 static void _BRPeerManagerAddTxToPublishList(BRPeerManager *manager, BRTransaction *tx, void *info,
                                              void (*callback)(void *, int))
@@ -232,26 +695,86 @@ static void _BRPeerManagerAddTxToPublishList(BRPeerManager *manager, BRTransacti
         array_add(manager->publishedTxHashes, tx->txHash);
 
         for (size_t i = 0; i < tx->inCount; i++) {
-            _BRPeerManagerAddTxToPublishList(manager, BRWalletTransactionForHash(manager->wallet, tx->inputs[i].txHash),
+            _BRPeerManagerAddTxToPublishList(manager, _BRPeerManagerTransactionForHash(manager, tx->inputs[i].txHash),
                                              NULL, NULL);
         }
     }
 }
 
+// main chain block at height, if it's still in memory
+inline static BRMerkleBlock *_BRPeerManagerBlockAt(BRPeerManager *manager, uint32_t height)
+{
+    return (height >= manager->mainChainStart && height - manager->mainChainStart < array_count(manager->mainChain)) ?
+           manager->mainChain[height - manager->mainChainStart] : NULL;
+}
+
+// ancestor of block at height, walking back only until block's chain joins the main chain, then looked up by height
+static BRMerkleBlock *_BRPeerManagerAncestor(BRPeerManager *manager, BRMerkleBlock *block, uint32_t height)
+{
+    while (block && block->height > height && _BRPeerManagerBlockAt(manager, block->height) != block) {
+        block = BRSetGet(manager->blocks, &block->prevBlock);
+    }
+
+    if (block && block->height > height && _BRPeerManagerBlockAt(manager, height)) {
+        block = _BRPeerManagerBlockAt(manager, height);
+    }
+
+    while (block && block->height > height) block = BRSetGet(manager->blocks, &block->prevBlock);
+    return block;
+}
+
+// sets the chain tip to block and updates the main chain index, walking back only to where block's chain joins the
+// indexed main chain, so extending the tip is O(1), and a reorg is O(fork depth)
+static void _BRPeerManagerSetLastBlock(BRPeerManager *manager, BRMerkleBlock *block)
+{
+    BRMerkleBlock *b = block;
+    uint32_t count = 0;
+    size_t n;
+
+    while (b && _BRPeerManagerBlockAt(manager, b->height) != b) {
+        b = BRSetGet(manager->blocks, &b->prevBlock);
+        count++;
+    }
+
+    if (b) array_set_count(manager->mainChain, b->height + 1 - manager->mainChainStart); // drop the old chain above b
+    else { // block's chain doesn't join the indexed chain, so index it from its earliest block in memory
+        array_clear(manager->mainChain);
+        manager->mainChainStart = block->height + 1 - count;
+    }
+
+    n = block->height + 1 - manager->mainChainStart;
+
+    // grow capacity the way array_add() does, since the tip is usually extended one block at a time
+    if (n > array_capacity(manager->mainChain)) array_set_capacity(manager->mainChain, (n + 1)*3/2);
+    array_set_count(manager->mainChain, n);
+
+    for (b = block; count > 0; b = BRSetGet(manager->blocks, &b->prevBlock), count--) {
+        manager->mainChain[b->height - manager->mainChainStart] = b;
+    }
+
+    manager->lastBlock = block;
+}
+
 static size_t _BRPeerManagerBlockLocators(BRPeerManager *manager, UInt256 locators[], size_t locatorsCount)
 {
     // append 10 most recent block hashes, decending, then continue appending, doubling the step back each time,
     // finishing with the genesis block (top, -1, -2, -3, -4, -5, -6, -7, -8, -9, -11, -15, -23, -39, -71, -135, ..., 0)
-    BRMerkleBlock *block = manager->lastBlock;
-    int32_t step = 1, i = 0, j;
+    BRMerkleBlock *block, stored;
+    uint32_t height = manager->lastBlock->height, step = 1;
+    size_t i = 0;
 
-    while (block && block->height > 0) {
-        if (locators && i < locatorsCount) locators[i] = block->blockHash;
-        if (++i >= 10) step *= 2;
+    while (height > 0) {
+        block = _BRPeerManagerBlockAt(manager, height);
 
-        for (j = 0; block && j < step; j++) {
-            block = BRSetGet(manager->blocks, &block->prevBlock);
+        // blocks older than the ones kept in memory are looked up by height in the header store
+        if (! block && manager->headerStore && BRHeaderStoreBlockAtHeight(manager->headerStore, height, &stored)) {
+            block = &stored;
         }
+
+        if (! block) break;
+        if (locators && i < locatorsCount) locators[i] = block->blockHash;
+        if (++i >= 10) step *= 2;
+        height = (height > step) ? height - step : 0;
     }
     
     if (locators && i < locatorsCount) locators[i] = genesis_block_hash(manager->params);
@@ -268,78 +791,266 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
     // every time a new wallet address is added, the bloom filter has to be rebuilt, and each address is only used
     // for one transaction, so here we generate some spare addresses to avoid rebuilding the filter each time a
     // wallet transaction is encountered during the chain sync
-    BRWalletUnusedAddrs(manager->wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL + 100, 0);
-    BRWalletUnusedAddrs(manager->wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL + 100, 1);
+    uint64_t start = BRPeerStatsTime();
+
+    _BRPeerManagerLockWallet(manager);
+
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        BRWalletUnusedAddrs(manager->wallets[i], NULL, SEQUENCE_GAP_LIMIT_EXTERNAL + 100, 0);
+        BRWalletUnusedAddrs(manager->wallets[i], NULL, SEQUENCE_GAP_LIMIT_INTERNAL + 100, 1);
+    }
 
     BRSetApply(manager->orphans, NULL, _setApplyFreeBlock);
     BRSetClear(manager->orphans); // clear out orphans that may have been received on an old filter
+    array_clear(manager->orphanQueue);
     manager->lastOrphan = NULL;
     manager->filterUpdateHeight = manager->lastBlock->height; 
     
-    size_t addrsCount = BRWalletAllAddrs(manager->wallet, NULL, 0);
-    BRAddress *addrs = malloc(addrsCount*sizeof(*addrs));
-    size_t utxosCount = BRWalletUTXOs(manager->wallet, NULL, 0);
-    BRUTXO *utxos = malloc(utxosCount*sizeof(*utxos));
     uint32_t blockHeight = (manager->lastBlock->height > 100) ? manager->lastBlock->height - 100 : 0;
-    size_t txCount = BRWalletTxUnconfirmedBefore(manager->wallet, NULL, 0, blockHeight);
-    BRTransaction **transactions = malloc(txCount*sizeof(*transactions));
+    size_t addrsMax = 0, utxosMax = 0, txMax = 0, addrsCount = 0, utxosCount = 0, txCount = 0;
+
+    for (size_t i = 0; i < array_count(manager->wallets); i++) { // one filter matches the tx of all the wallets
+        addrsMax += BRWalletAllAddrHashes(manager->wallets[i], NULL, 0);
+        utxosMax += BRWalletUTXOs(manager->wallets[i], NULL, 0);
+        txMax += BRWalletTxUnconfirmedBefore(manager->wallets[i], NULL, 0, blockHeight);
+    }
+
+    BRScriptHash *addrs = malloc((addrsMax ? addrsMax : 1)*sizeof(*addrs));
+    BRUTXO *utxos = malloc((utxosMax ? utxosMax : 1)*sizeof(*utxos));
+    BRTransaction **transactions = malloc((txMax ? txMax : 1)*sizeof(*transactions));
     BRBloomFilter *filter;
+    size_t itemCount = 0, itemsSize;
+    uint8_t (*elems)[sizeof(UInt256) + sizeof(uint32_t)];
+    const uint8_t **items;
+    size_t *itemLens;
+
+    assert(addrs != NULL);
+    assert(utxos != NULL);
+    assert(transactions != NULL);
+
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        addrsCount += BRWalletAllAddrHashes(manager->wallets[i], &addrs[addrsCount], addrsMax - addrsCount);
+        utxosCount += BRWalletUTXOs(manager->wallets[i], &utxos[utxosCount], utxosMax - utxosCount);
+        txCount += BRWalletTxUnconfirmedBefore(manager->wallets[i], &transactions[txCount], txMax - txCount,
+                                               blockHeight);
+    }
+
+    itemsSize = addrsCount + utxosCount;
+    for (size_t i = 0; i < txCount; i++) itemsSize += transactions[i]->inCount;
+    elems = malloc((itemsSize ? itemsSize : 1)*sizeof(*elems));
+    items = malloc((itemsSize ? itemsSize : 1)*sizeof(*items));
+    itemLens = malloc((itemsSize ? itemsSize : 1)*sizeof(*itemLens));
+    assert(elems != NULL);
+    assert(items != NULL);
+    assert(itemLens != NULL);
+    // leave spare capacity for addresses added later with filteradd, so a full filter reload is rarely needed
+    manager->bloomFilterCapacity = addrsCount + utxosCount + txCount + 100;
+    manager->bloomFilterCapacity += manager->bloomFilterCapacity/BLOOM_SPARE_CAPACITY;
+    filter = BRBloomFilterNew(manager->fpRate, manager->bloomFilterCapacity, (uint32_t)BRPeerHash(peer),
+                              BLOOM_UPDATE_ALL); // BUG: XXX txCount not the same as number of spent wallet outputs
+
+    // collect all the filter elements first so they're inserted in one BRBloomFilterInsertBatch() pass
+    for (size_t i = 0; i < addrsCount; i++) { // add addresses to watch for tx receiveing money to the wallet
+        if (addrs[i].len != sizeof(UInt160)) continue;
+        memcpy(elems[itemCount], addrs[i].data, addrs[i].len);
+        items[itemCount] = elems[itemCount];
+        itemLens[itemCount++] = addrs[i].len;
+    }
+
+    free(addrs);
+
+    for (size_t i = 0; i < utxosCount; i++) { // add UTXOs to watch for tx sending money from the wallet
+        UInt256Set(elems[itemCount], utxos[i].hash);
+        UInt32SetLE(&elems[itemCount][sizeof(UInt256)], utxos[i].n);
+        items[itemCount] = elems[itemCount];
+        itemLens[itemCount++] = sizeof(*elems);
+    }
+
+    free(utxos);
+
+    for (size_t i = 0; i < txCount; i++) { // also add TXOs spent within the last 100 blocks
+        for (size_t j = 0; j < transactions[i]->inCount; j++) {
+            BRTxInput *input = &transactions[i]->inputs[j];
+            BRTransaction *tx = _BRPeerManagerTransactionForHash(manager, input->txHash);
+
+            if (tx && input->index < tx->outCount &&
+                _BRPeerManagerContainsOutput(manager, &tx->outputs[input->index])) {
+                UInt256Set(elems[itemCount], input->txHash);
+                UInt32SetLE(&elems[itemCount][sizeof(UInt256)], input->index);
+                items[itemCount] = elems[itemCount];
+                itemLens[itemCount++] = sizeof(*elems);
+            }
+        }
+    }
+
+    free(transactions);
+    pthread_mutex_unlock(&manager->walletLock); // manager->lock is held
+    BRBloomFilterInsertBatch(filter, items, itemLens, itemCount);
+    free(itemLens);
+    free(items);
+    free(elems);
+    if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
+    manager->bloomFilter = filter;
+    BRPeerStatsAdd(&manager->stats.filterLoads, 1);
+    BRPeerStatsAdd(&manager->stats.filterLoadTime, BRPeerStatsTime() - start);
+    // TODO: XXX if already synced, recursively add inputs of unconfirmed receives
+
+    uint8_t data[BRBloomFilterSerialize(filter, NULL, 0)];
+    size_t len = BRBloomFilterSerialize(filter, data, sizeof(data));
+
+    BRPeerSendFilterload(peer, data, len);
+}
+
+static void _syncHelperLoadDone(void *info, int success)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+
+    free(info);
+
+    if (success) {
+        _BRPeerManagerLock(manager);
+
+        if (manager->syncStartHeight > 0 && manager->bloomFilter && peer != manager->downloadPeer) {
+            peer_log(peer, "helping with chain sync");
+            peer->flags |= PEER_FLAG_SYNCHELPER;
+        }
+
+        pthread_mutex_unlock(&manager->lock);
+    }
+}
+
+// loads the current sync filter on a non-download peer so it can be sent a share of the merkleblock requests
+static void _BRPeerManagerLoadSyncHelper(BRPeerManager *manager, BRPeer *peer)
+{
+    BRPeerCallbackInfo *info;
+
+    if (manager->bloomFilter && peer != manager->downloadPeer) {
+        uint8_t data[BRBloomFilterSerialize(manager->bloomFilter, NULL, 0)];
+        size_t len = BRBloomFilterSerialize(manager->bloomFilter, data, sizeof(data));
+
+        info = calloc(1, sizeof(*info));
+        assert(info != NULL);
+        info->peer = peer;
+        info->manager = manager;
+        peer->flags &= ~PEER_FLAG_SYNCHELPER;
+        BRPeerCork(peer);
+        BRPeerSendFilterload(peer, data, len);
+        BRPeerSendPing(peer, info, _syncHelperLoadDone); // wait for pong so filter is loaded
+        BRPeerUncork(peer);
+    }
+}
+
+// true if block is a header newer than one week before earliestKeyTime, for which a merkleblock is needed
+inline static int _BRPeerManagerNeedsFilteredBlock(BRPeerManager *manager, const BRMerkleBlock *block)
+{
+    return (block->totalTx == 0 && block->timestamp + 7*24*60*60 > manager->earliestKeyTime + 2*60*60);
+}
 
-    assert(addrs != NULL);
-    assert(utxos != NULL);
-    assert(transactions != NULL);
-    addrsCount = BRWalletAllAddrs(manager->wallet, addrs, addrsCount);
-    utxosCount = BRWalletUTXOs(manager->wallet, utxos, utxosCount);
-    txCount = BRWalletTxUnconfirmedBefore(manager->wallet, transactions, txCount, blockHeight);
-    filter = BRBloomFilterNew(manager->fpRate, addrsCount + utxosCount + txCount + 100, (uint32_t)BRPeerHash(peer),
-                              BLOOM_UPDATE_ALL); // BUG: XXX txCount not the same as number of spent wallet outputs
+// requests blockHashes from the download peer, split into windows across any sync helper peers
+static void _BRPeerManagerRequestBlocks(BRPeerManager *manager, const UInt256 blockHashes[], size_t blockCount)
+{
+    BRPeer *peer = manager->downloadPeer, *helpers[array_count(manager->connectedPeers) + 1];
+    size_t i, off, windowSize, helperCount = 0;
 
-    for (size_t i = 0; i < addrsCount; i++) { // add addresses to watch for tx receiveing money to the wallet
-        UInt160 hash = UINT160_ZERO;
+    for (i = array_count(manager->connectedPeers); i > 0; i--) {
+        BRPeer *p = manager->connectedPeers[i - 1];
+
+        if (p == peer || (p->flags & PEER_FLAG_SYNCHELPER) == 0) continue;
+        if (BRPeerConnectStatus(p) != BRPeerStatusConnected) continue;
+        if (_BRPeerManagerSyncWindowCount(manager, p) >= SYNC_MAX_PEER_WINDOWS) continue;
+        helpers[helperCount++] = p;
+    }
 
-        BRAddressHash160(&hash, addrs[i].s);
+    windowSize = (blockCount + helperCount)/(helperCount + 1);
+    if (windowSize < SYNC_WINDOW_MIN) windowSize = SYNC_WINDOW_MIN;
 
-        if (! UInt160IsZero(hash) && ! BRBloomFilterContainsData(filter, hash.u8, sizeof(hash))) {
-            BRBloomFilterInsertData(filter, hash.u8, sizeof(hash));
-        }
+    // the first window goes to the download peer, so the chain can keep extending while helpers fill in the rest
+    for (i = 0, off = 0; peer && off < blockCount; i++, off += windowSize) {
+        _BRPeerManagerRequestSyncWindow(manager, (i == 0 || i > helperCount) ? peer : helpers[i - 1],
+                                        &blockHashes[off], (off + windowSize < blockCount) ? windowSize :
+                                        blockCount - off);
     }
+}
 
-    free(addrs);
+// headers-first: keeps up to two batches of merkleblock requests outstanding
+static void _BRPeerManagerFetchRequest(BRPeerManager *manager)
+{
+    size_t count = array_count(manager->fetchHashes), n;
 
-    for (size_t i = 0; i < utxosCount; i++) { // add UTXOs to watch for tx sending money from the wallet
-        uint8_t o[sizeof(UInt256) + sizeof(uint32_t)];
+    while (manager->downloadPeer && manager->fetchNext < count &&
+           manager->fetchNext < manager->fetchIdx + 2*FETCH_BATCH_SIZE) {
+        n = (manager->fetchNext + FETCH_BATCH_SIZE < count) ? FETCH_BATCH_SIZE : count - manager->fetchNext;
+        _BRPeerManagerRequestBlocks(manager, &manager->fetchHashes[manager->fetchNext], n);
+        manager->fetchNext += n;
+    }
+}
+
+// headers-first: once the header chain reaches the tip, collects the main chain headers that need merkleblocks and
+// starts requesting them
+static void _BRPeerManagerFetchStart(BRPeerManager *manager)
+{
+    BRMerkleBlock *b = manager->lastBlock, *top;
+    size_t count = 0;
 
-        UInt256Set(o, utxos[i].hash);
-        UInt32SetLE(&o[sizeof(UInt256)], utxos[i].n);
-        if (! BRBloomFilterContainsData(filter, o, sizeof(o))) BRBloomFilterInsertData(filter, o, sizeof(o));
+    // skip blocks relayed at the tip
+    while (b && b->totalTx > 0) b = (b->height > 0) ? _BRPeerManagerBlockAt(manager, b->height - 1) : NULL;
+    top = b;
+
+    while (b && _BRPeerManagerNeedsFilteredBlock(manager, b)) {
+        b = (b->height > 0) ? _BRPeerManagerBlockAt(manager, b->height - 1) : NULL;
+        count++;
     }
 
-    free(utxos);
+    if (manager->fetchHashes) array_free(manager->fetchHashes);
+    manager->fetchHashes = NULL;
+    manager->fetchIdx = manager->fetchNext = 0;
 
-    for (size_t i = 0; i < txCount; i++) { // also add TXOs spent within the last 100 blocks
-        for (size_t j = 0; j < transactions[i]->inCount; j++) {
-            BRTxInput *input = &transactions[i]->inputs[j];
-            BRTransaction *tx = BRWalletTransactionForHash(manager->wallet, input->txHash);
-            uint8_t o[sizeof(UInt256) + sizeof(uint32_t)];
+    if (count > 0) {
+        if (manager->downloadPeer) {
+            peer_log(manager->downloadPeer, "header chain complete, fetching %zu filtered block(s)", count);
+        }
 
-            if (tx && input->index < tx->outCount &&
-                BRWalletContainsAddress(manager->wallet, tx->outputs[input->index].address)) {
-                UInt256Set(o, input->txHash);
-                UInt32SetLE(&o[sizeof(UInt256)], input->index);
-                if (! BRBloomFilterContainsData(filter, o, sizeof(o))) BRBloomFilterInsertData(filter, o,sizeof(o));
-            }
+        array_new(manager->fetchHashes, count);
+        array_set_count(manager->fetchHashes, count);
+        manager->fetchHeight = top->height + 1 - (uint32_t)count;
+
+        for (size_t i = 0; i < count; i++) {
+            manager->fetchHashes[i] = _BRPeerManagerBlockAt(manager, manager->fetchHeight + (uint32_t)i)->blockHash;
         }
+
+        _BRPeerManagerFetchRequest(manager);
     }
+}
 
-    free(transactions);
-    if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
-    manager->bloomFilter = filter;
-    // TODO: XXX if already synced, recursively add inputs of unconfirmed receives
+// true if block is a main chain block in the current headers-first fetch
+inline static int _BRPeerManagerFetchContains(BRPeerManager *manager, const BRMerkleBlock *block)
+{
+    return (manager->fetchHashes && block->height >= manager->fetchHeight &&
+            block->height - manager->fetchHeight < array_count(manager->fetchHashes) &&
+            UInt256Eq(manager->fetchHashes[block->height - manager->fetchHeight], block->blockHash));
+}
 
-    uint8_t data[BRBloomFilterSerialize(filter, NULL, 0)];
-    size_t len = BRBloomFilterSerialize(filter, data, sizeof(data));
+// headers-first: advances past merkleblocks received in chain order and requests more, returns true once every block
+// in the fetch has been received
+static int _BRPeerManagerFetchAdvance(BRPeerManager *manager)
+{
+    size_t count = array_count(manager->fetchHashes);
+    BRMerkleBlock *b;
 
-    BRPeerSendFilterload(peer, data, len);
+    while (manager->fetchIdx < count && (b = BRSetGet(manager->blocks, &manager->fetchHashes[manager->fetchIdx])) &&
+           b->totalTx > 0) manager->fetchIdx++;
+
+    if (manager->fetchIdx == count) {
+        array_free(manager->fetchHashes);
+        manager->fetchHashes = NULL;
+        manager->fetchIdx = manager->fetchNext = 0;
+        return 1;
+    }
+
+    if (manager->fetchNext < manager->fetchIdx) manager->fetchNext = manager->fetchIdx;
+    _BRPeerManagerFetchRequest(manager);
+    return 0;
 }
 
 static void _updateFilterRerequestDone(void *info, int success)
@@ -350,7 +1061,7 @@ static void _updateFilterRerequestDone(void *info, int success)
     free(info);
 
     if (success) {
-        pthread_mutex_lock(&manager->lock);
+        _BRPeerManagerLock(manager);
 
         if ((peer->flags & PEER_FLAG_NEEDSUPDATE) == 0) {
             UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0)];
@@ -372,11 +1083,15 @@ static void _updateFilterLoadDone(void *info, int success)
     free(info);
 
     if (success) {
-        pthread_mutex_lock(&manager->lock);
+        _BRPeerManagerLock(manager);
         BRPeerSetNeedsFilterUpdate(peer, 0);
         peer->flags &= ~PEER_FLAG_NEEDSUPDATE;
 
-        if (manager->lastBlock->height < manager->estimatedHeight) { // if syncing, rerequest blocks
+        if (manager->fetchHashes) { // if fetching merkleblocks after headers, rerequest from the first missing one
+            manager->fetchNext = manager->fetchIdx;
+            _BRPeerManagerFetchRequest(manager);
+        }
+        else if (manager->lastBlock->height < manager->estimatedHeight) { // if syncing, rerequest blocks
             peerInfo = calloc(1, sizeof(*peerInfo));
             assert(peerInfo != NULL);
             peerInfo->peer = peer;
@@ -397,15 +1112,23 @@ static void _updateFilterPingDone(void *info, int success)
     BRPeerCallbackInfo *peerInfo;
 
     if (success) {
-        pthread_mutex_lock(&manager->lock);
+        _BRPeerManagerLock(manager);
         peer_log(peer, "updating filter with newly created wallet addresses");
         if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
         manager->bloomFilter = NULL;
 
-        if (manager->lastBlock->height < manager->estimatedHeight) { // if we're syncing, only update download peer
+        // if we're syncing, only update download peer
+        if (manager->lastBlock->height < manager->estimatedHeight || manager->fetchHashes) {
             if (manager->downloadPeer) {
+                BRPeerCork(manager->downloadPeer);
                 _BRPeerManagerLoadBloomFilter(manager, manager->downloadPeer);
                 BRPeerSendPing(manager->downloadPeer, info, _updateFilterLoadDone); // wait for pong so filter is loaded
+                BRPeerUncork(manager->downloadPeer);
+
+                for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+                    if (BRPeerConnectStatus(manager->connectedPeers[i - 1]) != BRPeerStatusConnected) continue;
+                    _BRPeerManagerLoadSyncHelper(manager, manager->connectedPeers[i - 1]);
+                }
             }
             else free(info);
         }
@@ -418,8 +1141,10 @@ static void _updateFilterPingDone(void *info, int success)
                 assert(peerInfo != NULL);
                 peerInfo->peer = manager->connectedPeers[i - 1];
                 peerInfo->manager = manager;
+                BRPeerCork(peerInfo->peer);
                 _BRPeerManagerLoadBloomFilter(manager, peerInfo->peer);
                 BRPeerSendPing(peerInfo->peer, peerInfo, _updateFilterLoadDone); // wait for pong so filter is loaded
+                BRPeerUncork(peerInfo->peer);
             }
         }
 
@@ -428,11 +1153,72 @@ static void _updateFilterPingDone(void *info, int success)
     else free(info);
 }
 
+// adds newly generated wallet addresses to the loaded bloom filters with filteradd instead of a full filter reload,
+// returns false if the filter doesn't have capacity left for them
+static int _BRPeerManagerFilterAdd(BRPeerManager *manager)
+{
+    BRScriptHash addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL + 200];
+    UInt160 *hashes = malloc(array_count(manager->wallets)*sizeof(addrs)/sizeof(*addrs)*sizeof(*hashes));
+    size_t i, count, hashCount = 0;
+    int syncing = (manager->lastBlock->height < manager->estimatedHeight || manager->fetchHashes);
+
+    assert(hashes != NULL);
+
+    for (size_t w = 0; w < array_count(manager->wallets); w++) {
+        // generate the same spare addresses as _BRPeerManagerLoadBloomFilter() so the next few wallet tx are covered
+        count = BRWalletUnusedAddrHashes(manager->wallets[w], addrs, SEQUENCE_GAP_LIMIT_EXTERNAL + 100, 0);
+        count += BRWalletUnusedAddrHashes(manager->wallets[w], &addrs[count], SEQUENCE_GAP_LIMIT_INTERNAL + 100, 1);
+
+        for (i = 0; i < count; i++) {
+            if (addrs[i].len != sizeof(*hashes)) continue;
+            hashes[hashCount] = UInt160Get(addrs[i].data);
+            if (BRBloomFilterContainsData(manager->bloomFilter, hashes[hashCount].u8, sizeof(*hashes))) continue;
+            hashCount++;
+        }
+    }
+
+    if (manager->bloomFilter->elemCount + hashCount > manager->bloomFilterCapacity) {
+        free(hashes);
+        return 0;
+    }
+
+    for (i = 0; i < hashCount; i++) BRBloomFilterInsertData(manager->bloomFilter, hashes[i].u8, sizeof(*hashes));
+
+    for (size_t j = array_count(manager->connectedPeers); hashCount > 0 && j > 0; j--) {
+        BRPeer *peer = manager->connectedPeers[j - 1];
+
+        // while syncing, only the download peer and sync helpers have a filter loaded
+        if (BRPeerConnectStatus(peer) != BRPeerStatusConnected) continue;
+        if (syncing && peer != manager->downloadPeer && (peer->flags & PEER_FLAG_SYNCHELPER) == 0) continue;
+        BRPeerCork(peer);
+        for (i = 0; i < hashCount; i++) BRPeerSendFilteradd(peer, hashes[i].u8, sizeof(*hashes));
+
+        if (syncing && peer == manager->downloadPeer) {
+            // blocks already requested were filtered without the new addresses, so request them again, queued behind
+            // the filteradd messages so they're matched against the updated filter
+            peer_log(peer, "added %zu address(es) to bloom filter", hashCount);
+            _BRPeerManagerClearSyncWindows(manager, 0);
+
+            if (manager->fetchHashes) {
+                manager->fetchNext = manager->fetchIdx;
+                _BRPeerManagerFetchRequest(manager);
+            }
+            else BRPeerRerequestBlocks(peer, manager->lastBlock->blockHash);
+        }
+
+        BRPeerUncork(peer);
+    }
+
+    free(hashes);
+    return 1;
+}
+
 static void _BRPeerManagerUpdateFilter(BRPeerManager *manager)
 {
     BRPeerCallbackInfo *info;
 
     if (manager->downloadPeer && (manager->downloadPeer->flags & PEER_FLAG_NEEDSUPDATE) == 0) {
+        _BRPeerManagerClearSyncWindows(manager, 1); // blocks from helpers would be missing matches for the new filter
         BRPeerSetNeedsFilterUpdate(manager->downloadPeer, 1);
         manager->downloadPeer->flags |= PEER_FLAG_NEEDSUPDATE;
         peer_log(manager->downloadPeer, "filter update needed, waiting for pong");
@@ -456,18 +1242,14 @@ static void _BRPeerManagerUpdateTx(BRPeerManager *manager, const UInt256 txHashe
                 if (! UInt256Eq(txHashes[i], tx->txHash)) continue;
                 array_rm(manager->publishedTx, j - 1);
                 array_rm(manager->publishedTxHashes, j - 1);
-                if (! BRWalletTransactionForHash(manager->wallet, tx->txHash)) BRTransactionFree(tx);
+                if (! _BRPeerManagerTransactionForHash(manager, tx->txHash)) BRTransactionFree(tx);
             }
 
-            for (size_t j = array_count(manager->txRelays); j > 0; j--) {
-                if (! UInt256Eq(txHashes[i], manager->txRelays[j - 1].txHash)) continue;
-                array_free(manager->txRelays[j - 1].peers);
-                array_rm(manager->txRelays, j - 1);
-            }
+            _BRTxPeerListRemove(manager->txRelays, txHashes[i]);
         }
     }
 
-    BRWalletUpdateTransactions(manager->wallet, txHashes, txCount, blockHeight, timestamp);
+    _BRPeerManagerQueueWalletUpdate(manager, txHashes, txCount, blockHeight, timestamp);
 }
 
 // unconfirmed transactions that aren't in the mempools of any of connected peers have likely dropped off the network
@@ -479,7 +1261,8 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
     size_t count = 0;
 
     free(info);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
+    _BRPeerManagerLockWallet(manager);
     if (success) peer->flags |= PEER_FLAG_SYNCED;
 
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
@@ -492,12 +1275,13 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
 
     // don't remove transactions until we're connected to maxConnectCount peers, and all peers have finished
     // relaying their mempools
-    if (count >= manager->maxConnectCount) {
+    for (size_t w = 0; count >= manager->maxConnectCount && w < array_count(manager->wallets); w++) {
+        BRWallet *wallet = manager->wallets[w];
         UInt256 hash;
-        size_t txCount = BRWalletTxUnconfirmedBefore(manager->wallet, NULL, 0, TX_UNCONFIRMED);
+        size_t txCount = BRWalletTxUnconfirmedBefore(wallet, NULL, 0, TX_UNCONFIRMED);
         BRTransaction *tx[(txCount*sizeof(BRTransaction *) <= 0x1000) ? txCount : 0x1000/sizeof(BRTransaction *)];
         
-        txCount = BRWalletTxUnconfirmedBefore(manager->wallet, tx, sizeof(tx)/sizeof(*tx), TX_UNCONFIRMED);
+        txCount = BRWalletTxUnconfirmedBefore(wallet, tx, sizeof(tx)/sizeof(*tx), TX_UNCONFIRMED);
 
         for (size_t i = txCount; i > 0; i--) {
             hash = tx[i - 1]->txHash;
@@ -512,7 +1296,7 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
                 _BRTxPeerListCount(manager->txRequests, hash) == 0) {
                 peer_log(peer, "removing tx unconfirmed at: %d, txHash: %s", manager->lastBlock->height, u256hex(hash));
                 assert(tx[i - 1]->blockHeight == TX_UNCONFIRMED);
-                BRWalletRemoveTransaction(manager->wallet, hash);
+                BRWalletRemoveTransaction(wallet, hash);
             }
             else if (! isPublishing && _BRTxPeerListCount(manager->txRelays, hash) < manager->maxConnectCount) {
                 // set timestamp 0 to mark as unverified
@@ -522,22 +1306,30 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
     }
 
     pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockWallet(manager);
 }
 
 static void _BRPeerManagerRequestUnrelayedTx(BRPeerManager *manager, BRPeer *peer)
 {
     BRPeerCallbackInfo *info;
-    size_t hashCount = 0, txCount = BRWalletTxUnconfirmedBefore(manager->wallet, NULL, 0, TX_UNCONFIRMED);
+    size_t hashCount = 0, txCount = 0, count = 0;
+
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        txCount += BRWalletTxUnconfirmedBefore(manager->wallets[i], NULL, 0, TX_UNCONFIRMED);
+    }
+
     BRTransaction *tx[txCount];
     UInt256 txHashes[txCount];
 
-    txCount = BRWalletTxUnconfirmedBefore(manager->wallet, tx, txCount, TX_UNCONFIRMED);
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        count += BRWalletTxUnconfirmedBefore(manager->wallets[i], &tx[count], txCount - count, TX_UNCONFIRMED);
+    }
 
-    for (size_t i = 0; i < txCount; i++) {
+    for (size_t i = 0; i < count; i++) { // a tx shared by wallets is requested once, since it's then in txRequests
         if (! _BRTxPeerListHasPeer(manager->txRelays, tx[i]->txHash, peer) &&
             ! _BRTxPeerListHasPeer(manager->txRequests, tx[i]->txHash, peer)) {
             txHashes[hashCount++] = tx[i]->txHash;
-            _BRTxPeerListAddPeer(&manager->txRequests, tx[i]->txHash, peer);
+            _BRTxPeerListAddPeer(manager->txRequests, tx[i]->txHash, peer);
         }
     }
 
@@ -576,7 +1368,7 @@ static void _mempoolDone(void *info, int success)
 
     if (success) {
         peer_log(peer, "mempool request finished");
-        pthread_mutex_lock(&manager->lock);
+        _BRPeerManagerLock(manager);
         if (manager->syncStartHeight > 0) {
             peer_log(peer, "sync succeeded");
             syncFinished = 1;
@@ -597,7 +1389,7 @@ static void _loadBloomFilterDone(void *info, int success)
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
 
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
     if (success) {
         BRPeerSendMempool(peer, manager->publishedTxHashes, array_count(manager->publishedTxHashes), info,
@@ -631,112 +1423,25 @@ static void _BRPeerManagerLoadMempools(BRPeerManager *manager)
         info->manager = manager;
 
         if (peer != manager->downloadPeer || manager->fpRate > BLOOM_REDUCED_FALSEPOSITIVE_RATE*5.0) {
+            BRPeerCork(peer);
             _BRPeerManagerLoadBloomFilter(manager, peer);
             _BRPeerManagerPublishPendingTx(manager, peer);
             BRPeerSendPing(peer, info, _loadBloomFilterDone); // load mempool after updating bloomfilter
+            BRPeerUncork(peer);
         }
         else BRPeerSendMempool(peer, manager->publishedTxHashes, array_count(manager->publishedTxHashes), info,
                                _mempoolDone);
     }
 }
 
-// returns a UINT128_ZERO terminated array of addresses for hostname that must be freed, or NULL if lookup failed
-static UInt128 *_addressLookup(const char *hostname)
-{
-    struct addrinfo *servinfo, *p;
-    UInt128 *addrList = NULL;
-    size_t count = 0, i = 0;
-
-    if (getaddrinfo(hostname, NULL, NULL, &servinfo) == 0) {
-        for (p = servinfo; p != NULL; p = p->ai_next) count++;
-        if (count > 0) addrList = calloc(count + 1, sizeof(*addrList));
-        assert(addrList != NULL || count == 0);
-
-        for (p = servinfo; p != NULL; p = p->ai_next) {
-            if (p->ai_family == AF_INET) {
-                addrList[i].u16[5] = 0xffff;
-                addrList[i].u32[3] = ((struct sockaddr_in *)p->ai_addr)->sin_addr.s_addr;
-                i++;
-            }
-            else if (p->ai_family == AF_INET6) {
-                addrList[i++] = *(UInt128 *)&((struct sockaddr_in6 *)p->ai_addr)->sin6_addr;
-            }
-        }
-
-        freeaddrinfo(servinfo);
-    }
-
-    return addrList;
-}
-
-static void *_findPeersThreadRoutine(void *arg)
-{
-    BRPeerManager *manager = ((BRFindPeersInfo *)arg)->manager;
-    uint64_t services = ((BRFindPeersInfo *)arg)->services;
-    UInt128 *addrList, *addr;
-    time_t now = time(NULL), age;
-
-    pthread_cleanup_push(manager->threadCleanup, manager->info);
-    addrList = _addressLookup(((BRFindPeersInfo *)arg)->hostname);
-    free(arg);
-    pthread_mutex_lock(&manager->lock);
-
-    for (addr = addrList; addr && ! UInt128IsZero(*addr); addr++) {
-        age = 24*60*60 + BRRand(2*24*60*60); // add between 1 and 3 days
-        array_add(manager->peers, ((BRPeer) { *addr, manager->params->standardPort, services, now - age, 0 }));
-    }
-
-    manager->dnsThreadCount--;
-    pthread_mutex_unlock(&manager->lock);
-    if (addrList) free(addrList);
-    pthread_cleanup_pop(1);
-    return NULL;
-}
-
-// DNS peer discovery
-static void _BRPeerManagerFindPeers(BRPeerManager *manager)
+// called when lastBlock reaches estimatedHeight, returns the number of blocks to save, or 0 if headers-first sync still
+// needs to fetch merkleblocks
+static size_t _BRPeerManagerSyncTipReached(BRPeerManager *manager)
 {
-    uint64_t services = SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM | manager->params->services;
-    time_t now = time(NULL);
-    struct timespec ts;
-    pthread_t thread;
-    pthread_attr_t attr;
-    UInt128 *addr, *addrList;
-    BRFindPeersInfo *info;
-
-    if (! UInt128IsZero(manager->fixedPeer.address)) {
-        array_set_count(manager->peers, 1);
-        manager->peers[0] = manager->fixedPeer;
-        manager->peers[0].services = services;
-        manager->peers[0].timestamp = now;
-    }
-    else {
-        for (size_t i = 1; manager->params->dnsSeeds[i]; i++) {
-            info = calloc(1, sizeof(BRFindPeersInfo));
-            assert(info != NULL);
-            info->manager = manager;
-            info->hostname = manager->params->dnsSeeds[i];
-            info->services = services;
-            if (pthread_attr_init(&attr) == 0 && pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0 &&
-                pthread_create(&thread, &attr, _findPeersThreadRoutine, info) == 0) manager->dnsThreadCount++;
-        }
-
-        for (addr = addrList = _addressLookup(manager->params->dnsSeeds[0]); addr && ! UInt128IsZero(*addr); addr++) {
-            array_add(manager->peers, ((BRPeer) { *addr, manager->params->standardPort, services, now, 0 }));
-        }
-
-        if (addrList) free(addrList);
-        ts.tv_sec = 0;
-        ts.tv_nsec = 1;
-
-        do {
-            pthread_mutex_unlock(&manager->lock);
-            nanosleep(&ts, NULL); // pthread_yield() isn't POSIX standard :(
-            pthread_mutex_lock(&manager->lock);
-        } while (manager->dnsThreadCount > 0 && array_count(manager->peers) < PEER_MAX_CONNECTIONS);
-
-        qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
-    }
+    if (manager->headersFirst && ! manager->fetchHashes) _BRPeerManagerFetchStart(manager);
+    if (manager->fetchHashes) return 0;
+    _BRPeerManagerLoadMempools(manager);
+    return (manager->lastBlock->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
 }
 
 static void _peerConnected(void *info)
@@ -745,12 +1450,24 @@ static void _peerConnected(void *info)
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     BRPeerCallbackInfo *peerInfo;
     time_t now = time(NULL);
+    size_t connected = 0;
 
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     if (peer->timestamp > now + 2*60*60 || peer->timestamp < now - 2*60*60) peer->timestamp = now; // sanity check
 
+    for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+        BRPeer *p = manager->connectedPeers[i - 1];
+
+        if (p != peer && BRPeerConnectStatus(p) == BRPeerStatusConnected) connected++;
+    }
+
+    if (connected >= manager->maxConnectCount) { // lost the race against the extra connection attempts
+        peer_log(peer, "already connected to %zu peer(s), disconnecting", connected);
+        ((BRPeerCallbackInfo *)info)->lostRace = 1;
+        BRPeerDisconnect(peer);
+    }
     // TODO: XXX does this work with 0.11 pruned nodes?
-    if ((peer->services & manager->params->services) != manager->params->services) {
+    else if ((peer->services & manager->params->services) != manager->params->services) {
         peer_log(peer, "unsupported node type");
         BRPeerDisconnect(peer);
     }
@@ -769,8 +1486,10 @@ static void _peerConnected(void *info)
     else if (manager->downloadPeer && // check if we should stick with the existing download peer
              (BRPeerLastBlock(manager->downloadPeer) >= BRPeerLastBlock(peer) ||
               manager->lastBlock->height >= BRPeerLastBlock(peer))) {
-        if (manager->lastBlock->height >= BRPeerLastBlock(peer)) { // only load bloom filter if we're done syncing
+        // only load bloom filter if we're done syncing
+        if (manager->lastBlock->height >= BRPeerLastBlock(peer) && ! manager->fetchHashes) {
             manager->connectFailureCount = 0; // also reset connect failure count if we're already synced
+            BRPeerCork(peer);
             _BRPeerManagerLoadBloomFilter(manager, peer);
             _BRPeerManagerPublishPendingTx(manager, peer);
             peerInfo = calloc(1, sizeof(*peerInfo));
@@ -778,39 +1497,49 @@ static void _peerConnected(void *info)
             peerInfo->peer = peer;
             peerInfo->manager = manager;
             BRPeerSendPing(peer, peerInfo, _loadBloomFilterDone);
+            BRPeerUncork(peer);
         }
+        else if (manager->syncStartHeight > 0) _BRPeerManagerLoadSyncHelper(manager, peer); // help download the chain
     }
-    else { // select the peer with the lowest ping time to download the chain from if we're behind
+    else { // select the peer with the lowest ping time and sync rate cost to download the chain from if we're behind
         // BUG: XXX a malicious peer can report a higher lastblock to make us select them as the download peer, if
         // two peers agree on lastblock, use one of those two instead
         for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
             BRPeer *p = manager->connectedPeers[i - 1];
 
             if (BRPeerConnectStatus(p) != BRPeerStatusConnected) continue;
-            if ((BRPeerPingTime(p) < BRPeerPingTime(peer) && BRPeerLastBlock(p) >= BRPeerLastBlock(peer)) ||
-                BRPeerLastBlock(p) > BRPeerLastBlock(peer)) peer = p;
+            if ((_BRPeerCost(p, BRPeerPingTime(p)) < _BRPeerCost(peer, BRPeerPingTime(peer)) &&
+                 BRPeerLastBlock(p) >= BRPeerLastBlock(peer)) || BRPeerLastBlock(p) > BRPeerLastBlock(peer)) peer = p;
         }
         
         if (manager->downloadPeer) {
             peer_log(peer, "selecting new download peer with higher reported lastblock");
+            _BRPeerManagerScorePeer(manager, manager->downloadPeer);
             BRPeerDisconnect(manager->downloadPeer);
         }
         manager->downloadPeer = peer;
         manager->isConnected = 1;
         manager->estimatedHeight = BRPeerLastBlock(peer);
+        BRPeerCork(peer); // send filterload, inv and getblocks/getheaders together
         _BRPeerManagerLoadBloomFilter(manager, peer);
         BRPeerSetCurrentBlockHeight(peer, manager->lastBlock->height);
         _BRPeerManagerPublishPendingTx(manager, peer);
 
-        if (manager->lastBlock->height < BRPeerLastBlock(peer)) { // start blockchain sync
+        if (manager->lastBlock->height < BRPeerLastBlock(peer) || manager->fetchHashes) { // start blockchain sync
             UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0)];
             size_t count = _BRPeerManagerBlockLocators(manager, locators, sizeof(locators)/sizeof(*locators));
 
             BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // schedule sync timeout
+            _BRPeerManagerScoreStart(manager); // measure peer's sync rate for the scoreboard
 
             // request just block headers up to a week before earliestKeyTime, and then merkleblocks after that
+            // (in headers-first mode, headers up to the tip and then merkleblocks for the fetch range)
             // we do not reset connect failure count yet incase this request times out
-            if (manager->lastBlock->timestamp + 7*24*60*60 >= manager->earliestKeyTime) {
+            if (manager->fetchHashes) {
+                manager->fetchNext = manager->fetchIdx; // resume the merkleblock fetch where the last peer left off
+                _BRPeerManagerFetchRequest(manager);
+            }
+            else if (! manager->headersFirst && manager->lastBlock->timestamp + 7*24*60*60 >= manager->earliestKeyTime) {
                 BRPeerSendGetblocks(peer, locators, count, UINT256_ZERO);
             }
             else BRPeerSendGetheaders(peer, locators, count, UINT256_ZERO);
@@ -819,6 +1548,8 @@ static void _peerConnected(void *info)
             manager->connectFailureCount = 0; // reset connect failure count
             _BRPeerManagerLoadMempools(manager);
         }
+
+        BRPeerUncork(peer);
     }
 
     pthread_mutex_unlock(&manager->lock);
@@ -828,12 +1559,13 @@ static void _peerDisconnected(void *info, int error)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
-    BRTxPeerList *peerList;
-    int willSave = 0, willReconnect = 0, txError = 0;
-    size_t txCount = 0;
+    BRPeerStats peerStats;
+    BRPeer *save = NULL;
+    int willSave = 0, willReconnect = 0, txError = 0, scored;
+    size_t txCount = 0, saveCount = 0;
 
     //free(info);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
     void *txInfo[array_count(manager->publishedTx)];
     void (*txCallback[array_count(manager->publishedTx)])(void *, int);
@@ -854,15 +1586,13 @@ static void _peerDisconnected(void *info, int error)
                                    array_count(manager->connectedPeers) == 1)) txError = ETIMEDOUT;
     }
 
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) {
-        peerList = &manager->txRelays[i - 1];
-
-        for (size_t j = array_count(peerList->peers); j > 0; j--) {
-            if (BRPeerEq(&peerList->peers[j - 1], peer)) array_rm(peerList->peers, j - 1);
-        }
-    }
+    _BRTxPeerListRemovePeerAll(manager->txRelays, peer);
+    _BRTxPeerListRemovePeerAll(manager->txRequests, peer); // a disconnected peer won't answer, and frees its slot
+    // before downloadPeer is cleared, so its sync rate is kept, race losers are skipped so they don't trigger a save
+    scored = (! ((BRPeerCallbackInfo *)info)->lostRace) ? _BRPeerManagerScorePeer(manager, peer) : 0;
 
     if (peer == manager->downloadPeer) { // download peer disconnected
+        _BRPeerManagerClearSyncWindows(manager, 0); // the next download peer will re-request blocks from lastBlock
         manager->isConnected = 0;
         manager->downloadPeer = NULL;
         if (manager->connectFailureCount > MAX_CONNECT_FAILURES) manager->connectFailureCount = MAX_CONNECT_FAILURES;
@@ -892,12 +1622,25 @@ static void _peerDisconnected(void *info, int error)
         }
     }
 
+    for (size_t i = array_count(manager->syncWindows); i > 0; i--) { // hand off any blocks the peer didn't deliver
+        if (manager->syncWindows[i - 1].peer == peer) _BRPeerManagerReassignSyncWindow(manager, i - 1);
+    }
+
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
         if (manager->connectedPeers[i - 1] != peer) continue;
         array_rm(manager->connectedPeers, i - 1);
         break;
     }
 
+    if (scored && ! willSave && manager->savePeers) { // save the updated scoreboard
+        saveCount = array_count(manager->peers);
+        save = malloc(saveCount*sizeof(*save));
+        assert(save != NULL);
+        memcpy(save, manager->peers, saveCount*sizeof(*save));
+    }
+
+    BRPeerGetStats(peer, &peerStats);
+    BRPeerStatsSum(&manager->stats.peers, &peerStats); // keep the counters of disconnected peers in the totals
     BRPeerFree(peer);
     pthread_mutex_unlock(&manager->lock);
 
@@ -905,6 +1648,8 @@ static void _peerDisconnected(void *info, int error)
         txCallback[i](txInfo[i], txError);
     }
 
+    if (save) manager->savePeers(manager->info, 1, save, saveCount);
+    if (save) free(save);
     if (willSave && manager->savePeers) manager->savePeers(manager->info, 1, NULL, 0);
     if (willSave && manager->syncStopped) manager->syncStopped(manager->info, error);
     if (willReconnect) BRPeerManagerConnect(manager); // try connecting to another peer
@@ -916,11 +1661,26 @@ static void _peerRelayedPeers(void *info, const BRPeer peers[], size_t peersCoun
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     time_t now = time(NULL);
+    BRPeer added[peersCount], *p;
+    size_t addedCount = 0;
+    BRSet *known;
 
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     peer_log(peer, "relayed %zu peer(s)", peersCount);
+    known = BRSetNew(BRPeerHash, BRPeerEq, array_count(manager->peers) + peersCount);
+    for (size_t i = 0; i < array_count(manager->peers); i++) BRSetAdd(known, &manager->peers[i]);
+
+    for (size_t i = 0; i < peersCount; i++) { // refresh the timestamps of known peers, keeping their scoreboard
+        p = BRSetGet(known, &peers[i]);
+
+        if (p && p->timestamp < peers[i].timestamp) p->timestamp = peers[i].timestamp;
+        if (p) continue;
+        added[addedCount] = peers[i];
+        BRSetAdd(known, &added[addedCount++]);
+    }
 
-    array_add_array(manager->peers, peers, peersCount);
+    BRSetFree(known);
+    array_add_array(manager->peers, added, addedCount);
     qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
 
     // limit total to 2500 peers
@@ -941,16 +1701,39 @@ static void _peerRelayedPeers(void *info, const BRPeer peers[], size_t peersCoun
         manager->savePeers) manager->savePeers(manager->info, 1, save, peersCount);
 }
 
+// while syncing, _peerRelayedTx() discards any tx that isn't a wallet tx, so those can be rejected before being parsed
+// after syncing, non-wallet tx are kept for invalid/unverified input checks, so they still need to be parsed
+static int _peerRelayedTxIsRelevant(void *info, const BRTransactionView *view)
+{
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    int r;
+    
+    _BRPeerManagerLock(manager);
+    r = (manager->syncStartHeight == 0);
+    pthread_mutex_unlock(&manager->lock);
+    if (r) return r;
+    pthread_mutex_lock(&manager->walletLock); // keeps the wallets array from changing, each wallet has its own lock
+
+    for (size_t i = 0; ! r && i < array_count(manager->wallets); i++) {
+        r = BRWalletContainsTransactionView(manager->wallets[i], view);
+    }
+
+    pthread_mutex_unlock(&manager->walletLock);
+    return r;
+}
+
 static void _peerRelayedTx(void *info, BRTransaction *tx)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     void *txInfo = NULL;
     void (*txCallback)(void *, int) = NULL;
-    int isWalletTx = 0, hasPendingCallbacks = 0;
+    BRWallet *wallet;
+    int isWalletTx = 0, hasPendingCallbacks = 0, needsFilterUpdate = 0;
     size_t relayCount = 0;
 
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
+    _BRPeerManagerLockWallet(manager);
     peer_log(peer, "relayed tx: %s", u256hex(tx->txHash));
     
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
@@ -959,7 +1742,7 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
             txCallback = manager->publishedTx[i - 1].callback;
             manager->publishedTx[i - 1].info = NULL;
             manager->publishedTx[i - 1].callback = NULL;
-            relayCount = _BRTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
+            relayCount = _BRTxPeerListAddPeer(manager->txRelays, tx->txHash, peer);
         }
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
@@ -969,9 +1752,9 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
         BRPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
     }
 
-    if (manager->syncStartHeight == 0 || BRWalletContainsTransaction(manager->wallet, tx)) {
-        isWalletTx = BRWalletRegisterTransaction(manager->wallet, tx);
-        if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallet, tx->txHash);
+    if (manager->syncStartHeight == 0 || _BRPeerManagerTxWallet(manager, tx)) {
+        isWalletTx = _BRPeerManagerRegisterTransaction(manager, tx);
+        if (isWalletTx) tx = _BRPeerManagerTransactionForHash(manager, tx->txHash);
     }
     else {
         BRTransactionFree(tx);
@@ -984,32 +1767,38 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
             BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT);
         }
 
-        if (BRWalletAmountSentByTx(manager->wallet, tx) > 0 && BRWalletTransactionIsValid(manager->wallet, tx)) {
+        wallet = _BRPeerManagerTxWallet(manager, tx);
+
+        if (wallet && BRWalletAmountSentByTx(wallet, tx) > 0 && BRWalletTransactionIsValid(wallet, tx)) {
             _BRPeerManagerAddTxToPublishList(manager, tx, NULL, NULL); // add valid send tx to mempool
         }
 
         // keep track of how many peers have or relay a tx, this indicates how likely the tx is to confirm
         // (we only need to track this after syncing is complete)
-        if (manager->syncStartHeight == 0) relayCount = _BRTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
+        if (manager->syncStartHeight == 0) relayCount = _BRTxPeerListAddPeer(manager->txRelays, tx->txHash, peer);
 
         _BRTxPeerListRemovePeer(manager->txRequests, tx->txHash, peer);
 
         if (manager->bloomFilter != NULL) { // check if bloom filter is already being updated
-            BRAddress addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL];
-            UInt160 hash;
+            BRScriptHash addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL];
+            size_t count;
 
             // the transaction likely consumed one or more wallet addresses, so check that at least the next <gap limit>
-            // unused addresses are still matched by the bloom filter
-            BRWalletUnusedAddrs(manager->wallet, addrs, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
-            BRWalletUnusedAddrs(manager->wallet, addrs + SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+            // unused addresses of each wallet are still matched by the bloom filter
+            for (size_t i = 0; ! needsFilterUpdate && i < array_count(manager->wallets); i++) {
+                count = BRWalletUnusedAddrHashes(manager->wallets[i], addrs, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+                count += BRWalletUnusedAddrHashes(manager->wallets[i], &addrs[count], SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+
+                for (size_t j = 0; ! needsFilterUpdate && j < count; j++) {
+                    if (addrs[j].len == 0) continue;
+                    needsFilterUpdate = ! BRBloomFilterContainsData(manager->bloomFilter, addrs[j].data, addrs[j].len);
+                }
+            }
 
-            for (size_t i = 0; i < SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL; i++) {
-                if (! BRAddressHash160(&hash, addrs[i].s) ||
-                    BRBloomFilterContainsData(manager->bloomFilter, hash.u8, sizeof(hash))) continue;
+            if (needsFilterUpdate && ! _BRPeerManagerFilterAdd(manager)) { // extend the loaded filter if it has room
                 if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
                 manager->bloomFilter = NULL; // reset bloom filter so it's recreated with new wallet addresses
                 _BRPeerManagerUpdateFilter(manager);
-                break;
             }
         }
     }
@@ -1020,6 +1809,7 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
     }
 
     pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockWallet(manager);
     if (txCallback) txCallback(txInfo, 0);
 }
 
@@ -1033,8 +1823,9 @@ static void _peerHasTx(void *info, UInt256 txHash)
     int isWalletTx = 0, hasPendingCallbacks = 0;
     size_t relayCount = 0;
 
-    pthread_mutex_lock(&manager->lock);
-    tx = BRWalletTransactionForHash(manager->wallet, txHash);
+    _BRPeerManagerLock(manager);
+    _BRPeerManagerLockWallet(manager);
+    tx = _BRPeerManagerTransactionForHash(manager, txHash);
     peer_log(peer, "has tx: %s", u256hex(txHash));
 
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
@@ -1044,7 +1835,7 @@ static void _peerHasTx(void *info, UInt256 txHash)
             txCallback = manager->publishedTx[i - 1].callback;
             manager->publishedTx[i - 1].info = NULL;
             manager->publishedTx[i - 1].callback = NULL;
-            relayCount = _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
+            relayCount = _BRTxPeerListAddPeer(manager->txRelays, txHash, peer);
         }
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
@@ -1055,8 +1846,8 @@ static void _peerHasTx(void *info, UInt256 txHash)
     }
 
     if (tx) {
-        isWalletTx = BRWalletRegisterTransaction(manager->wallet, tx);
-        if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallet, tx->txHash);
+        isWalletTx = _BRPeerManagerRegisterTransaction(manager, tx);
+        if (isWalletTx) tx = _BRPeerManagerTransactionForHash(manager, tx->txHash);
 
         // reschedule sync timeout
         if (manager->syncStartHeight > 0 && peer == manager->downloadPeer && isWalletTx) {
@@ -1065,52 +1856,182 @@ static void _peerHasTx(void *info, UInt256 txHash)
 
         // keep track of how many peers have or relay a tx, this indicates how likely the tx is to confirm
         // (we only need to track this after syncing is complete)
-        if (manager->syncStartHeight == 0) relayCount = _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
+        if (manager->syncStartHeight == 0) relayCount = _BRTxPeerListAddPeer(manager->txRelays, txHash, peer);
 
         // set timestamp when tx is verified
         if (relayCount >= manager->maxConnectCount && tx && tx->blockHeight == TX_UNCONFIRMED && tx->timestamp == 0) {
             _BRPeerManagerUpdateTx(manager, &txHash, 1, TX_UNCONFIRMED, (uint32_t)time(NULL));
         }
 
-        _BRTxPeerListRemovePeer(manager->txRequests, txHash, peer);
+        _BRTxPeerListRemovePeer(manager->txRequests, txHash, peer);
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockWallet(manager);
+    if (txCallback) txCallback(txInfo, 0);
+}
+
+static void _peerRejectedTx(void *info, UInt256 txHash, uint8_t code)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRTransaction *tx, *t;
+    BRWallet *wallet;
+
+    _BRPeerManagerLock(manager);
+    _BRPeerManagerLockWallet(manager);
+    peer_log(peer, "rejected tx: %s", u256hex(txHash));
+    tx = _BRPeerManagerTransactionForHash(manager, txHash);
+    _BRTxPeerListRemovePeer(manager->txRequests, txHash, peer);
+
+    if (tx) {
+        if (_BRTxPeerListRemovePeer(manager->txRelays, txHash, peer) && tx->blockHeight == TX_UNCONFIRMED) {
+            // set timestamp 0 to mark tx as unverified
+            _BRPeerManagerUpdateTx(manager, &txHash, 1, TX_UNCONFIRMED, 0);
+        }
+
+        // if we get rejected for any reason other than double-spend, the peer is likely misconfigured
+        wallet = _BRPeerManagerTxWallet(manager, tx);
+
+        if (code != REJECT_SPENT && wallet && BRWalletAmountSentByTx(wallet, tx) > 0) {
+            for (size_t i = 0; i < tx->inCount; i++) { // check that all inputs are confirmed before dropping peer
+                t = _BRPeerManagerTransactionForHash(manager, tx->inputs[i].txHash);
+                if (! t || t->blockHeight != TX_UNCONFIRMED) continue;
+                tx = NULL;
+                break;
+            }
+
+            if (tx) _BRPeerManagerPeerMisbehavin(manager, peer);
+        }
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockWallet(manager);
+    if (manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
+}
+
+// appends blocks, given in descending height order as passed to saveBlocks(), to the header store, truncating any
+// stored headers they replace after a chain reorg, and filling any gap below them from the chain still in memory
+static void _BRPeerManagerStoreHeaders(BRPeerManager *manager, BRMerkleBlock *blocks[], size_t count)
+{
+    BRHeaderStore *store = manager->headerStore;
+    BRMerkleBlock stored, *a;
+    uint32_t next;
+
+    for (size_t i = count; i > 0; i--) {
+        BRMerkleBlock *b = blocks[i - 1];
+
+        next = BRHeaderStoreStartHeight(store) + (uint32_t)BRHeaderStoreCount(store);
+
+        if (BRHeaderStoreCount(store) > 0 && b->height < next) {
+            if (BRHeaderStoreBlockAtHeight(store, b->height, &stored) && UInt256Eq(stored.blockHash, b->blockHash)) {
+                continue; // already stored
+            }
+
+            BRHeaderStoreTruncate(store, b->height);
+            next = BRHeaderStoreStartHeight(store) + (uint32_t)BRHeaderStoreCount(store);
+        }
+
+        // append the headers connecting the store to b, as long as they're still in memory
+        while (BRHeaderStoreCount(store) > 0 && b->height > next &&
+               (a = _BRPeerManagerAncestor(manager, b, next)) != NULL && BRHeaderStoreAppend(store, a)) next++;
+
+        if (BRHeaderStoreCount(store) > 0 && b->height > next) {
+            // the gap was already pruned, so the store can only grow again by starting over at a difficulty transition
+            if ((b->height % BLOCK_DIFFICULTY_INTERVAL) != 0) continue;
+            BRHeaderStoreTruncate(store, 0);
+        }
+
+        if (BRHeaderStoreCount(store) == 0 && (b->height % BLOCK_DIFFICULTY_INTERVAL) != 0) continue;
+        if (! BRHeaderStoreAppend(store, b)) break;
+    }
+}
+
+// frees blocks more than one difficulty interval plus BLOCK_FORK_DEPTH below the tip, which are no longer needed to
+// verify difficulty transitions or resolve forks, so memory use stays bounded however long the manager runs, older
+// headers are still available from the header store if one is set
+static void _BRPeerManagerPruneBlocks(BRPeerManager *manager)
+{
+    uint32_t floor = (manager->lastBlock->height > BLOCK_DIFFICULTY_INTERVAL + BLOCK_FORK_DEPTH) ?
+                     manager->lastBlock->height - (BLOCK_DIFFICULTY_INTERVAL + BLOCK_FORK_DEPTH) : 0, start = 0;
+    size_t i, count = BRSetCount(manager->blocks);
+    BRMerkleBlock *b, **blocks;
+
+    if (count < manager->pruneCount) return;
+    blocks = malloc(count*sizeof(*blocks));
+    assert(blocks != NULL);
+    count = BRSetAll(manager->blocks, (void **)blocks, count);
+
+    for (i = 0; i < count; i++) {
+        b = blocks[i];
+        if (b->height >= floor || b == manager->lastBlock || BRSetContains(manager->checkpoints, b)) continue;
+
+        // keep headers that a headers-first sync still needs to fetch merkleblocks for
+        if (manager->headersFirst && _BRPeerManagerNeedsFilteredBlock(manager, b) &&
+            (! manager->fetchHashes || b->height >= manager->fetchHeight)) continue;
+
+        if (_BRPeerManagerBlockAt(manager, b->height) == b && b->height + 1 > start) start = b->height + 1;
+        BRSetRemove(manager->blocks, b);
+        if (BRSetGet(manager->orphans, b) != b) BRMerkleBlockFree(b);
     }
 
-    pthread_mutex_unlock(&manager->lock);
-    if (txCallback) txCallback(txInfo, 0);
+    if (start > manager->mainChainStart) { // the main chain index only holds the blocks above the last one pruned
+        array_rm_range(manager->mainChain, 0, start - manager->mainChainStart);
+        manager->mainChainStart = start;
+    }
+
+    free(blocks);
+    count = BRSetCount(manager->blocks);
+    manager->pruneCount = count + ((count/2 > BLOCK_PRUNE_INTERVAL) ? count/2 : BLOCK_PRUNE_INTERVAL);
 }
 
-static void _peerRejectedTx(void *info, UInt256 txHash, uint8_t code)
+// adds block relayed by peer to orphans, replacing any orphan with the same prevBlock, and drops the oldest orphans
+// beyond MAX_ORPHAN_BLOCKS, so peers can't exhaust memory by relaying blocks that never connect to the chain
+static void _BRPeerManagerAddOrphan(BRPeerManager *manager, BRMerkleBlock *block, const BRPeer *peer)
 {
-    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
-    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
-    BRTransaction *tx, *t;
+    BRMerkleBlock orphan, *b = BRSetAdd(manager->orphans, block);
+    BROrphanEntry entry = { block->prevBlock, *peer };
+    size_t i = 0, j, count;
 
-    pthread_mutex_lock(&manager->lock);
-    peer_log(peer, "rejected tx: %s", u256hex(txHash));
-    tx = BRWalletTransactionForHash(manager->wallet, txHash);
-    _BRTxPeerListRemovePeer(manager->txRequests, txHash, peer);
+    if (b && b != block) {
+        if (manager->lastOrphan == b) manager->lastOrphan = NULL;
+        if (BRSetGet(manager->blocks, b) != b) BRMerkleBlockFree(b);
+    }
 
-    if (tx) {
-        if (_BRTxPeerListRemovePeer(manager->txRelays, txHash, peer) && tx->blockHeight == TX_UNCONFIRMED) {
-            // set timestamp 0 to mark tx as unverified
-            _BRPeerManagerUpdateTx(manager, &txHash, 1, TX_UNCONFIRMED, 0);
-        }
+    array_add(manager->orphanQueue, entry);
 
-        // if we get rejected for any reason other than double-spend, the peer is likely misconfigured
-        if (code != REJECT_SPENT && BRWalletAmountSentByTx(manager->wallet, tx) > 0) {
-            for (size_t i = 0; i < tx->inCount; i++) { // check that all inputs are confirmed before dropping peer
-                t = BRWalletTransactionForHash(manager->wallet, tx->inputs[i].txHash);
-                if (! t || t->blockHeight != TX_UNCONFIRMED) continue;
-                tx = NULL;
-                break;
-            }
+    while (BRSetCount(manager->orphans) > MAX_ORPHAN_BLOCKS && i < array_count(manager->orphanQueue)) {
+        orphan.prevBlock = manager->orphanQueue[i++].prevBlock;
+        b = BRSetGet(manager->orphans, &orphan);
+        if (! b || b == block) continue; // orphan already connected to the chain or was replaced
+        BRSetRemove(manager->orphans, b);
+        if (manager->lastOrphan == b) manager->lastOrphan = NULL;
+        if (BRSetGet(manager->blocks, b) != b) BRMerkleBlockFree(b);
+    }
 
-            if (tx) _BRPeerManagerPeerMisbehavin(manager, peer);
+    if (i > 0) array_rm_range(manager->orphanQueue, 0, i);
+    count = array_count(manager->orphanQueue);
+
+    if (count > MAX_ORPHAN_BLOCKS*2) { // compact out entries for orphans that have since connected
+        for (i = 0, j = 0; i < count; i++) {
+            orphan.prevBlock = manager->orphanQueue[i].prevBlock;
+            if (BRSetContains(manager->orphans, &orphan)) manager->orphanQueue[j++] = manager->orphanQueue[i];
         }
+
+        array_set_count(manager->orphanQueue, j);
     }
+}
 
-    pthread_mutex_unlock(&manager->lock);
-    if (manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
+// the peer that relayed an orphan just removed from orphans, or peer if it isn't known
+static BRPeer _BRPeerManagerOrphanRelayer(BRPeerManager *manager, const BRMerkleBlock *orphan, const BRPeer *peer)
+{
+    for (size_t i = array_count(manager->orphanQueue); i > 0; i--) { // the latest entry is for the current orphan
+        BROrphanEntry *entry = &manager->orphanQueue[i - 1];
+
+        if (UInt256Eq(entry->prevBlock, orphan->prevBlock)) return entry->peer;
+    }
+
+    return *peer;
 }
 
 static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *block, BRMerkleBlock *prev, BRPeer *peer)
@@ -1121,28 +2042,12 @@ static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *bloc
 
     // check if we hit a difficulty transition, and find previous transition time
     if (r && (block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) {
-        BRMerkleBlock *b = block;
-        UInt256 prevBlock;
-
-        for (uint32_t i = 0; b && i < BLOCK_DIFFICULTY_INTERVAL; i++) {
-            b = BRSetGet(manager->blocks, &b->prevBlock);
-        }
+        BRMerkleBlock *b = _BRPeerManagerAncestor(manager, prev, block->height - BLOCK_DIFFICULTY_INTERVAL);
 
         if (! b) {
             peer_log(peer, "missing previous difficulty tansition, can't verify block: %s", u256hex(block->blockHash));
             r = 0;
         }
-        else prevBlock = b->prevBlock;
-        
-        while (b) { // free up some memory
-            b = BRSetGet(manager->blocks, &prevBlock);
-            if (b) prevBlock = b->prevBlock;
-
-            if (b && (b->height % BLOCK_DIFFICULTY_INTERVAL) != 0) {
-                BRSetRemove(manager->blocks, b);
-                BRMerkleBlockFree(b);
-            }
-        }
     }
 
     // verify block difficulty
@@ -1161,26 +2066,117 @@ static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *bloc
                      "expected: %s", block->height, u256hex(block->blockHash), u256hex(checkpoint->blockHash));
             r = 0;
         }
+        else if (checkpoint) block->powVerified = 1; // the checkpoint hash already commits to the header
+    }
+
+    if (r && ! block->powVerified) {
+        BRMerkleBlock *b = BRSetGet(manager->blocks, block);
+
+        // a block we already have with the same hash has the same header, so proof-of-work needn't be hashed again
+        if (b && b->powVerified) block->powVerified = 1;
+        
+        // verify proof-of-work, hashing it only now that we know the block is needed
+        if (! BRMerkleBlockIsValid(block, (uint32_t)time(NULL))) {
+            peer_log(peer, "relayed block with invalid proof-of-work, blockHash: %s", u256hex(block->blockHash));
+            r = 0;
+        }
     }
 
     return r;
 }
 
-static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
+// splits the block requests from the download peer's inv into windows and spreads them across sync helper peers,
+// returns true if the blocks were requested
+static int _peerRequestBlocks(void *info, const UInt256 blockHashes[], size_t blockCount)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
-    size_t txCount = BRMerkleBlockTxHashes(block, NULL, 0);
+    int r = 0;
+
+    _BRPeerManagerLock(manager);
+
+    if (peer == manager->downloadPeer && manager->syncStartHeight > 0 && manager->bloomFilter &&
+        manager->lastBlock->height < manager->estimatedHeight) {
+        for (size_t i = array_count(manager->connectedPeers); ! r && i > 0; i--) {
+            BRPeer *p = manager->connectedPeers[i - 1];
+
+            if (p != peer && (p->flags & PEER_FLAG_SYNCHELPER) && BRPeerConnectStatus(p) == BRPeerStatusConnected &&
+                _BRPeerManagerSyncWindowCount(manager, p) < SYNC_MAX_PEER_WINDOWS) r = 1;
+        }
+
+        // once windows are outstanding, blocks may arrive out of order, so keep tracking them even without helpers
+        if (array_count(manager->syncWindows) > 0) r = 1;
+    }
+
+    if (r) _BRPeerManagerRequestBlocks(manager, blockHashes, blockCount);
+    pthread_mutex_unlock(&manager->lock);
+    return r;
+}
+
+// processes a block relayed by the connected peer equal to relayer, or by peer if that one has since disconnected,
+// collects up to count blocks ending at tip into saveBlocks, trimmed so the oldest is at a difficulty interval, and
+// writes them to the header store, returns the number to pass to saveBlocks() once manager->lock is released
+static size_t _BRPeerManagerCollectSaveBlocks(BRPeerManager *manager, BRMerkleBlock *tip, BRMerkleBlock *saveBlocks[],
+                                              size_t count)
+{
+    BRMerkleBlock *b;
+    size_t i, j;
+
+    for (i = 0, b = tip; b && i < count; i++) {
+        assert(b->height != BLOCK_UNKNOWN_HEIGHT); // verify all blocks to be saved are in the chain
+        saveBlocks[i] = b;
+        b = BRSetGet(manager->blocks, &b->prevBlock);
+    }
+
+    // make sure the set of blocks to be saved starts at a difficulty interval
+    j = (i > 0) ? saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL : 0;
+    if (j > 0) i -= (i > BLOCK_DIFFICULTY_INTERVAL - j) ? BLOCK_DIFFICULTY_INTERVAL - j : i;
+    assert(i == 0 || (saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL) == 0);
+    if (i > 0 && manager->headerStore) _BRPeerManagerStoreHeaders(manager, saveBlocks, i);
+    return i;
+}
+
+// returning the next block if it was waiting for this one as an orphan, with relayer set to the peer that relayed it
+static BRMerkleBlock *_BRPeerManagerRelayedBlock(BRPeerManager *manager, BRPeer *peer, BRPeer *relayer,
+                                                 BRMerkleBlock *block)
+{
+    size_t txCount = block->txHashesCount;
     UInt256 _txHashes[(sizeof(UInt256)*txCount <= 0x1000) ? txCount : 0],
             *txHashes = (sizeof(UInt256)*txCount <= 0x1000) ? _txHashes : malloc(txCount*sizeof(*txHashes));
-    size_t i, j, fpCount = 0, saveCount = 0;
-    BRMerkleBlock orphan, *b, *b2, *prev, *next = NULL;
+    size_t i, fpCount = 0, saveCount = 0;
+    BRMerkleBlock orphan, *b, *b2, *prev, *next = NULL, *saveTip = NULL;
     uint32_t txTime = 0;
+    int scheduled, statusUpdate;
 
     assert(txHashes != NULL);
     txCount = BRMerkleBlockTxHashes(block, txHashes, txCount);
-    pthread_mutex_lock(&manager->lock);
+
+    pthread_mutex_lock(&manager->walletLock); // keeps the wallets array from changing, each wallet has its own lock
+
+    for (i = 0; block->totalTx > 0 && i < txCount; i++) { // wallet tx are not false-positives
+        if (! _BRPeerManagerTransactionForHash(manager, txHashes[i])) fpCount++;
+    }
+
+    pthread_mutex_unlock(&manager->walletLock);
+
+    _BRPeerManagerLock(manager);
+
+    for (i = array_count(manager->connectedPeers); i > 0; i--) {
+        if (BRPeerEq(manager->connectedPeers[i - 1], relayer)) peer = manager->connectedPeers[i - 1];
+    }
+
     prev = BRSetGet(manager->blocks, &block->prevBlock);
+    scheduled = _BRPeerManagerSyncWindowsRemove(manager, block->blockHash);
+    BRPeerStatsAdd((block->totalTx > 0) ? &manager->stats.blocks : &manager->stats.headers, 1);
+
+    if (manager->syncStartHeight > 0) {
+        BRPeerStatsAdd((block->totalTx > 0) ? &manager->stats.syncBlocks : &manager->stats.syncHeaders, 1);
+    }
+
+    if (block->totalTx > 0) {
+        BRPeerStatsAdd(&manager->stats.filterTxCount, block->totalTx);
+        BRPeerStatsAdd(&manager->stats.filterFpCount, fpCount);
+    }
 
     if (prev) {
         txTime = block->timestamp/2 + prev->timestamp/2;
@@ -1189,10 +2185,6 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
 
     // track the observed bloom filter false positive rate using a low pass filter to smooth out variance
     if (peer == manager->downloadPeer && block->totalTx > 0) {
-        for (i = 0; i < txCount; i++) { // wallet tx are not false-positives
-            if (! BRWalletTransactionForHash(manager->wallet, txHashes[i])) fpCount++;
-        }
-
         // moving average number of tx-per-block
         manager->averageTxPerBlock = manager->averageTxPerBlock*0.999 + block->totalTx*0.001;
         peer_log(peer, "user preferred fpRate: %f", manager->fpRate);
@@ -1219,8 +2211,9 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         }
     }
 
-    // ignore block headers that are newer than one week before earliestKeyTime (it's a header if it has 0 totalTx)
-    if (block->totalTx == 0 && block->timestamp + 7*24*60*60 > manager->earliestKeyTime + 2*60*60) {
+    // ignore block headers that are newer than one week before earliestKeyTime (it's a header if it has 0 totalTx),
+    // unless syncing headers-first, in which case their merkleblocks are fetched once the header chain is complete
+    if (! manager->headersFirst && _BRPeerManagerNeedsFilteredBlock(manager, block)) {
         BRMerkleBlockFree(block);
         block = NULL;
     }
@@ -1228,11 +2221,15 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         BRMerkleBlockFree(block);
         block = NULL;
 
-        if (peer == manager->downloadPeer && manager->lastBlock->height < manager->estimatedHeight) {
+        if (peer == manager->downloadPeer &&
+            (manager->lastBlock->height < manager->estimatedHeight || manager->fetchHashes)) {
             BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
             manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
         }
     }
+    else if (! prev && scheduled) { // block from a sync window arrived before its predecessor
+        _BRPeerManagerAddOrphan(manager, block, peer); // hold on to it until the chain reaches it
+    }
     else if (! prev) { // block is an orphan
         peer_log(peer, "relayed orphan block %s, previous %s, last block is %s, height %"PRIu32,
                  u256hex(block->blockHash), u256hex(block->prevBlock), u256hex(manager->lastBlock->blockHash),
@@ -1254,7 +2251,7 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
                 BRPeerSendGetblocks(peer, locators, locatorsCount, UINT256_ZERO);
             }
 
-            BRSetAdd(manager->orphans, block); // BUG: limit total orphans to avoid memory exhaustion attack
+            _BRPeerManagerAddOrphan(manager, block, peer);
             manager->lastOrphan = block;
         }
     }
@@ -1270,20 +2267,23 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         }
 
         BRSetAdd(manager->blocks, block);
-        manager->lastBlock = block;
+        _BRPeerManagerSetLastBlock(manager, block);
+        _BRPeerManagerPruneBlocks(manager);
         if (txCount > 0) _BRPeerManagerUpdateTx(manager, txHashes, txCount, block->height, txTime);
         if (manager->downloadPeer) BRPeerSetCurrentBlockHeight(manager->downloadPeer, block->height);
 
-        if (block->height < manager->estimatedHeight && peer == manager->downloadPeer) {
-            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        if (block->height < manager->estimatedHeight && manager->downloadPeer &&
+            (peer == manager->downloadPeer || (peer->flags & PEER_FLAG_SYNCHELPER))) {
+            BRPeerScheduleDisconnect(manager->downloadPeer, PROTOCOL_TIMEOUT); // reschedule sync timeout
             manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
         }
 
-        if ((block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) saveCount = 1; // save transition block immediately
+        // save transition block immediately, unless it's a header still waiting for its merkleblock
+        if ((block->height % BLOCK_DIFFICULTY_INTERVAL) == 0 &&
+            ! _BRPeerManagerNeedsFilteredBlock(manager, block)) saveCount = 1;
 
-        if (block->height == manager->estimatedHeight) { // chain download is complete
-            saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
-            _BRPeerManagerLoadMempools(manager);
+        if (block->height == manager->estimatedHeight && ! manager->fetchHashes) { // chain download is complete
+            saveCount = _BRPeerManagerSyncTipReached(manager);
         }
     }
     else if (BRSetContains(manager->blocks, block)) { // we already have the block (or at least the header)
@@ -1291,26 +2291,50 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
             peer_log(peer, "relayed existing block #%"PRIu32, block->height);
         }
 
-        b = manager->lastBlock;
-        while (b && b->height > block->height) b = BRSetGet(manager->blocks, &b->prevBlock); // is block in main chain?
+        b = _BRPeerManagerBlockAt(manager, block->height); // is block in main chain?
 
-        if (BRMerkleBlockEq(b, block)) { // if it's not on a fork, set block heights for its transactions
+        // if it's not on a fork, set block heights for its transactions (merkleblocks from a headers-first fetch are
+        // known to be in the main chain, even if pruning has since moved the main chain index above them)
+        if (_BRPeerManagerFetchContains(manager, block) || (b && BRMerkleBlockEq(b, block))) {
             if (txCount > 0) _BRPeerManagerUpdateTx(manager, txHashes, txCount, block->height, txTime);
-            if (block->height == manager->lastBlock->height) manager->lastBlock = block;
         }
 
         b = BRSetAdd(manager->blocks, block);
 
         if (b != block) {
+            if (_BRPeerManagerBlockAt(manager, b->height) == b) { // replace b in the main chain with block
+                manager->mainChain[b->height - manager->mainChainStart] = block;
+                if (manager->lastBlock == b) manager->lastBlock = block;
+            }
+
             if (BRSetGet(manager->orphans, b) == b) BRSetRemove(manager->orphans, b);
             if (manager->lastOrphan == b) manager->lastOrphan = NULL;
             BRMerkleBlockFree(b);
         }
+
+        if (block->totalTx > 0 && _BRPeerManagerFetchContains(manager, block)) { // merkleblock for a fetched header
+            if (manager->downloadPeer) BRPeerScheduleDisconnect(manager->downloadPeer, PROTOCOL_TIMEOUT);
+
+            if (_BRPeerManagerFetchAdvance(manager)) { // all merkleblocks received
+                saveTip = manager->lastBlock;
+                saveCount = (manager->lastBlock->height == manager->estimatedHeight) ?
+                            _BRPeerManagerSyncTipReached(manager) : 0;
+
+                if (manager->lastBlock->height < manager->estimatedHeight && manager->downloadPeer) {
+                    UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0)];
+                    size_t count = _BRPeerManagerBlockLocators(manager, locators, sizeof(locators)/sizeof(*locators));
+
+                    BRPeerSendGetblocks(manager->downloadPeer, locators, count, UINT256_ZERO); // new blocks since
+                }
+            }
+            else if ((block->height % BLOCK_DIFFICULTY_INTERVAL) == 0 && manager->fetchIdx > 0 &&
+                     block->height < manager->fetchHeight + manager->fetchIdx) saveCount = 1;
+        }
     }
     else if (manager->lastBlock->height < BRPeerLastBlock(peer) &&
              block->height > manager->lastBlock->height + 1) { // special case, new block mined durring rescan
         peer_log(peer, "marking new block #%"PRIu32" as orphan until rescan completes", block->height);
-        BRSetAdd(manager->orphans, block); // mark as orphan til we're caught up
+        _BRPeerManagerAddOrphan(manager, block, peer); // mark as orphan til we're caught up
         manager->lastOrphan = block;
     }
     else if (block->height <= manager->params->checkpoints[manager->params->checkpointsCount - 1].height) { // old fork
@@ -1325,41 +2349,39 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
 
         if (block->height > manager->lastBlock->height) { // check if fork is now longer than main chain
             b = block;
-            b2 = manager->lastBlock;
 
-            while (b && b2 && ! BRMerkleBlockEq(b, b2)) { // walk back to where the fork joins the main chain
+            while (b && _BRPeerManagerBlockAt(manager, b->height) != b) { // walk back to where the fork joins
                 b = BRSetGet(manager->blocks, &b->prevBlock);
-                if (b && b->height < b2->height) b2 = BRSetGet(manager->blocks, &b2->prevBlock);
             }
 
+            b2 = b;
+
             peer_log(peer, "reorganizing chain from height %"PRIu32", new height is %"PRIu32, b->height, block->height);
 
-            BRWalletSetTxUnconfirmedAfter(manager->wallet, b->height); // mark tx after the join point as unconfirmed
+            _BRPeerManagerQueueWalletUpdate(manager, NULL, 0, b->height, 0); // mark tx after the join as unconfirmed
 
             b = block;
 
             while (b && b2 && b->height > b2->height) { // set transaction heights for new main chain
-                size_t count = BRMerkleBlockTxHashes(b, NULL, 0);
-                uint32_t height = b->height, timestamp = b->timestamp;
-
-                if (count > txCount) {
-                    txHashes = (txHashes != _txHashes) ? realloc(txHashes, count*sizeof(*txHashes)) :
-                               malloc(count*sizeof(*txHashes));
-                    assert(txHashes != NULL);
-                    txCount = count;
+                BRMerkleBlock *prevB = BRSetGet(manager->blocks, &b->prevBlock);
+                uint32_t timestamp = (prevB) ? b->timestamp/2 + prevB->timestamp/2 : b->timestamp;
+
+                if (b->txHashesCount > 0) {
+                    _BRPeerManagerQueueWalletUpdate(manager, b->txHashes, b->txHashesCount, b->height, timestamp);
                 }
 
-                count = BRMerkleBlockTxHashes(b, txHashes, count);
-                b = BRSetGet(manager->blocks, &b->prevBlock);
-                if (b) timestamp = timestamp/2 + b->timestamp/2;
-                if (count > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, count, height, timestamp);
+                b = prevB;
             }
 
-            manager->lastBlock = block;
+            _BRPeerManagerSetLastBlock(manager, block);
+
+            if (manager->fetchHashes) { // the fetch range changed, start over from the new main chain
+                _BRPeerManagerClearSyncWindows(manager, 0);
+                _BRPeerManagerFetchStart(manager);
+            }
 
-            if (block->height == manager->estimatedHeight) { // chain download is complete
-                saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
-                _BRPeerManagerLoadMempools(manager);
+            if (block->height == manager->estimatedHeight && ! manager->fetchHashes) { // chain download is complete
+                saveCount = _BRPeerManagerSyncTipReached(manager);
             }
         }
     }
@@ -1372,29 +2394,60 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         // check if the next block was received as an orphan
         orphan.prevBlock = block->blockHash;
         next = BRSetRemove(manager->orphans, &orphan);
+        if (next) *relayer = _BRPeerManagerOrphanRelayer(manager, next, peer);
     }
 
     BRMerkleBlock *saveBlocks[saveCount];
 
-    for (i = 0, b = block; b && i < saveCount; i++) {
-        assert(b->height != BLOCK_UNKNOWN_HEIGHT); // verify all blocks to be saved are in the chain
-        saveBlocks[i] = b;
-        b = BRSetGet(manager->blocks, &b->prevBlock);
-    }
-
-    // make sure the set of blocks to be saved starts at a difficulty interval
-    j = (i > 0) ? saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL : 0;
-    if (j > 0) i -= (i > BLOCK_DIFFICULTY_INTERVAL - j) ? BLOCK_DIFFICULTY_INTERVAL - j : i;
-    assert(i == 0 || (saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL) == 0);
+    i = _BRPeerManagerCollectSaveBlocks(manager, (saveTip) ? saveTip : block, saveBlocks, saveCount);
+    // peer may not be the one running this callback, so it's only safe to use while the lock is held
+    statusUpdate = (block && block->height != BLOCK_UNKNOWN_HEIGHT && block->height >= BRPeerLastBlock(peer));
     pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerLockWallet(manager); // apply the wallet updates for this block now that the chain is unlocked
+    _BRPeerManagerUnlockWallet(manager);
     if (i > 0 && manager->saveBlocks) manager->saveBlocks(manager->info, (i > 1 ? 1 : 0), saveBlocks, i);
 
-    if (block && block->height != BLOCK_UNKNOWN_HEIGHT && block->height >= BRPeerLastBlock(peer) &&
-        manager->txStatusUpdate) {
+    if (statusUpdate && manager->txStatusUpdate) {
         manager->txStatusUpdate(manager->info); // notify that transaction confirmations may have changed
     }
 
-    if (next) _peerRelayedBlock(info, next);
+    return next;
+}
+
+static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRPeer relayer = *peer; // orphans are credited to the peer that relayed them, not the one that connected them
+
+    // blocks that arrived ahead of the chain are connected iteratively, a sync window can hold hundreds of them
+    while (block) block = _BRPeerManagerRelayedBlock(manager, peer, &relayer, block);
+}
+
+static void _peerHeadersDone(void *info)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    size_t saveCount = 0;
+
+    _BRPeerManagerLock(manager);
+
+    // the download peer's header chain can end below the height it reported, don't wait for headers it won't send
+    if (peer == manager->downloadPeer && manager->syncStartHeight > 0 && ! manager->fetchHashes &&
+        manager->lastBlock->height < manager->estimatedHeight) {
+        peer_log(peer, "header chain ended at height %"PRIu32", below estimated height %"PRIu32,
+                 manager->lastBlock->height, manager->estimatedHeight);
+        manager->estimatedHeight = manager->lastBlock->height;
+        saveCount = _BRPeerManagerSyncTipReached(manager);
+    }
+
+    BRMerkleBlock *saveBlocks[saveCount];
+
+    saveCount = _BRPeerManagerCollectSaveBlocks(manager, manager->lastBlock, saveBlocks, saveCount);
+    pthread_mutex_unlock(&manager->lock);
+    if (saveCount > 0 && manager->saveBlocks) {
+        manager->saveBlocks(manager->info, (saveCount > 1 ? 1 : 0), saveBlocks, saveCount);
+    }
 }
 
 static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCount,
@@ -1403,7 +2456,7 @@ static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCou
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
 
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
     for (size_t i = 0; i < txCount; i++) {
         _BRTxPeerListRemovePeer(manager->txRelays, txHashes[i], peer);
@@ -1419,7 +2472,7 @@ static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     uint64_t maxFeePerKb = 0, secondFeePerKb = 0;
 
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) { // find second highest fee rate
         p = manager->connectedPeers[i - 1];
@@ -1427,10 +2480,13 @@ static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
         if (BRPeerFeePerKb(p) > maxFeePerKb) secondFeePerKb = maxFeePerKb, maxFeePerKb = BRPeerFeePerKb(p);
     }
 
-    if (secondFeePerKb*3/2 > DEFAULT_FEE_PER_KB && secondFeePerKb*3/2 <= MAX_FEE_PER_KB &&
-        secondFeePerKb*3/2 > BRWalletFeePerKb(manager->wallet)) {
-        peer_log(peer, "increasing feePerKb to %"PRIu64" based on feefilter messages from peers", secondFeePerKb*3/2);
-        BRWalletSetFeePerKb(manager->wallet, secondFeePerKb*3/2);
+    for (size_t i = 0; i < array_count(manager->wallets); i++) {
+        if (secondFeePerKb*3/2 > DEFAULT_FEE_PER_KB && secondFeePerKb*3/2 <= MAX_FEE_PER_KB &&
+            secondFeePerKb*3/2 > BRWalletFeePerKb(manager->wallets[i])) {
+            peer_log(peer, "increasing feePerKb to %"PRIu64" based on feefilter messages from peers",
+                     secondFeePerKb*3/2);
+            BRWalletSetFeePerKb(manager->wallets[i], secondFeePerKb*3/2);
+        }
     }
 
     pthread_mutex_unlock(&manager->lock);
@@ -1446,7 +2502,7 @@ static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
 //    pthread_mutex_lock(&manager->lock);
 //
 //    if (success && ! _BRTxPeerListHasPeer(manager->txRequests, txHash, peer)) {
-//        _BRTxPeerListAddPeer(&manager->txRequests, txHash, peer);
+//        _BRTxPeerListAddPeer(manager->txRequests, txHash, peer);
 //        BRPeerSendGetdata(peer, &txHash, 1, NULL, 0); // check if peer will relay the transaction back
 //    }
 //
@@ -1459,11 +2515,13 @@ static BRTransaction *_peerRequestedTx(void *info, UInt256 txHash)
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
 //    BRPeerCallbackInfo *pingInfo;
     BRTransaction *tx = NULL;
+    BRWallet *wallet;
     void *txInfo = NULL;
     void (*txCallback)(void *, int) = NULL;
     int hasPendingCallbacks = 0, error = 0;
 
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
+    _BRPeerManagerLockWallet(manager);
 
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
         if (UInt256Eq(manager->publishedTxHashes[i - 1], txHash)) {
@@ -1473,12 +2531,14 @@ static BRTransaction *_peerRequestedTx(void *info, UInt256 txHash)
             manager->publishedTx[i - 1].info = NULL;
             manager->publishedTx[i - 1].callback = NULL;
 
-            if (tx && ! BRWalletTransactionIsValid(manager->wallet, tx)) {
+            wallet = (tx) ? _BRPeerManagerTxWallet(manager, tx) : NULL;
+
+            if (tx && ! BRWalletTransactionIsValid((wallet) ? wallet : manager->wallets[0], tx)) {
                 error = EINVAL;
                 array_rm(manager->publishedTx, i - 1);
                 array_rm(manager->publishedTxHashes, i - 1);
 
-                if (! BRWalletTransactionForHash(manager->wallet, txHash)) {
+                if (! _BRPeerManagerTransactionForHash(manager, txHash)) {
                     BRTransactionFree(tx);
                     tx = NULL;
                 }
@@ -1487,40 +2547,194 @@ static BRTransaction *_peerRequestedTx(void *info, UInt256 txHash)
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
 
-    // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
-    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || peer != manager->downloadPeer)) {
-        BRPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
-    }
+    // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
+    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || peer != manager->downloadPeer)) {
+        BRPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
+    }
+
+    if (tx && ! error) {
+        _BRTxPeerListAddPeer(manager->txRelays, txHash, peer);
+        _BRPeerManagerRegisterTransaction(manager, tx);
+    }
+
+//    pingInfo = calloc(1, sizeof(*pingInfo));
+//    assert(pingInfo != NULL);
+//    pingInfo->peer = peer;
+//    pingInfo->manager = manager;
+//    pingInfo->hash = txHash;
+//    BRPeerSendPing(peer, pingInfo, _peerRequestedTxPingDone);
+    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockWallet(manager);
+    if (txCallback) txCallback(txInfo, error);
+    return tx;
+}
+
+static int _peerNetworkIsReachable(void *info)
+{
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+
+    return (manager->networkIsReachable) ? manager->networkIsReachable(manager->info) : 1;
+}
+
+static void _peerThreadCleanup(void *info)
+{
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+
+    free(info);
+    if (manager->threadCleanup) manager->threadCleanup(manager->info);
+}
+
+// starts connections to known peers until there are enough, returns true if there are no peers connected or connecting
+// and no DNS lookups pending, meaning the sync failed, in which case syncStopped() needs calling once lock is released
+static int _BRPeerManagerConnectPeers(BRPeerManager *manager)
+{
+    size_t connected = 0, limit = manager->maxConnectCount;
+    BRPeer *peers;
+
+    for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+        if (BRPeerConnectStatus(manager->connectedPeers[i - 1]) == BRPeerStatusConnected) connected++;
+    }
+
+    // race a few extra connection attempts for the open slots, _peerConnected() drops the peers that finish last
+    if (connected < manager->maxConnectCount && UInt128IsZero(manager->fixedPeer.address)) {
+        limit += PEER_EXTRA_CONNECTS;
+    }
+
+    if (array_count(manager->connectedPeers) < limit) {
+        array_new(peers, 100);
+        array_add_array(peers, manager->peers,
+                        (array_count(manager->peers) < 100) ? array_count(manager->peers) : 100);
+        qsort(peers, array_count(peers), sizeof(*peers), _peerCostCompare); // most recent 100 peers, fastest first
+
+        while (array_count(peers) > 0 && array_count(manager->connectedPeers) < limit) {
+            size_t i = BRRand((uint32_t)array_count(peers)); // index of random peer
+            BRPeerCallbackInfo *info;
+
+            i = i*i/array_count(peers); // bias random peer selection toward peers with lower cost
+
+            for (size_t j = array_count(manager->connectedPeers); i != SIZE_MAX && j > 0; j--) {
+                if (! BRPeerEq(&peers[i], manager->connectedPeers[j - 1])) continue;
+                array_rm(peers, i); // already in connectedPeers
+                i = SIZE_MAX;
+            }
+
+            if (i != SIZE_MAX) {
+                info = calloc(1, sizeof(*info));
+                assert(info != NULL);
+                info->manager = manager;
+                info->peer = BRPeerNew(manager->params->magicNumber);
+                *info->peer = peers[i];
+                array_rm(peers, i);
+                array_add(manager->connectedPeers, info->peer);
+                BRPeerSetCallbacks(info->peer, info, _peerConnected, _peerDisconnected, _peerRelayedPeers,
+                                   _peerRelayedTx, _peerHasTx, _peerRejectedTx, _peerRelayedBlock, _peerDataNotfound,
+                                   _peerSetFeePerKb, _peerRequestedTx, _peerNetworkIsReachable, _peerThreadCleanup);
+                BRPeerSetRelayedTxFilter(info->peer, _peerRelayedTxIsRelevant);
+                BRPeerSetBlockRequestHandler(info->peer, _peerRequestBlocks);
+                BRPeerSetEarliestKeyTime(info->peer, manager->earliestKeyTime);
+                BRPeerSetHeadersFirst(info->peer, manager->headersFirst, _peerHeadersDone);
+                BRPeerSetEventLoop(info->peer, manager->eventLoop);
+                BRPeerConnect(info->peer);
+            }
+        }
+
+        array_free(peers);
+    }
+
+    if (array_count(manager->connectedPeers) > 0 || manager->dnsThreadCount > 0) return 0;
+    peer_log(&BR_PEER_NONE, "sync failed");
+    _BRPeerManagerSyncStopped(manager);
+    return 1;
+}
+
+// returns a UINT128_ZERO terminated array of addresses for hostname that must be freed, or NULL if lookup failed
+static UInt128 *_addressLookup(const char *hostname)
+{
+    struct addrinfo *servinfo, *p;
+    UInt128 *addrList = NULL;
+    size_t count = 0, i = 0;
+
+    if (getaddrinfo(hostname, NULL, NULL, &servinfo) == 0) {
+        for (p = servinfo; p != NULL; p = p->ai_next) count++;
+        if (count > 0) addrList = calloc(count + 1, sizeof(*addrList));
+        assert(addrList != NULL || count == 0);
+
+        for (p = servinfo; p != NULL; p = p->ai_next) {
+            if (p->ai_family == AF_INET) {
+                addrList[i].u16[5] = 0xffff;
+                addrList[i].u32[3] = ((struct sockaddr_in *)p->ai_addr)->sin_addr.s_addr;
+                i++;
+            }
+            else if (p->ai_family == AF_INET6) {
+                addrList[i++] = *(UInt128 *)&((struct sockaddr_in6 *)p->ai_addr)->sin6_addr;
+            }
+        }
+
+        freeaddrinfo(servinfo);
+    }
+
+    return addrList;
+}
+
+static void *_findPeersThreadRoutine(void *arg)
+{
+    BRPeerManager *manager = ((BRFindPeersInfo *)arg)->manager;
+    uint64_t services = ((BRFindPeersInfo *)arg)->services;
+    int isPrimary = ((BRFindPeersInfo *)arg)->isPrimary, failed = 0;
+    UInt128 *addrList, *addr;
+    time_t now = time(NULL), age;
+
+    pthread_cleanup_push(manager->threadCleanup, manager->info);
+    addrList = _addressLookup(((BRFindPeersInfo *)arg)->hostname);
+    free(arg);
+    _BRPeerManagerLock(manager);
 
-    if (tx && ! error) {
-        _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
-        BRWalletRegisterTransaction(manager->wallet, tx);
+    for (addr = addrList; addr && ! UInt128IsZero(*addr); addr++) {
+        age = (isPrimary) ? 0 : 24*60*60 + BRRand(2*24*60*60); // add between 1 and 3 days
+        array_add(manager->peers, ((BRPeer) { *addr, manager->params->standardPort, services, now - age, 0 }));
     }
 
-//    pingInfo = calloc(1, sizeof(*pingInfo));
-//    assert(pingInfo != NULL);
-//    pingInfo->peer = peer;
-//    pingInfo->manager = manager;
-//    pingInfo->hash = txHash;
-//    BRPeerSendPing(peer, pingInfo, _peerRequestedTxPingDone);
+    qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
+    manager->dnsThreadCount--;
+
+    // connect to peers from the first seeds to answer rather than waiting on all of them, unless we've disconnected
+    if (manager->connectFailureCount < MAX_CONNECT_FAILURES) failed = _BRPeerManagerConnectPeers(manager);
     pthread_mutex_unlock(&manager->lock);
-    if (txCallback) txCallback(txInfo, error);
-    return tx;
+    if (addrList) free(addrList);
+    if (failed && manager->syncStopped) manager->syncStopped(manager->info, ENETUNREACH);
+    pthread_cleanup_pop(1);
+    return NULL;
 }
 
-static int _peerNetworkIsReachable(void *info)
+// DNS peer discovery, seeds are looked up in the background, with peers connected to as their addresses come in
+static void _BRPeerManagerFindPeers(BRPeerManager *manager)
 {
-    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
-
-    return (manager->networkIsReachable) ? manager->networkIsReachable(manager->info) : 1;
-}
+    uint64_t services = SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM | manager->params->services;
+    time_t now = time(NULL);
+    pthread_t thread;
+    pthread_attr_t attr;
+    BRFindPeersInfo *info;
 
-static void _peerThreadCleanup(void *info)
-{
-    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    if (! UInt128IsZero(manager->fixedPeer.address)) {
+        array_set_count(manager->peers, 1);
+        manager->peers[0] = manager->fixedPeer;
+        manager->peers[0].services = services;
+        manager->peers[0].timestamp = now;
+    }
+    else if (manager->dnsThreadCount == 0) { // otherwise lookups from an earlier call are still pending
+        for (size_t i = 0; manager->params->dnsSeeds[i]; i++) {
+            info = calloc(1, sizeof(BRFindPeersInfo));
+            assert(info != NULL);
+            info->manager = manager;
+            info->hostname = manager->params->dnsSeeds[i];
+            info->services = services;
+            info->isPrimary = (i == 0);
 
-    free(info);
-    if (manager->threadCleanup) manager->threadCleanup(manager->info);
+            if (pthread_attr_init(&attr) == 0 && pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0 &&
+                pthread_create(&thread, &attr, _findPeersThreadRoutine, info) == 0) manager->dnsThreadCount++;
+            else free(info);
+        }
+    }
 }
 
 static void _dummyThreadCleanup(void *info)
@@ -1543,7 +2757,8 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     assert(blocks != NULL || blocksCount == 0);
     assert(peers != NULL || peersCount == 0);
     manager->params = params;
-    manager->wallet = wallet;
+    array_new(manager->wallets, 1);
+    array_add(manager->wallets, wallet);
     manager->earliestKeyTime = earliestKeyTime;
     manager->averageTxPerBlock = 1400;
     manager->maxConnectCount = PEER_MAX_CONNECTIONS;
@@ -1551,9 +2766,11 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     if (peers) array_add_array(manager->peers, peers, peersCount);
     qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
     array_new(manager->connectedPeers, PEER_MAX_CONNECTIONS);
+    array_new(manager->syncWindows, SYNC_MAX_PEER_WINDOWS*PEER_MAX_CONNECTIONS);
     manager->blocks = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, blocksCount);
     manager->orphans = BRSetNew(_BRPrevBlockHash, _BRPrevBlockEq, blocksCount); // orphans are indexed by prevBlock
     manager->checkpoints = BRSetNew(_BRBlockHeightHash, _BRBlockHeightEq, 100); // checkpoints are indexed by height
+    array_new(manager->mainChain, blocksCount + 100);
     manager->fpRate = fpRate; //loading the preferred rate
 
     for (size_t i = 0; i < manager->params->checkpointsCount; i++) {
@@ -1562,6 +2779,7 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
         block->blockHash = UInt256Reverse(manager->params->checkpoints[i].hash);
         block->timestamp = manager->params->checkpoints[i].timestamp;
         block->target = manager->params->checkpoints[i].target;
+        block->powVerified = 1;
         BRSetAdd(manager->checkpoints, block);
         BRSetAdd(manager->blocks, block);
         if (i == 0 || block->timestamp + 7*24*60*60 < manager->earliestKeyTime) manager->lastBlock = block;
@@ -1571,6 +2789,7 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
 
     for (size_t i = 0; blocks && i < blocksCount; i++) {
         assert(blocks[i]->height != BLOCK_UNKNOWN_HEIGHT); // height must be saved/restored along with serialized block
+        blocks[i]->powVerified = 1; // blocks from the persistent store were verified before they were saved
         BRSetAdd(manager->orphans, blocks[i]);
 
         if ((blocks[i]->height % BLOCK_DIFFICULTY_INTERVAL) == 0 &&
@@ -1586,11 +2805,21 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
         block = BRSetGet(manager->orphans, &orphan);
     }
 
-    array_new(manager->txRelays, 10);
-    array_new(manager->txRequests, 10);
+    _BRPeerManagerSetLastBlock(manager, manager->lastBlock);
+
+    // any stored blocks left over don't connect to the chain tip, and are either older or on stale forks
+    BRSetApply(manager->orphans, NULL, _setApplyFreeBlock);
+    BRSetClear(manager->orphans);
+    array_new(manager->orphanQueue, 100);
+    manager->pruneCount = BRSetCount(manager->blocks) + BLOCK_PRUNE_INTERVAL;
+    manager->txRelays = _BRTxPeerListNew(10);
+    manager->txRequests = _BRTxPeerListNew(10);
     array_new(manager->publishedTx, 10);
     array_new(manager->publishedTxHashes, 10);
+    array_new(manager->walletUpdates, 10);
     pthread_mutex_init(&manager->lock, NULL);
+    pthread_mutex_init(&manager->walletLock, NULL);
+    pthread_mutex_init(&manager->updatesLock, NULL);
     manager->threadCleanup = _dummyThreadCleanup;
     return manager;
 }
@@ -1632,17 +2861,136 @@ void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t
 {
     assert(manager != NULL);
     BRPeerManagerDisconnect(manager);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     manager->maxConnectCount = UInt128IsZero(address) ? PEER_MAX_CONNECTIONS : 1;
     manager->fixedPeer = ((BRPeer) { address, port, 0, 0, 0 });
     array_clear(manager->peers);
     pthread_mutex_unlock(&manager->lock);
 }
 
+// services peer connections from the given event loop, shared with any other managers using it, instead of starting a
+// thread for each peer, set loop to NULL to revert to default behavior (takes effect on next connect)
+void BRPeerManagerSetEventLoop(BRPeerManager *manager, BRPeerEventLoop *loop)
+{
+    assert(manager != NULL);
+    _BRPeerManagerLock(manager);
+    manager->eventLoop = loop;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// download and verify the header chain all the way to the tip before fetching merkleblocks for the blocks after
+// earliestKeyTime in large getdata batches, instead of switching to getblocks at earliestKeyTime (takes effect on next
+// connect)
+void BRPeerManagerSetHeadersFirst(BRPeerManager *manager, int headersFirst)
+{
+    assert(manager != NULL);
+    _BRPeerManagerLock(manager);
+    manager->headersFirst = headersFirst;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// not thread-safe, call once before BRPeerManagerConnect(), store must remain open until BRPeerManagerFree()
+// blocks since the last difficulty transition in store are loaded into memory, older headers are read from the memory
+// mapped store as needed, and best chain blocks are appended to it as they're saved, so the full block list doesn't
+// need to be passed to BRPeerManagerNew()
+void BRPeerManagerSetHeaderStore(BRPeerManager *manager, BRHeaderStore *store)
+{
+    BRMerkleBlock header, *checkpoint, *block, *last = NULL;
+    uint32_t height, tip;
+    size_t count;
+
+    assert(manager != NULL);
+    _BRPeerManagerLock(manager);
+    manager->headerStore = store;
+    count = (store) ? BRHeaderStoreCount(store) : 0;
+    tip = (count > 0) ? BRHeaderStoreStartHeight(store) + (uint32_t)count - 1 : 0;
+    height = tip - (tip % BLOCK_DIFFICULTY_INTERVAL);
+    if (count > 0 && height < BRHeaderStoreStartHeight(store)) height = BRHeaderStoreStartHeight(store);
+
+    // load the blocks since the last stored difficulty transition, they're all that's needed to verify the next ones
+    for (; count > 0 && tip > manager->lastBlock->height && height <= tip; height++) {
+        if (! BRHeaderStoreBlockAtHeight(store, height, &header)) break;
+        checkpoint = BRSetGet(manager->checkpoints, &header);
+
+        if (checkpoint && ! UInt256Eq(checkpoint->blockHash, header.blockHash)) {
+            BRHeaderStoreTruncate(store, height); // stored chain differs from the checkpoints, discard it
+            break;
+        }
+
+        block = BRSetGet(manager->blocks, &header);
+
+        if (! block) {
+            block = BRMerkleBlockNew();
+            *block = header;
+            BRSetAdd(manager->blocks, block);
+        }
+
+        last = block;
+    }
+
+    if (last && last->height > manager->lastBlock->height) _BRPeerManagerSetLastBlock(manager, last);
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// attaches another wallet to be synced along with the others over the same header chain and peer connections
+void BRPeerManagerAddWallet(BRPeerManager *manager, BRWallet *wallet, uint32_t earliestKeyTime)
+{
+    int isAttached = 0;
+
+    assert(manager != NULL);
+    assert(wallet != NULL);
+    _BRPeerManagerLock(manager);
+    _BRPeerManagerLockWallet(manager);
+
+    for (size_t i = array_count(manager->wallets); ! isAttached && i > 0; i--) {
+        isAttached = (manager->wallets[i - 1] == wallet);
+    }
+
+    if (! isAttached) array_add(manager->wallets, wallet);
+    pthread_mutex_unlock(&manager->walletLock);
+    if (! isAttached && earliestKeyTime < manager->earliestKeyTime) manager->earliestKeyTime = earliestKeyTime;
+
+    if (! isAttached && manager->bloomFilter) { // the loaded filter doesn't match any of the new wallet's addresses
+        BRBloomFilterFree(manager->bloomFilter);
+        manager->bloomFilter = NULL;
+        _BRPeerManagerUpdateFilter(manager);
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// detaches a wallet added with BRPeerManagerAddWallet()
+void BRPeerManagerRemoveWallet(BRPeerManager *manager, BRWallet *wallet)
+{
+    BRTransaction *tx;
+    size_t i;
+
+    assert(manager != NULL);
+    assert(wallet != NULL);
+    _BRPeerManagerLock(manager);
+    _BRPeerManagerLockWallet(manager);
+    _BRPeerManagerApplyWalletUpdates(manager); // so the detached wallet doesn't miss blocks already processed
+    for (i = array_count(manager->wallets); i > 1 && manager->wallets[i - 1] != wallet; i--);
+
+    if (i > 1) {
+        array_rm(manager->wallets, i - 1);
+
+        for (i = array_count(manager->publishedTx); i > 0; i--) { // the wallet may be freed once it's detached
+            tx = manager->publishedTx[i - 1].tx;
+            if (BRWalletTransactionForHash(wallet, tx->txHash) != tx) continue;
+            manager->publishedTx[i - 1].tx = _BRPeerManagerTransactionForHash(manager, tx->txHash);
+            if (! manager->publishedTx[i - 1].tx) manager->publishedTx[i - 1].tx = BRTransactionCopy(tx);
+        }
+    }
+
+    pthread_mutex_unlock(&manager->walletLock);
+    pthread_mutex_unlock(&manager->lock);
+}
+
 uint16_t BRPeerManagerStandardPort(BRPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     uint16_t port = manager->params->standardPort;
     pthread_mutex_unlock(&manager->lock);
     return port;
@@ -1654,7 +3002,7 @@ BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager)
     BRPeerStatus status = BRPeerStatusDisconnected;
     
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     if (manager->isConnected != 0) status = BRPeerStatusConnected;
 
     for (size_t i = array_count(manager->connectedPeers); i > 0 && status == BRPeerStatusDisconnected; i--) {
@@ -1669,16 +3017,22 @@ BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager)
 // connect to bitcoin peer-to-peer network (also call this whenever networkIsReachable() status changes)
 void BRPeerManagerConnect(BRPeerManager *manager)
 {
+    int failed;
+
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     if (manager->connectFailureCount >= MAX_CONNECT_FAILURES) manager->connectFailureCount = 0; //this is a manual retry
 
     if ((! manager->downloadPeer || manager->lastBlock->height < manager->estimatedHeight) &&
         manager->syncStartHeight == 0) {
         manager->syncStartHeight = manager->lastBlock->height + 1;
+        manager->syncStartTime = BRPeerStatsTime();
+        manager->syncStopTime = 0;
+        __atomic_store_n(&manager->stats.syncBlocks, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&manager->stats.syncHeaders, 0, __ATOMIC_RELAXED);
         pthread_mutex_unlock(&manager->lock);
         if (manager->syncStarted) manager->syncStarted(manager->info);
-        pthread_mutex_lock(&manager->lock);
+        _BRPeerManagerLock(manager);
     }
 
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
@@ -1687,57 +3041,15 @@ void BRPeerManagerConnect(BRPeerManager *manager)
         if (BRPeerConnectStatus(p) == BRPeerStatusConnecting) BRPeerConnect(p);
     }
 
-    if (array_count(manager->connectedPeers) < manager->maxConnectCount) {
-        time_t now = time(NULL);
-        BRPeer *peers;
-
-        if (array_count(manager->peers) < manager->maxConnectCount ||
-            manager->peers[manager->maxConnectCount - 1].timestamp + 3*24*60*60 < now) {
-            _BRPeerManagerFindPeers(manager);
-        }
-
-        array_new(peers, 100);
-        array_add_array(peers, manager->peers,
-                        (array_count(manager->peers) < 100) ? array_count(manager->peers) : 100);
-
-        while (array_count(peers) > 0 && array_count(manager->connectedPeers) < manager->maxConnectCount) {
-            size_t i = BRRand((uint32_t)array_count(peers)); // index of random peer
-            BRPeerCallbackInfo *info;
-
-            i = i*i/array_count(peers); // bias random peer selection toward peers with more recent timestamp
-
-            for (size_t j = array_count(manager->connectedPeers); i != SIZE_MAX && j > 0; j--) {
-                if (! BRPeerEq(&peers[i], manager->connectedPeers[j - 1])) continue;
-                array_rm(peers, i); // already in connectedPeers
-                i = SIZE_MAX;
-            }
-
-            if (i != SIZE_MAX) {
-                info = calloc(1, sizeof(*info));
-                assert(info != NULL);
-                info->manager = manager;
-                info->peer = BRPeerNew(manager->params->magicNumber);
-                *info->peer = peers[i];
-                array_rm(peers, i);
-                array_add(manager->connectedPeers, info->peer);
-                BRPeerSetCallbacks(info->peer, info, _peerConnected, _peerDisconnected, _peerRelayedPeers,
-                                   _peerRelayedTx, _peerHasTx, _peerRejectedTx, _peerRelayedBlock, _peerDataNotfound,
-                                   _peerSetFeePerKb, _peerRequestedTx, _peerNetworkIsReachable, _peerThreadCleanup);
-                BRPeerSetEarliestKeyTime(info->peer, manager->earliestKeyTime);
-                BRPeerConnect(info->peer);
-            }
-        }
-
-        array_free(peers);
+    if (array_count(manager->connectedPeers) < manager->maxConnectCount &&
+        (array_count(manager->peers) < manager->maxConnectCount ||
+         manager->peers[manager->maxConnectCount - 1].timestamp + 3*24*60*60 < time(NULL))) {
+        _BRPeerManagerFindPeers(manager);
     }
 
-    if (array_count(manager->connectedPeers) == 0) {
-        peer_log(&BR_PEER_NONE, "sync failed");
-        _BRPeerManagerSyncStopped(manager);
-        pthread_mutex_unlock(&manager->lock);
-        if (manager->syncStopped) manager->syncStopped(manager->info, ENETUNREACH);
-    }
-    else pthread_mutex_unlock(&manager->lock);
+    failed = _BRPeerManagerConnectPeers(manager);
+    pthread_mutex_unlock(&manager->lock);
+    if (failed && manager->syncStopped) manager->syncStopped(manager->info, ENETUNREACH);
 }
 
 void BRPeerManagerDisconnect(BRPeerManager *manager)
@@ -1746,14 +3058,11 @@ void BRPeerManagerDisconnect(BRPeerManager *manager)
     size_t peerCount, dnsThreadCount;
 
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     peerCount = array_count(manager->connectedPeers);
     dnsThreadCount = manager->dnsThreadCount;
-
-    for (size_t i = peerCount; i > 0; i--) {
-        manager->connectFailureCount = MAX_CONNECT_FAILURES; // prevent futher automatic reconnect attempts
-        BRPeerDisconnect(manager->connectedPeers[i - 1]);
-    }
+    manager->connectFailureCount = MAX_CONNECT_FAILURES; // prevent futher automatic reconnect attempts
+    for (size_t i = peerCount; i > 0; i--) BRPeerDisconnect(manager->connectedPeers[i - 1]);
 
     pthread_mutex_unlock(&manager->lock);
     ts.tv_sec = 0;
@@ -1761,7 +3070,7 @@ void BRPeerManagerDisconnect(BRPeerManager *manager)
 
     while (peerCount > 0 || dnsThreadCount > 0) {
         nanosleep(&ts, NULL); // pthread_yield() isn't POSIX standard :(
-        pthread_mutex_lock(&manager->lock);
+        _BRPeerManagerLock(manager);
         peerCount = array_count(manager->connectedPeers);
         dnsThreadCount = manager->dnsThreadCount;
         pthread_mutex_unlock(&manager->lock);
@@ -1773,19 +3082,24 @@ void BRPeerManagerDisconnect(BRPeerManager *manager)
 void BRPeerManagerRescan(BRPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
     if (manager->isConnected) {
         // start the chain download from the most recent checkpoint that's at least a week older than earliestKeyTime
         for (size_t i = manager->params->checkpointsCount; i > 0; i--) {
             if (i - 1 == 0 || manager->params->checkpoints[i - 1].timestamp + 7*24*60*60 < manager->earliestKeyTime) {
                 UInt256 hash = UInt256Reverse(manager->params->checkpoints[i - 1].hash);
+                BRMerkleBlock *checkpoint = BRSetGet(manager->blocks, &hash);
 
-                manager->lastBlock = BRSetGet(manager->blocks, &hash);
+                if (checkpoint) _BRPeerManagerSetLastBlock(manager, checkpoint);
                 break;
             }
         }
 
+        if (manager->fetchHashes) array_free(manager->fetchHashes);
+        manager->fetchHashes = NULL;
+        manager->fetchIdx = manager->fetchNext = 0;
+
         if (manager->downloadPeer) { // disconnect the current download peer so a new random one will be selected
             for (size_t i = array_count(manager->peers); i > 0; i--) {
                 if (BRPeerEq(&manager->peers[i - 1], manager->downloadPeer)) array_rm(manager->peers, i - 1);
@@ -1807,7 +3121,7 @@ uint32_t BRPeerManagerEstimatedBlockHeight(BRPeerManager *manager)
     uint32_t height;
 
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     height = (manager->lastBlock->height < manager->estimatedHeight) ? manager->estimatedHeight :
              manager->lastBlock->height;
     pthread_mutex_unlock(&manager->lock);
@@ -1820,7 +3134,7 @@ uint32_t BRPeerManagerLastBlockHeight(BRPeerManager *manager)
     uint32_t height;
 
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     height = manager->lastBlock->height;
     pthread_mutex_unlock(&manager->lock);
     return height;
@@ -1832,7 +3146,7 @@ uint32_t BRPeerManagerLastBlockTimestamp(BRPeerManager *manager)
     uint32_t timestamp;
 
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     timestamp = manager->lastBlock->timestamp;
     pthread_mutex_unlock(&manager->lock);
     return timestamp;
@@ -1845,15 +3159,19 @@ double BRPeerManagerSyncProgress(BRPeerManager *manager, uint32_t startHeight)
     double progress;
 
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     if (startHeight == 0) startHeight = manager->syncStartHeight;
 
     if (! manager->downloadPeer && manager->syncStartHeight == 0) {
         progress = 0.0;
     }
+    else if (manager->fetchHashes) { // headers-first: header chain is done, progress is the share of merkleblocks
+        progress = 0.5 + 0.5*manager->fetchIdx/array_count(manager->fetchHashes);
+    }
     else if (! manager->downloadPeer || manager->lastBlock->height < manager->estimatedHeight) {
         if (manager->lastBlock->height > startHeight && manager->estimatedHeight > startHeight) {
-            progress = 0.1 + 0.9*(manager->lastBlock->height - startHeight)/(manager->estimatedHeight - startHeight);
+            progress = 0.1 + ((manager->headersFirst) ? 0.4 : 0.9)*(manager->lastBlock->height - startHeight)/
+                       (manager->estimatedHeight - startHeight);
         }
         else progress = 0.05;
     }
@@ -1869,7 +3187,7 @@ size_t BRPeerManagerPeerCount(BRPeerManager *manager)
     size_t count = 0;
 
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
         if (BRPeerConnectStatus(manager->connectedPeers[i - 1]) != BRPeerStatusDisconnected) count++;
@@ -1883,7 +3201,7 @@ size_t BRPeerManagerPeerCount(BRPeerManager *manager)
 const char *BRPeerManagerDownloadPeerName(BRPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
     if (manager->downloadPeer) {
         sprintf(manager->downloadPeerName, "%s:%d", BRPeerHost(manager->downloadPeer), manager->downloadPeer->port);
@@ -1900,7 +3218,7 @@ static void _publishTxInvDone(void *info, int success)
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
 
     free(info);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     _BRPeerManagerRequestUnrelayedTx(manager, peer);
     pthread_mutex_unlock(&manager->lock);
 }
@@ -1911,7 +3229,7 @@ void BRPeerManagerPublishTx(BRPeerManager *manager, BRTransaction *tx, void *inf
 {
     assert(manager != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
-    if (tx) pthread_mutex_lock(&manager->lock);
+    if (tx) _BRPeerManagerLock(manager);
 
     if (tx && ! BRTransactionIsSigned(tx)) {
         pthread_mutex_unlock(&manager->lock);
@@ -1930,14 +3248,16 @@ void BRPeerManagerPublishTx(BRPeerManager *manager, BRTransaction *tx, void *inf
             tx = NULL;
             if (callback) callback(info, ENOTCONN); // not connected to bitcoin network
         }
-        else pthread_mutex_lock(&manager->lock);
+        else _BRPeerManagerLock(manager);
     }
 
     if (tx) {
         size_t i, count = 0;
 
         tx->timestamp = (uint32_t)time(NULL); // set timestamp to publish time
+        _BRPeerManagerLockWallet(manager);
         _BRPeerManagerAddTxToPublishList(manager, tx, info, callback);
+        pthread_mutex_unlock(&manager->walletLock);
 
         for (i = array_count(manager->connectedPeers); i > 0; i--) {
             if (BRPeerConnectStatus(manager->connectedPeers[i - 1]) == BRPeerStatusConnected) count++;
@@ -1952,12 +3272,14 @@ void BRPeerManagerPublishTx(BRPeerManager *manager, BRTransaction *tx, void *inf
             // instead of publishing to all peers, leave out downloadPeer to see if tx propogates/gets relayed back
             // TODO: XXX connect to a random peer with an empty or fake bloom filter just for publishing
             if (peer != manager->downloadPeer || count == 1) {
+                BRPeerCork(peer);
                 _BRPeerManagerPublishPendingTx(manager, peer);
                 peerInfo = calloc(1, sizeof(*peerInfo));
                 assert(peerInfo != NULL);
                 peerInfo->peer = peer;
                 peerInfo->manager = manager;
                 BRPeerSendPing(peer, peerInfo, _publishTxInvDone);
+                BRPeerUncork(peer);
             }
         }
 
@@ -1972,38 +3294,211 @@ size_t BRPeerManagerRelayCount(BRPeerManager *manager, UInt256 txHash)
 
     assert(manager != NULL);
     assert(! UInt256IsZero(txHash));
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) {
-        if (! UInt256Eq(manager->txRelays[i - 1].txHash, txHash)) continue;
-        count = array_count(manager->txRelays[i - 1].peers);
-        break;
+    count = _BRTxPeerListCount(manager->txRelays, txHash);
+    pthread_mutex_unlock(&manager->lock);
+    return count;
+}
+
+// copies the running counters for manager and all of its peers, past and present, into stats
+void BRPeerManagerGetStats(BRPeerManager *manager, BRPeerManagerStats *stats)
+{
+    BRPeerStats peerStats;
+    uint64_t now = BRPeerStatsTime();
+
+    assert(manager != NULL);
+    assert(stats != NULL);
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&manager->lock); // not counted as a lock wait, so polling stats doesn't skew them
+    BRPeerStatsSum(&stats->peers, &manager->stats.peers);
+
+    for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+        BRPeerGetStats(manager->connectedPeers[i - 1], &peerStats);
+        BRPeerStatsSum(&stats->peers, &peerStats);
+    }
+
+    if (manager->syncStartTime > 0) {
+        stats->syncTime = ((manager->syncStopTime) ? manager->syncStopTime : now) - manager->syncStartTime;
     }
 
     pthread_mutex_unlock(&manager->lock);
-    return count;
+    stats->blocks = __atomic_load_n(&manager->stats.blocks, __ATOMIC_RELAXED);
+    stats->headers = __atomic_load_n(&manager->stats.headers, __ATOMIC_RELAXED);
+    stats->syncBlocks = __atomic_load_n(&manager->stats.syncBlocks, __ATOMIC_RELAXED);
+    stats->syncHeaders = __atomic_load_n(&manager->stats.syncHeaders, __ATOMIC_RELAXED);
+    stats->filterLoads = __atomic_load_n(&manager->stats.filterLoads, __ATOMIC_RELAXED);
+    stats->filterLoadTime = __atomic_load_n(&manager->stats.filterLoadTime, __ATOMIC_RELAXED);
+    stats->filterTxCount = __atomic_load_n(&manager->stats.filterTxCount, __ATOMIC_RELAXED);
+    stats->filterFpCount = __atomic_load_n(&manager->stats.filterFpCount, __ATOMIC_RELAXED);
+    stats->lockWaits = __atomic_load_n(&manager->stats.lockWaits, __ATOMIC_RELAXED);
+    stats->lockWaitTime = __atomic_load_n(&manager->stats.lockWaitTime, __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i < PEER_STATS_LATENCY_BUCKETS; i++) {
+        stats->lockWaitLatency[i] = __atomic_load_n(&manager->stats.lockWaitLatency[i], __ATOMIC_RELAXED);
+    }
+
+    if (stats->syncTime > 0) {
+        stats->blocksPerSec = stats->syncBlocks*1000000.0/stats->syncTime;
+        stats->headersPerSec = stats->syncHeaders*1000000.0/stats->syncTime;
+    }
+
+    if (stats->filterTxCount > 0) stats->fpRate = (double)stats->filterFpCount/stats->filterTxCount;
 }
 
 // frees memory allocated for manager
 void BRPeerManagerFree(BRPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
+    if (manager->headerStore) BRHeaderStoreSync(manager->headerStore); // the store is closed by its owner
+    _BRPeerManagerClearSyncWindows(manager, 0); // before connectedPeers is freed
+    array_free(manager->syncWindows);
     array_free(manager->peers);
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) BRPeerFree(manager->connectedPeers[i - 1]);
     array_free(manager->connectedPeers);
     BRSetApply(manager->blocks, NULL, _setApplyFreeBlock);
     BRSetFree(manager->blocks);
+    array_free(manager->mainChain);
     BRSetApply(manager->orphans, NULL, _setApplyFreeBlock);
     BRSetFree(manager->orphans);
+    array_free(manager->orphanQueue);
     BRSetFree(manager->checkpoints);
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) free(manager->txRelays[i - 1].peers);
-    array_free(manager->txRelays);
-    for (size_t i = array_count(manager->txRequests); i > 0; i--) free(manager->txRequests[i - 1].peers);
-    array_free(manager->txRequests);
+    _BRTxPeerListFree(manager->txRelays);
+    _BRTxPeerListFree(manager->txRequests);
+    if (manager->fetchHashes) array_free(manager->fetchHashes);
+    _BRPeerManagerLockWallet(manager);
+    _BRPeerManagerApplyWalletUpdates(manager); // before checking which tx the wallets still hold
+    
+    for (size_t i = array_count(manager->publishedTx); i > 0; i--) { // free tx that no wallet holds, like the copies
+        BRTransaction *tx = manager->publishedTx[i - 1].tx;          // kept for a detached wallet
+        size_t j = array_count(manager->wallets);
+        
+        while (j > 0 && BRWalletTransactionForHash(manager->wallets[j - 1], tx->txHash) != tx) j--;
+        if (j == 0) BRTransactionFree(tx);
+    }
+    
+    pthread_mutex_unlock(&manager->walletLock);
     array_free(manager->publishedTx);
     array_free(manager->publishedTxHashes);
+    array_free(manager->walletUpdates);
+    array_free(manager->wallets);
     pthread_mutex_unlock(&manager->lock);
+    pthread_mutex_destroy(&manager->updatesLock);
+    pthread_mutex_destroy(&manager->walletLock);
     pthread_mutex_destroy(&manager->lock);
     free(manager);
 }
+
+int BRPeerManagerPeerCostCompareTest(const BRPeer *peer, const BRPeer *otherPeer)
+{
+    return _peerCostCompare(peer, otherPeer);
+}
+
+double BRPeerManagerPeerCostTest(const BRPeer *peer, double pingTime)
+{
+    return _BRPeerCost(peer, pingTime);
+}
+
+void BRPeerManagerRelayedPeersTest(BRPeerManager *manager, const BRPeer peers[], size_t peersCount)
+{
+    BRPeerCallbackInfo info = { BRPeerNew(manager->params->magicNumber), manager, UINT256_ZERO, 0 };
+
+    _peerRelayedPeers(&info, peers, peersCount);
+    BRPeerFree(info.peer);
+}
+
+BRPeer BRPeerManagerOrphanRelayerTest(BRPeerManager *manager, BRMerkleBlock *orphan, const BRPeer *relayer,
+                                      const BRPeer *peer)
+{
+    BRPeer r;
+
+    pthread_mutex_lock(&manager->lock);
+    if (relayer) _BRPeerManagerAddOrphan(manager, orphan, relayer);
+    BRSetRemove(manager->orphans, orphan);
+    r = _BRPeerManagerOrphanRelayer(manager, orphan, peer);
+    pthread_mutex_unlock(&manager->lock);
+    return r;
+}
+
+size_t BRPeerManagerTxPeerListChurnTest(const BRPeer peers[], size_t peersCount, UInt256 txHash)
+{
+    BRTxPeerList *list = _BRTxPeerListNew(10);
+    UInt256 otherHash = UINT256_ZERO;
+    size_t count;
+
+    _BRTxPeerListAddPeer(list, txHash, &peers[0]); // peers[0] stays connected while the others come and go
+
+    for (size_t i = 1; i < peersCount; i++) {
+        otherHash.u32[0] = (uint32_t)i;
+        _BRTxPeerListAddPeer(list, otherHash, &peers[i]);
+        _BRTxPeerListRemovePeerAll(list, &peers[i]);
+    }
+
+    count = (_BRTxPeerListHasPeer(list, txHash, &peers[0])) ? _BRTxPeerListCount(list, txHash) : 0;
+    _BRTxPeerListFree(list);
+    return count;
+}
+
+void BRPeerManagerPublishWalletTxTest(BRPeerManager *manager, BRTransaction *tx)
+{
+    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLockWallet(manager);
+    _BRPeerManagerRegisterTransaction(manager, tx); // registered the same way as a tx relayed by a peer
+    _BRPeerManagerAddTxToPublishList(manager, _BRPeerManagerTransactionForHash(manager, tx->txHash), NULL, NULL);
+    pthread_mutex_unlock(&manager->walletLock);
+    pthread_mutex_unlock(&manager->lock);
+}
+
+uint32_t BRPeerManagerWalletUpdatesTest(BRPeerManager *manager, UInt256 txHash, const uint32_t heights[], size_t count)
+{
+    BRTransaction *tx;
+    uint32_t height;
+
+    pthread_mutex_lock(&manager->lock);
+
+    for (size_t i = 0; i < count; i++) { // queued the way a relayed block queues them
+        _BRPeerManagerQueueWalletUpdate(manager, &txHash, 1, heights[i], 0);
+    }
+
+    _BRPeerManagerLockWallet(manager); // the way a peer callback takes walletLock while holding lock
+    tx = _BRPeerManagerTransactionForHash(manager, txHash);
+    height = (tx) ? tx->blockHeight : 0;
+    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockWallet(manager);
+    return height;
+}
+
+uint32_t BRPeerManagerHeadersDoneTest(BRPeerManager *manager, uint32_t estimatedHeight)
+{
+    BRPeerCallbackInfo info = { BRPeerNew(manager->params->magicNumber), manager, UINT256_ZERO, 0 };
+    uint32_t height;
+
+    pthread_mutex_lock(&manager->lock); // the download peer's header chain ended at lastBlock
+    manager->downloadPeer = info.peer;
+    manager->syncStartHeight = manager->lastBlock->height + 1;
+    manager->estimatedHeight = estimatedHeight;
+    pthread_mutex_unlock(&manager->lock);
+    _peerHeadersDone(&info);
+    pthread_mutex_lock(&manager->lock);
+    height = manager->estimatedHeight;
+    manager->downloadPeer = NULL;
+    manager->syncStartHeight = 0;
+    pthread_mutex_unlock(&manager->lock);
+    BRPeerFree(info.peer);
+    return height;
+}
+
+BRTransaction *BRPeerManagerPublishedTxTest(BRPeerManager *manager, UInt256 txHash)
+{
+    BRTransaction *tx = NULL;
+
+    pthread_mutex_lock(&manager->lock);
+
+    for (size_t i = array_count(manager->publishedTx); ! tx && i > 0; i--) {
+        if (UInt256Eq(manager->publishedTxHashes[i - 1], txHash)) tx = manager->publishedTx[i - 1].tx;
+    }
+
+    pthread_mutex_unlock(&manager->lock);
+    return tx;
+}
@@ -30,6 +30,7 @@
 #include "BRTransaction.h"
 #include "BRWallet.h"
 #include "BRChainParams.h"
+#include "BRHeaderStore.h"
 #include <stddef.h>
 #include <inttypes.h>
 
@@ -41,6 +42,19 @@ extern "C" {
 
 typedef struct BRPeerManagerStruct BRPeerManager;
 
+typedef struct {
+    BRPeerStats peers; // message counters and handler latencies summed over all peers, including disconnected ones
+    uint64_t blocks, headers; // merkleblocks and block headers received
+    uint64_t syncBlocks, syncHeaders; // merkleblocks and headers received during the current or most recent sync
+    uint64_t syncTime; // microseconds since the current sync started, or the duration of the most recent one
+    uint64_t filterLoads, filterLoadTime; // bloom filters built, and the total microseconds spent building them
+    uint64_t filterTxCount, filterFpCount; // tx in received merkleblocks, and matched tx that weren't wallet tx
+    uint64_t lockWaits, lockWaitTime; // contended acquisitions of the manager lock, and the total microseconds waited
+    uint64_t lockWaitLatency[PEER_STATS_LATENCY_BUCKETS]; // histogram of manager lock wait times
+    double blocksPerSec, headersPerSec; // syncBlocks and syncHeaders per second of syncTime
+    double fpRate; // observed bloom filter false positive rate, filterFpCount/filterTxCount
+} BRPeerManagerStats;
+
 // returns a newly allocated BRPeerManager struct that must be freed by calling BRPeerManagerFree()
 BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, uint32_t earliestKeyTime,
                                 BRMerkleBlock *blocks[], size_t blocksCount, const BRPeer peers[], size_t peersCount, 
@@ -70,6 +84,31 @@ void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
 // set address to UINT128_ZERO to revert to default behavior
 void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t port);
 
+// services peer connections from the given event loop, shared with any other managers using it, instead of starting a
+// thread for each peer, set loop to NULL to revert to default behavior (takes effect on next connect)
+void BRPeerManagerSetEventLoop(BRPeerManager *manager, BRPeerEventLoop *loop);
+
+// download and verify the header chain all the way to the tip before fetching merkleblocks for the blocks after
+// earliestKeyTime in large getdata batches, instead of switching to getblocks at earliestKeyTime (takes effect on next
+// connect)
+void BRPeerManagerSetHeadersFirst(BRPeerManager *manager, int headersFirst);
+
+// not thread-safe, call once before BRPeerManagerConnect(), store must remain open until BRPeerManagerFree()
+// blocks since the last difficulty transition in store are loaded into memory, older headers are read from the memory
+// mapped store as needed, and best chain blocks are appended to it as they're saved, so the full block list doesn't
+// need to be passed to BRPeerManagerNew(), the store is synced to disk each time a chain sync stops, and when the
+// manager is freed
+void BRPeerManagerSetHeaderStore(BRPeerManager *manager, BRHeaderStore *store);
+
+// attaches another wallet, synced over the same header chain and peer connections as the wallet passed to
+// BRPeerManagerNew(), with a single bloom filter matching the addresses of all attached wallets, and each tx registered
+// with every wallet it belongs to (the filter is reloaded if already loaded, call BRPeerManagerRescan() if the wallet
+// has tx in blocks that have already been synced), wallet must remain valid until it's removed or manager is freed
+void BRPeerManagerAddWallet(BRPeerManager *manager, BRWallet *wallet, uint32_t earliestKeyTime);
+
+// detaches a wallet added with BRPeerManagerAddWallet(), the wallet passed to BRPeerManagerNew() can't be removed
+void BRPeerManagerRemoveWallet(BRPeerManager *manager, BRWallet *wallet);
+
 // current connect status
 BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager);
 
@@ -112,6 +151,10 @@ void BRPeerManagerPublishTx(BRPeerManager *manager, BRTransaction *tx, void *inf
 // number of connected peers that have relayed the given unconfirmed transaction
 size_t BRPeerManagerRelayCount(BRPeerManager *manager, UInt256 txHash);
 
+// copies the running counters for manager and all of its peers, past and present, into stats (counting is always on,
+// and the manager lock is only taken here to sum the counters of connected peers)
+void BRPeerManagerGetStats(BRPeerManager *manager, BRPeerManagerStats *stats);
+
 // frees memory allocated for manager (call BRPeerManagerDisconnect() first if connected)
 void BRPeerManagerFree(BRPeerManager *manager);
 
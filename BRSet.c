@@ -28,24 +28,42 @@
 #include <assert.h>
 
 // linear probed hashtable for good cache performance, maximum load factor is 2/3
+// each bucket caches its item's hash value, so probes can skip mismatched items without calling eq() or dereferencing
+// the item, and table sizes are powers of two so that buckets are found with a bitmask instead of a modulo
 
-static const size_t tableSizes[] = { // starting with 1, multiply by 3/2, round up, then find next largest prime
-    1, 3, 7, 13, 23, 37, 59, 97, 149, 227, 347, 523, 787, 1187, 1783, 2677, 4019, 6037, 9059, 13591,
-    20389, 30593, 45887, 68863, 103307, 154981, 232487, 348739, 523129, 784697, 1177067, 1765609,
-    2648419, 3972643, 5958971, 8938469, 13407707, 20111563, 30167359, 45251077, 67876637, 101814991,
-    152722489, 229083739, 343625629, 515438447, 773157683, 1159736527, 1739604799, 2609407319, 3914111041
-};
+#define SET_MIN_SIZE 4
 
-#define TABLE_SIZES_LEN (sizeof(tableSizes)/sizeof(*tableSizes))
+typedef struct {
+    size_t hash;
+    void *item;
+} BRSetBucket;
 
 struct BRSetStruct {
-    void **table; // hashtable
-    size_t size; // number of buckets in table
+    BRSetBucket *table; // hashtable
+    size_t size; // number of buckets in table, always a power of two
     size_t itemCount; // number of items in set
     size_t (*hash)(const void *); // hash function
     int (*eq)(const void *, const void *); // equality function
 };
 
+// returns the starting bucket for hash, hash values are mixed first since power-of-two tables only use the low bits
+inline static size_t _BRSetIndex(const BRSet *set, size_t hash)
+{
+    uint64_t x = (uint64_t)hash;
+    
+    x ^= x >> 32;
+    return (size_t)((x*0x9e3779b97f4a7c15ULL) >> 32) & (set->size - 1);
+}
+
+// returns the smallest power-of-two table size that keeps load factor at or below 2/3 when holding capacity items
+inline static size_t _BRSetTableSize(size_t capacity)
+{
+    size_t size = SET_MIN_SIZE;
+    
+    while (size < capacity + (capacity + 1)/2) size <<= 1;
+    return size;
+}
+
 static void _BRSetInit(BRSet *set, size_t (*hash)(const void *), int (*eq)(const void *, const void *), size_t capacity)
 {
     assert(set != NULL);
@@ -53,16 +71,9 @@ static void _BRSetInit(BRSet *set, size_t (*hash)(const void *), int (*eq)(const
     assert(eq != NULL);
     assert(capacity >= 0);
 
-    size_t i = 0;
-    
-    while (i < TABLE_SIZES_LEN && tableSizes[i] < capacity) i++;
-
-    if (i + 1 < TABLE_SIZES_LEN) { // use next larger table size to keep load factor below 2/3 at capacity
-        set->table = calloc(tableSizes[i + 1], sizeof(void *));
-        assert(set->table != NULL);
-        set->size = tableSizes[i + 1];
-    }
-    
+    set->size = _BRSetTableSize(capacity);
+    set->table = calloc(set->size, sizeof(*set->table));
+    assert(set->table != NULL);
     set->itemCount = 0;
     set->hash = hash;
     set->eq = eq;
@@ -82,17 +93,58 @@ BRSet *BRSetNew(size_t (*hash)(const void *), int (*eq)(const void *, const void
     return set;
 }
 
-// rebuilds hashtable to hold up to capacity items
-static void _BRSetGrow(BRSet *set, size_t capacity)
+// returns the bucket index holding an item equivalent to item with the given hash, or the empty bucket ending the probe
+static size_t _BRSetFind(const BRSet *set, const void *item, size_t hash)
+{
+    size_t mask = set->size - 1, i = _BRSetIndex(set, hash);
+    const BRSetBucket *b = &set->table[i];
+
+    while (b->item && b->item != item && (b->hash != hash || ! set->eq(b->item, item))) { // probe for item
+        i = (i + 1) & mask;
+        b = &set->table[i];
+    }
+    
+    return i;
+}
+
+// adds item with precomputed hash without checking load factor, returns item replaced if any
+static void *_BRSetAddHashed(BRSet *set, void *item, size_t hash)
 {
-    BRSet newSet;
+    size_t i = _BRSetFind(set, item, hash);
+    void *t = set->table[i].item;
     
-    _BRSetInit(&newSet, set->hash, set->eq, capacity);
-    BRSetUnion(&newSet, set);
-    free(set->table);
-    set->table = newSet.table;
-    set->size = newSet.size;
-    set->itemCount = newSet.itemCount;
+    if (! t) set->itemCount++;
+    set->table[i].hash = hash;
+    set->table[i].item = item;
+    return t;
+}
+
+// rebuilds hashtable with size buckets, reusing cached hash values
+static void _BRSetResize(BRSet *set, size_t size)
+{
+    BRSetBucket *table = set->table;
+    size_t i, oldSize = set->size;
+    
+    set->table = calloc(size, sizeof(*set->table));
+    assert(set->table != NULL);
+    set->size = size;
+    set->itemCount = 0;
+    
+    for (i = 0; i < oldSize; i++) {
+        if (table[i].item) _BRSetAddHashed(set, table[i].item, table[i].hash);
+    }
+    
+    free(table);
+}
+
+// grows hashtable if needed so that set can hold capacity items without further rehashing
+void BRSetReserve(BRSet *set, size_t capacity)
+{
+    assert(set != NULL);
+    
+    size_t size = _BRSetTableSize(capacity);
+    
+    if (size > set->size) _BRSetResize(set, size);
 }
 
 // adds given item to set or replaces an equivalent existing item and returns item replaced if any
@@ -101,18 +153,9 @@ void *BRSetAdd(BRSet *set, void *item)
     assert(set != NULL);
     assert(item != NULL);
     
-    size_t size = set->size;
-    size_t i = set->hash(item) % size;
-    void *t = set->table[i];
+    void *t = _BRSetAddHashed(set, item, set->hash(item));
 
-    while (t && t != item && ! set->eq(t, item)) { // probe for empty bucket
-        i = (i + 1) % size;
-        t = set->table[i];
-    }
-
-    if (! t) set->itemCount++;
-    set->table[i] = item;
-    if (set->itemCount > ((size + 2)/3)*2) _BRSetGrow(set, size); // limit load factor to 2/3
+    if (set->itemCount > (set->size/3)*2) _BRSetResize(set, set->size*2); // limit load factor to 2/3
     return t;
 }
 
@@ -122,26 +165,21 @@ void *BRSetRemove(BRSet *set, const void *item)
     assert(set != NULL);
     assert(item != NULL);
     
-    size_t size = set->size;
-    size_t i = set->hash(item) % size;
-    void *r = set->table[i], *t;
+    size_t mask = set->size - 1, i = _BRSetFind(set, item, set->hash(item));
+    void *r = set->table[i].item;
+    BRSetBucket t;
 
-    while (r != item && r && ! set->eq(r, item)) { // probe for item
-        i = (i + 1) % size;
-        r = set->table[i];
-    }
-    
     if (r) {
         set->itemCount--;
-        set->table[i] = NULL;
-        i = (i + 1) % size;
+        set->table[i].item = NULL;
+        i = (i + 1) & mask;
         t = set->table[i];
         
-        while (t) { // hashtable cleanup
+        while (t.item) { // hashtable cleanup
             set->itemCount--;
-            set->table[i] = NULL;
-            BRSetAdd(set, t);
-            i = (i + 1) % size;
+            set->table[i].item = NULL;
+            _BRSetAddHashed(set, t.item, t.hash);
+            i = (i + 1) & mask;
             t = set->table[i];
         }
     }
@@ -178,12 +216,15 @@ int BRSetIntersects(const BRSet *set, const BRSet *otherSet)
     assert(set != NULL);
     assert(otherSet != NULL);
     
-    size_t i = 0, size = otherSet->size;
-    void *t;
+    size_t i = 0, size = otherSet->size, hash;
+    const BRSetBucket *b;
     
     while (i < size) {
-        t = otherSet->table[i++];
-        if (t && BRSetGet(set, t) != NULL) return 1;
+        b = &otherSet->table[i++];
+        if (! b->item) continue;
+        // the hash cached in otherSet can only be reused when both sets use the same hash function
+        hash = (set->hash == otherSet->hash) ? b->hash : set->hash(b->item);
+        if (set->table[_BRSetFind(set, b->item, hash)].item != NULL) return 1;
     }
     
     return 0;
@@ -195,16 +236,7 @@ void *BRSetGet(const BRSet *set, const void *item)
     assert(set != NULL);
     assert(item != NULL);
     
-    size_t size = set->size;
-    size_t i = set->hash(item) % size;
-    void *t = set->table[i];
-
-    while (t != item && t && ! set->eq(t, item)) { // probe for item
-        i = (i + 1) % size;
-        t = set->table[i];
-    }
-    
-    return t;
+    return set->table[_BRSetFind(set, item, set->hash(item))].item;
 }
 
 // interates over set and returns the next item after previous, or NULL if no more items are available
@@ -214,21 +246,10 @@ void *BRSetIterate(const BRSet *set, const void *previous)
     assert(set != NULL);
     
     size_t i = 0, size = set->size;
-    void *t, *r = NULL;
-    
-    if (previous != NULL) {
-        i = set->hash(previous) % size;
-        t = set->table[i];
-        
-        while (t != previous && t && ! set->eq(t, previous)) { // probe for item
-            i = (i + 1) % size;
-            t = set->table[i];
-        }
-    
-        i++;
-    }
+    void *r = NULL;
     
-    while (! r && i < size) r = set->table[i++];
+    if (previous != NULL) i = _BRSetFind(set, previous, set->hash(previous)) + 1;
+    while (! r && i < size) r = set->table[i++].item;
     return r;
 }
 
@@ -243,7 +264,7 @@ size_t BRSetAll(const BRSet *set, void *allItems[], size_t count)
     void *t;
     
     while (i < size && j < count) {
-        t = set->table[i++];
+        t = set->table[i++].item;
         if (t) allItems[j++] = t;
     }
     
@@ -260,7 +281,7 @@ void BRSetApply(const BRSet *set, void *info, void (*apply)(void *info, void *it
     void *t;
     
     while (i < size) {
-        t = set->table[i++];
+        t = set->table[i++].item;
         if (t) apply(info, t);
     }
 }
@@ -272,11 +293,15 @@ void BRSetUnion(BRSet *set, const BRSet *otherSet)
     assert(otherSet != NULL);
     
     size_t i = 0, size = otherSet->size;
-    void *t;
+    const BRSetBucket *b;
+    
+    // if both sets use the same hash function, cached hash values are reused
+    if (set->hash == otherSet->hash) BRSetReserve(set, set->itemCount + otherSet->itemCount);
     
     while (i < size) {
-        t = otherSet->table[i++];
-        if (t) BRSetAdd(set, t);
+        b = &otherSet->table[i++];
+        if (b->item && set->hash == otherSet->hash) _BRSetAddHashed(set, b->item, b->hash);
+        else if (b->item) BRSetAdd(set, b->item);
     }
 }
 
@@ -290,7 +315,7 @@ void BRSetMinus(BRSet *set, const BRSet *otherSet)
     void *t;
     
     while (i < size) {
-        t = otherSet->table[i++];
+        t = otherSet->table[i++].item;
         if (t) BRSetRemove(set, t);
     }
 }
@@ -305,7 +330,7 @@ void BRSetIntersect(BRSet *set, const BRSet *otherSet)
     void *t;
     
     while (i < size) {
-        t = set->table[i];
+        t = set->table[i].item;
 
         if (t && ! BRSetContains(otherSet, t)) {
             BRSetRemove(set, t);
@@ -41,6 +41,9 @@ typedef struct BRSetStruct BRSet;
 // capacity is the initial number of items the set can hold, which will be auto-increased as needed
 BRSet *BRSetNew(size_t (*hash)(const void *), int (*eq)(const void *, const void *), size_t capacity);
 
+// grows set if needed so that it can hold capacity items without rehashing
+void BRSetReserve(BRSet *set, size_t capacity);
+
 // adds given item to set or replaces an equivalent existing item and returns item replaced if any
 void *BRSetAdd(BRSet *set, void *item);
 
@@ -26,6 +26,7 @@
 #include "BRKey.h"
 #include "BRAddress.h"
 #include "BRArray.h"
+#include "BRWorkPool.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -40,6 +41,49 @@
 #define SIGHASH_ANYONECANPAY 0x80 // let other people add inputs, I don't care where the rest of the bitcoins come from
 #define SIGHASH_FORKID       0x40 // use BIP143 digest method (for b-cash/b-gold signatures)
 
+// parsed and copied transactions are flattened into a single allocation holding the BRTransaction struct followed by
+// its inputs, outputs and all their scripts and signatures, each laid out as a BRArray.h array whose capacity is set
+// to TX_ARENA_CAPACITY to mark it as part of the allocation, so freeing the tx struct frees everything at once
+// arena arrays are never resized in place, any setter or add function that changes one moves it to its own allocation
+#define TX_ARENA_CAPACITY    SIZE_MAX
+
+#define SIGN_BATCH_SIZE      8 // number of keys or inputs a signing worker thread takes at a time
+#define SIGN_MAX_THREADS     8 // maximum number of threads, including the caller, signing a transaction
+
+#define _array_is_arena(array) (array_capacity(array) == TX_ARENA_CAPACITY)
+
+typedef struct {
+    uint8_t *buf; // NULL when only measuring the space needed
+    size_t off;
+} BRTxArena;
+
+// the parts of the SIGHASH_ALL signature hash data that are the same for every input, computed once per tx so signing
+// all inputs takes O(n) hashing for BIP143 instead of O(n^2)
+typedef struct {
+    int hashType;
+    UInt256 hashPrevouts, hashSequence, hashOutputs; // BIP143 hashes
+    uint8_t *legacy; // legacy serialization with every input script empty, to splice each signed input's script into
+    size_t legacyLen;
+    size_t scratchLen; // size of the buffer needed to splice an input's script into legacy, zero for BIP143
+    size_t *scriptOffs; // offset in legacy of each input's empty script varint
+} BRTxSigHashCache;
+
+// places an array of count items of itemSize bytes in arena, copying items if not NULL, and returns it marked as arena
+// owned, or returns NULL and only advances arena->off if arena->buf is NULL
+static void *_BRTxArenaArray(BRTxArena *arena, const void *items, size_t itemSize, size_t count)
+{
+    size_t *a;
+    
+    arena->off = (arena->off + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    a = (arena->buf) ? (size_t *)&arena->buf[arena->off] : NULL;
+    arena->off += sizeof(size_t)*2 + itemSize*count;
+    if (! a) return NULL;
+    a[0] = TX_ARENA_CAPACITY;
+    a[1] = count;
+    if (items && count > 0) memcpy(&a[2], items, itemSize*count);
+    return &a[2];
+}
+
 // returns a random number less than upperBound, for non-cryptographic use only
 uint32_t BRRand(uint32_t upperBound)
 {
@@ -62,7 +106,7 @@ void BRTxInputSetAddress(BRTxInput *input, const char *address)
 {
     assert(input != NULL);
     assert(address == NULL || BRAddressIsValid(address));
-    if (input->script) array_free(input->script);
+    if (input->script && ! _array_is_arena(input->script)) array_free(input->script);
     input->script = NULL;
     input->scriptLen = 0;
     memset(input->address, 0, sizeof(input->address));
@@ -80,7 +124,7 @@ void BRTxInputSetScript(BRTxInput *input, const uint8_t *script, size_t scriptLe
 {
     assert(input != NULL);
     assert(script != NULL || scriptLen == 0);
-    if (input->script) array_free(input->script);
+    if (input->script && ! _array_is_arena(input->script)) array_free(input->script);
     input->script = NULL;
     input->scriptLen = 0;
     memset(input->address, 0, sizeof(input->address));
@@ -97,7 +141,7 @@ void BRTxInputSetSignature(BRTxInput *input, const uint8_t *signature, size_t si
 {
     assert(input != NULL);
     assert(signature != NULL || sigLen == 0);
-    if (input->signature) array_free(input->signature);
+    if (input->signature && ! _array_is_arena(input->signature)) array_free(input->signature);
     input->signature = NULL;
     input->sigLen = 0;
     
@@ -135,7 +179,7 @@ void BRTxOutputSetAddress(BRTxOutput *output, const char *address)
 {
     assert(output != NULL);
     assert(address == NULL || BRAddressIsValid(address));
-    if (output->script) array_free(output->script);
+    if (output->script && ! _array_is_arena(output->script)) array_free(output->script);
     output->script = NULL;
     output->scriptLen = 0;
     memset(output->address, 0, sizeof(output->address));
@@ -152,7 +196,7 @@ void BRTxOutputSetAddress(BRTxOutput *output, const char *address)
 void BRTxOutputSetScript(BRTxOutput *output, const uint8_t *script, size_t scriptLen)
 {
     assert(output != NULL);
-    if (output->script) array_free(output->script);
+    if (output->script && ! _array_is_arena(output->script)) array_free(output->script);
     output->script = NULL;
     output->scriptLen = 0;
     memset(output->address, 0, sizeof(output->address));
@@ -182,64 +226,86 @@ static size_t _BRTransactionOutputData(const BRTransaction *tx, uint8_t *data, s
     return (! data || off <= dataLen) ? off : 0;
 }
 
-// writes the BIP143 witness program data that needs to be hashed and signed for the tx input at index
+// computes the BIP143 hashPrevouts, hashSequence and hashOutputs for cache->hashType, which are the same for all inputs
 // https://github.com/bitcoin/bips/blob/master/bip-0143.mediawiki
-// an index of SIZE_MAX will write the entire signed transaction
-// returns number of bytes written, or total len needed if data is NULL
-static size_t _BRTransactionWitnessData(const BRTransaction *tx, uint8_t *data, size_t dataLen, size_t index,
-                                        int hashType)
+// hashOutputs is left zero for SIGHASH_SINGLE since it depends on the input index
+static void _BRTxSigHashCacheWitnessHashes(BRTxSigHashCache *cache, const BRTransaction *tx)
 {
-    BRTxInput input;
-    int anyoneCanPay = (hashType & SIGHASH_ANYONECANPAY), sigHash = (hashType & 0x1f);
-    size_t i, off = 0;
-    
-    if (index >= tx->inCount) return 0;
-    if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], tx->version); // tx version
-    off += sizeof(uint32_t);
-    
+    int anyoneCanPay = (cache->hashType & SIGHASH_ANYONECANPAY), sigHash = (cache->hashType & 0x1f);
+    size_t i;
+
+    cache->hashPrevouts = cache->hashSequence = cache->hashOutputs = UINT256_ZERO;
+
     if (! anyoneCanPay) {
-        uint8_t buf[(sizeof(UInt256) + sizeof(uint32_t))*tx->inCount];
-        
+        uint8_t _buf[(tx->inCount <= 0x40) ? (sizeof(UInt256) + sizeof(uint32_t))*tx->inCount : 0],
+                *buf = (tx->inCount <= 0x40) ? _buf : malloc((sizeof(UInt256) + sizeof(uint32_t))*tx->inCount);
+
+        assert(buf != NULL || tx->inCount == 0);
+
         for (i = 0; i < tx->inCount; i++) {
             UInt256Set(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i], tx->inputs[i].txHash);
             UInt32SetLE(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i + sizeof(UInt256)], tx->inputs[i].index);
         }
-        
-        if (data && off + sizeof(UInt256) <= dataLen) BRSHA256_2(&data[off], buf, sizeof(buf)); // inputs hash
+
+        BRSHA256_2(&cache->hashPrevouts, buf, (sizeof(UInt256) + sizeof(uint32_t))*tx->inCount); // inputs hash
+
+        if (sigHash != SIGHASH_SINGLE && sigHash != SIGHASH_NONE) {
+            for (i = 0; i < tx->inCount; i++) UInt32SetLE(&buf[sizeof(uint32_t)*i], tx->inputs[i].sequence);
+            BRSHA256_2(&cache->hashSequence, buf, sizeof(uint32_t)*tx->inCount); // sequence hash
+        }
+
+        if (buf != _buf) free(buf);
+    }
+
+    if (sigHash != SIGHASH_SINGLE && sigHash != SIGHASH_NONE) {
+        size_t bufLen = _BRTransactionOutputData(tx, NULL, 0, SIZE_MAX);
+        uint8_t _buf[(bufLen <= 0x1000) ? bufLen : 0], *buf = (bufLen <= 0x1000) ? _buf : malloc(bufLen);
+
+        assert(buf != NULL || bufLen == 0);
+        bufLen = _BRTransactionOutputData(tx, buf, bufLen, SIZE_MAX);
+        BRSHA256_2(&cache->hashOutputs, buf, bufLen); // SIGHASH_ALL outputs hash
+        if (buf != _buf) free(buf);
     }
-    else if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], UINT256_ZERO); // anyone-can-pay
+}
+
+// writes the BIP143 witness program data that needs to be hashed and signed for the tx input at index
+// https://github.com/bitcoin/bips/blob/master/bip-0143.mediawiki
+// cache is optional, and if not NULL and for the same hashType, supplies the precomputed hashes shared by all inputs
+// returns number of bytes written, or total len needed if data is NULL
+static size_t _BRTransactionWitnessData(const BRTransaction *tx, uint8_t *data, size_t dataLen, size_t index,
+                                        int hashType, const BRTxSigHashCache *cache)
+{
+    BRTxSigHashCache _cache;
+    BRTxInput input;
+    int sigHash = (hashType & 0x1f);
+    size_t off = 0;
     
-    off += sizeof(UInt256);
+    if (index >= tx->inCount) return 0;
     
-    if (! anyoneCanPay && sigHash != SIGHASH_SINGLE && sigHash != SIGHASH_NONE) {
-        uint8_t buf[sizeof(uint32_t)*tx->inCount];
-        
-        for (i = 0; i < tx->inCount; i++) UInt32SetLE(&buf[sizeof(uint32_t)*i], tx->inputs[i].sequence);
-        if (data && off + sizeof(UInt256) <= dataLen) BRSHA256_2(&data[off], buf, sizeof(buf)); // sequence hash
+    if (! cache || cache->hashType != hashType) {
+        _cache.hashType = hashType;
+        if (data) _BRTxSigHashCacheWitnessHashes(&_cache, tx); // the hashes aren't needed if only measuring length
+        cache = &_cache;
     }
-    else if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], UINT256_ZERO);
     
+    if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], tx->version); // tx version
+    off += sizeof(uint32_t);
+    if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], cache->hashPrevouts); // inputs hash
+    off += sizeof(UInt256);
+    if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], cache->hashSequence); // sequence hash
     off += sizeof(UInt256);
     input = tx->inputs[index];
     input.signature = input.script; // TODO: handle OP_CODESEPARATOR
     input.sigLen = input.scriptLen;
     off += _BRTxInputData(&input, (data ? &data[off] : NULL), (off <= dataLen ? dataLen - off : 0));
     
-    if (sigHash != SIGHASH_SINGLE && sigHash != SIGHASH_NONE) {
-        size_t bufLen = _BRTransactionOutputData(tx, NULL, 0, SIZE_MAX);
-        uint8_t _buf[(bufLen <= 0x1000) ? bufLen : 0], *buf = (bufLen <= 0x1000) ? _buf : malloc(bufLen);
-        
-        bufLen = _BRTransactionOutputData(tx, buf, bufLen, SIZE_MAX);
-        if (data && off + sizeof(UInt256) <= dataLen) BRSHA256_2(&data[off], buf, bufLen); // SIGHASH_ALL outputs hash
-        if (buf != _buf) free(buf);
-    }
-    else if (sigHash == SIGHASH_SINGLE && index < tx->outCount) {
+    if (sigHash == SIGHASH_SINGLE && index < tx->outCount) {
         uint8_t buf[_BRTransactionOutputData(tx, NULL, 0, index)];
         size_t bufLen = _BRTransactionOutputData(tx, buf, sizeof(buf), index);
         
         if (data && off + sizeof(UInt256) <= dataLen) BRSHA256_2(&data[off], buf, bufLen); //SIGHASH_SINGLE outputs hash
     }
-    else if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], UINT256_ZERO); // SIGHASH_NONE
+    else if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], cache->hashOutputs); // zero if NONE
     
     off += sizeof(UInt256);
     if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], tx->lockTime); // locktime
@@ -258,7 +324,7 @@ static size_t _BRTransactionData(const BRTransaction *tx, uint8_t *data, size_t
     int anyoneCanPay = (hashType & SIGHASH_ANYONECANPAY), sigHash = (hashType & 0x1f);
     size_t i, off = 0;
     
-    if (hashType & SIGHASH_FORKID) return _BRTransactionWitnessData(tx, data, dataLen, index, hashType);
+    if (hashType & SIGHASH_FORKID) return _BRTransactionWitnessData(tx, data, dataLen, index, hashType, NULL);
     if (anyoneCanPay && index >= tx->inCount) return 0;
     if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], tx->version); // tx version
     off += sizeof(uint32_t);
@@ -321,6 +387,98 @@ static size_t _BRTransactionData(const BRTransaction *tx, uint8_t *data, size_t
     return (! data || off <= dataLen) ? off : 0;
 }
 
+// prepares cache for signing the inputs of tx with hashType, which must be SIGHASH_ALL or SIGHASH_FORKID | SIGHASH_ALL,
+// signatures may be added to tx afterward since SIGHASH_ALL data doesn't include them, but nothing else may change
+static void _BRTxSigHashCacheInit(BRTxSigHashCache *cache, const BRTransaction *tx, int hashType)
+{
+    size_t i, off = 0, maxScriptLen = 0;
+
+    assert((hashType & ~SIGHASH_FORKID) == SIGHASH_ALL);
+    memset(cache, 0, sizeof(*cache));
+    cache->hashType = hashType;
+
+    if (hashType & SIGHASH_FORKID) {
+        _BRTxSigHashCacheWitnessHashes(cache, tx);
+        return;
+    }
+
+    // for legacy SIGHASH_ALL, every input's script but the one being signed is empty, so serialize the tx once that
+    // way, and only splice in the one script for each input
+    for (i = 0; i < tx->inCount; i++) {
+        if (tx->inputs[i].scriptLen > maxScriptLen) maxScriptLen = tx->inputs[i].scriptLen;
+    }
+
+    cache->legacyLen = sizeof(uint32_t) + BRVarIntSize(tx->inCount) +
+                       (sizeof(UInt256) + sizeof(uint32_t) + 1 + sizeof(uint32_t))*tx->inCount +
+                       BRVarIntSize(tx->outCount) + _BRTransactionOutputData(tx, NULL, 0, SIZE_MAX) + sizeof(uint32_t) +
+                       sizeof(uint32_t);
+    cache->scratchLen = cache->legacyLen + BRVarIntSize(maxScriptLen) + maxScriptLen;
+    cache->legacy = malloc(cache->legacyLen);
+    cache->scriptOffs = malloc((tx->inCount ? tx->inCount : 1)*sizeof(*cache->scriptOffs));
+    assert(cache->legacy != NULL);
+    assert(cache->scriptOffs != NULL);
+    UInt32SetLE(&cache->legacy[off], tx->version); // tx version
+    off += sizeof(uint32_t);
+    off += BRVarIntSet(&cache->legacy[off], cache->legacyLen - off, tx->inCount);
+
+    for (i = 0; i < tx->inCount; i++) { // inputs, with empty scripts
+        UInt256Set(&cache->legacy[off], tx->inputs[i].txHash);
+        off += sizeof(UInt256);
+        UInt32SetLE(&cache->legacy[off], tx->inputs[i].index);
+        off += sizeof(uint32_t);
+        cache->scriptOffs[i] = off;
+        cache->legacy[off++] = 0;
+        UInt32SetLE(&cache->legacy[off], tx->inputs[i].sequence);
+        off += sizeof(uint32_t);
+    }
+
+    off += BRVarIntSet(&cache->legacy[off], cache->legacyLen - off, tx->outCount); // SIGHASH_ALL outputs
+    off += _BRTransactionOutputData(tx, &cache->legacy[off], cache->legacyLen - off, SIZE_MAX);
+    UInt32SetLE(&cache->legacy[off], tx->lockTime); // locktime
+    off += sizeof(uint32_t);
+    UInt32SetLE(&cache->legacy[off], (uint32_t)hashType); // hash type
+    off += sizeof(uint32_t);
+    assert(off == cache->legacyLen);
+}
+
+// returns the signature hash for the tx input at index, using the parts of the data precomputed in cache
+// scratch must point to a buffer of cache->scratchLen bytes, so that inputs can be hashed concurrently
+static UInt256 _BRTxSigHashCacheDigest(const BRTxSigHashCache *cache, const BRTransaction *tx, size_t index,
+                                       uint8_t *scratch)
+{
+    const BRTxInput *input = &tx->inputs[index];
+    UInt256 md = UINT256_ZERO;
+    size_t off, len;
+
+    assert(index < tx->inCount);
+
+    if (cache->hashType & SIGHASH_FORKID) {
+        uint8_t data[_BRTransactionWitnessData(tx, NULL, 0, index, cache->hashType, cache)];
+
+        len = _BRTransactionWitnessData(tx, data, sizeof(data), index, cache->hashType, cache);
+        BRSHA256_2(&md, data, len);
+    }
+    else {
+        off = cache->scriptOffs[index];
+        assert(scratch != NULL);
+        memcpy(scratch, cache->legacy, off);
+        len = off + BRVarIntSet(&scratch[off], cache->scratchLen - off, input->scriptLen);
+        memcpy(&scratch[len], input->script, input->scriptLen); // TODO: handle OP_CODESEPARATOR
+        len += input->scriptLen;
+        memcpy(&scratch[len], &cache->legacy[off + 1], cache->legacyLen - (off + 1));
+        len += cache->legacyLen - (off + 1);
+        BRSHA256_2(&md, scratch, len);
+    }
+
+    return md;
+}
+
+static void _BRTxSigHashCacheFree(BRTxSigHashCache *cache)
+{
+    if (cache->legacy) free(cache->legacy);
+    if (cache->scriptOffs) free(cache->scriptOffs);
+}
+
 // returns a newly allocated empty transaction that must be freed by calling BRTransactionFree()
 BRTransaction *BRTransactionNew(void)
 {
@@ -335,94 +493,230 @@ BRTransaction *BRTransactionNew(void)
     return tx;
 }
 
+// places the inputs and outputs of tx and all their scripts and signatures in arena, and points cpy at them
+static void _BRTransactionArenaLayout(BRTxArena *arena, BRTransaction *cpy, const BRTransaction *tx)
+{
+    BRTxInput *inputs = _BRTxArenaArray(arena, tx->inputs, sizeof(*inputs), tx->inCount), *in;
+    BRTxOutput *outputs;
+    uint8_t *data;
+    size_t i;
+    
+    for (i = 0; i < tx->inCount; i++) {
+        in = &tx->inputs[i];
+        data = (in->script) ? _BRTxArenaArray(arena, in->script, 1, in->scriptLen) : NULL;
+        if (inputs) inputs[i].script = data;
+        data = (in->signature) ? _BRTxArenaArray(arena, in->signature, 1, in->sigLen) : NULL;
+        if (inputs) inputs[i].signature = data;
+    }
+    
+    outputs = _BRTxArenaArray(arena, tx->outputs, sizeof(*outputs), tx->outCount);
+    
+    for (i = 0; i < tx->outCount; i++) {
+        data = (tx->outputs[i].script) ?
+               _BRTxArenaArray(arena, tx->outputs[i].script, 1, tx->outputs[i].scriptLen) : NULL;
+        if (outputs) outputs[i].script = data;
+    }
+    
+    if (cpy) cpy->inputs = inputs, cpy->outputs = outputs;
+}
+
 // returns a deep copy of tx and that must be freed by calling BRTransactionFree()
 BRTransaction *BRTransactionCopy(const BRTransaction *tx)
 {
-    BRTransaction *cpy = BRTransactionNew();
-    BRTxInput *inputs = cpy->inputs;
-    BRTxOutput *outputs = cpy->outputs;
+    BRTxArena arena = { NULL, sizeof(*tx) };
+    BRTransaction *cpy;
+    
     assert(tx != NULL);
+    _BRTransactionArenaLayout(&arena, NULL, tx); // measure
+    cpy = calloc(1, arena.off);
+    assert(cpy != NULL);
     *cpy = *tx;
-    cpy->inputs = inputs;
-    cpy->outputs = outputs;
-    cpy->inCount = cpy->outCount = 0;
-
-    for (size_t i = 0; i < tx->inCount; i++) {
-        BRTransactionAddInput(cpy, tx->inputs[i].txHash, tx->inputs[i].index, tx->inputs[i].amount,
-                              tx->inputs[i].script, tx->inputs[i].scriptLen,
-                              tx->inputs[i].signature, tx->inputs[i].sigLen, tx->inputs[i].sequence);
-    }
-    for (size_t i = 0; i < tx->outCount; i++) {
-        BRTransactionAddOutput(cpy, tx->outputs[i].amount, tx->outputs[i].script, tx->outputs[i].scriptLen);
-    }
-
+    arena.buf = (uint8_t *)cpy;
+    arena.off = sizeof(*cpy);
+    _BRTransactionArenaLayout(&arena, cpy, tx);
     return cpy;
 }
 
-// buf must contain a serialized tx
-// retruns a transaction that must be freed by calling BRTransactionFree()
-BRTransaction *BRTransactionParse(const uint8_t *buf, size_t bufLen)
+// indexes the serialized tx in buf into view, returns true if buf contains a complete, well formed tx
+int BRTransactionViewInit(BRTransactionView *view, const uint8_t *buf, size_t bufLen)
 {
-    assert(buf != NULL || bufLen == 0);
-    if (! buf) return NULL;
-    
     int isSigned = 1;
     size_t i, off = 0, sLen = 0, len = 0;
-    BRTransaction *tx = BRTransactionNew();
-    BRTxInput *input;
-    BRTxOutput *output;
     
-    tx->version = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
+    assert(view != NULL);
+    assert(buf != NULL || bufLen == 0);
+    if (! buf || bufLen < sizeof(uint32_t)) return 0;
+    memset(view, 0, sizeof(*view));
+    view->buf = buf;
+    view->version = UInt32GetLE(&buf[off]);
     off += sizeof(uint32_t);
-    tx->inCount = (size_t)BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+    view->inCount = (size_t)BRVarInt(&buf[off], bufLen - off, &len);
     off += len;
-    array_set_count(tx->inputs, tx->inCount);
+    view->inOff = off;
+    if (view->inCount == 0 || off > bufLen || view->inCount > (bufLen - off)/41) return 0; // inputs are >= 41 bytes
     
-    for (i = 0; off <= bufLen && i < tx->inCount; i++) {
-        input = &tx->inputs[i];
-        input->txHash = (off + sizeof(UInt256) <= bufLen) ? UInt256Get(&buf[off]) : UINT256_ZERO;
-        off += sizeof(UInt256);
-        input->index = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
-        off += sizeof(uint32_t);
-        sLen = (size_t)BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+    for (i = 0; i < view->inCount; i++) {
+        off += sizeof(UInt256) + sizeof(uint32_t);
+        if (off > bufLen) return 0;
+        sLen = (size_t)BRVarInt(&buf[off], bufLen - off, &len);
         off += len;
+        if (off > bufLen || sLen > bufLen - off) return 0; // a hostile script length mustn't wrap off around
         
-        if (off + sLen <= bufLen && BRAddressFromScriptPubKey(NULL, 0, &buf[off], sLen) > 0) {
-            BRTxInputSetScript(input, &buf[off], sLen);
-            input->amount = (off + sLen + sizeof(uint64_t) <= bufLen) ? UInt64GetLE(&buf[off + sLen]) : 0;
+        if (BRAddressFromScriptPubKey(NULL, 0, &buf[off], sLen) > 0) {
             off += sizeof(uint64_t);
             isSigned = 0;
         }
-        else if (off + sLen <= bufLen) BRTxInputSetSignature(input, &buf[off], sLen);
         
-        off += sLen;
-        input->sequence = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
-        off += sizeof(uint32_t);
+        off += sLen + sizeof(uint32_t);
     }
     
-    tx->outCount = (size_t)BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+    if (off > bufLen) return 0;
+    view->outCount = (size_t)BRVarInt(&buf[off], bufLen - off, &len);
     off += len;
-    array_set_count(tx->outputs, tx->outCount);
+    view->outOff = off;
+    if (off > bufLen || view->outCount > (bufLen - off)/9) return 0; // outputs are at least 9 bytes
     
-    for (i = 0; off <= bufLen && i < tx->outCount; i++) {
-        output = &tx->outputs[i];
-        output->amount = (off + sizeof(uint64_t) <= bufLen) ? UInt64GetLE(&buf[off]) : 0;
+    for (i = 0; i < view->outCount; i++) {
         off += sizeof(uint64_t);
-        sLen = (size_t)BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
+        if (off > bufLen) return 0;
+        sLen = (size_t)BRVarInt(&buf[off], bufLen - off, &len);
         off += len;
-        if (off + sLen <= bufLen) BRTxOutputSetScript(output, &buf[off], sLen);
+        if (off > bufLen || sLen > bufLen - off) return 0;
         off += sLen;
     }
     
-    tx->lockTime = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
+    if (off > bufLen || bufLen - off < sizeof(uint32_t)) return 0;
+    view->lockTime = UInt32GetLE(&buf[off]);
     off += sizeof(uint32_t);
+    view->len = off;
+    if (isSigned) BRSHA256_2(&view->txHash, buf, off);
+    return 1;
+}
+
+// reads the input at offset *off into input and advances *off to the next input, start with *off = view->inOff
+void BRTransactionViewInput(const BRTransactionView *view, size_t *off, BRTxInputView *input)
+{
+    const uint8_t *buf = view->buf;
+    size_t o = *off, sLen, len = 0;
+    
+    assert(view != NULL);
+    assert(off != NULL && *off < view->len);
+    assert(input != NULL);
+    memset(input, 0, sizeof(*input));
+    input->txHash = UInt256Get(&buf[o]);
+    o += sizeof(UInt256);
+    input->index = UInt32GetLE(&buf[o]);
+    o += sizeof(uint32_t);
+    sLen = (size_t)BRVarInt(&buf[o], view->len - o, &len);
+    o += len;
+    
+    if (BRAddressFromScriptPubKey(NULL, 0, &buf[o], sLen) > 0) {
+        input->script = &buf[o];
+        input->scriptLen = sLen;
+        input->amount = UInt64GetLE(&buf[o + sLen]);
+        o += sizeof(uint64_t);
+    }
+    else {
+        input->signature = &buf[o];
+        input->sigLen = sLen;
+    }
+    
+    o += sLen;
+    input->sequence = UInt32GetLE(&buf[o]);
+    *off = o + sizeof(uint32_t);
+}
+
+// reads the output at offset *off into output and advances *off to the next output, start with *off = view->outOff
+void BRTransactionViewOutput(const BRTransactionView *view, size_t *off, BRTxOutputView *output)
+{
+    const uint8_t *buf = view->buf;
+    size_t o = *off, len = 0;
+    
+    assert(view != NULL);
+    assert(off != NULL && *off < view->len);
+    assert(output != NULL);
+    output->amount = UInt64GetLE(&buf[o]);
+    o += sizeof(uint64_t);
+    output->scriptLen = (size_t)BRVarInt(&buf[o], view->len - o, &len);
+    o += len;
+    output->script = &buf[o];
+    *off = o + output->scriptLen;
+}
+
+// buf must contain a serialized tx
+// retruns a transaction that must be freed by calling BRTransactionFree()
+BRTransaction *BRTransactionParse(const uint8_t *buf, size_t bufLen)
+{
+    BRTransactionView view;
+    BRTxArena arena = { NULL, sizeof(BRTransaction) };
+    BRTransaction *tx;
+    BRTxInputView in;
+    BRTxOutputView out;
+    size_t i, off;
+    
+    assert(buf != NULL || bufLen == 0);
+    if (! BRTransactionViewInit(&view, buf, bufLen)) return NULL;
+    
+    // first pass measures the space needed so the tx and all its scripts can be parsed into a single allocation
+    _BRTxArenaArray(&arena, NULL, sizeof(BRTxInput), view.inCount);
     
-    if (tx->inCount == 0 || off > bufLen) {
-        BRTransactionFree(tx);
-        tx = NULL;
+    for (i = 0, off = view.inOff; i < view.inCount; i++) {
+        BRTransactionViewInput(&view, &off, &in);
+        _BRTxArenaArray(&arena, NULL, 1, (in.script) ? in.scriptLen : in.sigLen);
     }
-    else if (isSigned) BRSHA256_2(&tx->txHash, buf, off);
     
+    _BRTxArenaArray(&arena, NULL, sizeof(BRTxOutput), view.outCount);
+    
+    for (i = 0, off = view.outOff; i < view.outCount; i++) {
+        BRTransactionViewOutput(&view, &off, &out);
+        _BRTxArenaArray(&arena, NULL, 1, out.scriptLen);
+    }
+    
+    tx = calloc(1, arena.off);
+    assert(tx != NULL);
+    arena.buf = (uint8_t *)tx;
+    arena.off = sizeof(*tx);
+    tx->txHash = view.txHash;
+    tx->version = view.version;
+    tx->inCount = view.inCount;
+    tx->inputs = _BRTxArenaArray(&arena, NULL, sizeof(*tx->inputs), tx->inCount);
+    
+    for (i = 0, off = view.inOff; i < tx->inCount; i++) {
+        BRTxInput *input = &tx->inputs[i];
+        
+        BRTransactionViewInput(&view, &off, &in);
+        input->txHash = in.txHash;
+        input->index = in.index;
+        input->sequence = in.sequence;
+        
+        if (in.script) {
+            input->script = _BRTxArenaArray(&arena, in.script, 1, in.scriptLen);
+            input->scriptLen = in.scriptLen;
+            input->amount = in.amount;
+            BRAddressFromScriptPubKey(input->address, sizeof(input->address), in.script, in.scriptLen);
+        }
+        else {
+            input->signature = _BRTxArenaArray(&arena, in.signature, 1, in.sigLen);
+            input->sigLen = in.sigLen;
+            BRAddressFromScriptSig(input->address, sizeof(input->address), in.signature, in.sigLen);
+        }
+    }
+    
+    tx->outCount = view.outCount;
+    tx->outputs = _BRTxArenaArray(&arena, NULL, sizeof(*tx->outputs), tx->outCount);
+    
+    for (i = 0, off = view.outOff; i < tx->outCount; i++) {
+        BRTxOutput *output = &tx->outputs[i];
+        
+        BRTransactionViewOutput(&view, &off, &out);
+        output->amount = out.amount;
+        output->script = _BRTxArenaArray(&arena, out.script, 1, out.scriptLen);
+        output->scriptLen = out.scriptLen;
+        BRAddressFromScriptPubKey(output->address, sizeof(output->address), out.script, out.scriptLen);
+    }
+    
+    tx->lockTime = view.lockTime;
+    tx->blockHeight = TX_UNCONFIRMED;
     return tx;
 }
 
@@ -449,6 +743,16 @@ void BRTransactionAddInput(BRTransaction *tx, UInt256 txHash, uint32_t index, ui
     if (tx) {
         if (script) BRTxInputSetScript(&input, script, scriptLen);
         if (signature) BRTxInputSetSignature(&input, signature, sigLen);
+        
+        if (_array_is_arena(tx->inputs)) { // move inputs out of the flattened tx allocation so they can grow
+            BRTxInput *inputs;
+            
+            array_new(inputs, tx->inCount + 1);
+            memcpy(inputs, tx->inputs, tx->inCount*sizeof(*inputs));
+            array_set_count(inputs, tx->inCount);
+            tx->inputs = inputs;
+        }
+        
         array_add(tx->inputs, input);
         tx->inCount = array_count(tx->inputs);
     }
@@ -464,6 +768,16 @@ void BRTransactionAddOutput(BRTransaction *tx, uint64_t amount, const uint8_t *s
     
     if (tx) {
         BRTxOutputSetScript(&output, script, scriptLen);
+        
+        if (_array_is_arena(tx->outputs)) { // move outputs out of the flattened tx allocation so they can grow
+            BRTxOutput *outputs;
+            
+            array_new(outputs, tx->outCount + 1);
+            memcpy(outputs, tx->outputs, tx->outCount*sizeof(*outputs));
+            array_set_count(outputs, tx->outCount);
+            tx->outputs = outputs;
+        }
+        
         array_add(tx->outputs, output);
         tx->outCount = array_count(tx->outputs);
     }
@@ -530,61 +844,107 @@ int BRTransactionIsSigned(const BRTransaction *tx)
     return (tx) ? 1 : 0;
 }
 
+typedef struct {
+    BRTransaction *tx;
+    int forkId;
+    BRKey *keys;
+    BRAddress *addrs;
+    const BRTxSigHashCache *cache;
+    const size_t *inputs; // index of each input to sign
+    const size_t *inputKeys; // index in keys of the key for each input to sign
+    int signing; // false while deriving key addresses, true while signing inputs
+} BRSignBatch;
+
+static void _BRSignInput(BRSignBatch *batch, size_t inputIdx, BRKey *key, uint8_t *scratch)
+{
+    BRTxInput *input = &batch->tx->inputs[inputIdx];
+    const uint8_t *elems[BRScriptElements(NULL, 0, input->script, input->scriptLen)];
+    size_t elemsCount = BRScriptElements(elems, sizeof(elems)/sizeof(*elems), input->script, input->scriptLen);
+    uint8_t pubKey[BRKeyPubKey(key, NULL, 0)];
+    size_t pkLen = BRKeyPubKey(key, pubKey, sizeof(pubKey));
+    uint8_t sig[73], script[1 + sizeof(sig) + 1 + sizeof(pubKey)];
+    size_t sigLen, scriptLen;
+    UInt256 md = _BRTxSigHashCacheDigest(batch->cache, batch->tx, inputIdx, scratch);
+
+    sigLen = BRKeySign(key, sig, sizeof(sig) - 1, md);
+    sig[sigLen++] = batch->forkId | SIGHASH_ALL;
+    scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
+
+    if (elemsCount >= 2 && *elems[elemsCount - 2] == OP_EQUALVERIFY) { // pay-to-pubkey-hash
+        scriptLen += BRScriptPushData(&script[scriptLen], sizeof(script) - scriptLen, pubKey, pkLen);
+    }
+
+    BRTxInputSetSignature(input, script, scriptLen); // pay-to-pubkey only needs the signature
+}
+
+static void _signWorker(void *info, BRWorkPool *pool)
+{
+    BRSignBatch *batch = info;
+    uint8_t *scratch = NULL;
+    size_t i, j, n;
+
+    if (batch->signing && batch->cache->scratchLen > 0) { // each worker needs its own legacy splice buffer
+        scratch = malloc(batch->cache->scratchLen);
+        assert(scratch != NULL);
+    }
+
+    while ((n = BRWorkPoolNext(pool, &i)) > 0) {
+        for (j = i; j < i + n; j++) {
+            if (batch->signing) {
+                _BRSignInput(batch, batch->inputs[j], &batch->keys[batch->inputKeys[j]], scratch);
+            }
+            else if (! BRKeyAddress(&batch->keys[j], batch->addrs[j].s, sizeof(batch->addrs[j]))) {
+                batch->addrs[j] = BR_ADDRESS_NONE; // this also caches each key's pubKey for the signing pass
+            }
+        }
+    }
+
+    if (scratch) free(scratch);
+}
+
 // adds signatures to any inputs with NULL signatures that can be signed with any keys
 // forkId is 0 for bitcoin, 0x40 for b-cash, 0x4f for b-gold
+// key addresses and input signatures are calculated in parallel using a pool of worker threads for large transactions
 // returns true if tx is signed
 int BRTransactionSign(BRTransaction *tx, int forkId, BRKey keys[], size_t keysCount)
 {
     BRAddress addrs[keysCount], address;
-    size_t i, j;
+    BRTxSigHashCache cache;
+    BRSignBatch batch;
+    size_t i, j, count = 0, inputs[(tx) ? tx->inCount : 0], inputKeys[(tx) ? tx->inCount : 0];
     
     assert(tx != NULL);
     assert(keys != NULL || keysCount == 0);
+    if (! tx) return 0;
+    memset(&batch, 0, sizeof(batch));
+    batch.tx = tx;
+    batch.forkId = forkId;
+    batch.keys = keys;
+    batch.addrs = addrs;
+    BRWorkPoolRun(keysCount, SIGN_BATCH_SIZE, SIGN_MAX_THREADS, &batch, _signWorker);
     
-    for (i = 0; tx && i < keysCount; i++) {
-        if (! BRKeyAddress(&keys[i], addrs[i].s, sizeof(addrs[i]))) addrs[i] = BR_ADDRESS_NONE;
-    }
-    
-    for (i = 0; tx && i < tx->inCount; i++) {
+    for (i = 0; i < tx->inCount; i++) {
         BRTxInput *input = &tx->inputs[i];
         
         if (! BRAddressFromScriptPubKey(address.s, sizeof(address), input->script, input->scriptLen)) continue;
         j = 0;
         while (j < keysCount && ! BRAddressEq(&addrs[j], &address)) j++;
         if (j >= keysCount) continue;
-        
-        const uint8_t *elems[BRScriptElements(NULL, 0, input->script, input->scriptLen)];
-        size_t elemsCount = BRScriptElements(elems, sizeof(elems)/sizeof(*elems), input->script, input->scriptLen);
-        uint8_t pubKey[BRKeyPubKey(&keys[j], NULL, 0)];
-        size_t pkLen = BRKeyPubKey(&keys[j], pubKey, sizeof(pubKey));
-        uint8_t sig[73], script[1 + sizeof(sig) + 1 + sizeof(pubKey)];
-        size_t sigLen, scriptLen;
-        UInt256 md = UINT256_ZERO;
-        
-        if (elemsCount >= 2 && *elems[elemsCount - 2] == OP_EQUALVERIFY) { // pay-to-pubkey-hash
-            uint8_t data[_BRTransactionData(tx, NULL, 0, i, forkId | SIGHASH_ALL)];
-            size_t dataLen = _BRTransactionData(tx, data, sizeof(data), i, forkId | SIGHASH_ALL);
-            
-            BRSHA256_2(&md, data, dataLen);
-            sigLen = BRKeySign(&keys[j], sig, sizeof(sig) - 1, md);
-            sig[sigLen++] = forkId | SIGHASH_ALL;
-            scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
-            scriptLen += BRScriptPushData(&script[scriptLen], sizeof(script) - scriptLen, pubKey, pkLen);
-            BRTxInputSetSignature(input, script, scriptLen);
-        }
-        else { // pay-to-pubkey
-            uint8_t data[_BRTransactionData(tx, NULL, 0, i, forkId | SIGHASH_ALL)];
-            size_t dataLen = _BRTransactionData(tx, data, sizeof(data), i, forkId | SIGHASH_ALL);
-            
-            BRSHA256_2(&md, data, dataLen);
-            sigLen = BRKeySign(&keys[j], sig, sizeof(sig) - 1, md);
-            sig[sigLen++] = forkId | SIGHASH_ALL;
-            scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
-            BRTxInputSetSignature(input, script, scriptLen);
-        }
+        inputs[count] = i;
+        inputKeys[count++] = j;
     }
     
-    if (tx && BRTransactionIsSigned(tx)) {
+    if (count > 0) { // the parts of the signature hash data shared by all inputs are only computed once
+        _BRTxSigHashCacheInit(&cache, tx, forkId | SIGHASH_ALL);
+        batch.cache = &cache;
+        batch.inputs = inputs;
+        batch.inputKeys = inputKeys;
+        batch.signing = 1;
+        BRWorkPoolRun(count, SIGN_BATCH_SIZE, SIGN_MAX_THREADS, &batch, _signWorker);
+        _BRTxSigHashCacheFree(&cache);
+    }
+    
+    if (BRTransactionIsSigned(tx)) {
         uint8_t data[_BRTransactionData(tx, NULL, 0, SIZE_MAX, 0)];
         size_t len = _BRTransactionData(tx, data, sizeof(data), SIZE_MAX, 0);
         
@@ -619,8 +979,53 @@ void BRTransactionFree(BRTransaction *tx)
             BRTxOutputSetScript(&tx->outputs[i], NULL, 0);
         }
 
-        array_free(tx->outputs);
-        array_free(tx->inputs);
-        free(tx);
+        if (! _array_is_arena(tx->outputs)) array_free(tx->outputs);
+        if (! _array_is_arena(tx->inputs)) array_free(tx->inputs);
+        free(tx); // for a flattened tx, this also frees any arena arrays
     }
 }
+
+// true if every input's cached signature hash matches the uncached one, hashType must be SIGHASH_ALL or FORKID
+int BRTransactionSigHashCacheTest(const BRTransaction *tx, int hashType)
+{
+    BRTxSigHashCache cache;
+    uint8_t *scratch = NULL;
+    UInt256 md1, md2;
+    size_t i, len;
+    int r = 1;
+
+    assert(tx != NULL);
+    assert((hashType & SIGHASH_FORKID) || hashType == SIGHASH_ALL);
+    memset(&cache, 0, sizeof(cache));
+
+    if ((hashType & ~SIGHASH_FORKID) == SIGHASH_ALL) {
+        _BRTxSigHashCacheInit(&cache, tx, hashType);
+        scratch = malloc(cache.scratchLen + 1);
+        assert(scratch != NULL);
+    }
+    else { // _BRTxSigHashCacheInit() only takes SIGHASH_ALL, but the BIP143 shared hashes work for any hashType
+        cache.hashType = hashType;
+        _BRTxSigHashCacheWitnessHashes(&cache, tx);
+    }
+
+    for (i = 0; r && i < tx->inCount; i++) {
+        uint8_t data[_BRTransactionData(tx, NULL, 0, i, hashType)];
+
+        len = _BRTransactionData(tx, data, sizeof(data), i, hashType);
+        BRSHA256_2(&md1, data, len);
+
+        if (scratch) md2 = _BRTxSigHashCacheDigest(&cache, tx, i, scratch);
+        else {
+            uint8_t wdata[_BRTransactionWitnessData(tx, NULL, 0, i, hashType, &cache)];
+
+            len = _BRTransactionWitnessData(tx, wdata, sizeof(wdata), i, hashType, &cache);
+            BRSHA256_2(&md2, wdata, len);
+        }
+
+        if (! UInt256Eq(md1, md2)) r = 0;
+    }
+
+    if (scratch) free(scratch);
+    _BRTxSigHashCacheFree(&cache);
+    return r;
+}
@@ -95,6 +95,46 @@ typedef struct {
     uint32_t timestamp; // time interval since unix epoch
 } BRTransaction;
 
+// read-only views of a serialized transaction that point into the original buffer without copying anything, useful for
+// deciding if a transaction is relevant before paying for a full BRTransactionParse()
+typedef struct {
+    const uint8_t *buf; // serialized tx, must remain valid while the view is in use
+    size_t len; // length of the serialized tx
+    UInt256 txHash; // zero if any inputs are unsigned, same as BRTransactionParse()
+    uint32_t version;
+    size_t inCount;
+    size_t inOff; // offset of the first input in buf
+    size_t outCount;
+    size_t outOff; // offset of the first output in buf
+    uint32_t lockTime;
+} BRTransactionView;
+
+typedef struct {
+    UInt256 txHash;
+    uint32_t index;
+    uint64_t amount; // only present for unsigned inputs
+    const uint8_t *script; // only present for unsigned inputs, otherwise NULL
+    size_t scriptLen;
+    const uint8_t *signature; // NULL for unsigned inputs
+    size_t sigLen;
+    uint32_t sequence;
+} BRTxInputView;
+
+typedef struct {
+    uint64_t amount;
+    const uint8_t *script;
+    size_t scriptLen;
+} BRTxOutputView;
+
+// indexes the serialized tx in buf into view, returns true if buf contains a complete, well formed tx
+int BRTransactionViewInit(BRTransactionView *view, const uint8_t *buf, size_t bufLen);
+
+// reads the input at offset *off into input and advances *off to the next input, start with *off = view->inOff
+void BRTransactionViewInput(const BRTransactionView *view, size_t *off, BRTxInputView *input);
+
+// reads the output at offset *off into output and advances *off to the next output, start with *off = view->outOff
+void BRTransactionViewOutput(const BRTransactionView *view, size_t *off, BRTxOutputView *output);
+
 // returns a newly allocated empty transaction that must be freed by calling BRTransactionFree()
 BRTransaction *BRTransactionNew(void);
 
@@ -25,7 +25,10 @@
 #include "BRWallet.h"
 #include "BRSet.h"
 #include "BRAddress.h"
+#include "BRCrypto.h"
 #include "BRArray.h"
+#include "BRMap.h"
+#include "BRWorkPool.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -33,14 +36,34 @@
 #include <pthread.h>
 #include <assert.h>
 
+#define ADDR_RESTORE_BATCH  1024 // maximum number of addresses derived at once when restoring a wallet
+#define ADDR_BATCH_SIZE     128  // number of addresses an address derivation worker thread derives at a time
+#define ADDR_MAX_THREADS    8    // maximum number of threads, including the caller, deriving addresses
+#define COIN_SELECT_TRIES   100000 // maximum number of branches visited searching for a coin selection with no change
+#define SNAPSHOT_MAGIC      0x53575242 // "BRWS"
+#define SNAPSHOT_TX_INVALID 0x01 // snapshot tx record flag for a tx in invalidTx
+#define SNAPSHOT_TX_PENDING 0x02 // snapshot tx record flag for a tx in pendingTx
+
+map_define(BRUTXOAmountMap, BRUTXO, uint64_t, BRUTXOHash, BRUTXOEq);
+map_define(BRTxIndexMap, UInt256, size_t, BRUInt256Hash, BRUInt256Eq);
+map_define(BRScriptHashMap, BRScriptHash, uint32_t, BRScriptHashHash, BRScriptHashEq);
+
+typedef struct {
+    BRUTXO utxo;
+    uint64_t amount;
+} BRUTXOCoin;
+
 struct BRWalletStruct {
     uint64_t balance, totalSent, totalReceived, feePerKb, *balanceHist;
     uint32_t blockHeight;
     BRUTXO *utxos;
+    BRUTXOAmountMap *utxoAmounts; // amount of each output in utxos
+    BRUTXOCoin *utxoCoins; // utxos with their amounts, sorted by descending amount, emptied whenever utxos changes
     BRTransaction **transactions;
-    BRMasterPubKey masterPubKey;
-    BRAddress *internalChain, *externalChain;
-    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedAddrs, *allAddrs;
+    BRMasterPubKey masterPubKey, chainPubKey[2]; // chainPubKey caches N(m/0H/0) and N(m/0H/1)
+    BRScriptHash *internalChain, *externalChain; // addresses are only base58 encoded when they're returned
+    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs;
+    BRScriptHashMap *usedAddrs, *allAddrs; // allAddrs maps each chain address to its chain index << 1 | internal
     void *callbackInfo;
     void (*balanceChanged)(void *info, uint64_t balance);
     void (*txAdded)(void *info, BRTransaction *tx);
@@ -57,16 +80,32 @@ inline static uint64_t _txFee(uint64_t feePerKb, size_t size)
     return (fee > standardFee) ? fee : standardFee;
 }
 
-// chain position of first tx output address that appears in chain
-inline static size_t _txChainIndex(const BRTransaction *tx, const BRAddress *addrChain)
+// allAddrs entry for the address of a scriptPubKey, its chain index << 1 | internal, or NULL if it's not in the wallet
+inline static const uint32_t *_BRWalletScriptAddr(BRWallet *wallet, const uint8_t *script, size_t scriptLen)
 {
-    for (size_t i = array_count(addrChain); i > 0; i--) {
-        for (size_t j = 0; j < tx->outCount; j++) {
-            if (BRAddressEq(tx->outputs[j].address, &addrChain[i - 1])) return i - 1;
-        }
+    BRScriptHash h;
+    
+    return (BRScriptHashFromScriptPubKey(&h, script, scriptLen)) ? BRScriptHashMapGet(wallet->allAddrs, &h) : NULL;
+}
+
+// true if the given tx output pays to a wallet address
+inline static int _BRWalletContainsOutput(BRWallet *wallet, const BRTxOutput *output)
+{
+    return (_BRWalletScriptAddr(wallet, output->script, output->scriptLen) != NULL);
+}
+
+// position of the last tx output address in the internal or external chain, or SIZE_MAX if none are on that chain
+inline static size_t _txChainIndex(BRWallet *wallet, const BRTransaction *tx, int internal)
+{
+    const uint32_t *idx;
+    size_t r = SIZE_MAX;
+    
+    for (size_t j = 0; j < tx->outCount; j++) {
+        idx = _BRWalletScriptAddr(wallet, tx->outputs[j].script, tx->outputs[j].scriptLen);
+        if (idx && (*idx & 1) == (internal != 0) && (r == SIZE_MAX || (*idx >> 1) > r)) r = *idx >> 1;
     }
     
-    return SIZE_MAX;
+    return r;
 }
 
 inline static int _BRWalletTxIsAscending(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2)
@@ -96,15 +135,16 @@ inline static int _BRWalletTxCompare(BRWallet *wallet, const BRTransaction *tx1,
 
     if (_BRWalletTxIsAscending(wallet, tx1, tx2)) return 1;
     if (_BRWalletTxIsAscending(wallet, tx2, tx1)) return -1;
-    i = _txChainIndex(tx1, wallet->internalChain);
-    j = _txChainIndex(tx2, (i == SIZE_MAX) ? wallet->externalChain : wallet->internalChain);
-    if (i == SIZE_MAX && j != SIZE_MAX) i = _txChainIndex((BRTransaction *)tx1, wallet->externalChain);
+    i = _txChainIndex(wallet, tx1, 1);
+    j = _txChainIndex(wallet, tx2, (i != SIZE_MAX));
+    if (i == SIZE_MAX && j != SIZE_MAX) i = _txChainIndex(wallet, tx1, 0);
     if (i != SIZE_MAX && j != SIZE_MAX && i != j) return (i > j) ? 1 : -1;
     return 0;
 }
 
 // inserts tx into wallet->transactions, keeping wallet->transactions sorted by date, oldest first (insertion sort)
-inline static void _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
+// returns the index tx was inserted at
+inline static size_t _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
 {
     size_t i = array_count(wallet->transactions);
     
@@ -116,6 +156,108 @@ inline static void _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
     }
     
     wallet->transactions[i] = tx;
+    return i;
+}
+
+// position of the first tx in wallet->transactions with blockHeight at or above the given height (binary search)
+inline static size_t _BRWalletTxHeightIndex(BRWallet *wallet, uint32_t blockHeight)
+{
+    size_t lo = 0, hi = array_count(wallet->transactions), mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (wallet->transactions[mid]->blockHeight < blockHeight) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return lo;
+}
+
+// position of tx in wallet->transactions, found among the txs at its blockHeight, or SIZE_MAX if it isn't there
+inline static size_t _BRWalletTxIndex(BRWallet *wallet, const BRTransaction *tx)
+{
+    size_t count = array_count(wallet->transactions);
+
+    tx = BRSetGet(wallet->allTx, tx); // the wallet's copy, tx may be another with a different blockHeight
+
+    for (size_t i = (tx) ? _BRWalletTxHeightIndex(wallet, tx->blockHeight) : count; i < count; i++) {
+        if (wallet->transactions[i] == tx) return i;
+        if (wallet->transactions[i]->blockHeight != tx->blockHeight) break;
+    }
+
+    return SIZE_MAX;
+}
+
+typedef struct {
+    BRTransaction *tx;
+    size_t idx; // position in the list of txs being loaded, so txs at the same height keep the order they were given in
+} BRTxSortEntry;
+
+static int _BRTxSortEntryCompare(const void *e1, const void *e2)
+{
+    const BRTxSortEntry *a = e1, *b = e2;
+    
+    if (a->tx->blockHeight != b->tx->blockHeight) return (a->tx->blockHeight < b->tx->blockHeight) ? -1 : 1;
+    return (a->idx < b->idx) ? -1 : (a->idx > b->idx) ? 1 : 0;
+}
+
+// adds the signed txs that aren't already in the wallet to allTx and wallet->transactions, sorted by block height,
+// with each tx after any tx at the same height that it spends from, the order that calling _BRWalletInsertTx() for
+// each tx would give, but in O(n log n) instead of O(n^2)
+static void _BRWalletBulkInsertTxs(BRWallet *wallet, BRTransaction *txs[], size_t txCount)
+{
+    BRTxSortEntry *entries = malloc(txCount*sizeof(*entries) + 1);
+    size_t *stack = malloc(txCount*sizeof(*stack) + 1), *next = calloc(txCount + 1, sizeof(*next));
+    uint8_t *state = calloc(txCount + 1, sizeof(*state)); // 0 for not visited, 1 for on the stack, 2 for inserted
+    BRTxIndexMap *indexes = BRTxIndexMapNew(txCount);
+    BRTransaction *tx;
+    size_t i, j, k, n, count = 0, *idx;
+    
+    assert(entries != NULL && stack != NULL && next != NULL && state != NULL);
+    
+    for (i = 0; i < txCount; i++) {
+        tx = txs[i];
+        if (! BRTransactionIsSigned(tx) || BRSetContains(wallet->allTx, tx)) continue;
+        BRSetAdd(wallet->allTx, tx);
+        entries[count] = (BRTxSortEntry) { tx, count };
+        count++;
+    }
+    
+    qsort(entries, count, sizeof(*entries), _BRTxSortEntryCompare);
+    for (i = 0; i < count; i++) BRTxIndexMapSet(indexes, &entries[i].tx->txHash, i);
+    
+    // depth first, so each tx is inserted after the txs at the same height that it spends from, txs at lower heights
+    // are earlier in entries, so they're already inserted
+    for (i = 0; i < count; i++) {
+        if (state[i] != 0) continue;
+        stack[0] = i, n = 1, state[i] = 1;
+        
+        while (n > 0) {
+            k = stack[n - 1];
+            tx = entries[k].tx;
+            
+            for (j = SIZE_MAX; j == SIZE_MAX && next[k] < tx->inCount;) {
+                idx = BRTxIndexMapGet(indexes, &tx->inputs[next[k]++].txHash);
+                if (idx && state[*idx] == 0 && entries[*idx].tx->blockHeight == tx->blockHeight) j = *idx;
+            }
+            
+            if (j != SIZE_MAX) { // insert the tx it spends from first
+                state[j] = 1;
+                stack[n++] = j;
+            }
+            else {
+                state[k] = 2;
+                n--;
+                array_add(wallet->transactions, tx);
+            }
+        }
+    }
+    
+    BRTxIndexMapFree(indexes);
+    free(state);
+    free(next);
+    free(stack);
+    free(entries);
 }
 
 // non-threadsafe version of BRWalletContainsTransaction()
@@ -124,153 +266,612 @@ static int _BRWalletContainsTx(BRWallet *wallet, const BRTransaction *tx)
     int r = 0;
     
     for (size_t i = 0; ! r && i < tx->outCount; i++) {
-        if (BRSetContains(wallet->allAddrs, tx->outputs[i].address)) r = 1;
+        if (_BRWalletContainsOutput(wallet, &tx->outputs[i])) r = 1;
     }
     
     for (size_t i = 0; ! r && i < tx->inCount; i++) {
         BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
         uint32_t n = tx->inputs[i].index;
         
-        if (t && n < t->outCount && BRSetContains(wallet->allAddrs, t->outputs[n].address)) r = 1;
+        if (t && n < t->outCount && _BRWalletContainsOutput(wallet, &t->outputs[n])) r = 1;
     }
     
     return r;
 }
 
+// applies the effects of tx on wallet balance, utxos, spent outputs and invalid/pending status, updating wallet state
+// as though tx were the next transaction after those already applied, and appending its entry to balanceHist
+static void _BRWalletApplyTx(BRWallet *wallet, BRTransaction *tx, time_t now)
+{
+    int isInvalid, isPending = 0;
+    uint64_t balance = wallet->balance, prevBalance = wallet->balance, *amount;
+    BRScriptHash h;
+    size_t j, k;
+    
+    // check if any inputs are invalid or already spent
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        for (j = 0, isInvalid = 0; ! isInvalid && j < tx->inCount; j++) {
+            if (BRSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
+                BRSetContains(wallet->invalidTx, &tx->inputs[j].txHash)) isInvalid = 1;
+        }
+    
+        if (isInvalid) {
+            BRSetAdd(wallet->invalidTx, tx);
+            array_add(wallet->balanceHist, balance);
+            return;
+        }
+    }
+
+    // add inputs to spent output set
+    for (j = 0; j < tx->inCount; j++) {
+        BRSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+    }
+
+    // check if tx is pending
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        isPending = (BRTransactionSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
+        
+        for (j = 0; ! isPending && j < tx->outCount; j++) {
+            if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1; // check that no outputs are dust
+        }
+
+        for (j = 0; ! isPending && j < tx->inCount; j++) {
+            if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1; // check for replace-by-fee
+            if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
+                tx->lockTime > wallet->blockHeight + 1) isPending = 1; // future lockTime
+            if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1; // future lockTime
+            if (BRSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
+            // TODO: XXX handle BIP68 check lock time verify rules
+        }
+        
+        if (isPending) BRSetAdd(wallet->pendingTx, tx);
+    }
+
+    // add outputs to UTXO set, a pending tx's outputs aren't spendable yet, but its inputs are still spent below
+    // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
+    // TODO: don't add coin generation outputs < 100 blocks deep
+    // NOTE: balance/UTXOs will then need to be recalculated when last block changes
+    for (j = 0; ! isPending && j < tx->outCount; j++) {
+        if (BRScriptHashFromScriptPubKey(&h, tx->outputs[j].script, tx->outputs[j].scriptLen)) {
+            BRScriptHashMapSet(wallet->usedAddrs, &h, 0);
+            
+            // transaction ordering is not guaranteed, so skip outputs already spent by a previously applied tx
+            if (BRScriptHashMapGet(wallet->allAddrs, &h) &&
+                ! BRSetContains(wallet->spentOutputs, &((BRUTXO) { tx->txHash, (uint32_t)j }))) {
+                array_add(wallet->utxos, ((BRUTXO) { tx->txHash, (uint32_t)j }));
+                BRUTXOAmountMapSet(wallet->utxoAmounts, &wallet->utxos[array_count(wallet->utxos) - 1],
+                                   tx->outputs[j].amount);
+                array_clear(wallet->utxoCoins);
+                balance += tx->outputs[j].amount;
+            }
+        }
+    }
+
+    // earlier utxos were already checked against earlier spends, so only this tx's inputs can remove entries from the
+    // UTXO set, this includes the inputs of a pending tx, since they were added to the spent output set above
+    for (j = 0; j < tx->inCount; j++) {
+        amount = BRUTXOAmountMapGet(wallet->utxoAmounts, (const BRUTXO *)&tx->inputs[j]);
+        if (! amount) continue;
+        balance -= *amount;
+        BRUTXOAmountMapRemove(wallet->utxoAmounts, (const BRUTXO *)&tx->inputs[j]);
+        array_clear(wallet->utxoCoins);
+        
+        for (k = array_count(wallet->utxos); k > 0; k--) {
+            if (! BRUTXOEq(&wallet->utxos[k - 1], &tx->inputs[j])) continue;
+            array_rm(wallet->utxos, k - 1);
+            break;
+        }
+    }
+    
+    if (prevBalance < balance) wallet->totalReceived += balance - prevBalance;
+    if (balance < prevBalance) wallet->totalSent += prevBalance - balance;
+    array_add(wallet->balanceHist, balance);
+    wallet->balance = balance;
+}
+
+// rebuilds wallet balance, utxos, spent outputs and invalid/pending status from scratch, applying each tx in order
 static void _BRWalletUpdateBalance(BRWallet *wallet)
 {
-    int isInvalid, isPending;
-    uint64_t balance = 0, prevBalance = 0;
     time_t now = time(NULL);
-    size_t i, j;
-    BRTransaction *tx, *t;
     
     array_clear(wallet->utxos);
+    BRUTXOAmountMapClear(wallet->utxoAmounts);
+    array_clear(wallet->utxoCoins);
     array_clear(wallet->balanceHist);
     BRSetClear(wallet->spentOutputs);
     BRSetClear(wallet->invalidTx);
     BRSetClear(wallet->pendingTx);
-    BRSetClear(wallet->usedAddrs);
+    BRScriptHashMapClear(wallet->usedAddrs);
+    wallet->balance = 0;
     wallet->totalSent = 0;
     wallet->totalReceived = 0;
 
-    for (i = 0; i < array_count(wallet->transactions); i++) {
-        tx = wallet->transactions[i];
+    for (size_t i = 0; i < array_count(wallet->transactions); i++) {
+        _BRWalletApplyTx(wallet, wallet->transactions[i], now);
+    }
 
-        // check if any inputs are invalid or already spent
-        if (tx->blockHeight == TX_UNCONFIRMED) {
-            for (j = 0, isInvalid = 0; ! isInvalid && j < tx->inCount; j++) {
-                if (BRSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
-                    BRSetContains(wallet->invalidTx, &tx->inputs[j].txHash)) isInvalid = 1;
-            }
+    assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
+}
+
+// updates wallet state after tx was inserted into wallet->transactions at index idx
+// when tx is the newest transaction, only its own effects are applied, otherwise all transactions are re-applied
+static void _BRWalletUpdateBalanceForTx(BRWallet *wallet, BRTransaction *tx, size_t idx)
+{
+    // pending status of earlier transactions depends on the current time and block height, so if any are pending,
+    // they must be re-checked with a full rebuild
+    if (idx + 1 == array_count(wallet->transactions) && idx == array_count(wallet->balanceHist) &&
+        BRSetCount(wallet->pendingTx) == 0) {
+        _BRWalletApplyTx(wallet, tx, time(NULL));
+    }
+    else _BRWalletUpdateBalance(wallet);
+}
+
+// sets h to the binary form of the pay-to-pubkey-hash address of pubKey, or sets h->len to 0 if pubKey is invalid
+static void _BRPubKeyScriptHash(BRScriptHash *h, const BRECPoint *pubKey)
+{
+    BRKey key;
+    UInt160 hash = UINT160_ZERO;
+    
+    memset(h, 0, sizeof(*h));
+    if (BRKeySetPubKey(&key, pubKey->p, sizeof(pubKey->p))) hash = BRKeyHash160(&key);
+    
+    if (! UInt160IsZero(hash)) {
+        h->type = SCRIPT_HASH_PUBKEY;
+        h->len = sizeof(hash);
+        UInt160Set(h->data, hash);
+    }
+}
+
+typedef struct {
+    BRScriptHash *addrs;
+    BRMasterPubKey xpub;
+    uint32_t start;
+} BRAddrBatch;
+
+static void _addrWorker(void *info, BRWorkPool *pool)
+{
+    BRAddrBatch *batch = info;
+    BRECPoint pubKeys[ADDR_BATCH_SIZE];
+    size_t i, k, n;
+    
+    while ((n = BRWorkPoolNext(pool, &i)) > 0) { // children of a chain node are independent of each other
+        BRBIP32ChildPubKeyRange(pubKeys, n, batch->xpub, batch->start + (uint32_t)i);
+        for (k = 0; k < n; k++) _BRPubKeyScriptHash(&batch->addrs[i + k], &pubKeys[k]);
+    }
+}
+
+// writes the addresses for children start through start + count - 1 of xpub to addrs, splitting the work across
+// available cores, addresses that can't be derived have a len of 0
+static void _BRWalletDeriveAddrs(BRScriptHash addrs[], size_t count, BRMasterPubKey xpub, uint32_t start)
+{
+    BRAddrBatch batch = { addrs, xpub, start };
+    
+    BRWorkPoolRun(count, ADDR_BATCH_SIZE, ADDR_MAX_THREADS, &batch, _addrWorker);
+}
+
+// appends addr to the internal or external chain, and adds it to allAddrs with its chain index
+inline static void _BRWalletAddChainAddr(BRWallet *wallet, const BRScriptHash *addr, int internal)
+{
+    BRScriptHash **addrChain = (internal) ? &wallet->internalChain : &wallet->externalChain;
+    
+    BRScriptHashMapSet(wallet->allAddrs, addr, (uint32_t)array_count(*addrChain) << 1 | (internal != 0));
+    array_add(*addrChain, *addr);
+}
+
+// extends an address chain of a newly created wallet past its last used address plus gapLimit, deriving just the
+// addresses still missing below that in parallel batches, with chain and allAddrs capacity reserved up front
+static void _BRWalletRestoreChain(BRWallet *wallet, uint32_t gapLimit, int internal)
+{
+    BRScriptHash *addrChain = (internal) ? wallet->internalChain : wallet->externalChain, *addrs;
+    uint32_t chain = (internal) ? SEQUENCE_INTERNAL_CHAIN : SEQUENCE_EXTERNAL_CHAIN;
+    size_t i, k, m, count, usedCount = BRScriptHashMapCount(wallet->usedAddrs), n = gapLimit;
+    
+    if (n > ADDR_RESTORE_BATCH) n = ADDR_RESTORE_BATCH; // i <= count, so no more than gapLimit are missing at a time
+    i = count = array_count(addrChain);
+    while (i > 0 && ! BRScriptHashMapGet(wallet->usedAddrs, &addrChain[i - 1])) i--;
+    if (array_capacity(addrChain) < count + usedCount + gapLimit) {
+        array_set_capacity(addrChain, count + usedCount + gapLimit);
+    }
+    
+    if (internal) wallet->internalChain = addrChain;
+    if (! internal) wallet->externalChain = addrChain;
+    BRScriptHashMapReserve(wallet->allAddrs, BRScriptHashMapCount(wallet->allAddrs) + usedCount + gapLimit);
+    addrs = malloc(n*sizeof(*addrs));
+    assert(addrs != NULL);
+    
+    while (i + gapLimit > count) {
+        m = (i + gapLimit - count < n) ? i + gapLimit - count : n; // derive only up to the last used addr + gapLimit
+        _BRWalletDeriveAddrs(addrs, m, wallet->chainPubKey[chain], (uint32_t)count);
         
-            if (isInvalid) {
-                BRSetAdd(wallet->invalidTx, tx);
-                array_add(wallet->balanceHist, balance);
-                continue;
-            }
+        for (k = 0; k < m && i + gapLimit > count; k++) {
+            if (addrs[k].len == 0) break;
+            _BRWalletAddChainAddr(wallet, &addrs[k], internal);
+            count++;
+            if (BRScriptHashMapGet(wallet->usedAddrs, &addrs[k])) i = count;
         }
+        
+        if (k < m && i + gapLimit > count) break; // an address couldn't be derived
+    }
+    
+    free(addrs);
+}
 
-        // add inputs to spent output set
-        for (j = 0; j < tx->inCount; j++) {
-            BRSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+// adds the addresses of tx outputs to usedAddrs
+static void _BRWalletAddUsedAddrs(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRScriptHash h;
+    
+    for (size_t j = 0; j < tx->outCount; j++) {
+        if (BRScriptHashFromScriptPubKey(&h, tx->outputs[j].script, tx->outputs[j].scriptLen)) {
+            BRScriptHashMapSet(wallet->usedAddrs, &h, 0);
         }
+    }
+}
 
-        // check if tx is pending
-        if (tx->blockHeight == TX_UNCONFIRMED) {
-            isPending = (BRTransactionSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
-            
-            for (j = 0; ! isPending && j < tx->outCount; j++) {
-                if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1; // check that no outputs are dust
-            }
+// appends len bytes of data to buf at *off, unless buf is NULL or too small, and advances *off either way, so the same
+// code can both measure and write a snapshot
+inline static void _BRSnapshotPut(uint8_t *buf, size_t bufLen, size_t *off, const void *data, size_t len)
+{
+    if (buf && *off + len <= bufLen) memcpy(&buf[*off], data, len);
+    *off += len;
+}
 
-            for (j = 0; ! isPending && j < tx->inCount; j++) {
-                if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1; // check for replace-by-fee
-                if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
-                    tx->lockTime > wallet->blockHeight + 1) isPending = 1; // future lockTime
-                if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1; // future lockTime
-                if (BRSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
-                // TODO: XXX handle BIP68 check lock time verify rules
-            }
-            
-            if (isPending) {
-                BRSetAdd(wallet->pendingTx, tx);
-                array_add(wallet->balanceHist, balance);
-                continue;
-            }
-        }
+inline static void _BRSnapshotPutUInt32(uint8_t *buf, size_t bufLen, size_t *off, uint32_t u)
+{
+    uint8_t b[sizeof(uint32_t)];
+    
+    UInt32SetLE(b, u);
+    _BRSnapshotPut(buf, bufLen, off, b, sizeof(b));
+}
 
-        // add outputs to UTXO set
-        // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
-        // TODO: don't add coin generation outputs < 100 blocks deep
-        // NOTE: balance/UTXOs will then need to be recalculated when last block changes
-        for (j = 0; j < tx->outCount; j++) {
-            if (tx->outputs[j].address[0] != '\0') {
-                BRSetAdd(wallet->usedAddrs, tx->outputs[j].address);
-                
-                if (BRSetContains(wallet->allAddrs, tx->outputs[j].address)) {
-                    array_add(wallet->utxos, ((BRUTXO) { tx->txHash, (uint32_t)j }));
-                    balance += tx->outputs[j].amount;
-                }
-            }
-        }
+inline static void _BRSnapshotPutUInt64(uint8_t *buf, size_t bufLen, size_t *off, uint64_t u)
+{
+    uint8_t b[sizeof(uint64_t)];
+    
+    UInt64SetLE(b, u);
+    _BRSnapshotPut(buf, bufLen, off, b, sizeof(b));
+}
 
-        // transaction ordering is not guaranteed, so check the entire UTXO set against the entire spent output set
-        for (j = array_count(wallet->utxos); j > 0; j--) {
-            if (! BRSetContains(wallet->spentOutputs, &wallet->utxos[j - 1])) continue;
-            t = BRSetGet(wallet->allTx, &wallet->utxos[j - 1].hash);
-            balance -= t->outputs[wallet->utxos[j - 1].n].amount;
-            array_rm(wallet->utxos, j - 1);
-        }
+inline static void _BRSnapshotPutVarInt(uint8_t *buf, size_t bufLen, size_t *off, uint64_t i)
+{
+    uint8_t b[9];
+    
+    _BRSnapshotPut(buf, bufLen, off, b, BRVarIntSet(b, sizeof(b), i));
+}
+
+static void _BRSnapshotPutChain(uint8_t *buf, size_t bufLen, size_t *off, const BRScriptHash *addrChain)
+{
+    _BRSnapshotPutVarInt(buf, bufLen, off, array_count(addrChain));
+    
+    for (size_t i = 0; i < array_count(addrChain); i++) {
+        _BRSnapshotPut(buf, bufLen, off, &addrChain[i].type, sizeof(addrChain[i].type));
+        _BRSnapshotPut(buf, bufLen, off, &addrChain[i].len, sizeof(addrChain[i].len));
+        _BRSnapshotPut(buf, bufLen, off, addrChain[i].data, addrChain[i].len);
+    }
+}
+
+// copies len bytes at *off in buf to data and advances *off, returns false if buf is too short
+inline static int _BRSnapshotGet(const uint8_t *buf, size_t bufLen, size_t *off, void *data, size_t len)
+{
+    if (*off > bufLen || len > bufLen - *off) return 0;
+    memcpy(data, &buf[*off], len);
+    *off += len;
+    return 1;
+}
+
+inline static int _BRSnapshotGetUInt32(const uint8_t *buf, size_t bufLen, size_t *off, uint32_t *u)
+{
+    uint8_t b[sizeof(uint32_t)];
+    
+    if (! _BRSnapshotGet(buf, bufLen, off, b, sizeof(b))) return 0;
+    *u = UInt32GetLE(b);
+    return 1;
+}
+
+inline static int _BRSnapshotGetUInt64(const uint8_t *buf, size_t bufLen, size_t *off, uint64_t *u)
+{
+    uint8_t b[sizeof(uint64_t)];
+    
+    if (! _BRSnapshotGet(buf, bufLen, off, b, sizeof(b))) return 0;
+    *u = UInt64GetLE(b);
+    return 1;
+}
+
+// reads a count of items that take at least itemLen bytes each, returns false if there isn't room left for that many
+inline static int _BRSnapshotGetCount(const uint8_t *buf, size_t bufLen, size_t *off, size_t itemLen, size_t *count)
+{
+    size_t len = 0;
+    uint64_t i = (*off < bufLen) ? BRVarInt(&buf[*off], bufLen - *off, &len) : 0;
+    
+    if (len == 0 || i > (bufLen - *off - len)/itemLen) return 0;
+    *off += len;
+    *count = (size_t)i;
+    return 1;
+}
+
+// reads an address chain into the internal or external chain of wallet, adding its addresses to allAddrs
+static int _BRSnapshotGetChain(const uint8_t *buf, size_t bufLen, size_t *off, BRWallet *wallet, int internal)
+{
+    BRScriptHash **addrChain = (internal) ? &wallet->internalChain : &wallet->externalChain, addr;
+    size_t i, count = 0;
+    int r = _BRSnapshotGetCount(buf, bufLen, off, 2, &count);
+    
+    if (r && array_capacity(*addrChain) < count) array_set_capacity(*addrChain, count);
+    if (r) BRScriptHashMapReserve(wallet->allAddrs, BRScriptHashMapCount(wallet->allAddrs) + count);
+    
+    for (i = 0; r && i < count; i++) {
+        memset(&addr, 0, sizeof(addr));
+        r = (_BRSnapshotGet(buf, bufLen, off, &addr.type, sizeof(addr.type)) &&
+             _BRSnapshotGet(buf, bufLen, off, &addr.len, sizeof(addr.len)) && addr.len > 0 &&
+             addr.len <= sizeof(addr.data) && _BRSnapshotGet(buf, bufLen, off, addr.data, addr.len) &&
+             ! BRScriptHashMapGet(wallet->allAddrs, &addr));
+        if (r) _BRWalletAddChainAddr(wallet, &addr, internal);
+    }
+    
+    return r;
+}
+
+// double-sha256 of the serialized master pubKey, so a snapshot is only ever restored into the wallet it was taken of
+static UInt256 _BRWalletSnapshotKey(BRMasterPubKey mpk)
+{
+    uint8_t data[sizeof(uint32_t) + sizeof(UInt256) + sizeof(mpk.pubKey)];
+    UInt256 md;
+    
+    UInt32SetLE(data, mpk.fingerPrint);
+    UInt256Set(&data[sizeof(uint32_t)], mpk.chainCode);
+    memcpy(&data[sizeof(uint32_t) + sizeof(UInt256)], mpk.pubKey, sizeof(mpk.pubKey));
+    BRSHA256_2(&md, data, sizeof(data));
+    return md;
+}
+
+// true if snapshot has the right magic number, version and checksum
+static int _BRWalletSnapshotIsValid(const uint8_t *snapshot, size_t snapshotLen)
+{
+    UInt256 md;
+    
+    if (! snapshot || snapshotLen < sizeof(uint32_t)*3 + sizeof(UInt256)*2) return 0;
+    if (UInt32GetLE(snapshot) != SNAPSHOT_MAGIC || UInt32GetLE(&snapshot[4]) != WALLET_SNAPSHOT_VERSION) return 0;
+    BRSHA256_2(&md, snapshot, snapshotLen - sizeof(uint32_t));
+    return (memcmp(md.u8, &snapshot[snapshotLen - sizeof(uint32_t)], sizeof(uint32_t)) == 0);
+}
+
+// writes the snapshot of wallet's derived state to buf, without the trailing checksum, returns its length
+//
+// format (all integers little endian, counts are varints):
+// magic "BRWS", format version, block hash, snapshot key of the master pubKey, wallet blockHeight, balance,
+// totalSent, totalReceived
+// tx count, then for each tx in wallet->transactions: txHash, blockHeight, invalid/pending flags, balanceHist entry
+// utxo count, then for each utxo: txHash, output index, amount
+// internal chain address count, then each address as its BRScriptHash type, length and data, then the external chain
+// followed by the first 4 bytes of the double-sha256 of everything before it
+//
+// spentOutputs holds pointers into the txs, so it's rebuilt from the txs, along with usedAddrs, on restore
+static size_t _BRWalletSnapshotData(BRWallet *wallet, uint8_t *buf, size_t bufLen, UInt256 blockHash)
+{
+    BRTransaction *tx;
+    UInt256 key = _BRWalletSnapshotKey(wallet->masterPubKey);
+    size_t i, off = 0;
+    uint64_t *amount;
+    uint8_t flags;
+    
+    _BRSnapshotPutUInt32(buf, bufLen, &off, SNAPSHOT_MAGIC);
+    _BRSnapshotPutUInt32(buf, bufLen, &off, WALLET_SNAPSHOT_VERSION);
+    _BRSnapshotPut(buf, bufLen, &off, &blockHash, sizeof(blockHash));
+    _BRSnapshotPut(buf, bufLen, &off, &key, sizeof(key));
+    _BRSnapshotPutUInt32(buf, bufLen, &off, wallet->blockHeight);
+    _BRSnapshotPutUInt64(buf, bufLen, &off, wallet->balance);
+    _BRSnapshotPutUInt64(buf, bufLen, &off, wallet->totalSent);
+    _BRSnapshotPutUInt64(buf, bufLen, &off, wallet->totalReceived);
+    _BRSnapshotPutVarInt(buf, bufLen, &off, array_count(wallet->transactions));
+    
+    for (i = 0; i < array_count(wallet->transactions); i++) {
+        tx = wallet->transactions[i];
+        flags = (BRSetContains(wallet->invalidTx, tx)) ? SNAPSHOT_TX_INVALID : 0;
+        if (BRSetContains(wallet->pendingTx, tx)) flags |= SNAPSHOT_TX_PENDING;
+        _BRSnapshotPut(buf, bufLen, &off, &tx->txHash, sizeof(tx->txHash));
+        _BRSnapshotPutUInt32(buf, bufLen, &off, tx->blockHeight);
+        _BRSnapshotPut(buf, bufLen, &off, &flags, sizeof(flags));
+        _BRSnapshotPutUInt64(buf, bufLen, &off, wallet->balanceHist[i]);
+    }
+    
+    _BRSnapshotPutVarInt(buf, bufLen, &off, array_count(wallet->utxos));
+    
+    for (i = 0; i < array_count(wallet->utxos); i++) {
+        amount = BRUTXOAmountMapGet(wallet->utxoAmounts, &wallet->utxos[i]);
+        _BRSnapshotPut(buf, bufLen, &off, &wallet->utxos[i].hash, sizeof(UInt256));
+        _BRSnapshotPutUInt32(buf, bufLen, &off, wallet->utxos[i].n);
+        _BRSnapshotPutUInt64(buf, bufLen, &off, (amount) ? *amount : 0);
+    }
+    
+    _BRSnapshotPutChain(buf, bufLen, &off, wallet->internalChain);
+    _BRSnapshotPutChain(buf, bufLen, &off, wallet->externalChain);
+    return off;
+}
+
+// restores a newly allocated wallet's state from snapshot, then adds and applies the txs that the snapshot doesn't
+// include, returns false and leaves wallet empty if snapshot can't be used with the given txs
+static int _BRWalletLoadSnapshot(BRWallet *wallet, BRTransaction *txs[], size_t txCount, const uint8_t *snapshot,
+                                 size_t snapshotLen)
+{
+    BRTransaction *tx, **newTxs;
+    BRSet *snapshotTx;
+    UInt256 hash, key = _BRWalletSnapshotKey(wallet->masterPubKey);
+    size_t i, j, count = 0, off = sizeof(uint32_t)*2 + sizeof(UInt256);
+    uint32_t height;
+    uint64_t n, balance;
+    uint8_t flags;
+    int rebuild = 0, r = _BRWalletSnapshotIsValid(snapshot, snapshotLen);
+    
+    if (! r || memcmp(&snapshot[off], &key, sizeof(key)) != 0) return 0;
+    snapshotLen -= sizeof(uint32_t); // checksum
+    off += sizeof(key);
+    r = (_BRSnapshotGetUInt32(snapshot, snapshotLen, &off, &wallet->blockHeight) &&
+         _BRSnapshotGetUInt64(snapshot, snapshotLen, &off, &wallet->balance) &&
+         _BRSnapshotGetUInt64(snapshot, snapshotLen, &off, &wallet->totalSent) &&
+         _BRSnapshotGetUInt64(snapshot, snapshotLen, &off, &wallet->totalReceived) &&
+         _BRSnapshotGetCount(snapshot, snapshotLen, &off, sizeof(UInt256) + 13, &count));
+    
+    for (i = 0; txs && i < txCount; i++) {
+        if (! BRTransactionIsSigned(txs[i]) || BRSetContains(wallet->allTx, txs[i])) continue;
+        BRSetAdd(wallet->allTx, txs[i]);
+    }
+    
+    snapshotTx = BRSetNew(BRTransactionHash, BRTransactionEq, count + 1);
+    
+    for (i = 0; r && i < count; i++) {
+        r = (_BRSnapshotGet(snapshot, snapshotLen, &off, &hash, sizeof(hash)) &&
+             _BRSnapshotGetUInt32(snapshot, snapshotLen, &off, &height) &&
+             _BRSnapshotGet(snapshot, snapshotLen, &off, &flags, sizeof(flags)) &&
+             _BRSnapshotGetUInt64(snapshot, snapshotLen, &off, &balance));
+        tx = (r) ? BRSetGet(wallet->allTx, &hash) : NULL;
         
-        if (prevBalance < balance) wallet->totalReceived += balance - prevBalance;
-        if (balance < prevBalance) wallet->totalSent += prevBalance - balance;
+        // every tx in the snapshot must still be in the wallet, unchanged since the snapshot was taken
+        if (! tx || tx->blockHeight != height || BRSetContains(snapshotTx, tx)) r = 0;
+        if (! r) break;
+        BRSetAdd(snapshotTx, tx);
+        array_add(wallet->transactions, tx);
         array_add(wallet->balanceHist, balance);
-        prevBalance = balance;
+        if (flags & SNAPSHOT_TX_INVALID) BRSetAdd(wallet->invalidTx, tx);
+        if (flags & SNAPSHOT_TX_PENDING) BRSetAdd(wallet->pendingTx, tx);
+        
+        // inputs of every valid tx are spent, and outputs of every tx that's neither invalid nor pending are used
+        for (j = 0; ! (flags & SNAPSHOT_TX_INVALID) && j < tx->inCount; j++) {
+            BRSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+        }
+        
+        if (! flags) _BRWalletAddUsedAddrs(wallet, tx);
     }
-
-    assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
-    wallet->balance = balance;
+    
+    r = (r && _BRSnapshotGetCount(snapshot, snapshotLen, &off, sizeof(UInt256) + 12, &count));
+    
+    for (i = 0; r && i < count; i++) {
+        BRUTXO o;
+        
+        r = (_BRSnapshotGet(snapshot, snapshotLen, &off, &o.hash, sizeof(o.hash)) &&
+             _BRSnapshotGetUInt32(snapshot, snapshotLen, &off, &o.n) &&
+             _BRSnapshotGetUInt64(snapshot, snapshotLen, &off, &n));
+        if (! r) break;
+        array_add(wallet->utxos, o);
+        BRUTXOAmountMapSet(wallet->utxoAmounts, &o, n);
+    }
+    
+    r = (r && _BRSnapshotGetChain(snapshot, snapshotLen, &off, wallet, 1) &&
+         _BRSnapshotGetChain(snapshot, snapshotLen, &off, wallet, 0) && off == snapshotLen);
+    
+    if (r) {
+        array_new(newTxs, 10);
+        
+        for (i = 0; txs && i < txCount; i++) { // txs added to the wallet since the snapshot was taken
+            if (BRSetGet(wallet->allTx, txs[i]) != txs[i] || BRSetContains(snapshotTx, txs[i])) continue;
+            array_add(newTxs, txs[i]);
+            _BRWalletAddUsedAddrs(wallet, txs[i]);
+        }
+        
+        if (array_count(newTxs) > 0) { // the new txs may use addresses past the end of the snapshot's chains
+            _BRWalletRestoreChain(wallet, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+            _BRWalletRestoreChain(wallet, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+        }
+        
+        BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+        BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+        
+        // a pending tx may have stopped being pending since the snapshot was taken, since that depends on the current
+        // time and block height, so its status, and the balance and utxos that follow from it, must be recomputed
+        if (BRSetCount(wallet->pendingTx) > 0) rebuild = 1;
+        
+        // txs newer than all the others are applied on top of the snapshot, otherwise the balance is rebuilt once
+        for (i = 0; i < array_count(newTxs); i++) {
+            if (_BRWalletInsertTx(wallet, newTxs[i]) + 1 != array_count(wallet->transactions)) rebuild = 1;
+            if (BRSetCount(wallet->pendingTx) > 0) rebuild = 1;
+            if (! rebuild) _BRWalletApplyTx(wallet, newTxs[i], time(NULL));
+        }
+        
+        if (rebuild) _BRWalletUpdateBalance(wallet);
+        array_free(newTxs);
+    }
+    else { // leave the wallet as it was allocated
+        array_clear(wallet->transactions);
+        array_clear(wallet->balanceHist);
+        array_clear(wallet->utxos);
+        BRUTXOAmountMapClear(wallet->utxoAmounts);
+        array_clear(wallet->internalChain);
+        array_clear(wallet->externalChain);
+        BRSetClear(wallet->allTx);
+        BRSetClear(wallet->invalidTx);
+        BRSetClear(wallet->pendingTx);
+        BRSetClear(wallet->spentOutputs);
+        BRScriptHashMapClear(wallet->usedAddrs);
+        BRScriptHashMapClear(wallet->allAddrs);
+        wallet->blockHeight = 0;
+        wallet->balance = wallet->totalSent = wallet->totalReceived = 0;
+    }
+    
+    BRSetFree(snapshotTx);
+    return r;
 }
 
 // allocates and populates a BRWallet struct which must be freed by calling BRWalletFree()
 BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk)
+{
+    return BRWalletNewWithSnapshot(transactions, txCount, mpk, NULL, 0);
+}
+
+// allocates a BRWallet struct like BRWalletNew(), but restores the state derived from transactions, including the
+// address chains, from a snapshot written by BRWalletSnapshot() instead of rebuilding it, then applies only the
+// transactions the snapshot doesn't include
+// if snapshot is NULL, invalid, of a different wallet, or includes transactions that are missing or have changed block
+// height, the state is rebuilt the same as BRWalletNew()
+// only use a snapshot if its block, given by BRWalletSnapshotBlockHash(), is still in the best chain
+BRWallet *BRWalletNewWithSnapshot(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk,
+                                  const uint8_t *snapshot, size_t snapshotLen)
 {
     BRWallet *wallet = NULL;
-    BRTransaction *tx;
+    size_t inCount = 0, outCount = 0;
 
     assert(transactions != NULL || txCount == 0);
+    assert(snapshot != NULL || snapshotLen == 0);
+    for (size_t i = 0; transactions && i < txCount; i++) {
+        inCount += transactions[i]->inCount;
+        outCount += transactions[i]->outCount;
+    }
+    
     wallet = calloc(1, sizeof(*wallet));
     assert(wallet != NULL);
     array_new(wallet->utxos, 100);
+    wallet->utxoAmounts = BRUTXOAmountMapNew(100);
+    array_new(wallet->utxoCoins, 100);
     array_new(wallet->transactions, txCount + 100);
     wallet->feePerKb = DEFAULT_FEE_PER_KB;
     wallet->masterPubKey = mpk;
+    wallet->chainPubKey[SEQUENCE_EXTERNAL_CHAIN] = BRBIP32ChainPubKey(mpk, SEQUENCE_EXTERNAL_CHAIN);
+    wallet->chainPubKey[SEQUENCE_INTERNAL_CHAIN] = BRBIP32ChainPubKey(mpk, SEQUENCE_INTERNAL_CHAIN);
     array_new(wallet->internalChain, 100);
     array_new(wallet->externalChain, 100);
     array_new(wallet->balanceHist, txCount + 100);
     wallet->allTx = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
     wallet->invalidTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
     wallet->pendingTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
-    wallet->spentOutputs = BRSetNew(BRUTXOHash, BRUTXOEq, txCount + 100);
-    wallet->usedAddrs = BRSetNew(BRAddressHash, BRAddressEq, txCount + 100);
-    wallet->allAddrs = BRSetNew(BRAddressHash, BRAddressEq, txCount + 100);
+    wallet->spentOutputs = BRSetNew(BRUTXOHash, BRUTXOEq, inCount + 100);
+    wallet->usedAddrs = BRScriptHashMapNew(outCount + 100);
+    wallet->allAddrs = BRScriptHashMapNew(txCount + 100);
     pthread_mutex_init(&wallet->lock, NULL);
 
-    for (size_t i = 0; transactions && i < txCount; i++) {
-        tx = transactions[i];
-        if (! BRTransactionIsSigned(tx) || BRSetContains(wallet->allTx, tx)) continue;
-        BRSetAdd(wallet->allTx, tx);
-        _BRWalletInsertTx(wallet, tx);
+    if (! snapshot || ! _BRWalletLoadSnapshot(wallet, transactions, txCount, snapshot, snapshotLen)) {
+        _BRWalletBulkInsertTxs(wallet, transactions, txCount);
 
-        for (size_t j = 0; j < tx->outCount; j++) {
-            if (tx->outputs[j].address[0] != '\0') BRSetAdd(wallet->usedAddrs, tx->outputs[j].address);
+        for (size_t i = 0; i < array_count(wallet->transactions); i++) {
+            _BRWalletAddUsedAddrs(wallet, wallet->transactions[i]);
+        }
+        
+        if (txCount > 0) { // restoring a wallet, possibly with a deep address history
+            _BRWalletRestoreChain(wallet, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+            _BRWalletRestoreChain(wallet, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
         }
+        
+        BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+        BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+        _BRWalletUpdateBalance(wallet);
     }
-    
-    BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
-    BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
-    _BRWalletUpdateBalance(wallet);
 
     if (txCount > 0 && ! _BRWalletContainsTx(wallet, transactions[0])) { // verify transactions match master pubKey
         BRWalletFree(wallet);
@@ -280,6 +881,35 @@ BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPub
     return wallet;
 }
 
+// writes a versioned, checksummed binary snapshot of the wallet's derived state to buf, keyed to blockHash, the hash of
+// the last block the wallet has been synced to, for restoring with BRWalletNewWithSnapshot()
+// returns number of bytes written, or buf size needed if buf is NULL, or 0 if buf is too small
+size_t BRWalletSnapshot(BRWallet *wallet, uint8_t *buf, size_t bufLen, UInt256 blockHash)
+{
+    UInt256 md;
+    size_t len;
+    
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    len = _BRWalletSnapshotData(wallet, NULL, 0, blockHash) + sizeof(uint32_t);
+    
+    if (buf && len <= bufLen) {
+        _BRWalletSnapshotData(wallet, buf, bufLen, blockHash);
+        BRSHA256_2(&md, buf, len - sizeof(uint32_t));
+        memcpy(&buf[len - sizeof(uint32_t)], md.u8, sizeof(uint32_t));
+    }
+    
+    pthread_mutex_unlock(&wallet->lock);
+    return (! buf || len <= bufLen) ? len : 0;
+}
+
+// returns the block hash that snapshot is keyed to, or UINT256_ZERO if snapshot is invalid
+UInt256 BRWalletSnapshotBlockHash(const uint8_t *snapshot, size_t snapshotLen)
+{
+    assert(snapshot != NULL || snapshotLen == 0);
+    return (_BRWalletSnapshotIsValid(snapshot, snapshotLen)) ? UInt256Get(&snapshot[sizeof(uint32_t)*2]) : UINT256_ZERO;
+}
+
 // not thread-safe, set callbacks once after BRWalletNew(), before calling other BRWallet functions
 // info is a void pointer that will be passed along with each callback call
 // void balanceChanged(void *, uint64_t) - called when the wallet balance changes
@@ -303,6 +933,41 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
     wallet->txDeleted = txDeleted;
 }
 
+// non-threadsafe version of BRWalletUnusedAddrs(), extends the chain to gapLimit unused addresses past the last used
+// address, and returns the chain index of the first of them, or SIZE_MAX if they couldn't all be derived
+static size_t _BRWalletUnusedAddrs(BRWallet *wallet, uint32_t gapLimit, int internal)
+{
+    const BRScriptHash *addrChain = (internal) ? wallet->internalChain : wallet->externalChain;
+    uint32_t chain = (internal) ? SEQUENCE_INTERNAL_CHAIN : SEQUENCE_EXTERNAL_CHAIN;
+    size_t i, count;
+    
+    i = count = array_count(addrChain);
+    
+    // keep only the trailing contiguous block of addresses with no transactions
+    while (i > 0 && ! BRScriptHashMapGet(wallet->usedAddrs, &addrChain[i - 1])) i--;
+    
+    while (i + gapLimit > count) { // generate new addresses up to gapLimit
+        BRECPoint pubKeys[100];
+        BRScriptHash addr;
+        size_t k, n = (i + gapLimit - count < 100) ? i + gapLimit - count : 100;
+        
+        // every address up to i + gapLimit is needed, so derive them in batches from the cached chain pubKey
+        BRBIP32ChildPubKeyRange(pubKeys, n, wallet->chainPubKey[chain], (uint32_t)count);
+        
+        for (k = 0; k < n; k++) {
+            _BRPubKeyScriptHash(&addr, &pubKeys[k]);
+            if (addr.len == 0) break;
+            _BRWalletAddChainAddr(wallet, &addr, internal);
+            count++;
+            if (BRScriptHashMapGet(wallet->usedAddrs, &addr)) i = count;
+        }
+        
+        if (k < n) break;
+    }
+    
+    return (i + gapLimit <= count) ? i : SIZE_MAX;
+}
+
 // wallets are composed of chains of addresses
 // each chain is traversed until a gap of a number of addresses is found that haven't been used in any transactions
 // this function writes to addrs an array of <gapLimit> unused addresses following the last used address in the chain
@@ -311,58 +976,39 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
 // returns the number addresses written to addrs
 size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, int internal)
 {
-    BRAddress *addrChain;
-    size_t i, j = 0, count, startCount;
-    uint32_t chain = (internal) ? SEQUENCE_INTERNAL_CHAIN : SEQUENCE_EXTERNAL_CHAIN;
+    const BRScriptHash *addrChain;
+    size_t i, j = 0;
 
     assert(wallet != NULL);
     assert(gapLimit > 0);
     pthread_mutex_lock(&wallet->lock);
+    i = _BRWalletUnusedAddrs(wallet, gapLimit, internal);
     addrChain = (internal) ? wallet->internalChain : wallet->externalChain;
-    i = count = startCount = array_count(addrChain);
     
-    // keep only the trailing contiguous block of addresses with no transactions
-    while (i > 0 && ! BRSetContains(wallet->usedAddrs, &addrChain[i - 1])) i--;
-    
-    while (i + gapLimit > count) { // generate new addresses up to gapLimit
-        BRKey key;
-        BRAddress address = BR_ADDRESS_NONE;
-        uint8_t pubKey[BRBIP32PubKey(NULL, 0, wallet->masterPubKey, chain, count)];
-        size_t len = BRBIP32PubKey(pubKey, sizeof(pubKey), wallet->masterPubKey, chain, (uint32_t)count);
-        
-        if (! BRKeySetPubKey(&key, pubKey, len)) break;
-        if (! BRKeyAddress(&key, address.s, sizeof(address)) || BRAddressEq(&address, &BR_ADDRESS_NONE)) break;
-        array_add(addrChain, address);
-        count++;
-        if (BRSetContains(wallet->usedAddrs, &address)) i = count;
-    }
-
-    if (addrs && i + gapLimit <= count) {
-        for (j = 0; j < gapLimit; j++) {
-            addrs[j] = addrChain[i + j];
-        }
+    for (j = 0; addrs && i != SIZE_MAX && j < gapLimit; j++) { // addresses are only base58 encoded when returned
+        addrs[j] = BR_ADDRESS_NONE;
+        BRScriptHashAddress(addrs[j].s, sizeof(addrs[j]), &addrChain[i + j]);
     }
     
-    // was addrChain moved to a new memory location?
-    if (addrChain == (internal ? wallet->internalChain : wallet->externalChain)) {
-        for (i = startCount; i < count; i++) {
-            BRSetAdd(wallet->allAddrs, &addrChain[i]);
-        }
-    }
-    else {
-        if (internal) wallet->internalChain = addrChain;
-        if (! internal) wallet->externalChain = addrChain;
-        BRSetClear(wallet->allAddrs); // clear and rebuild allAddrs
+    pthread_mutex_unlock(&wallet->lock);
+    return j;
+}
 
-        for (i = array_count(wallet->internalChain); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->internalChain[i - 1]);
-        }
-        
-        for (i = array_count(wallet->externalChain); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->externalChain[i - 1]);
-        }
+// same as BRWalletUnusedAddrs(), but writes the binary form of the addresses, with no base58 encoding
+size_t BRWalletUnusedAddrHashes(BRWallet *wallet, BRScriptHash hashes[], uint32_t gapLimit, int internal)
+{
+    size_t i, j = 0;
+    
+    assert(wallet != NULL);
+    assert(gapLimit > 0);
+    pthread_mutex_lock(&wallet->lock);
+    i = _BRWalletUnusedAddrs(wallet, gapLimit, internal);
+    
+    if (hashes && i != SIZE_MAX) {
+        j = gapLimit;
+        memcpy(hashes, (internal) ? &wallet->internalChain[i] : &wallet->externalChain[i], j*sizeof(*hashes));
     }
-
+    
     pthread_mutex_unlock(&wallet->lock);
     return j;
 }
@@ -415,12 +1061,12 @@ size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], siz
 size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions[], size_t txCount,
                                    uint32_t blockHeight)
 {
-    size_t total, n = 0;
+    size_t total, n;
 
     assert(wallet != NULL);
     pthread_mutex_lock(&wallet->lock);
     total = array_count(wallet->transactions);
-    while (n < total && wallet->transactions[(total - n) - 1]->blockHeight >= blockHeight) n++;
+    n = total - _BRWalletTxHeightIndex(wallet, blockHeight);
     if (! transactions || n < txCount) txCount = n;
 
     for (size_t i = 0; transactions && i < txCount; i++) {
@@ -431,6 +1077,77 @@ size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions
     return txCount;
 }
 
+// position in the list written by BRWalletTransactions() of the first transaction with blockHeight at or above the
+// given height, unconfirmed transactions are last, at TX_UNCONFIRMED
+size_t BRWalletTxIndexForHeight(BRWallet *wallet, uint32_t blockHeight)
+{
+    size_t idx;
+
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    idx = _BRWalletTxHeightIndex(wallet, blockHeight);
+    pthread_mutex_unlock(&wallet->lock);
+    return idx;
+}
+
+// position in the list written by BRWalletTransactions() of the first transaction with a timestamp at or after the
+// given unix time, unconfirmed transactions count as the most recent
+size_t BRWalletTxIndexForTime(BRWallet *wallet, uint32_t timestamp)
+{
+    size_t lo = 0, hi, mid;
+
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    hi = _BRWalletTxHeightIndex(wallet, TX_UNCONFIRMED); // unconfirmed tx may have timestamp 0 if they're unverified
+
+    while (lo < hi) { // confirmed tx have their block's timestamp, which mostly increases with height
+        mid = lo + (hi - lo)/2;
+        if (wallet->transactions[mid]->timestamp < timestamp) lo = mid + 1;
+        else hi = mid;
+    }
+
+    pthread_mutex_unlock(&wallet->lock);
+    return lo;
+}
+
+// position of the transaction with txHash in the list written by BRWalletTransactions(), or SIZE_MAX if it isn't in the
+// wallet
+size_t BRWalletTxIndexForHash(BRWallet *wallet, UInt256 txHash)
+{
+    size_t idx;
+
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    idx = _BRWalletTxIndex(wallet, &(BRTransaction) { .txHash = txHash });
+    pthread_mutex_unlock(&wallet->lock);
+    return idx;
+}
+
+// writes up to txCount transactions, starting at position idx in the list written by BRWalletTransactions(), to the
+// transactions array, and the wallet balance after each of them to balances, either of which may be NULL, returns the
+// number written, or the number available from idx if both are NULL
+size_t BRWalletTransactionsAt(BRWallet *wallet, BRTransaction *transactions[], uint64_t balances[], size_t txCount,
+                              size_t idx)
+{
+    size_t n;
+
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    n = (idx < array_count(wallet->transactions)) ? array_count(wallet->transactions) - idx : 0;
+    if ((! transactions && ! balances) || n < txCount) txCount = n;
+
+    for (size_t i = 0; transactions && i < txCount; i++) {
+        transactions[i] = wallet->transactions[idx + i];
+    }
+
+    for (size_t i = 0; balances && i < txCount; i++) {
+        balances[i] = wallet->balanceHist[idx + i];
+    }
+
+    pthread_mutex_unlock(&wallet->lock);
+    return txCount;
+}
+
 // total amount spent from the wallet (exluding change)
 uint64_t BRWalletTotalSent(BRWallet *wallet)
 {
@@ -496,29 +1213,62 @@ size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress addrs[], size_t addrsCount)
                     array_count(wallet->internalChain) : addrsCount;
 
     for (i = 0; addrs && i < internalCount; i++) {
-        addrs[i] = wallet->internalChain[i];
+        addrs[i] = BR_ADDRESS_NONE;
+        BRScriptHashAddress(addrs[i].s, sizeof(addrs[i]), &wallet->internalChain[i]);
     }
 
     externalCount = (! addrs || array_count(wallet->externalChain) < addrsCount - internalCount) ?
                     array_count(wallet->externalChain) : addrsCount - internalCount;
 
     for (i = 0; addrs && i < externalCount; i++) {
-        addrs[internalCount + i] = wallet->externalChain[i];
+        addrs[internalCount + i] = BR_ADDRESS_NONE;
+        BRScriptHashAddress(addrs[internalCount + i].s, sizeof(*addrs), &wallet->externalChain[i]);
     }
 
     pthread_mutex_unlock(&wallet->lock);
     return internalCount + externalCount;
 }
 
+// same as BRWalletAllAddrs(), but writes the binary form of the addresses, for building bloom and compact filters
+size_t BRWalletAllAddrHashes(BRWallet *wallet, BRScriptHash hashes[], size_t hashesCount)
+{
+    size_t internalCount = 0, externalCount = 0;
+    
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    internalCount = (! hashes || array_count(wallet->internalChain) < hashesCount) ?
+                    array_count(wallet->internalChain) : hashesCount;
+    if (hashes) memcpy(hashes, wallet->internalChain, internalCount*sizeof(*hashes));
+    externalCount = (! hashes || array_count(wallet->externalChain) < hashesCount - internalCount) ?
+                    array_count(wallet->externalChain) : hashesCount - internalCount;
+    if (hashes) memcpy(&hashes[internalCount], wallet->externalChain, externalCount*sizeof(*hashes));
+    pthread_mutex_unlock(&wallet->lock);
+    return internalCount + externalCount;
+}
+
 // true if the address was previously generated by BRWalletUnusedAddrs() (even if it's now used)
 int BRWalletContainsAddress(BRWallet *wallet, const char *addr)
 {
+    BRScriptHash h;
     int r = 0;
 
     assert(wallet != NULL);
     assert(addr != NULL);
     pthread_mutex_lock(&wallet->lock);
-    if (addr) r = BRSetContains(wallet->allAddrs, addr);
+    if (addr && BRScriptHashFromAddress(&h, addr)) r = (BRScriptHashMapGet(wallet->allAddrs, &h) != NULL);
+    pthread_mutex_unlock(&wallet->lock);
+    return r;
+}
+
+// same as BRWalletContainsAddress(), but takes the binary form of the address, with no base58 decoding
+int BRWalletContainsAddrHash(BRWallet *wallet, const BRScriptHash *h)
+{
+    int r = 0;
+
+    assert(wallet != NULL);
+    assert(h != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    if (h) r = (BRScriptHashMapGet(wallet->allAddrs, h) != NULL);
     pthread_mutex_unlock(&wallet->lock);
     return r;
 }
@@ -526,12 +1276,13 @@ int BRWalletContainsAddress(BRWallet *wallet, const char *addr)
 // true if the address was previously used as an output in any wallet transaction
 int BRWalletAddressIsUsed(BRWallet *wallet, const char *addr)
 {
+    BRScriptHash h;
     int r = 0;
 
     assert(wallet != NULL);
     assert(addr != NULL);
     pthread_mutex_lock(&wallet->lock);
-    if (addr) r = BRSetContains(wallet->usedAddrs, addr);
+    if (addr && BRScriptHashFromAddress(&h, addr)) r = (BRScriptHashMapGet(wallet->usedAddrs, &h) != NULL);
     pthread_mutex_unlock(&wallet->lock);
     return r;
 }
@@ -580,6 +1331,93 @@ BRTransaction *BRWalletCreateOpsTransaction(BRWallet *wallet,
     return BRWalletCreateTxForOutputs(wallet, outputs, 2);
 }
 
+static int _BRUTXOCoinCompare(const void *c1, const void *c2)
+{
+    const BRUTXOCoin *a = c1, *b = c2;
+    int r;
+    
+    if (a->amount != b->amount) return (a->amount > b->amount) ? -1 : 1;
+    r = memcmp(&a->utxo.hash, &b->utxo.hash, sizeof(a->utxo.hash));
+    if (r == 0 && a->utxo.n != b->utxo.n) r = (a->utxo.n < b->utxo.n) ? -1 : 1;
+    return r;
+}
+
+// rebuilds wallet->utxoCoins from wallet->utxos if it was emptied by a change to utxos
+static void _BRWalletUpdateCoins(BRWallet *wallet)
+{
+    uint64_t *amount;
+    
+    if (array_count(wallet->utxoCoins) == array_count(wallet->utxos)) return;
+    array_clear(wallet->utxoCoins);
+    
+    for (size_t i = 0; i < array_count(wallet->utxos); i++) {
+        amount = BRUTXOAmountMapGet(wallet->utxoAmounts, &wallet->utxos[i]);
+        if (amount) array_add(wallet->utxoCoins, ((BRUTXOCoin) { wallet->utxos[i], *amount }));
+    }
+    
+    qsort(wallet->utxoCoins, array_count(wallet->utxoCoins), sizeof(*wallet->utxoCoins), _BRUTXOCoinCompare);
+}
+
+// size of a tx with inCount unsigned inputs and outCount outputs totalling outSize bytes, as BRTransactionSize()
+// estimates it
+inline static size_t _txSizeForInputs(size_t inCount, size_t outCount, size_t outSize)
+{
+    return 8 + BRVarIntSize(inCount) + BRVarIntSize(outCount) + inCount*TX_INPUT_SIZE + outSize;
+}
+
+// fee for a tx with inCount inputs after adding a change output, increased to round off the remaining wallet balance
+// to nearest 100 satoshi
+inline static uint64_t _BRWalletChangeFee(BRWallet *wallet, uint64_t amount, size_t inCount, size_t outCount,
+                                          size_t outSize)
+{
+    uint64_t fee = _txFee(wallet->feePerKb, _txSizeForInputs(inCount, outCount, outSize) + TX_OUTPUT_SIZE);
+    
+    if (wallet->balance > amount + fee) fee += (wallet->balance - (amount + fee)) % 100;
+    return fee;
+}
+
+// branch and bound search of coins, sorted by descending amount, for at most maxCount of them that pay amount plus the
+// fee for a tx with no change output, overpaying by no more than maxExcess, which then goes to the fee
+// each coin must be worth more than adding it as an input can increase the fee, so every coin added raises the amount
+// left after fees, returns the number of coins selected and writes their indexes to sel[], or 0 if none were found
+static size_t _BRCoinSelectNoChange(size_t sel[], const BRUTXOCoin coins[], size_t count, size_t maxCount,
+                                    uint64_t amount, uint64_t maxExcess, uint64_t feePerKb, size_t outCount,
+                                    size_t outSize)
+{
+    uint64_t fee, total = 0, avail = 0; // avail is the sum of coins not yet included or excluded
+    size_t i = 0, j, n = 0;
+    
+    for (j = 0; j < count; j++) avail += coins[j].amount;
+    
+    for (size_t tries = 0; tries < COIN_SELECT_TRIES; tries++) {
+        fee = _txFee(feePerKb, _txSizeForInputs(n, outCount, outSize));
+        
+        // the fee never decreases as coins are added, and the amount left after fees never decreases either, so a
+        // branch can only lead to a selection if it can still cover amount plus fee, and isn't already overpaying
+        if (total + avail >= amount + fee && total <= amount + fee + maxExcess) {
+            if (n > 0 && total >= amount + fee) return n;
+            
+            if (i < count && n < maxCount) { // include the next coin
+                sel[n++] = i;
+                total += coins[i].amount;
+                avail -= coins[i++].amount;
+                continue;
+            }
+        }
+        
+        if (n == 0) break; // every branch was searched
+        
+        // backtrack: restore the coins passed over since the last one included, then exclude it, along with any coins
+        // after it of the same amount, which would only repeat branches already searched
+        j = sel[--n];
+        while (i > j + 1) avail += coins[--i].amount;
+        total -= coins[j].amount;
+        while (i < count && coins[i].amount == coins[j].amount) avail -= coins[i++].amount;
+    }
+    
+    return 0;
+}
+
 /// Description:
 /// returns an unsigned transaction that satisifes the given transaction outputs
 /// result must be freed by calling BRTransactionFree()
@@ -588,9 +1426,10 @@ BRTransaction *BRWalletCreateOpsTransaction(BRWallet *wallet,
 BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput outputs[], size_t outCount)
 {
     BRTransaction *tx, *transaction = BRTransactionNew();
-    uint64_t feeAmount, amount = 0, balance = 0, minAmount;
-    size_t i, j, cpfpSize = 0;
-    BRUTXO *o;
+    uint64_t feeAmount = 0, amount = 0, balance = 0, minAmount, inputFee;
+    size_t i, j, lo, hi, count, coinCount, maxCount, outSize = 0, selCount = 0;
+    const BRUTXOCoin *coins;
+    const BRUTXO *o;
     BRAddress addr = BR_ADDRESS_NONE;
     
     assert(wallet != NULL);
@@ -600,30 +1439,56 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
         assert(outputs[i].script != NULL && outputs[i].scriptLen > 0);
         BRTransactionAddOutput(transaction, outputs[i].amount, outputs[i].script, outputs[i].scriptLen);
         amount += outputs[i].amount;
+        outSize += sizeof(uint64_t) + BRVarIntSize(outputs[i].scriptLen) + outputs[i].scriptLen;
     }
     
     minAmount = BRWalletMinOutputAmount(wallet);
     pthread_mutex_lock(&wallet->lock);
-    feeAmount = _txFee(wallet->feePerKb, BRTransactionSize(transaction) + TX_OUTPUT_SIZE);
+    _BRWalletUpdateCoins(wallet);
+    coins = wallet->utxoCoins;
+    count = array_count(wallet->utxoCoins);
+    
+    // most inputs the transaction can have and still be under TX_MAX_SIZE after adding a change output
+    for (maxCount = TX_MAX_SIZE/TX_INPUT_SIZE;
+         maxCount > 0 && _txSizeForInputs(maxCount, outCount, outSize) + TX_OUTPUT_SIZE > TX_MAX_SIZE; maxCount--);
+    
+    size_t sel[maxCount + 1];
     
     // TODO: use up all UTXOs for all used addresses to avoid leaving funds in addresses whose public key is revealed
     // TODO: avoid combining addresses in a single transaction when possible to reduce information leakage
     // TODO: use up UTXOs received from any of the output scripts that this transaction sends funds to, to mitigate an
     //       attacker double spending and requesting a refund
-    for (i = 0; i < array_count(wallet->utxos); i++) {
-        o = &wallet->utxos[i];
-        tx = BRSetGet(wallet->allTx, o);
-        if (! tx || o->n >= tx->outCount) continue;
-        BRTransactionAddInput(transaction, tx->txHash, o->n, tx->outputs[o->n].amount,
-                              tx->outputs[o->n].script, tx->outputs[o->n].scriptLen, NULL, 0, TXIN_SEQUENCE);
+    
+    // first look for coins that pay amount plus fee with no change output, leaving out coins worth no more than the
+    // most that adding an input can increase the fee
+    inputFee = (TX_INPUT_SIZE + 2)*wallet->feePerKb/1000 + 100;
+    if (inputFee < TX_FEE_PER_KB) inputFee = TX_FEE_PER_KB;
+    for (coinCount = 0; coinCount < count && coins[coinCount].amount > inputFee; coinCount++);
+    selCount = _BRCoinSelectNoChange(sel, coins, coinCount, maxCount, amount, minAmount, wallet->feePerKb, outCount,
+                                     outSize);
+    if (selCount > 0) feeAmount = _txFee(wallet->feePerKb, _txSizeForInputs(selCount, outCount, outSize));
+    
+    if (selCount == 0 && maxCount > 0) { // next, the smallest single coin that pays amount plus fee with change
+        feeAmount = _BRWalletChangeFee(wallet, amount, 1, outCount, outSize);
+        
+        for (lo = 0, hi = count; lo < hi;) { // find the first coin that's too small
+            i = lo + (hi - lo)/2;
+            if (coins[i].amount >= amount + feeAmount + minAmount) lo = i + 1;
+            else hi = i;
+        }
         
-        if (BRTransactionSize(transaction) + TX_OUTPUT_SIZE > TX_MAX_SIZE) { // transaction size-in-bytes too large
+        if (lo > 0) sel[selCount++] = lo - 1;
+    }
+    
+    // otherwise add the largest coins until they pay amount plus fee
+    for (i = 0, balance = 0; selCount == 0 && i < count; i++) {
+        if (i == maxCount) { // transaction size-in-bytes too large
             BRTransactionFree(transaction);
             transaction = NULL;
-        
+            
             // check for sufficient total funds before building a smaller transaction
-            if (wallet->balance < amount + _txFee(wallet->feePerKb, 10 + array_count(wallet->utxos)*TX_INPUT_SIZE +
-                                                  (outCount + 1)*TX_OUTPUT_SIZE + cpfpSize)) break;
+            if (wallet->balance < amount + _txFee(wallet->feePerKb, 10 + count*TX_INPUT_SIZE +
+                                                  (outCount + 1)*TX_OUTPUT_SIZE)) break;
             pthread_mutex_unlock(&wallet->lock);
 
             if (outputs[outCount - 1].amount > amount + feeAmount + minAmount - balance) {
@@ -643,20 +1508,25 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
             break;
         }
         
-        balance += tx->outputs[o->n].amount;
+        balance += coins[i].amount;
+        feeAmount = _BRWalletChangeFee(wallet, amount, i + 1, outCount, outSize);
         
-//        // size of unconfirmed, non-change inputs for child-pays-for-parent fee
-//        // don't include parent tx with more than 10 inputs or 10 outputs
-//        if (tx->blockHeight == TX_UNCONFIRMED && tx->inCount <= 10 && tx->outCount <= 10 &&
-//            ! _BRWalletTxIsSend(wallet, tx)) cpfpSize += BRTransactionSize(tx);
-
-        // fee amount after adding a change output
-        feeAmount = _txFee(wallet->feePerKb, BRTransactionSize(transaction) + TX_OUTPUT_SIZE + cpfpSize);
-
-        // increase fee to round off remaining wallet balance to nearest 100 satoshi
-        if (wallet->balance > amount + feeAmount) feeAmount += (wallet->balance - (amount + feeAmount)) % 100;
-        
-        if (balance == amount + feeAmount || balance >= amount + feeAmount + minAmount) break;
+        if (balance == amount + feeAmount || balance >= amount + feeAmount + minAmount) {
+            for (selCount = 0; selCount <= i; selCount++) sel[selCount] = selCount;
+        }
+    }
+    
+    if (selCount == 0 && i == count) { // nothing met the target, so spend every coin, any excess goes to the fee
+        for (j = 0; j < count; j++) sel[selCount++] = j;
+    }
+    
+    for (i = 0, balance = 0; transaction && i < selCount; i++) {
+        o = &coins[sel[i]].utxo;
+        tx = BRSetGet(wallet->allTx, o);
+        if (! tx || o->n >= tx->outCount) continue;
+        BRTransactionAddInput(transaction, tx->txHash, o->n, tx->outputs[o->n].amount,
+                              tx->outputs[o->n].script, tx->outputs[o->n].scriptLen, NULL, 0, TXIN_SEQUENCE);
+        balance += tx->outputs[o->n].amount;
     }
     
     pthread_mutex_unlock(&wallet->lock);
@@ -683,7 +1553,48 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
 // returns true if all inputs were signed, or false if there was an error or not all inputs were able to be signed
 int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, int forkId, const void *seed, size_t seedLen)
 {
-    uint32_t j, internalIdx[tx->inCount], externalIdx[tx->inCount];
+    BRWalletSigner signer;
+    int r = -1; // user canceled authentication if there's no seed
+
+    assert(wallet != NULL);
+    assert(tx != NULL);
+
+    if (seed) {
+        BRWalletSignerInit(&signer, seed, seedLen);
+        // TODO: XXX wipe seed callback
+        seed = NULL;
+        r = BRWalletSignTransactionWithSigner(wallet, tx, forkId, &signer);
+        BRWalletSignerClean(&signer);
+    }
+
+    return r;
+}
+
+// derives signer from seed, the master private key corresponding to the wallet's master public key
+// signer must be wiped by calling BRWalletSignerClean() when the signing session ends
+void BRWalletSignerInit(BRWalletSigner *signer, const void *seed, size_t seedLen)
+{
+    assert(signer != NULL);
+    assert(seed != NULL || seedLen == 0);
+    BRBIP32ChainPrivKey(&signer->internal, seed, seedLen, SEQUENCE_INTERNAL_CHAIN);
+    BRBIP32ChainPrivKey(&signer->external, seed, seedLen, SEQUENCE_EXTERNAL_CHAIN);
+}
+
+// wipes signer from memory
+void BRWalletSignerClean(BRWalletSigner *signer)
+{
+    assert(signer != NULL);
+    BRBIP32ChainPrivKeyClean(&signer->internal);
+    BRBIP32ChainPrivKeyClean(&signer->external);
+}
+
+// signs any inputs in tx that can be signed using private keys from the wallet, same as BRWalletSignTransaction(), but
+// using keys derived from signer, returns -1 if signer is NULL
+int BRWalletSignTransactionWithSigner(BRWallet *wallet, BRTransaction *tx, int forkId, const BRWalletSigner *signer)
+{
+    uint32_t internalIdx[tx->inCount], externalIdx[tx->inCount];
+    const uint32_t *idx;
+    BRScriptHash h;
     size_t i, internalCount = 0, externalCount = 0;
     int r = 0;
     
@@ -691,25 +1602,24 @@ int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, int forkId, con
     assert(tx != NULL);
     pthread_mutex_lock(&wallet->lock);
     
-    for (i = 0; tx && i < tx->inCount; i++) {
-        for (j = (uint32_t)array_count(wallet->internalChain); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->internalChain[j - 1])) internalIdx[internalCount++] = j - 1;
-        }
-
-        for (j = (uint32_t)array_count(wallet->externalChain); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->externalChain[j - 1])) externalIdx[externalCount++] = j - 1;
+    for (i = 0; tx && i < tx->inCount; i++) { // look up the chain index of each input's address in allAddrs
+        idx = _BRWalletScriptAddr(wallet, tx->inputs[i].script, tx->inputs[i].scriptLen);
+        
+        if (! idx && tx->inputs[i].address[0] != '\0' && BRScriptHashFromAddress(&h, tx->inputs[i].address)) {
+            idx = BRScriptHashMapGet(wallet->allAddrs, &h);
         }
+        
+        if (idx && (*idx & 1)) internalIdx[internalCount++] = *idx >> 1;
+        else if (idx) externalIdx[externalCount++] = *idx >> 1;
     }
 
     pthread_mutex_unlock(&wallet->lock);
 
     BRKey keys[internalCount + externalCount];
 
-    if (seed) {
-        BRBIP32PrivKeyList(keys, internalCount, seed, seedLen, SEQUENCE_INTERNAL_CHAIN, internalIdx);
-        BRBIP32PrivKeyList(&keys[internalCount], externalCount, seed, seedLen, SEQUENCE_EXTERNAL_CHAIN, externalIdx);
-        // TODO: XXX wipe seed callback
-        seed = NULL;
+    if (signer) {
+        BRBIP32ChildPrivKeyList(keys, internalCount, &signer->internal, internalIdx);
+        BRBIP32ChildPrivKeyList(&keys[internalCount], externalCount, &signer->external, externalIdx);
         if (tx) r = BRTransactionSign(tx, forkId, keys, internalCount + externalCount);
         for (i = 0; i < internalCount + externalCount; i++) BRKeyClean(&keys[i]);
     }
@@ -731,6 +1641,34 @@ int BRWalletContainsTransaction(BRWallet *wallet, const BRTransaction *tx)
     return r;
 }
 
+// true if the serialized transaction indexed by view is associated with the wallet, without parsing it
+int BRWalletContainsTransactionView(BRWallet *wallet, const BRTransactionView *view)
+{
+    BRTxInputView in;
+    BRTxOutputView out;
+    BRTransaction *t;
+    size_t i, off;
+    int r = 0;
+    
+    assert(wallet != NULL);
+    assert(view != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    
+    for (i = 0, off = view->outOff; ! r && i < view->outCount; i++) {
+        BRTransactionViewOutput(view, &off, &out);
+        if (_BRWalletScriptAddr(wallet, out.script, out.scriptLen)) r = 1;
+    }
+    
+    for (i = 0, off = view->inOff; ! r && i < view->inCount; i++) {
+        BRTransactionViewInput(view, &off, &in);
+        t = BRSetGet(wallet->allTx, &in.txHash);
+        if (t && in.index < t->outCount && _BRWalletContainsOutput(wallet, &t->outputs[in.index])) r = 1;
+    }
+    
+    pthread_mutex_unlock(&wallet->lock);
+    return r;
+}
+
 // adds a transaction to the wallet, or returns false if it isn't associated with the wallet
 int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
 {
@@ -748,8 +1686,7 @@ int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
                 // TODO: handle tx replacement with input sequence numbers
                 //       (for now, replacements appear invalid until confirmation)
                 BRSetAdd(wallet->allTx, tx);
-                _BRWalletInsertTx(wallet, tx);
-                _BRWalletUpdateBalance(wallet);
+                _BRWalletUpdateBalanceForTx(wallet, tx, _BRWalletInsertTx(wallet, tx));
                 wasAdded = 1;
             }
             else { // keep track of unconfirmed non-wallet tx for invalid tx checks and child-pays-for-parent fees
@@ -968,15 +1905,14 @@ void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size
     for (i = 0, j = 0; txHashes && i < txCount; i++) {
         tx = BRSetGet(wallet->allTx, &txHashes[i]);
         if (! tx || (tx->blockHeight == blockHeight && tx->timestamp == timestamp)) continue;
+        k = _BRWalletTxIndex(wallet, tx); // found by its current blockHeight, so before that's changed
         tx->timestamp = timestamp;
         tx->blockHeight = blockHeight;
         
         if (_BRWalletContainsTx(wallet, tx)) {
-            for (k = array_count(wallet->transactions); k > 0; k--) { // remove and re-insert tx to keep wallet sorted
-                if (! BRTransactionEq(wallet->transactions[k - 1], tx)) continue;
-                array_rm(wallet->transactions, k - 1);
-                _BRWalletInsertTx(wallet, tx);
-                break;
+            if (k != SIZE_MAX) { // remove and re-insert tx to keep wallet sorted
+                array_rm(wallet->transactions, k);
+                if (_BRWalletInsertTx(wallet, tx) != k) needsUpdate = 1; // balanceHist must follow the new order
             }
             
             hashes[j++] = txHashes[i];
@@ -1034,7 +1970,7 @@ uint64_t BRWalletAmountReceivedFromTx(BRWallet *wallet, const BRTransaction *tx)
     
     // TODO: don't include outputs below TX_MIN_OUTPUT_AMOUNT
     for (size_t i = 0; tx && i < tx->outCount; i++) {
-        if (BRSetContains(wallet->allAddrs, tx->outputs[i].address)) amount += tx->outputs[i].amount;
+        if (_BRWalletContainsOutput(wallet, &tx->outputs[i])) amount += tx->outputs[i].amount;
     }
     
     pthread_mutex_unlock(&wallet->lock);
@@ -1054,7 +1990,7 @@ uint64_t BRWalletAmountSentByTx(BRWallet *wallet, const BRTransaction *tx)
         BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
         uint32_t n = tx->inputs[i].index;
         
-        if (t && n < t->outCount && BRSetContains(wallet->allAddrs, t->outputs[n].address)) {
+        if (t && n < t->outCount && _BRWalletContainsOutput(wallet, &t->outputs[n])) {
             amount += t->outputs[n].amount;
         }
     }
@@ -1095,18 +2031,13 @@ uint64_t BRWalletFeeForTx(BRWallet *wallet, const BRTransaction *tx)
 uint64_t BRWalletBalanceAfterTx(BRWallet *wallet, const BRTransaction *tx)
 {
     uint64_t balance;
+    size_t idx;
     
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
     pthread_mutex_lock(&wallet->lock);
-    balance = wallet->balance;
-    
-    for (size_t i = array_count(wallet->transactions); tx && i > 0; i--) {
-        if (! BRTransactionEq(tx, wallet->transactions[i - 1])) continue;
-        balance = wallet->balanceHist[i - 1];
-        break;
-    }
-
+    idx = _BRWalletTxIndex(wallet, tx);
+    balance = (idx != SIZE_MAX) ? wallet->balanceHist[idx] : wallet->balance;
     pthread_mutex_unlock(&wallet->lock);
     return balance;
 }
@@ -1195,8 +2126,8 @@ void BRWalletFree(BRWallet *wallet)
 {
     assert(wallet != NULL);
     pthread_mutex_lock(&wallet->lock);
-    BRSetFree(wallet->allAddrs);
-    BRSetFree(wallet->usedAddrs);
+    BRScriptHashMapFree(wallet->allAddrs);
+    BRScriptHashMapFree(wallet->usedAddrs);
     BRSetFree(wallet->allTx);
     BRSetFree(wallet->invalidTx);
     BRSetFree(wallet->pendingTx);
@@ -1211,6 +2142,8 @@ void BRWalletFree(BRWallet *wallet)
 
     array_free(wallet->transactions);
     array_free(wallet->utxos);
+    BRUTXOAmountMapFree(wallet->utxoAmounts);
+    array_free(wallet->utxoCoins);
     pthread_mutex_unlock(&wallet->lock);
     pthread_mutex_destroy(&wallet->lock);
     free(wallet);
@@ -1249,3 +2182,10 @@ int64_t BRBitcoinAmount(int64_t localAmount, double price)
     
     return (localAmount < 0) ? -amount : amount;
 }
+
+void BRWalletUpdateBalanceTest(BRWallet *wallet)
+{
+    pthread_mutex_lock(&wallet->lock);
+    _BRWalletUpdateBalance(wallet);
+    pthread_mutex_unlock(&wallet->lock);
+}
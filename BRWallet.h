@@ -61,6 +61,25 @@ typedef struct BRWalletStruct BRWallet;
 // allocates and populates a BRWallet struct that must be freed by calling BRWalletFree()
 BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk);
 
+#define WALLET_SNAPSHOT_VERSION 2
+
+// allocates a BRWallet struct like BRWalletNew(), but restores the state derived from transactions, including the
+// address chains, from a snapshot written by BRWalletSnapshot() instead of rebuilding it, then applies only the
+// transactions the snapshot doesn't include
+// if snapshot is NULL, invalid, of a different wallet, or includes transactions that are missing or have changed block
+// height, the state is rebuilt the same as BRWalletNew()
+// only use a snapshot if its block, given by BRWalletSnapshotBlockHash(), is still in the best chain
+BRWallet *BRWalletNewWithSnapshot(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk,
+                                  const uint8_t *snapshot, size_t snapshotLen);
+
+// writes a versioned, checksummed binary snapshot of the wallet's derived state to buf, keyed to blockHash, the hash of
+// the last block the wallet has been synced to, for restoring with BRWalletNewWithSnapshot()
+// returns number of bytes written, or buf size needed if buf is NULL, or 0 if buf is too small
+size_t BRWalletSnapshot(BRWallet *wallet, uint8_t *buf, size_t bufLen, UInt256 blockHash);
+
+// returns the block hash that snapshot is keyed to, or UINT256_ZERO if snapshot is invalid
+UInt256 BRWalletSnapshotBlockHash(const uint8_t *snapshot, size_t snapshotLen);
+
 // not thread-safe, set callbacks once after BRWalletNew(), before calling other BRWallet functions
 // info is a void pointer that will be passed along with each callback call
 // void balanceChanged(void *, uint64_t) - called when the wallet balance changes
@@ -83,6 +102,9 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
 // returns the number addresses written to addrs
 size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, int internal);
 
+// same as BRWalletUnusedAddrs(), but writes the binary form of the addresses, with no base58 encoding
+size_t BRWalletUnusedAddrHashes(BRWallet *wallet, BRScriptHash hashes[], uint32_t gapLimit, int internal);
+
 // returns the first unused external address
 BRAddress BRWalletReceiveAddress(BRWallet *wallet);
 
@@ -90,9 +112,15 @@ BRAddress BRWalletReceiveAddress(BRWallet *wallet);
 // returns the number addresses written, or total number available if addrs is NULL
 size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress addrs[], size_t addrsCount);
 
+// same as BRWalletAllAddrs(), but writes the binary form of the addresses, for building bloom and compact filters
+size_t BRWalletAllAddrHashes(BRWallet *wallet, BRScriptHash hashes[], size_t hashesCount);
+
 // true if the address was previously generated by BRWalletUnusedAddrs() (even if it's now used)
 int BRWalletContainsAddress(BRWallet *wallet, const char *addr);
 
+// same as BRWalletContainsAddress(), but takes the binary form of the address, with no base58 decoding
+int BRWalletContainsAddrHash(BRWallet *wallet, const BRScriptHash *h);
+
 // true if the address was previously used as an input or output in any wallet transaction
 int BRWalletAddressIsUsed(BRWallet *wallet, const char *addr);
 
@@ -105,6 +133,26 @@ size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], siz
 size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions[], size_t txCount,
                                    uint32_t blockHeight);
 
+// position in the list written by BRWalletTransactions() of the first transaction with blockHeight at or above the
+// given height, unconfirmed transactions are last, at TX_UNCONFIRMED, so the transactions confirmed in blocks start up
+// to end are the ones from BRWalletTxIndexForHeight(start) up to, but not including, BRWalletTxIndexForHeight(end + 1)
+size_t BRWalletTxIndexForHeight(BRWallet *wallet, uint32_t blockHeight);
+
+// position in the list written by BRWalletTransactions() of the first transaction with a timestamp at or after the
+// given unix time, unconfirmed transactions count as the most recent (block timestamps aren't strictly increasing, so
+// for a time close to a block's timestamp, the position found may be off by the transactions in that block)
+size_t BRWalletTxIndexForTime(BRWallet *wallet, uint32_t timestamp);
+
+// position of the transaction with txHash in the list written by BRWalletTransactions(), or SIZE_MAX if it isn't in the
+// wallet, for use as a cursor that stays on the same transaction as others are added or removed
+size_t BRWalletTxIndexForHash(BRWallet *wallet, UInt256 txHash);
+
+// writes up to txCount transactions, starting at position idx in the list written by BRWalletTransactions(), to the
+// transactions array, and the wallet balance after each of them to balances, either of which may be NULL, returns the
+// number written, or the number available from idx if both are NULL (the last n transactions start at total - n)
+size_t BRWalletTransactionsAt(BRWallet *wallet, BRTransaction *transactions[], uint64_t balances[], size_t txCount,
+                              size_t idx);
+
 // current wallet balance, not including transactions known to be invalid
 uint64_t BRWalletBalance(BRWallet *wallet);
 
@@ -139,9 +187,30 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
 // returns true if all inputs were signed, or false if there was an error or not all inputs were able to be signed
 int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, int forkId, const void *seed, size_t seedLen);
 
+// private keys for the wallet's internal and external chains, derived from the seed once for a signing session that
+// may sign several transactions with BRWalletSignTransactionWithSigner()
+typedef struct {
+    BRChainPrivKey internal;
+    BRChainPrivKey external;
+} BRWalletSigner;
+
+// derives signer from seed, the master private key corresponding to the wallet's master public key
+// signer must be wiped by calling BRWalletSignerClean() when the signing session ends
+void BRWalletSignerInit(BRWalletSigner *signer, const void *seed, size_t seedLen);
+
+// wipes signer from memory
+void BRWalletSignerClean(BRWalletSigner *signer);
+
+// signs any inputs in tx that can be signed using private keys from the wallet, same as BRWalletSignTransaction(), but
+// using keys derived from signer, returns -1 if signer is NULL
+int BRWalletSignTransactionWithSigner(BRWallet *wallet, BRTransaction *tx, int forkId, const BRWalletSigner *signer);
+
 // true if the given transaction is associated with the wallet (even if it hasn't been registered)
 int BRWalletContainsTransaction(BRWallet *wallet, const BRTransaction *tx);
 
+// true if the serialized transaction indexed by view is associated with the wallet, without parsing it
+int BRWalletContainsTransactionView(BRWallet *wallet, const BRTransactionView *view);
+
 // adds a transaction to the wallet, or returns false if it isn't associated with the wallet
 int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx);
 
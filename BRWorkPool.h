@@ -0,0 +1,114 @@
+//
+//  BRWorkPool.h
+//
+//  Copyright (c) 2026 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRWorkPool_h
+#define BRWorkPool_h
+
+#include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a parallel for loop over count independent jobs, handed out in chunks to the calling thread and a few worker threads
+//
+// example:
+//
+// static void worker(void *info, BRWorkPool *pool)
+// {
+//     size_t start, n;                                 // set up any per-thread scratch state here
+//
+//     while ((n = BRWorkPoolNext(pool, &start)) > 0) { // jobs start through start + n - 1 are this thread's
+//         ...
+//     }
+// }
+//
+// BRWorkPoolRun(1000, 32, 8, info, worker);           // 1000 jobs, 32 at a time, on at most 8 threads
+
+typedef struct BRWorkPoolStruct {
+    pthread_mutex_t lock;
+    size_t count, chunkSize, next;
+    void *info;
+    void (*worker)(void *info, struct BRWorkPoolStruct *pool);
+} BRWorkPool;
+
+// claims up to chunkSize of the remaining jobs and writes the first one's index to start, returns the number claimed,
+// or 0 once every job has been handed out
+inline static size_t BRWorkPoolNext(BRWorkPool *pool, size_t *start)
+{
+    size_t n;
+
+    pthread_mutex_lock(&pool->lock);
+    *start = pool->next;
+    n = (pool->next < pool->count) ? pool->count - pool->next : 0;
+    if (n > pool->chunkSize) n = pool->chunkSize;
+    pool->next += n;
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
+
+inline static void *_BRWorkPoolThread(void *arg)
+{
+    BRWorkPool *pool = arg;
+
+    pool->worker(pool->info, pool);
+    return NULL;
+}
+
+// runs worker(info, pool) on the calling thread and on as many more threads as there are further chunks of jobs, up to
+// maxThreads in all and no more than the number of available cores, worker claims jobs with BRWorkPoolNext() until it
+// returns 0, and all jobs are done when this returns
+inline static void BRWorkPoolRun(size_t count, size_t chunkSize, size_t maxThreads, void *info,
+                                 void (*worker)(void *info, BRWorkPool *pool))
+{
+    BRWorkPool pool;
+    pthread_t threads[(maxThreads > 1) ? maxThreads - 1 : 1];
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i, threadCount = 0;
+
+    pool.count = count;
+    pool.chunkSize = (chunkSize > 0) ? chunkSize : 1;
+    pool.next = 0;
+    pool.info = info;
+    pool.worker = worker;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    // the calling thread is a worker too, so it's counted against maxThreads and the available cores
+    while (threadCount + 1 < maxThreads && (long)threadCount + 1 < cpuCount &&
+           (threadCount + 1)*pool.chunkSize < count) {
+        if (pthread_create(&threads[threadCount], NULL, _BRWorkPoolThread, &pool) != 0) break;
+        threadCount++;
+    }
+
+    worker(info, &pool);
+    for (i = 0; i < threadCount; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRWorkPool_h
@@ -0,0 +1,686 @@
+//
+//  bench.c
+//
+//  Copyright (c) 2026 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+// benchmarks for the hot paths, built from the same sources as test.c, but with this file in place of test.c
+//
+// usage: bench [-p stream] [name ...]
+// runs the benchmarks whose names start with any of the given names, or all of them, and prints one line for each:
+// name<TAB>iterations<TAB>median ns/op<TAB>min ns/op
+// -p replays a recorded peer message stream (raw bytes as received from a peer socket) instead of the built-in one
+//
+// each benchmark is calibrated so a run takes at least BENCH_RUN_TIME, then timed over BENCH_RUNS runs of the same
+// iteration count, compare the median across commits (redirect to bench_output.txt to keep a copy)
+
+#include "BRCrypto.h"
+#include "BRBloomFilter.h"
+#include "BRMerkleBlock.h"
+#include "BRWallet.h"
+#include "BRKey.h"
+#include "BRAddress.h"
+#include "BRBIP32Sequence.h"
+#include "BRPeer.h"
+#include "BRChainParams.h"
+#include "BRInt.h"
+#include "BRArray.h"
+#include "BRSet.h"
+#include "BRMap.h"
+#include "BRTransaction.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BENCH_RUNS         5
+#define BENCH_RUN_TIME     0.1   // seconds
+#define BENCH_WALLET_ADDS  100   // tx registered per run of the wallet benchmarks, small next to the wallet size
+#define BENCH_SET_COUNT    10000
+#define BENCH_BLOOM_COUNT  10000
+
+#if LITECOIN_TESTNET
+#define BR_CHAIN_PARAMS BRTestNetParams
+#else
+#define BR_CHAIN_PARAMS BRMainNetParams
+#endif
+
+// runs n iterations, and returns the seconds taken by the timed part, so setup and cleanup can be left out
+typedef double (*BRBenchFunc)(void *ctx, size_t n);
+
+static const char **_benchNames = NULL;
+static size_t _benchNamesCount = 0;
+
+static double _benchTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static int _benchTimeCompare(const void *a, const void *b)
+{
+    return (*(const double *)a > *(const double *)b) - (*(const double *)a < *(const double *)b);
+}
+
+// true if name was selected on the command line
+static int _benchSelected(const char *name)
+{
+    for (size_t i = 0; i < _benchNamesCount; i++) {
+        if (strncmp(name, _benchNames[i], strlen(_benchNames[i])) == 0) return 1;
+    }
+
+    return (_benchNamesCount == 0);
+}
+
+// times fn and prints its result line, n is the iteration count for each run, or 0 to calibrate it
+static void _bench(const char *name, BRBenchFunc fn, void *ctx, size_t n)
+{
+    double t, runs[BENCH_RUNS];
+
+    if (! _benchSelected(name)) return;
+
+    if (n == 0) { // grow n until a run takes at least BENCH_RUN_TIME
+        for (n = 1; (t = fn(ctx, n)) < BENCH_RUN_TIME; n *= (t*10 < BENCH_RUN_TIME) ? 10 : 2);
+    }
+
+    for (size_t i = 0; i < BENCH_RUNS; i++) runs[i] = fn(ctx, n)*1e9/n;
+    qsort(runs, BENCH_RUNS, sizeof(*runs), _benchTimeCompare);
+    printf("%s\t%zu\t%.1f\t%.1f\n", name, n, runs[BENCH_RUNS/2], runs[0]);
+    fflush(stdout);
+}
+
+// deterministic filler bytes, so every run of the benchmarks works on the same data
+static void _benchFill(void *buf, size_t len, uint32_t seed)
+{
+    UInt256 h;
+
+    for (size_t off = 0; off < len; off += sizeof(h)) {
+        uint32_t s[2] = { seed, (uint32_t)off };
+
+        BRSHA256(&h, s, sizeof(s));
+        memcpy((uint8_t *)buf + off, &h, (len - off < sizeof(h)) ? len - off : sizeof(h));
+    }
+}
+
+// scrypt
+
+typedef struct {
+    unsigned n, r, p;
+    size_t pwLen, saltLen, dkLen;
+} BRBenchScrypt;
+
+static double _benchScrypt(void *ctx, size_t n)
+{
+    BRBenchScrypt *b = ctx;
+    uint8_t pw[80], salt[80], dk[64];
+    double start;
+
+    _benchFill(pw, sizeof(pw), 1);
+    _benchFill(salt, sizeof(salt), 2);
+    start = _benchTime();
+    for (size_t i = 0; i < n; i++) BRScrypt(dk, b->dkLen, pw, b->pwLen, salt, b->saltLen, b->n, b->r, b->p);
+    return _benchTime() - start;
+}
+
+// sha256
+
+static double _benchSHA256_2(void *ctx, size_t n)
+{
+    size_t len = *(size_t *)ctx;
+    uint8_t *buf = malloc(len);
+    UInt256 md;
+    double start;
+
+    assert(buf != NULL);
+    _benchFill(buf, len, 3);
+    start = _benchTime();
+
+    for (size_t i = 0; i < n; i++) {
+        BRSHA256_2(&md, buf, len);
+        buf[0] = md.u8[0]; // chain each hash into the next so none of them can be skipped
+    }
+
+    start = _benchTime() - start;
+    free(buf);
+    return start;
+}
+
+// transactions
+
+typedef struct {
+    BRTransaction *tx; // signed
+    BRTransaction *unsignedTx;
+    uint8_t *buf;
+    size_t len;
+    BRKey key;
+} BRBenchTx;
+
+// unsigned tx spending inCount outputs to script, with a change output back to it
+static BRTransaction *_benchNewTx(size_t inCount, const uint8_t *script, size_t scriptLen, uint32_t seed)
+{
+    BRTransaction *tx = BRTransactionNew();
+    UInt256 hash;
+
+    for (size_t i = 0; i < inCount; i++) {
+        _benchFill(&hash, sizeof(hash), seed + (uint32_t)i);
+        BRTransactionAddInput(tx, hash, (uint32_t)i, SATOSHIS, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+    }
+
+    BRTransactionAddOutput(tx, inCount*SATOSHIS/2, script, scriptLen);
+    BRTransactionAddOutput(tx, inCount*SATOSHIS/2 - 100000, script, scriptLen);
+    return tx;
+}
+
+static void _benchTxInit(BRBenchTx *b, size_t inCount)
+{
+    UInt256 secret = uint256("0000000000000000000000000000000000000000000000000000000000000001");
+    BRAddress addr;
+
+    BRKeySetSecret(&b->key, &secret, 1);
+    BRKeyAddress(&b->key, addr.s, sizeof(addr));
+
+    uint8_t script[BRAddressScriptPubKey(NULL, 0, addr.s)];
+    size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr.s);
+
+    b->unsignedTx = _benchNewTx(inCount, script, scriptLen, 4);
+    b->tx = BRTransactionCopy(b->unsignedTx);
+    BRTransactionSign(b->tx, 0, &b->key, 1);
+    b->len = BRTransactionSerialize(b->tx, NULL, 0);
+    b->buf = malloc(b->len);
+    assert(b->buf != NULL);
+    b->len = BRTransactionSerialize(b->tx, b->buf, b->len);
+}
+
+static void _benchTxFree(BRBenchTx *b)
+{
+    BRTransactionFree(b->tx);
+    BRTransactionFree(b->unsignedTx);
+    free(b->buf);
+}
+
+static double _benchTxParse(void *ctx, size_t n)
+{
+    BRBenchTx *b = ctx;
+    double start = _benchTime();
+
+    for (size_t i = 0; i < n; i++) BRTransactionFree(BRTransactionParse(b->buf, b->len));
+    return _benchTime() - start;
+}
+
+static double _benchTxSerialize(void *ctx, size_t n)
+{
+    BRBenchTx *b = ctx;
+    uint8_t *buf = malloc(b->len);
+    double start;
+
+    assert(buf != NULL);
+    start = _benchTime();
+    for (size_t i = 0; i < n; i++) BRTransactionSerialize(b->tx, buf, b->len);
+    start = _benchTime() - start;
+    free(buf);
+    return start;
+}
+
+static double _benchTxSign(void *ctx, size_t n)
+{
+    BRBenchTx *b = ctx;
+    BRTransaction **tx = malloc(n*sizeof(*tx));
+    double start;
+
+    assert(tx != NULL);
+    for (size_t i = 0; i < n; i++) tx[i] = BRTransactionCopy(b->unsignedTx);
+    start = _benchTime();
+    for (size_t i = 0; i < n; i++) BRTransactionSign(tx[i], 0, &b->key, 1);
+    start = _benchTime() - start;
+    for (size_t i = 0; i < n; i++) BRTransactionFree(tx[i]);
+    free(tx);
+    return start;
+}
+
+// wallet
+
+typedef struct {
+    BRMasterPubKey mpk;
+    BRTransaction **tx; // count confirmed wallet tx, followed by BENCH_WALLET_ADDS more to register
+    size_t count;
+} BRBenchWallet;
+
+// a confirmed tx paying to script, with a placeholder signature since the wallet doesn't verify signatures
+static BRTransaction *_benchWalletTx(const uint8_t *script, size_t scriptLen, uint32_t seed, uint32_t blockHeight)
+{
+    uint8_t sig[107], buf[512];
+    UInt256 hash;
+    BRTransaction *tx = BRTransactionNew();
+    size_t len;
+
+    _benchFill(&hash, sizeof(hash), seed);
+    _benchFill(sig, sizeof(sig), ~seed);
+    BRTransactionAddInput(tx, hash, 0, SATOSHIS, NULL, 0, sig, sizeof(sig), TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, SATOSHIS/100, script, scriptLen);
+    len = BRTransactionSerialize(tx, buf, sizeof(buf));
+    BRTransactionFree(tx);
+    tx = BRTransactionParse(buf, len); // sets txHash
+    assert(tx != NULL);
+    tx->blockHeight = blockHeight;
+    tx->timestamp = 1500000000 + blockHeight*150;
+    return tx;
+}
+
+static void _benchWalletInit(BRBenchWallet *b, size_t count)
+{
+    BRWallet *w;
+    BRAddress addr;
+
+    b->mpk = BRBIP32MasterPubKey("", 1);
+    w = BRWalletNew(NULL, 0, b->mpk);
+    addr = BRWalletReceiveAddress(w);
+    BRWalletFree(w);
+
+    uint8_t script[BRAddressScriptPubKey(NULL, 0, addr.s)];
+    size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr.s);
+
+    b->count = count;
+    b->tx = malloc((count + BENCH_WALLET_ADDS)*sizeof(*b->tx));
+    assert(b->tx != NULL);
+
+    for (size_t i = 0; i < count + BENCH_WALLET_ADDS; i++) {
+        uint32_t blockHeight = (i < count) ? 100000 + (uint32_t)i/4 : TX_UNCONFIRMED;
+
+        b->tx[i] = _benchWalletTx(script, scriptLen, (uint32_t)i, blockHeight);
+    }
+}
+
+static void _benchWalletFree(BRBenchWallet *b)
+{
+    for (size_t i = 0; i < b->count + BENCH_WALLET_ADDS; i++) BRTransactionFree(b->tx[i]);
+    free(b->tx);
+}
+
+// n is at most BENCH_WALLET_ADDS, so the wallet stays about the same size
+static double _benchWalletRegister(void *ctx, size_t n)
+{
+    BRBenchWallet *b = ctx;
+    BRTransaction **tx = malloc((b->count + n)*sizeof(*tx));
+    BRWallet *w;
+    double start;
+
+    assert(tx != NULL);
+    assert(n <= BENCH_WALLET_ADDS);
+    for (size_t i = 0; i < b->count + n; i++) tx[i] = BRTransactionCopy(b->tx[i]); // the wallet takes ownership
+    w = BRWalletNew(tx, b->count, b->mpk);
+    start = _benchTime();
+    for (size_t i = b->count; i < b->count + n; i++) BRWalletRegisterTransaction(w, tx[i]);
+    start = _benchTime() - start;
+    BRWalletFree(w);
+    free(tx);
+    return start;
+}
+
+// bloom filter
+
+typedef struct {
+    uint8_t (*elems)[sizeof(UInt160)];
+    const uint8_t **items;
+    size_t *itemLens;
+} BRBenchBloom;
+
+static double _benchBloomBuild(void *ctx, size_t n)
+{
+    BRBenchBloom *b = ctx;
+    double start = _benchTime();
+
+    for (size_t i = 0; i < n; i++) { // same batch insert as a full filter load of BENCH_BLOOM_COUNT wallet addresses
+        BRBloomFilter *f = BRBloomFilterNew(BLOOM_DEFAULT_FALSEPOSITIVE_RATE, BENCH_BLOOM_COUNT, (uint32_t)i,
+                                            BLOOM_UPDATE_ALL);
+
+        BRBloomFilterInsertBatch(f, b->items, b->itemLens, BENCH_BLOOM_COUNT);
+        BRBloomFilterFree(f);
+    }
+
+    return _benchTime() - start;
+}
+
+// merkleblock
+
+// block 10001 filtered to include only transactions 0, 1, 2, and 6, the same block as BRMerkleBlockTests()
+static const char _benchBlock[] =
+    "\x01\x00\x00\x00\x06\xe5\x33\xfd\x1a\xda\x86\x39\x1f\x3f\x6c\x34\x32\x04\xb0\xd2\x78\xd4\xaa\xec\x1c"
+    "\x0b\x20\xaa\x27\xba\x03\x00\x00\x00\x00\x00\x6a\xbb\xb3\xeb\x3d\x73\x3a\x9f\xe1\x89\x67\xfd\x7d\x4c\x11\x7e\x4c"
+    "\xcb\xba\xc5\xbe\xc4\xd9\x10\xd9\x00\xb3\xae\x07\x93\xe7\x7f\x54\x24\x1b\x4d\x4c\x86\x04\x1b\x40\x89\xcc\x9b\x0c"
+    "\x00\x00\x00\x08\x4c\x30\xb6\x3c\xfc\xdc\x2d\x35\xe3\x32\x94\x21\xb9\x80\x5e\xf0\xc6\x56\x5d\x35\x38\x1c\xa8\x57"
+    "\x76\x2e\xa0\xb3\xa5\xa1\x28\xbb\xca\x50\x65\xff\x96\x17\xcb\xcb\xa4\x5e\xb2\x37\x26\xdf\x64\x98\xa9\xb9\xca\xfe"
+    "\xd4\xf5\x4c\xba\xb9\xd2\x27\xb0\x03\x5d\xde\xfb\xbb\x15\xac\x1d\x57\xd0\x18\x2a\xae\xe6\x1c\x74\x74\x3a\x9c\x4f"
+    "\x78\x58\x95\xe5\x63\x90\x9b\xaf\xec\x45\xc9\xa2\xb0\xff\x31\x81\xd7\x77\x06\xbe\x8b\x1d\xcc\x91\x11\x2e\xad\xa8"
+    "\x6d\x42\x4e\x2d\x0a\x89\x07\xc3\x48\x8b\x6e\x44\xfd\xa5\xa7\x4a\x25\xcb\xc7\xd6\xbb\x4f\xa0\x42\x45\xf4\xac\x8a"
+    "\x1a\x57\x1d\x55\x37\xea\xc2\x4a\xdc\xa1\x45\x4d\x65\xed\xa4\x46\x05\x54\x79\xaf\x6c\x6d\x4d\xd3\xc9\xab\x65\x84"
+    "\x48\xc1\x0b\x69\x21\xb7\xa4\xce\x30\x21\xeb\x22\xed\x6b\xb6\xa7\xfd\xe1\xe5\xbc\xc4\xb1\xdb\x66\x15\xc6\xab\xc5"
+    "\xca\x04\x21\x27\xbf\xaf\x9f\x44\xeb\xce\x29\xcb\x29\xc6\xdf\x9d\x05\xb4\x7f\x35\xb2\xed\xff\x4f\x00\x64\xb5\x78"
+    "\xab\x74\x1f\xa7\x82\x76\x22\x26\x51\x20\x9f\xe1\xa2\xc4\xc0\xfa\x1c\x58\x51\x0a\xec\x8b\x09\x0d\xd1\xeb\x1f\x82"
+    "\xf9\xd2\x61\xb8\x27\x3b\x52\x5b\x02\xff\x1a";
+
+static double _benchMerkleBlockParse(void *ctx, size_t n)
+{
+    double start = _benchTime();
+
+    for (size_t i = 0; i < n; i++) {
+        BRMerkleBlockFree(BRMerkleBlockParse((const uint8_t *)_benchBlock, sizeof(_benchBlock) - 1));
+    }
+
+    return _benchTime() - start;
+}
+
+// set
+
+typedef struct {
+    UInt256 *hashes;
+    BRSet *set; // holds all of hashes, for lookups
+} BRBenchSet;
+
+static double _benchSetInsert(void *ctx, size_t n)
+{
+    BRBenchSet *b = ctx;
+    BRSet *set = BRSetNew(BRUInt256Hash, BRUInt256Eq, 0);
+    double start = _benchTime();
+
+    for (size_t i = 0; i < n; i++) { // each iteration inserts BENCH_SET_COUNT hashes into an emptied set
+        BRSetClear(set);
+        for (size_t j = 0; j < BENCH_SET_COUNT; j++) BRSetAdd(set, &b->hashes[j]);
+    }
+
+    start = _benchTime() - start;
+    BRSetFree(set);
+    return start;
+}
+
+static double _benchSetLookup(void *ctx, size_t n)
+{
+    BRBenchSet *b = ctx;
+    size_t found = 0;
+    double start = _benchTime();
+
+    for (size_t i = 0; i < n; i++) { // each iteration looks up BENCH_SET_COUNT hashes
+        for (size_t j = 0; j < BENCH_SET_COUNT; j++) found += BRSetContains(b->set, &b->hashes[j]);
+    }
+
+    start = _benchTime() - start;
+    assert(found == n*BENCH_SET_COUNT);
+    return start;
+}
+
+// peer message stream
+
+void BRPeerAcceptMessageTest(BRPeer *peer, const uint8_t *msg, size_t len, const char *type);
+
+typedef struct {
+    uint8_t *stream; // wire format messages, each a 24 byte header followed by its payload
+    size_t len;
+} BRBenchPeer;
+
+static void _benchPeerAddMessage(BRBenchPeer *b, const char *type, const uint8_t *msg, size_t msgLen)
+{
+    uint8_t header[24];
+    UInt256 hash;
+
+    UInt32SetLE(&header[0], BR_CHAIN_PARAMS.magicNumber);
+    memset(&header[4], 0, 12);
+    strncpy((char *)&header[4], type, 12);
+    UInt32SetLE(&header[16], (uint32_t)msgLen);
+    BRSHA256_2(&hash, msg, msgLen);
+    memcpy(&header[20], &hash, sizeof(uint32_t));
+    b->stream = realloc(b->stream, b->len + sizeof(header) + msgLen);
+    assert(b->stream != NULL);
+    memcpy(&b->stream[b->len], header, sizeof(header));
+    memcpy(&b->stream[b->len + sizeof(header)], msg, msgLen);
+    b->len += sizeof(header) + msgLen;
+}
+
+// the built-in stream, a mix of what a peer sends while synced: tx invs, addrs, a merkleblock and its tx, and pings
+static void _benchPeerInit(BRBenchPeer *b, const BRBenchTx *tx)
+{
+    uint8_t msg[0x8000];
+    size_t off;
+    BRMerkleBlock *block = BRMerkleBlockNew();
+    uint8_t flags = 0x01;
+
+    memset(b, 0, sizeof(*b));
+
+    for (uint32_t k = 0; k < 10; k++) {
+        off = BRVarIntSet(msg, sizeof(msg), 500);
+
+        for (uint32_t i = 0; i < 500; i++, off += sizeof(UInt256)) { // inv of tx hashes the peer hasn't seen before
+            UInt32SetLE(&msg[off], 1);
+            off += sizeof(uint32_t);
+            _benchFill(&msg[off], sizeof(UInt256), k*500 + i);
+        }
+
+        _benchPeerAddMessage(b, MSG_INV, msg, off);
+        off = BRVarIntSet(msg, sizeof(msg), 100);
+
+        for (uint32_t i = 0; i < 100; i++) { // addr with 100 IPv4 peers
+            UInt32SetLE(&msg[off], 1500000000 + k);
+            UInt64SetLE(&msg[off + 4], SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM);
+            memset(&msg[off + 12], 0, 10);
+            msg[off + 22] = msg[off + 23] = 0xff;
+            msg[off + 24] = 10, msg[off + 25] = (uint8_t)k, msg[off + 26] = 0, msg[off + 27] = (uint8_t)i;
+            UInt16SetBE(&msg[off + 28], BR_CHAIN_PARAMS.standardPort);
+            off += 30;
+        }
+
+        _benchPeerAddMessage(b, MSG_ADDR, msg, off);
+        UInt64SetLE(msg, k);
+        _benchPeerAddMessage(b, MSG_PING, msg, sizeof(uint64_t));
+    }
+
+    // a merkleblock matching a single tx, followed by that tx
+    _benchFill(&block->prevBlock, sizeof(block->prevBlock), 5);
+    block->merkleRoot = tx->tx->txHash;
+    block->timestamp = 1500000000;
+    block->target = 0x1e0ffff0;
+    block->totalTx = 1;
+    BRMerkleBlockSetTxHashes(block, &tx->tx->txHash, 1, &flags, 1);
+    off = BRMerkleBlockSerialize(block, msg, sizeof(msg));
+    BRMerkleBlockFree(block);
+    _benchPeerAddMessage(b, MSG_MERKLEBLOCK, msg, off);
+    _benchPeerAddMessage(b, MSG_TX, tx->buf, tx->len);
+}
+
+static int _benchPeerLoad(BRBenchPeer *b, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    long len;
+
+    memset(b, 0, sizeof(*b));
+    if (! f) return 0;
+
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        b->stream = malloc(len);
+        assert(b->stream != NULL);
+        b->len = fread(b->stream, 1, len, f);
+    }
+
+    fclose(f);
+    return (b->len > 0);
+}
+
+static double _benchPeerReplay(void *ctx, size_t n)
+{
+    BRBenchPeer *b = ctx;
+    int out = dup(STDOUT_FILENO), null = open("/dev/null", O_WRONLY);
+    uint8_t filter[] = { 0 };
+    double start, t = 0;
+
+    fflush(stdout);
+    dup2(null, STDOUT_FILENO); // discard peer_log() output, so what's timed is message handling, not the terminal
+
+    for (size_t i = 0; i < n; i++) {
+        BRPeer *peer = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
+        size_t off = 0, msgLen;
+
+        // the sends fail since peer isn't connected, but they mark the filter and getaddr as sent, so invs, addrs,
+        // and merkleblocks get all the way through their handlers
+        BRPeerSendFilterload(peer, filter, sizeof(filter));
+        BRPeerSendGetaddr(peer);
+        start = _benchTime();
+
+        while (off + 24 <= b->len) { // same framing as the peer receive loop, skipping ahead on bad magic numbers
+            if (UInt32GetLE(&b->stream[off]) != BR_CHAIN_PARAMS.magicNumber) {
+                off++;
+                continue;
+            }
+
+            msgLen = UInt32GetLE(&b->stream[off + 16]);
+            if (off + 24 + msgLen > b->len) break;
+            b->stream[off + 15] = '\0'; // type is NULL terminated in a valid header
+            BRPeerAcceptMessageTest(peer, &b->stream[off + 24], msgLen, (const char *)&b->stream[off + 4]);
+            off += 24 + msgLen;
+        }
+
+        t += _benchTime() - start;
+        BRPeerFree(peer);
+    }
+
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    close(null);
+    return t;
+}
+
+int main(int argc, const char *argv[])
+{
+    const char *streamPath = NULL;
+    char name[64];
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) streamPath = argv[++i];
+        else _benchNames = realloc(_benchNames, (_benchNamesCount + 1)*sizeof(*_benchNames)),
+             _benchNames[_benchNamesCount++] = argv[i];
+    }
+
+    printf("# name\titerations\tmedian ns/op\tmin ns/op\n");
+
+    BRBenchScrypt pow = { 1024, 1, 1, 80, 80, 32 }, bip38 = { 16384, 8, 8, 8, 4, 64 };
+
+    _bench("scrypt_pow", _benchScrypt, &pow, 0); // a block header's proof-of-work hash
+    _bench("scrypt_bip38", _benchScrypt, &bip38, 0); // a BIP38 non-EC-multiplied key derivation
+
+    size_t shaLens[] = { 80, 1024 };
+
+    for (size_t i = 0; i < sizeof(shaLens)/sizeof(*shaLens); i++) {
+        snprintf(name, sizeof(name), "sha256_2_%zu", shaLens[i]);
+        _bench(name, _benchSHA256_2, &shaLens[i], 0);
+    }
+
+    size_t inCounts[] = { 1, 10, 500 };
+    BRBenchFunc txFuncs[] = { _benchTxParse, _benchTxSerialize, _benchTxSign };
+    const char *txNames[] = { "parse", "serialize", "sign" };
+    char names[3][64];
+    BRBenchTx tx1;
+
+    for (size_t i = 0; i < sizeof(inCounts)/sizeof(*inCounts); i++) {
+        BRBenchTx tx;
+        int selected = 0;
+
+        for (size_t j = 0; j < 3; j++) {
+            snprintf(names[j], sizeof(*names), "tx_%s_%zu_in", txNames[j], inCounts[i]);
+            selected |= _benchSelected(names[j]);
+        }
+
+        if (! selected) continue; // skip building and signing the tx when none of its benchmarks will run
+        _benchTxInit(&tx, inCounts[i]);
+        for (size_t j = 0; j < 3; j++) _bench(names[j], txFuncs[j], &tx, 0);
+        _benchTxFree(&tx);
+    }
+
+    size_t walletCounts[] = { 1000, 10000, 100000 };
+
+    for (size_t i = 0; i < sizeof(walletCounts)/sizeof(*walletCounts); i++) {
+        BRBenchWallet w;
+
+        snprintf(name, sizeof(name), "wallet_register_%zuk", walletCounts[i]/1000);
+        if (! _benchSelected(name)) continue;
+        _benchWalletInit(&w, walletCounts[i]);
+        _bench(name, _benchWalletRegister, &w, BENCH_WALLET_ADDS);
+        _benchWalletFree(&w);
+    }
+
+    if (_benchSelected("bloom_build_10k")) {
+        BRBenchBloom bloom;
+
+        bloom.elems = malloc(BENCH_BLOOM_COUNT*sizeof(*bloom.elems));
+        bloom.items = malloc(BENCH_BLOOM_COUNT*sizeof(*bloom.items));
+        bloom.itemLens = malloc(BENCH_BLOOM_COUNT*sizeof(*bloom.itemLens));
+        assert(bloom.elems != NULL && bloom.items != NULL && bloom.itemLens != NULL);
+        _benchFill(bloom.elems, BENCH_BLOOM_COUNT*sizeof(*bloom.elems), 6);
+
+        for (size_t i = 0; i < BENCH_BLOOM_COUNT; i++) {
+            bloom.items[i] = bloom.elems[i];
+            bloom.itemLens[i] = sizeof(*bloom.elems);
+        }
+
+        _bench("bloom_build_10k", _benchBloomBuild, &bloom, 0);
+        free(bloom.itemLens);
+        free(bloom.items);
+        free(bloom.elems);
+    }
+
+    _bench("merkleblock_parse", _benchMerkleBlockParse, NULL, 0);
+
+    if (_benchSelected("set_insert_10k") || _benchSelected("set_lookup_10k")) {
+        BRBenchSet set;
+
+        set.hashes = malloc(BENCH_SET_COUNT*sizeof(*set.hashes));
+        assert(set.hashes != NULL);
+        _benchFill(set.hashes, BENCH_SET_COUNT*sizeof(*set.hashes), 7);
+        set.set = BRSetNew(BRUInt256Hash, BRUInt256Eq, BENCH_SET_COUNT);
+        for (size_t i = 0; i < BENCH_SET_COUNT; i++) BRSetAdd(set.set, &set.hashes[i]);
+        _bench("set_insert_10k", _benchSetInsert, &set, 0);
+        _bench("set_lookup_10k", _benchSetLookup, &set, 0);
+        BRSetFree(set.set);
+        free(set.hashes);
+    }
+
+    if (_benchSelected("peer_replay")) {
+        BRBenchPeer peer;
+
+        if (streamPath && ! _benchPeerLoad(&peer, streamPath)) {
+            fprintf(stderr, "failed to read peer message stream: %s\n", streamPath);
+            return 1;
+        }
+
+        if (! streamPath) {
+            _benchTxInit(&tx1, 1);
+            _benchPeerInit(&peer, &tx1);
+            _benchTxFree(&tx1);
+        }
+
+        _bench("peer_replay", _benchPeerReplay, &peer, 0);
+        free(peer.stream);
+    }
+
+    free(_benchNames);
+    return 0;
+}
@@ -24,7 +24,9 @@
 
 #include "BRCrypto.h"
 #include "BRBloomFilter.h"
+#include "BRCompactFilter.h"
 #include "BRMerkleBlock.h"
+#include "BRHeaderStore.h"
 #include "BRWallet.h"
 #include "BRKey.h"
 #include "BRBIP38Key.h"
@@ -40,6 +42,7 @@
 #include "BRInt.h"
 #include "BRArray.h"
 #include "BRSet.h"
+#include "BRMap.h"
 #include "BRTransaction.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -171,6 +174,11 @@ inline static size_t hash_int(const void *i)
     return (size_t)((0x811C9dc5 ^ *(const unsigned *)i)*0x01000193); // (FNV_OFFSET xor i)*FNV_PRIME
 }
 
+inline static size_t hash_int2(const void *i)
+{
+    return (size_t)*(const unsigned *)i;
+}
+
 inline static int eq_int(const void *a, const void *b)
 {
     return (*(const int *)a == *(const int *)b);
@@ -207,6 +215,66 @@ int BRSetTests()
 
     if (BRSetCount(s) != 0) r = 0, fprintf(stderr, "***FAILED*** %s: BRSetCount() test 2\n", __func__);
     
+    BRSetReserve(s, 1000);
+    
+    for (i = 0; i < 1000; i++) {
+        BRSetAdd(s, &x[i]);
+    }
+    
+    int *t = NULL, n = 0;
+    
+    while ((t = BRSetIterate(s, t)) != NULL) n++;
+    if (n != 1000) r = 0, fprintf(stderr, "***FAILED*** %s: BRSetIterate() test\n", __func__);
+    
+    BRSet *s2 = BRSetNew(hash_int2, eq_int, 0); // different hash function, so cached hashes can't be reused
+    
+    BRSetAdd(s2, &x[999]);
+    if (! BRSetIntersects(s, s2) || ! BRSetIntersects(s2, s))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRSetIntersects() test 1\n", __func__);
+    
+    BRSetRemove(s, &x[999]);
+    if (BRSetIntersects(s, s2) || BRSetIntersects(s2, s))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRSetIntersects() test 2\n", __func__);
+    
+    BRSetFree(s2);
+    BRSetFree(s);
+    return r;
+}
+
+map_define(BRTestMap, UInt256, int, BRUInt256Hash, BRUInt256Eq);
+
+int BRMapTests()
+{
+    int r = 1, i, *v;
+    UInt256 k[1000];
+    BRTestMap *m = BRTestMapNew(0);
+    
+    for (i = 0; i < 1000; i++) {
+        BRSHA256(&k[i], &i, sizeof(i));
+        BRTestMapSet(m, &k[i], i);
+    }
+    
+    BRTestMapSet(m, &k[0], 1000); // replace existing value
+    if (BRTestMapCount(m) != 1000) r = 0, fprintf(stderr, "***FAILED*** %s: BRTestMapSet() test\n", __func__);
+    
+    for (i = 1; i < 1000; i++) {
+        v = BRTestMapGet(m, &k[i]);
+        if (! v || *v != i) r = 0, fprintf(stderr, "***FAILED*** %s: BRTestMapGet() test %d\n", __func__, i);
+    }
+    
+    for (i = 0; i < 1000; i += 2) {
+        if (! BRTestMapRemove(m, &k[i]))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRTestMapRemove() test %d\n", __func__, i);
+    }
+    
+    for (i = 0; i < 1000; i++) {
+        v = BRTestMapGet(m, &k[i]);
+        if ((v != NULL) != (i % 2 == 1) || (v && *v != i))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRTestMapGet() test %d\n", __func__, i);
+    }
+    
+    if (BRTestMapCount(m) != 500) r = 0, fprintf(stderr, "***FAILED*** %s: BRTestMapCount() test\n", __func__);
+    BRTestMapFree(m);
     return r;
 }
 
@@ -346,6 +414,8 @@ int BRBech32Tests()
     return r;
 }
 
+int BRSHA256HWTest(int hw);
+
 int BRHashTests()
 {
     // test sha1
@@ -426,6 +496,45 @@ int BRHashTests()
                     "\x14\x7c\x4e\x72\xb9\x80\x77\x85\xaf\xee\x48\xbb", *(UInt256 *)md))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256() test 6\n", __func__);
 
+    const void *msgs[] = { "", "a", "1234567890123456789012345678901234567890123456789012345678901234",
+                           "this is some text to test the sha256 implementation with more than 64bytes of data since "
+                           "it's internal digest buffer is 64bytes in size", "123456789012345678901234567890123456",
+                           "12345678901234567890123456789012345678901234567890123456" };
+    size_t msgLens[] = { 0, 1, 64, 135, 36, 56 };
+    UInt256 mds[6], md2;
+    void *mdPtrs[] = { &mds[0], &mds[1], &mds[2], &mds[3], &mds[4], &mds[5] };
+
+    // on cpus with sha instructions, the second pass forces the simd lanes
+    for (int pass = 0; pass < 2 && (pass == 0 || BRSHA256HWTest(0)); pass++) {
+        BRSHA256Multi(mdPtrs, msgs, msgLens, 6);
+
+        for (size_t i = 0; i < 6; i++) {
+            BRSHA256(&md2, msgs[i], msgLens[i]);
+            if (! UInt256Eq(md2, mds[i]))
+                r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256Multi() test %zu\n", __func__, i);
+        }
+
+        BRSHA256_2Multi(mdPtrs, msgs, msgLens, 6);
+
+        for (size_t i = 0; i < 6; i++) {
+            BRSHA256_2(&md2, msgs[i], msgLens[i]);
+            if (! UInt256Eq(md2, mds[i]))
+                r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256_2Multi() test %zu\n", __func__, i);
+        }
+    }
+
+    BRSHA256HWTest(-1);
+
+    BRSHA256Ctx ctx;
+
+    BRSHA256Init(&ctx);
+    BRSHA256Update(&ctx, msgs[3], 10);
+    BRSHA256Update(&ctx, (const char *)msgs[3] + 10, 70);
+    BRSHA256Update(&ctx, (const char *)msgs[3] + 80, msgLens[3] - 80);
+    BRSHA256Final(&ctx, &md2);
+    BRSHA256(mds, msgs[3], msgLens[3]);
+    if (! UInt256Eq(md2, mds[0])) r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256Update() test\n", __func__);
+
     // test sha512
     
     s = "Free online SHA512 Calculator, type text here...";
@@ -473,6 +582,17 @@ int BRHashTests()
                     "\x18\x33\x5d\xe0\x5a\xbc\x54\xd0\x56\x0e\x0f\x53\x02\x86\x0c\x65\x2b\xf0\x8d\x56\x02\x52"
                     "\xaa\x5e\x74\x21\x05\x46\xf3\x69\xfb\xbb\xce\x8c\x12\xcf\xc7\x95\x7b\x26\x52\xfe\x9a\x75",
                     *(UInt512 *)md)) r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA512() test 6\n", __func__);
+
+    BRSHA512Ctx ctx512;
+    UInt512 md512;
+
+    BRSHA512Init(&ctx512);
+    BRSHA512Update(&ctx512, msgs[3], 100);
+    BRSHA512Update(&ctx512, (const char *)msgs[3] + 100, msgLens[3] - 100);
+    BRSHA512Final(&ctx512, &md512);
+    BRSHA512(md, msgs[3], msgLens[3]);
+    if (! UInt512Eq(md512, *(UInt512 *)md))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA512Update() test\n", __func__);
     
     // test ripemd160
     
@@ -571,6 +691,18 @@ int BRHashTests()
                     "\x82\x27\x3b\x7b\xfa\xd8\x04\x5d\x85\xa4\x70", *(UInt256 *)md))
         r = 0, fprintf(stderr, "***FAILED*** %s: Keccak-256() test 10\n", __func__);
     
+    // test siphash-2-4, reference vectors with key 00 01 02 ... 0f and data 00 01 02 ...
+    
+    uint8_t key[16], data[15];
+    
+    for (size_t i = 0; i < sizeof(key); i++) key[i] = i;
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = i;
+    if (BRSipHash24(key, data, 0) != 0x726fdb47dd0e0e31)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRSipHash24() test 11\n", __func__);
+    
+    if (BRSipHash24(key, data, 15) != 0xa129ca6149be45e5)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRSipHash24() test 12\n", __func__);
+    
     return r;
 }
 
@@ -726,6 +858,36 @@ int BRMacTests()
     if (memcmp("\x13\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", mac, 16) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRPoly1305() test 11\n", __func__);
     
+    // scrypt test vectors: https://tools.ietf.org/html/rfc7914#section-12
+    uint8_t dk[64], dk2[64], dk3[64];
+    
+    BRScrypt(dk, sizeof(dk), "", 0, "", 0, 16, 1, 1);
+    if (memcmp("\x77\xd6\x57\x62\x38\x65\x7b\x20\x3b\x19\xca\x42\xc1\x8a\x04\x97\xf1\x6b\x48\x44\xe3\x07\x4a\xe8\xdf\xdf"
+               "\xfa\x3f\xed\xe2\x14\x42\xfc\xd0\x06\x9d\xed\x09\x48\xf8\x32\x6a\x75\x3a\x0f\xc8\x1f\x17\xe8\xd3\xe0\xfb"
+               "\x2e\x0d\x36\x28\xcf\x35\xe2\x0c\x38\xd1\x89\x06", dk, sizeof(dk)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRScrypt() test 1\n", __func__);
+    
+    BRScrypt(dk, sizeof(dk), "password", 8, "NaCl", 4, 1024, 8, 16);
+    if (memcmp("\xfd\xba\xbe\x1c\x9d\x34\x72\x00\x78\x56\xe7\x19\x0d\x01\xe9\xfe\x7c\x6a\xd7\xcb\xc8\x23\x78\x30\xe7\x73"
+               "\x76\x63\x4b\x37\x31\x62\x2e\xaf\x30\xd9\x2e\x22\xa3\x88\x6f\xf1\x09\x27\x9d\x98\x30\xda\xc7\x27\xaf\xb9"
+               "\x4a\x83\xee\x6d\x83\x60\xcb\xdf\xa2\xcc\x06\x40", dk, sizeof(dk)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRScrypt() test 2\n", __func__);
+    
+    BRScryptCtx ctx;
+    void *dks[] = { dk2, dk3 };
+    const void *pws[] = { "password", "password" }, *salts[] = { "NaCl", "NaCl" };
+    
+    BRScryptCtxInit(&ctx, 0);
+    BRScryptCtxDerive(&ctx, dk2, sizeof(dk2), "password", 8, "NaCl", 4, 1024, 8, 16);
+    if (memcmp(dk, dk2, sizeof(dk)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRScryptCtxDerive() test\n", __func__);
+    
+    memset(dk2, 0, sizeof(dk2));
+    BRScryptBatch(&ctx, dks, sizeof(dk), pws, 8, salts, 4, 2, 1024, 8, 16);
+    if (memcmp(dk, dk2, sizeof(dk)) != 0 || memcmp(dk, dk3, sizeof(dk)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRScryptBatch() test\n", __func__);
+
+    BRScryptCtxFree(&ctx);
     return r;
 }
 
@@ -1417,6 +1579,36 @@ int BRAddressTests()
     if (script3Len != sizeof(script2) || memcmp(script2, script3, sizeof(script2)))
         r = 0, fprintf(stderr, "\n***FAILED*** %s: BRAddressScriptPubKey() test", __func__);
 
+    BRScriptHash h, h2;
+    UInt160 hash = BRKeyHash160(&k);
+
+    if (! BRScriptHashFromScriptPubKey(&h, script, scriptLen) || h.type != SCRIPT_HASH_PUBKEY ||
+        h.len != sizeof(hash) || memcmp(h.data, hash.u8, sizeof(hash)) != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRScriptHashFromScriptPubKey() test 1", __func__);
+
+    uint8_t script4[BRKeyPubKey(&k, NULL, 0) + 2];
+
+    script4[0] = BRKeyPubKey(&k, &script4[1], sizeof(script4) - 2);
+    script4[sizeof(script4) - 1] = OP_CHECKSIG;
+    if (! BRScriptHashFromScriptPubKey(&h2, script4, sizeof(script4)) || ! BRScriptHashEq(&h, &h2))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRScriptHashFromScriptPubKey() test 2", __func__);
+
+    addr2 = BR_ADDRESS_NONE;
+    BRScriptHashAddress(addr2.s, sizeof(addr2), &h);
+    if (! BRAddressEq(&addr, &addr2) || ! BRScriptHashFromAddress(&h2, addr.s) || ! BRScriptHashEq(&h, &h2))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRScriptHashAddress() test 1", __func__);
+
+    if (! BRScriptHashFromScriptPubKey(&h, (uint8_t *)script2, sizeof(script2)) ||
+        h.type != SCRIPT_HASH_WITNESS || ! BRScriptHashFromAddress(&h2, addr3.s) || ! BRScriptHashEq(&h, &h2))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRScriptHashFromScriptPubKey() test 3", __func__);
+
+    if (BRScriptHashScriptPubKey(script3, sizeof(script3), &h) != sizeof(script2) ||
+        memcmp(script2, script3, sizeof(script2)))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRScriptHashScriptPubKey() test", __func__);
+
+    if (BRScriptHashFromScriptPubKey(&h, script, scriptLen - 1) || BRScriptHashFromAddress(&h, "1CC3X2gu58d6wXUW"))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRScriptHashFromScriptPubKey() test 4", __func__);
+
     if (! r) fprintf(stderr, "\n                                    ");
     return r;
 }
@@ -1586,7 +1778,19 @@ int BRBIP32SequenceTests()
     printf("000102030405060708090a0b0c0d0e0f/0H/0/97 prv = %s\n", u256hex(key.secret));
     if (! UInt256Eq(key.secret, uint256("00136c1ad038f9a00871895322a487ed14f1cdc4d22ad351cfa1a0d235975dd7")))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32PrivKey() test 2\n", __func__);
-    
+
+    BRChainPrivKey chainKey;
+    uint32_t idx[] = { 97, 0 };
+    BRKey keys[2];
+
+    BRBIP32ChainPrivKey(&chainKey, &seed, sizeof(seed), SEQUENCE_EXTERNAL_CHAIN);
+    BRBIP32ChildPrivKeyList(keys, 2, &chainKey, idx);
+    BRBIP32ChainPrivKeyClean(&chainKey);
+    BRBIP32PrivKey(&key, &seed, sizeof(seed), SEQUENCE_EXTERNAL_CHAIN, 0);
+    if (! UInt256Eq(keys[0].secret, uint256("00136c1ad038f9a00871895322a487ed14f1cdc4d22ad351cfa1a0d235975dd7")) ||
+        ! UInt256Eq(keys[1].secret, key.secret))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32ChildPrivKeyList() test\n", __func__);
+
     BRMasterPubKey mpk = BRBIP32MasterPubKey(&seed, sizeof(seed));
     
 //    printf("000102030405060708090a0b0c0d0e0f/0H fp:%08x chain:%s pubkey:%02x%s\n", be32(mpk.fingerPrint),
@@ -1607,6 +1811,16 @@ int BRBIP32SequenceTests()
                     uint256("7b6a7dd645507d775215a9035be06700e1ed8c541da9351b4bd14bd50ab61428")))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32PubKey() test\n", __func__);
 
+    BRECPoint pubKeys[2];
+    
+    BRBIP32PubKeyRange(pubKeys, 2, mpk, SEQUENCE_EXTERNAL_CHAIN, 0);
+    if (memcmp(pubKeys[0].p, pubKey, sizeof(pubKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32PubKeyRange() test 1\n", __func__);
+
+    BRBIP32PubKey(pubKey, sizeof(pubKey), mpk, SEQUENCE_EXTERNAL_CHAIN, 1);
+    if (memcmp(pubKeys[1].p, pubKey, sizeof(pubKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32PubKeyRange() test 2\n", __func__);
+
     UInt512 dk;
     BRAddress addr;
 
@@ -1670,6 +1884,8 @@ static int BRTransactionEqual (BRTransaction *tx1, BRTransaction *tx2) {
     return 1;
 }
 
+int BRTransactionSigHashCacheTest(const BRTransaction *tx, int hashType);
+
 int BRTransactionTests()
 {
     int r = 1;
@@ -1764,6 +1980,57 @@ int BRTransactionTests()
     
     if (len4 != len5 || memcmp(buf4, buf5, len4) != 0)
         r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionSerialize() test 2", __func__);
+    
+    BRTransactionView view;
+    BRTxOutputView out;
+    size_t off;
+    
+    if (! BRTransactionViewInit(&view, buf4, len4) || ! UInt256Eq(view.txHash, tx->txHash) ||
+        view.inCount != tx->inCount || view.outCount != tx->outCount || view.len != len4)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewInit() test", __func__);
+    
+    off = view.outOff;
+    BRTransactionViewOutput(&view, &off, &out);
+    if (out.amount != tx->outputs[0].amount || out.scriptLen != tx->outputs[0].scriptLen ||
+        memcmp(out.script, tx->outputs[0].script, out.scriptLen) != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewOutput() test", __func__);
+    
+    uint8_t bad[80] = { 0x01, 0x00, 0x00, 0x00, 0x01 }; // one input, script length varint at offset 41
+    
+    bad[41] = 0xff, UInt64SetLE(&bad[42], (uint64_t)-44); // script length that wraps off back to 10
+    if (BRTransactionViewInit(&view, bad, sizeof(bad)) || BRTransactionParse(bad, sizeof(bad)))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewInit() test 2", __func__);
+    
+    memset(&bad[41], 0, sizeof(bad) - 41);
+    bad[46] = 0x01; // one output, script length varint at offset 55
+    bad[55] = 0xff, UInt64SetLE(&bad[56], (uint64_t)-60); // script length that wraps off back to 4
+    if (BRTransactionViewInit(&view, bad, sizeof(bad)) || BRTransactionParse(bad, sizeof(bad)))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionViewInit() test 3", __func__);
+    
+    BRTransaction *ref = BRTransactionParse(buf4, len4);
+    
+    BRTransactionAddOutput(tx, 1234567, script, scriptLen); // parsed tx data is in one allocation, test growing it
+    if (tx->outCount != 11 || tx->outputs[10].amount != 1234567 || tx->outputs[10].scriptLen != scriptLen ||
+        memcmp(tx->outputs[10].script, script, scriptLen) != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionAddOutput() test", __func__);
+    
+    for (size_t i = 0; ref && i < ref->outCount; i++) { // earlier outputs and inputs must survive the move
+        if (tx->outputs[i].amount != ref->outputs[i].amount || tx->outputs[i].scriptLen != ref->outputs[i].scriptLen ||
+            memcmp(tx->outputs[i].script, ref->outputs[i].script, ref->outputs[i].scriptLen) != 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionAddOutput() test 2", __func__);
+    }
+    
+    for (size_t i = 0; ref && i < ref->inCount; i++) {
+        if (tx->inputs[i].scriptLen != ref->inputs[i].scriptLen || tx->inputs[i].sigLen != ref->inputs[i].sigLen ||
+            memcmp(tx->inputs[i].script, ref->inputs[i].script, ref->inputs[i].scriptLen) != 0 ||
+            memcmp(tx->inputs[i].signature, ref->inputs[i].signature, ref->inputs[i].sigLen) != 0)
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionAddOutput() test 3", __func__);
+    }
+    
+    BRTxInputSetSignature(&tx->inputs[0], NULL, 0);
+    if (! ref || BRTransactionIsSigned(tx))
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTxInputSetSignature() test", __func__);
+    if (ref) BRTransactionFree(ref);
     BRTransactionFree(tx);
 
     BRTransaction *src = BRTransactionNew ();
@@ -1816,6 +2083,28 @@ int BRTransactionTests()
     BRTransactionFree(tgt);
     BRTransactionFree(src);
 
+    tx = BRTransactionNew(); // more inputs than outputs, so SIGHASH_SINGLE also covers inputs without a matching output
+    
+    for (size_t i = 0; i < 5; i++) {
+        inHash.u8[0] = (uint8_t)i;
+        BRTransactionAddInput(tx, inHash, (uint32_t)i, 1000000*(i + 1), script, scriptLen - (i % 2), NULL, 0,
+                              TXIN_SEQUENCE - (uint32_t)i);
+    }
+    
+    for (size_t i = 0; i < 3; i++) BRTransactionAddOutput(tx, 1000000*(i + 1), script, scriptLen);
+    tx->lockTime = 1000;
+    
+    // SIGHASH_ALL, then SIGHASH_ALL, SIGHASH_NONE and SIGHASH_SINGLE with SIGHASH_FORKID, with and without
+    // SIGHASH_ANYONECANPAY
+    int hashTypes[] = { 0x01, 0x41, 0x42, 0x43, 0xc1, 0xc2, 0xc3 };
+    
+    for (size_t i = 0; i < sizeof(hashTypes)/sizeof(*hashTypes); i++) {
+        if (! BRTransactionSigHashCacheTest(tx, hashTypes[i]))
+            r = 0, fprintf(stderr, "\n***FAILED*** %s: BRTransactionSigHashCache() test %zu", __func__, i + 1);
+    }
+    
+    BRTransactionFree(tx);
+
     if (! r) fprintf(stderr, "\n                                    ");
     return r;
 }
@@ -1849,6 +2138,8 @@ static void walletTxDeleted(void *info, UInt256 txHash, int notifyUser, int reco
 // TODO: test tx ordering for multiple tx with same block height
 // TODO: port all applicable tests from bitcoinj and bitcoincore
 
+void BRWalletUpdateBalanceTest(BRWallet *wallet);
+
 int BRWalletTests()
 {
     int r = 1;
@@ -1928,7 +2219,28 @@ int BRWalletTests()
 
     if (BRWalletAllAddrs(w, NULL, 0) != SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL + 1)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletAllAddrs() test\n", __func__);
-    
+
+    BRScriptHash addrHash;
+    BRAddress addr2 = BR_ADDRESS_NONE;
+
+    BRWalletAllAddrHashes(w, &addrHash, 1);
+    BRScriptHashAddress(addr2.s, sizeof(addr2), &addrHash);
+    if (! BRWalletContainsAddress(w, addr2.s))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletAllAddrHashes() test\n", __func__);
+
+    if (! BRWalletContainsAddrHash(w, &addrHash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletContainsAddrHash() test 1\n", __func__);
+
+    addrHash.data[0] ^= 0xff;
+    if (BRWalletContainsAddrHash(w, &addrHash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletContainsAddrHash() test 2\n", __func__);
+
+    addr2 = BR_ADDRESS_NONE;
+    if (BRWalletUnusedAddrHashes(w, &addrHash, 1, 0) == 1) BRScriptHashAddress(addr2.s, sizeof(addr2), &addrHash);
+    recvAddr = BRWalletReceiveAddress(w);
+    if (! BRAddressEq(&addr2, &recvAddr))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUnusedAddrHashes() test\n", __func__);
+
     UInt256 hash = tx->txHash;
 
     tx = BRWalletCreateTransaction(w, SATOSHIS*2, addr.s);
@@ -1948,6 +2260,9 @@ int BRWalletTests()
     if (tx && BRWalletBalance(w) + BRWalletFeeForTx(w, tx) != SATOSHIS/2)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransaction() test 5\n", __func__);
     
+    if (tx && BRWalletBalanceAfterTx(w, tx) != BRWalletBalance(w))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletBalanceAfterTx() test\n", __func__);
+    
     if (BRWalletTransactions(w, NULL, 0) != 2)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactions() test 3\n", __func__);
     
@@ -1962,7 +2277,29 @@ int BRWalletTests()
 
     if (tx && BRWalletTransactionIsPending(w, tx))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsPending() test 2\n", __func__);
-    
+
+    BRTransaction *pageTx[2] = { NULL, NULL };
+    uint64_t pageBalances[2] = { 0, 0 };
+
+    BRWalletUpdateTransactions(w, &hash, 1, 100, 1); // confirm the first tx, leaving the second one unconfirmed
+    if (BRWalletTxIndexForHash(w, hash) != 0 || (tx && BRWalletTxIndexForHash(w, tx->txHash) != 1) ||
+        BRWalletTxIndexForHash(w, UINT256_ZERO) != SIZE_MAX)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxIndexForHash() test\n", __func__);
+
+    if (BRWalletTxIndexForHeight(w, 100) != 0 || BRWalletTxIndexForHeight(w, 101) != 1 ||
+        BRWalletTxIndexForHeight(w, TX_UNCONFIRMED) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxIndexForHeight() test\n", __func__);
+
+    if (BRWalletTxIndexForTime(w, 1) != 0 || BRWalletTxIndexForTime(w, 2) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTxIndexForTime() test\n", __func__);
+
+    if (BRWalletTransactionsAt(w, NULL, NULL, 0, 1) != 1 || BRWalletTransactionsAt(w, NULL, NULL, 0, 2) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionsAt() test 1\n", __func__);
+
+    if (BRWalletTransactionsAt(w, pageTx, pageBalances, 2, 0) != 2 || ! UInt256Eq(pageTx[0]->txHash, hash) ||
+        pageTx[1] != tx || pageBalances[0] != SATOSHIS || pageBalances[1] != BRWalletBalance(w))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionsAt() test 2\n", __func__);
+
     BRWalletRemoveTransaction(w, hash); // removing first tx should recursively remove second, leaving none
     if (BRWalletTransactions(w, NULL, 0) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRemoveTransaction() test\n", __func__);
@@ -1993,6 +2330,158 @@ int BRWalletTests()
 
     BRTransactionFree(tx);
     BRWalletFree(w);
+
+    tx = BRTransactionNew();
+    BRTransactionAddInput(tx, inHash, 0, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, 2000000, outScript, outScriptLen);
+    BRTransactionAddOutput(tx, 500000, outScript, outScriptLen);
+    BRTransactionAddOutput(tx, 300000, outScript, outScriptLen);
+    BRTransactionSign(tx, 0, &k, 1);
+    w = BRWalletNew(&tx, 1, mpk);
+    BRWalletSetCallbacks(w, w, walletBalanceChanged, walletTxAdded, walletTxUpdated, walletTxDeleted);
+    tx = BRWalletCreateTransaction(w, 782000, addr.s); // 500000 + 300000 pays this plus fee with no change output
+    
+    if (! tx || tx->inCount != 2 || tx->outCount != 1 || BRWalletFeeForTx(w, tx) != 18000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletCreateTransaction() test 5\n", __func__);
+
+    if (tx) BRTransactionFree(tx);
+    BRWalletFree(w);
+
+    tx = BRTransactionNew();
+    BRTransactionAddInput(tx, inHash, 0, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, SATOSHIS, outScript, outScriptLen);
+    BRTransactionSign(tx, 0, &k, 1);
+    tx->blockHeight = 100;
+    w = BRWalletNew(&tx, 1, mpk);
+    BRWalletSetCallbacks(w, w, walletBalanceChanged, walletTxAdded, walletTxUpdated, walletTxDeleted);
+    tx = BRWalletCreateTransaction(w, SATOSHIS/2, addr.s);
+    if (tx) tx->inputs[0].sequence = 0; // replace-by-fee makes the spend pending
+    if (tx) BRWalletSignTransaction(w, tx, 0, "", 1), tx->timestamp = 1, BRWalletRegisterTransaction(w, tx);
+
+    if (! tx || ! BRWalletTransactionIsPending(w, tx) || BRWalletBalance(w) != 0 || BRWalletUTXOs(w, NULL, 0) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransaction() pending spend test\n", __func__);
+
+    BRWalletFree(w);
+
+    BRUTXO utxos[2], rebuiltUtxos[2];
+    uint64_t balance;
+    size_t utxoCount;
+
+    tx = BRTransactionNew();
+    BRTransactionAddInput(tx, inHash, 0, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, SATOSHIS, outScript, outScriptLen);
+    BRTransactionAddOutput(tx, SATOSHIS*2, outScript, outScriptLen);
+    BRTransactionSign(tx, 0, &k, 1);
+    tx->blockHeight = 100;
+    w = BRWalletNew(&tx, 1, mpk);
+    BRWalletSetCallbacks(w, w, walletBalanceChanged, walletTxAdded, walletTxUpdated, walletTxDeleted);
+    tx = BRWalletCreateTransaction(w, SATOSHIS/2, addr.s); // spends the SATOSHIS output, the smallest that covers it
+    if (tx) tx->inputs[0].sequence = 0; // replace-by-fee makes the spend pending
+    if (tx) BRWalletSignTransaction(w, tx, 0, "", 1), tx->timestamp = 1, BRWalletRegisterTransaction(w, tx);
+    balance = BRWalletBalance(w);
+    utxoCount = BRWalletUTXOs(w, utxos, 2);
+    BRWalletUpdateBalanceTest(w); // the full rebuild must match the incrementally applied spend
+
+    if (! tx || tx->inCount != 1 || balance != SATOSHIS*2 || utxoCount != 1 || BRWalletBalance(w) != balance ||
+        BRWalletUTXOs(w, rebuiltUtxos, 2) != utxoCount || ! BRUTXOEq(&utxos[0], &rebuiltUtxos[0]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransaction() pending spend test 2\n", __func__);
+
+    BRWalletFree(w);
+
+    BRTransaction *unconfTx[2];
+    
+    w = BRWalletNew(NULL, 0, mpk);
+    
+    for (size_t i = 0; i < 2; i++) {
+        unconfTx[i] = BRTransactionNew();
+        BRTransactionAddInput(unconfTx[i], inHash, 2 + i, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+        BRTransactionAddOutput(unconfTx[i], SATOSHIS*(i + 1), outScript, outScriptLen);
+        BRTransactionSign(unconfTx[i], 0, &k, 1);
+        unconfTx[i]->timestamp = 1 + i;
+        BRWalletRegisterTransaction(w, unconfTx[i]);
+    }
+    
+    BRWalletUpdateTransactions(w, &unconfTx[1]->txHash, 1, 100, 1); // confirm the second tx first, moving it ahead
+    if (BRWalletTransactionsAt(w, pageTx, pageBalances, 2, 0) != 2 || pageTx[0] != unconfTx[1] ||
+        pageTx[1] != unconfTx[0] || pageBalances[0] != SATOSHIS*2 || pageBalances[1] != SATOSHIS*3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionsAt() test 3\n", __func__);
+    
+    BRWalletFree(w);
+
+    BRTransaction *txs[2];
+    
+    txs[1] = BRTransactionNew();
+    BRTransactionAddInput(txs[1], inHash, 0, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(txs[1], SATOSHIS, outScript, outScriptLen);
+    BRTransactionAddOutput(txs[1], SATOSHIS, inScript, inScriptLen);
+    BRTransactionSign(txs[1], 0, &k, 1);
+    hash = txs[1]->txHash;
+    txs[0] = BRTransactionNew(); // spends txs[1] in the same block, but is listed first
+    BRTransactionAddInput(txs[0], hash, 1, SATOSHIS, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(txs[0], SATOSHIS/2, outScript, outScriptLen);
+    BRTransactionSign(txs[0], 0, &k, 1);
+    txs[0]->blockHeight = txs[1]->blockHeight = 100;
+    w = BRWalletNew(txs, 2, mpk);
+    
+    if (! w || BRWalletTransactions(w, txs, 2) != 2 || ! UInt256Eq(txs[0]->txHash, hash) ||
+        BRWalletBalance(w) != SATOSHIS + SATOSHIS/2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNew() test 2\n", __func__);
+    
+    if (w) {
+        size_t snapshotLen = BRWalletSnapshot(w, NULL, 0, inHash);
+        uint8_t snapshot[snapshotLen];
+        BRWallet *w2;
+        
+        BRWalletSnapshot(w, snapshot, sizeof(snapshot), inHash);
+        if (! UInt256Eq(BRWalletSnapshotBlockHash(snapshot, sizeof(snapshot)), inHash))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSnapshotBlockHash() test 1\n", __func__);
+        
+        txs[0] = BRTransactionCopy(txs[0]);
+        txs[1] = BRTransactionCopy(txs[1]);
+        w2 = BRWalletNewWithSnapshot(txs, 2, mpk, snapshot, sizeof(snapshot));
+        
+        if (! w2 || BRWalletBalance(w2) != BRWalletBalance(w) ||
+            BRWalletAllAddrs(w2, NULL, 0) != BRWalletAllAddrs(w, NULL, 0))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNewWithSnapshot() test\n", __func__);
+        
+        snapshot[sizeof(snapshot)/2] ^= 1;
+        if (! UInt256IsZero(BRWalletSnapshotBlockHash(snapshot, sizeof(snapshot))))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSnapshotBlockHash() test 2\n", __func__);
+        
+        if (w2) BRWalletFree(w2);
+        BRWalletFree(w);
+    }
+    
+    txs[0] = BRTransactionNew(); // pending until block 1000 is near, the wallet's block height starts at 0
+    BRTransactionAddInput(txs[0], inHash, 0, 1, inScript, inScriptLen, NULL, 0, TXIN_SEQUENCE - 1);
+    BRTransactionAddOutput(txs[0], SATOSHIS, outScript, outScriptLen);
+    txs[0]->lockTime = 1000;
+    BRTransactionSign(txs[0], 0, &k, 1);
+    w = BRWalletNew(txs, 1, mpk);
+    
+    if (! w || BRWalletBalance(w) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNew() test 3\n", __func__);
+    
+    if (w) {
+        size_t snapshotLen = BRWalletSnapshot(w, NULL, 0, inHash);
+        uint8_t snapshot[snapshotLen];
+        BRWallet *w2;
+        
+        // move the snapshot's wallet height, after its magic, version, block hash and key, up to the lockTime, this
+        // stands in for the time or block height passing that ends a tx's pending status after a snapshot is taken
+        BRWalletSnapshot(w, snapshot, sizeof(snapshot), inHash);
+        UInt32SetLE(&snapshot[sizeof(uint32_t)*2 + sizeof(UInt256)*2], 1000);
+        BRSHA256_2(&hash, snapshot, sizeof(snapshot) - sizeof(uint32_t));
+        memcpy(&snapshot[sizeof(snapshot) - sizeof(uint32_t)], &hash, sizeof(uint32_t));
+        txs[0] = BRTransactionCopy(txs[0]);
+        w2 = BRWalletNewWithSnapshot(txs, 1, mpk, snapshot, sizeof(snapshot));
+        
+        if (! w2 || BRWalletBalance(w2) != SATOSHIS || BRWalletUTXOs(w2, NULL, 0) != 1)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNewWithSnapshot() test 2\n", __func__);
+        
+        if (w2) BRWalletFree(w2);
+        BRWalletFree(w);
+    }
     
     amt = BRBitcoinAmount(50000, 50000);
     if (amt != SATOSHIS) r = 0, fprintf(stderr, "***FAILED*** %s: BRBitcoinAmount() test 1\n", __func__);
@@ -2080,7 +2569,79 @@ int BRBloomFilterTests()
     if (len2 != sizeof(d2) - 1 || memcmp(buf2, d2, len2) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterSerialize() test 2\n", __func__);
     
-    BRBloomFilterFree(f);    
+    BRBloomFilterFree(f);
+    f = BRBloomFilterNew(0.01, 3, 0, BLOOM_UPDATE_ALL);
+
+    // batch insert should produce the same filter as inserting one at a time, with duplicates only added once
+    const uint8_t *items[] = { (uint8_t *)data1, (uint8_t *)data3, (uint8_t *)data1, (uint8_t *)data4 };
+    size_t itemLens[] = { sizeof(data1) - 1, sizeof(data3) - 1, sizeof(data1) - 1, sizeof(data4) - 1 };
+    
+    if (BRBloomFilterInsertBatch(f, items, itemLens, 4) != 3 || f->elemCount != 3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterInsertBatch() test\n", __func__);
+
+    uint8_t buf3[BRBloomFilterSerialize(f, NULL, 0)];
+    size_t len3 = BRBloomFilterSerialize(f, buf3, sizeof(buf3));
+    
+    if (len3 != sizeof(d1) - 1 || memcmp(buf3, d1, len3) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterSerialize() test 3\n", __func__);
+
+    if (! BRBloomFilterTestAndInsertData(f, (uint8_t *)data3, sizeof(data3) - 1) || f->elemCount != 3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterTestAndInsertData() test 1\n", __func__);
+
+    if (BRBloomFilterTestAndInsertData(f, (uint8_t *)data2, sizeof(data2) - 1) || f->elemCount != 4 ||
+        ! BRBloomFilterContainsData(f, (uint8_t *)data2, sizeof(data2) - 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterTestAndInsertData() test 2\n", __func__);
+
+    BRBloomFilterFree(f);
+    return r;
+}
+
+int BRCompactFilterTests()
+{
+    int r = 1;
+    // BIP158 test vector: basic filter for the testnet genesis block
+    UInt256 blockHash = UInt256Reverse(uint256("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943"));
+    uint8_t script[] = "\x41\x04\x67\x8a\xfd\xb0\xfe\x55\x48\x27\x19\x67\xf1\xa6\x71\x30\xb7\x10\x5c\xd6\xa8\x28\xe0"
+    "\x39\x09\xa6\x79\x62\xe0\xea\x1f\x61\xde\xb6\x49\xf6\xbc\x3f\x4c\xef\x38\xc4\xf3\x55\x04\xe5\x1e\xc1\x12\xde\x5c"
+    "\x38\x4d\xf7\xba\x0b\x8d\x57\x8a\x4c\x70\x2b\x6b\xf1\x1d\x5f\xac", other[] = "\x00\x14\x01\x02\x03";
+    const uint8_t *items[] = { script, other };
+    size_t itemLens[] = { sizeof(script) - 1, sizeof(other) - 1 };
+    BRCompactFilter *f = BRCompactFilterNew(COMPACT_FILTER_TYPE_BASIC, blockHash, items, itemLens, 1), *f2;
+    
+    if (f->length != 4 || memcmp(f->data, "\x01\x9d\xfc\xa8", 4) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCompactFilterNew() test\n", __func__);
+    
+    if (! UInt256Eq(UInt256Reverse(BRCompactFilterHeader(BRCompactFilterHash(f), UINT256_ZERO)),
+                    uint256("21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750")))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCompactFilterHeader() test\n", __func__);
+    
+    f2 = BRCompactFilterParse(COMPACT_FILTER_TYPE_BASIC, blockHash, f->data, f->length);
+    
+    if (! f2 || ! BRCompactFilterMatch(f2, script, sizeof(script) - 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCompactFilterMatch() test 1\n", __func__);
+    
+    if (f2 && BRCompactFilterMatch(f2, other, sizeof(other) - 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCompactFilterMatch() test 2\n", __func__);
+    
+    if (f2 && ! BRCompactFilterMatchAny(f2, items, itemLens, 2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCompactFilterMatchAny() test\n", __func__);
+    
+    if (BRCompactFilterParse(COMPACT_FILTER_TYPE_BASIC, blockHash, (const uint8_t *)"\x05\x9d", 2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCompactFilterParse() test\n", __func__);
+    
+    BRCompactFilterFree(f);
+    if (f2) BRCompactFilterFree(f2);
+    
+    const uint8_t *dupItems[] = { script, script, other };
+    size_t dupLens[] = { sizeof(script) - 1, sizeof(script) - 1, sizeof(other) - 1 };
+    
+    f = BRCompactFilterNew(COMPACT_FILTER_TYPE_BASIC, blockHash, dupItems, dupLens, 3);
+    
+    if (f->elemCount != 2 || ! BRCompactFilterMatch(f, script, sizeof(script) - 1) ||
+        ! BRCompactFilterMatch(f, other, sizeof(other) - 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCompactFilterNew() duplicate items test\n", __func__);
+    
+    BRCompactFilterFree(f);
     return r;
 }
 
@@ -2133,6 +2694,9 @@ int BRMerkleBlockTests()
     if (BRMerkleBlockSerialize(b, block2, sizeof(block2)) != sizeof(block2) ||
         memcmp(block, block2, sizeof(block2)) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockSerialize() test\n", __func__);
+
+    if (! UInt256Eq(b->txRoot, b->merkleRoot) || b->txHashesCount != 4)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParse() merkle tree test\n", __func__);
     
     if (! BRMerkleBlockContainsTxHash(b, uint256("4c30b63cfcdc2d35e3329421b9805ef0c6565d35381ca857762ea0b3a5a128bb")))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockContainsTxHash() test\n", __func__);
@@ -2156,6 +2720,28 @@ int BRMerkleBlockTests()
     if (! UInt256Eq(txHashes[3], uint256("c9ab658448c10b6921b7a4ce3021eb22ed6bb6a7fde1e5bcc4b1db6615c6abc5")))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockTxHashes() test 4\n", __func__);
     
+    uint8_t headers[81*40];
+    BRMerkleBlock *hdrs[40], *h;
+    
+    for (size_t i = 0; i < 40; i++) { // headers message payload with 40 headers that differ by nonce
+        memcpy(&headers[81*i], block, 80);
+        UInt32SetLE(&headers[81*i + 76], (uint32_t)i);
+        headers[81*i + 80] = 0;
+    }
+    
+    if (BRMerkleBlockParseHeaders(hdrs, 40, headers, sizeof(headers)) != 40)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseHeaders() test 0\n", __func__);
+    
+    for (size_t i = 0; i < 40; i++) {
+        h = BRMerkleBlockParse(&headers[81*i], 81);
+        
+        if (! UInt256Eq(h->blockHash, hdrs[i]->blockHash) || ! UInt256Eq(BRMerkleBlockPowHash(h), hdrs[i]->powHash))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseHeaders() test %zu\n", __func__, i + 1);
+        
+        BRMerkleBlockFree(h);
+        BRMerkleBlockFree(hdrs[i]);
+    }
+    
     BRMerkleBlock *c = BRMerkleBlockCopy(b);
 
     if (!BRMerkleBlockEqual(b, c))
@@ -2172,6 +2758,69 @@ int BRMerkleBlockTests()
     return r;
 }
 
+int BRHeaderStoreTests()
+{
+    int r = 1;
+    char path[] = "/tmp/BRHeaderStoreTestsXXXXXX";
+    int fd = mkstemp(path);
+    BRHeaderStore *store = (fd >= 0) ? BRHeaderStoreOpen(path) : NULL;
+    BRMerkleBlock blocks[3], b;
+    
+    if (fd >= 0) close(fd);
+    
+    if (! store) {
+        fprintf(stderr, "***FAILED*** %s: BRHeaderStoreOpen() test 1\n", __func__);
+        return 0;
+    }
+    
+    for (int i = 0; i < 3; i++) {
+        blocks[i] = BR_MERKLE_BLOCK_NONE;
+        blocks[i].version = 2;
+        blocks[i].prevBlock = (i > 0) ? blocks[i - 1].blockHash : UINT256_ZERO;
+        blocks[i].timestamp = 1486949366 + i*150;
+        blocks[i].target = 0x1e0ffff0;
+        blocks[i].nonce = i;
+        blocks[i].height = 2016 + i;
+        BRSHA256_2(&blocks[i].blockHash, &blocks[i].nonce, sizeof(blocks[i].nonce));
+        if (! BRHeaderStoreAppend(store, &blocks[i]))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreAppend() test 1\n", __func__);
+    }
+    
+    if (BRHeaderStoreAppend(store, &blocks[1])) // doesn't connect to the last stored header
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreAppend() test 2\n", __func__);
+    
+    BRHeaderStoreClose(store);
+    store = BRHeaderStoreOpen(path); // reopen to check that headers were persisted
+    
+    if (! store) {
+        fprintf(stderr, "***FAILED*** %s: BRHeaderStoreOpen() test 2\n", __func__);
+        unlink(path);
+        return 0;
+    }
+    
+    if (BRHeaderStoreCount(store) != 3 || BRHeaderStoreStartHeight(store) != 2016)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreCount() test\n", __func__);
+    
+    if (! BRHeaderStoreBlockAtHeight(store, 2017, &b) || ! BRMerkleBlockEqual(&b, &blocks[1]) ||
+        BRHeaderStoreBlockAtHeight(store, 2019, &b))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreBlockAtHeight() test\n", __func__);
+    
+    if (BRHeaderStoreHeightForHash(store, blocks[2].blockHash) != 2018 ||
+        BRHeaderStoreHeightForHash(store, UINT256_ZERO) != BLOCK_UNKNOWN_HEIGHT)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreHeightForHash() test\n", __func__);
+    
+    BRHeaderStoreTruncate(store, 2017);
+    
+    if (BRHeaderStoreCount(store) != 1 ||
+        BRHeaderStoreHeightForHash(store, blocks[1].blockHash) != BLOCK_UNKNOWN_HEIGHT ||
+        ! BRHeaderStoreAppend(store, &blocks[1]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreTruncate() test\n", __func__);
+    
+    BRHeaderStoreClose(store);
+    unlink(path);
+    return r;
+}
+
 int BRPaymentProtocolTests()
 {
     int r = 1;
@@ -2615,8 +3264,185 @@ int BRPeerTests()
     int r = 1;
     BRPeer *p = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
     const char msg[] = "my message";
+    BRPeerStats stats;
+    size_t i, latencyCount = 0;
     
     BRPeerAcceptMessageTest(p, (const uint8_t *)msg, sizeof(msg) - 1, "inv");
+    BRPeerGetStats(p, &stats);
+    for (i = 0; i < PEER_STATS_MSG_TYPES - 1 && strcmp(BRPeerStatsMessageType(i), MSG_INV) != 0; i++);
+    
+    if (i == PEER_STATS_MSG_TYPES - 1 || stats.recvCount[i] != 1 || stats.recvBytes[i] != 24 + sizeof(msg) - 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerGetStats() test 1\n", __func__);
+    
+    for (size_t j = 0; i < PEER_STATS_MSG_TYPES && j < PEER_STATS_LATENCY_BUCKETS; j++) {
+        latencyCount += stats.handlerLatency[i][j];
+    }
+    
+    if (latencyCount != 1) r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerGetStats() test 2\n", __func__);
+    
+    BRPeerAcceptMessageTest(p, (const uint8_t *)msg, sizeof(msg) - 1, "unknown");
+    BRPeerGetStats(p, &stats);
+    
+    if (stats.recvCount[PEER_STATS_MSG_TYPES - 1] != 1 || *BRPeerStatsMessageType(PEER_STATS_MSG_TYPES - 1) != '\0')
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerGetStats() test 3\n", __func__);
+    
+    return r;
+}
+
+int BRPeerManagerPeerCostCompareTest(const BRPeer *peer, const BRPeer *otherPeer);
+double BRPeerManagerPeerCostTest(const BRPeer *peer, double pingTime);
+void BRPeerManagerRelayedPeersTest(BRPeerManager *manager, const BRPeer peers[], size_t peersCount);
+size_t BRPeerManagerTxPeerListChurnTest(const BRPeer peers[], size_t peersCount, UInt256 txHash);
+BRPeer BRPeerManagerOrphanRelayerTest(BRPeerManager *manager, BRMerkleBlock *orphan, const BRPeer *relayer,
+                                      const BRPeer *peer);
+void BRPeerManagerPublishWalletTxTest(BRPeerManager *manager, BRTransaction *tx);
+BRTransaction *BRPeerManagerPublishedTxTest(BRPeerManager *manager, UInt256 txHash);
+uint32_t BRPeerManagerHeadersDoneTest(BRPeerManager *manager, uint32_t estimatedHeight);
+uint32_t BRPeerManagerWalletUpdatesTest(BRPeerManager *manager, UInt256 txHash, const uint32_t heights[], size_t count);
+
+static BRPeer savedPeers[10];
+static size_t savedPeersCount = 0;
+
+static void managerSavePeers(void *info, int replace, const BRPeer peers[], size_t peersCount)
+{
+    savedPeersCount = (peersCount < 10) ? peersCount : 10;
+    memcpy(savedPeers, peers, savedPeersCount*sizeof(*peers));
+}
+
+int BRPeerManagerTests()
+{
+    int r = 1;
+    BRMasterPubKey mpk = BRBIP32MasterPubKey("", 1);
+    BRWallet *w = BRWalletNew(NULL, 0, mpk);
+    uint32_t now = (uint32_t)time(NULL);
+    BRPeer a = BR_PEER_NONE, b = BR_PEER_NONE, c = BR_PEER_NONE, d, peers[3];
+    BRMerkleBlock *orphan = BRMerkleBlockNew(), *orphan2 = BRMerkleBlockNew();
+    BRPeerManager *m;
+    size_t i;
+    
+    a.address.u32[3] = 1, a.port = BR_CHAIN_PARAMS.standardPort, a.timestamp = now - 100;
+    a.pingTime = 100, a.syncRate = 500; // 0.1s ping, 1s per 500 blocks
+    b.address.u32[3] = 2, b.port = BR_CHAIN_PARAMS.standardPort, b.timestamp = now - 200; // no score yet
+    c.address.u32[3] = 3, c.port = BR_CHAIN_PARAMS.standardPort, c.timestamp = now, c.pingTime = 900;
+    d = b, d.timestamp = b.timestamp + 1;
+    
+    if (BRPeerManagerPeerCostTest(&a, 0.1) >= BRPeerManagerPeerCostTest(&b, 0.1) ||
+        BRPeerManagerPeerCostTest(&a, 0.1) >= BRPeerManagerPeerCostTest(&a, 0.2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: _BRPeerCost() test\n", __func__);
+    
+    if (BRPeerManagerPeerCostCompareTest(&a, &b) >= 0 || BRPeerManagerPeerCostCompareTest(&b, &c) >= 0 ||
+        BRPeerManagerPeerCostCompareTest(&c, &a) <= 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: _peerCostCompare() test 1\n", __func__);
+    
+    if (BRPeerManagerPeerCostCompareTest(&d, &b) >= 0) // equal cost, so the most recent peer is first
+        r = 0, fprintf(stderr, "***FAILED*** %s: _peerCostCompare() test 2\n", __func__);
+    
+    peers[0] = a, peers[1] = b;
+    m = BRPeerManagerNew(&BR_CHAIN_PARAMS, w, 0, NULL, 0, peers, 2, BLOOM_DEFAULT_FALSEPOSITIVE_RATE);
+    BRPeerManagerSetCallbacks(m, m, NULL, NULL, NULL, NULL, managerSavePeers, NULL, NULL);
+    peers[0] = a, peers[0].timestamp = now, peers[0].pingTime = peers[0].syncRate = 0; // relayed without a score
+    peers[1] = peers[2] = c; // relayed twice
+    BRPeerManagerRelayedPeersTest(m, peers, 3);
+    
+    if (savedPeersCount != 3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: _peerRelayedPeers() test 1\n", __func__);
+    
+    for (i = 0; i < savedPeersCount && ! BRPeerEq(&savedPeers[i], &a); i++);
+    
+    if (i == savedPeersCount || savedPeers[i].timestamp != now || savedPeers[i].pingTime != a.pingTime ||
+        savedPeers[i].syncRate != a.syncRate) // timestamp refreshed, score kept
+        r = 0, fprintf(stderr, "***FAILED*** %s: _peerRelayedPeers() test 2\n", __func__);
+    
+    orphan->prevBlock = uint256("0000000000000000000000000000000000000000000000000000000000000001");
+    orphan2->prevBlock = orphan->prevBlock;
+    orphan->timestamp = orphan2->timestamp = now;
+    d = BRPeerManagerOrphanRelayerTest(m, orphan, &a, &b); // orphan relayed by a, connected by a block from b
+    
+    if (! BRPeerEq(&d, &a))
+        r = 0, fprintf(stderr, "***FAILED*** %s: _BRPeerManagerOrphanRelayer() test 1\n", __func__);
+    
+    d = BRPeerManagerOrphanRelayerTest(m, orphan2, &c, &b); // the latest orphan with the same prevBlock wins
+    
+    if (! BRPeerEq(&d, &c))
+        r = 0, fprintf(stderr, "***FAILED*** %s: _BRPeerManagerOrphanRelayer() test 2\n", __func__);
+    
+    orphan->prevBlock = UINT256_ZERO;
+    d = BRPeerManagerOrphanRelayerTest(m, orphan, NULL, &b); // unknown relayer
+    
+    if (! BRPeerEq(&d, &b))
+        r = 0, fprintf(stderr, "***FAILED*** %s: _BRPeerManagerOrphanRelayer() test 3\n", __func__);
+    
+    BRMerkleBlockFree(orphan);
+    BRMerkleBlockFree(orphan2);
+    
+    BRWallet *w2 = BRWalletNew(NULL, 0, BRBIP32MasterPubKey("2", 1));
+    BRAddress addr1 = BRWalletReceiveAddress(w), addr2 = BRWalletReceiveAddress(w2);
+    uint8_t script1[BRAddressScriptPubKey(NULL, 0, addr1.s)], script2[BRAddressScriptPubKey(NULL, 0, addr2.s)],
+            sig[] = { 0x00 }; // the wallets only check that a signature is present
+    UInt256 inHash = uint256("0000000000000000000000000000000000000000000000000000000000000002"), txHash[2];
+    BRTransaction *tx, *tx1, *tx2;
+    
+    BRAddressScriptPubKey(script1, sizeof(script1), addr1.s);
+    BRAddressScriptPubKey(script2, sizeof(script2), addr2.s);
+    BRPeerManagerAddWallet(m, w2, 0);
+    
+    for (i = 0; i < 2; i++) { // the first tx pays both wallets, the second pays only the second wallet
+        tx = BRTransactionNew();
+        BRTransactionAddInput(tx, inHash, (uint32_t)i, 1, NULL, 0, sig, sizeof(sig), TXIN_SEQUENCE);
+        if (i == 0) BRTransactionAddOutput(tx, SATOSHIS, script1, sizeof(script1));
+        BRTransactionAddOutput(tx, SATOSHIS, script2, sizeof(script2));
+        
+        uint8_t buf[BRTransactionSerialize(tx, NULL, 0)]; // parsing sets txHash
+        
+        BRTransactionSerialize(tx, buf, sizeof(buf));
+        BRTransactionFree(tx);
+        tx = BRTransactionParse(buf, sizeof(buf));
+        txHash[i] = tx->txHash;
+        BRPeerManagerPublishWalletTxTest(m, tx);
+    }
+    
+    tx1 = BRWalletTransactionForHash(w, txHash[0]);
+    tx2 = BRWalletTransactionForHash(w2, txHash[0]);
+    
+    if (! tx1 || ! tx2 || tx1 == tx2 || BRWalletBalance(w) != SATOSHIS || BRWalletBalance(w2) != SATOSHIS*2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerAddWallet() test\n", __func__);
+    
+    tx2 = BRWalletTransactionForHash(w2, txHash[1]);
+    BRPeerManagerRemoveWallet(m, w2); // published tx held by the second wallet must be moved out of it
+    tx = BRPeerManagerPublishedTxTest(m, txHash[1]);
+    
+    if (! tx1 || BRPeerManagerPublishedTxTest(m, txHash[0]) != tx1 || ! tx2 || ! tx || tx == tx2 ||
+        ! UInt256Eq(tx->txHash, txHash[1]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerRemoveWallet() test\n", __func__);
+    
+    uint32_t heights[] = { 10, 20 };
+    
+    // updates queued by a block are applied in order, and not while a peer callback holds the chain lock
+    if (BRPeerManagerWalletUpdatesTest(m, txHash[0], heights, 2) != TX_UNCONFIRMED || tx1->blockHeight != 20)
+        r = 0, fprintf(stderr, "***FAILED*** %s: _BRPeerManagerApplyWalletUpdates() test\n", __func__);
+    
+    BRWalletFree(w2);
+    BRPeerManagerFree(m);
+    
+    // a headers-first sync that doesn't need any merkleblocks, so it's done once the header chain is
+    m = BRPeerManagerNew(&BR_CHAIN_PARAMS, w, now, NULL, 0, NULL, 0, BLOOM_DEFAULT_FALSEPOSITIVE_RATE);
+    BRPeerManagerSetHeadersFirst(m, 1);
+    
+    // a header chain that ends below the estimated height doesn't wait for headers that aren't coming
+    if (BRPeerManagerHeadersDoneTest(m, BRPeerManagerLastBlockHeight(m) + 100) != BRPeerManagerLastBlockHeight(m))
+        r = 0, fprintf(stderr, "***FAILED*** %s: _peerHeadersDone() test\n", __func__);
+    
+    BRPeerManagerFree(m);
+    
+    BRPeer churn[100];
+    UInt256 churnHash = uint256("0000000000000000000000000000000000000000000000000000000000000100");
+    
+    for (i = 0; i < 100; i++) churn[i] = a, churn[i].address.u32[3] = (uint32_t)(100 + i);
+    
+    // more peers than there are slots connect and disconnect while the first one stays connected
+    if (BRPeerManagerTxPeerListChurnTest(churn, 100, churnHash) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: _BRTxPeerListRemovePeerAll() test\n", __func__);
+    BRWalletFree(w);
     return r;
 }
 
@@ -2630,6 +3456,8 @@ int BRRunTests()
     printf("%s\n", (BRArrayTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRSetTests...                       ");
     printf("%s\n", (BRSetTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRMapTests...                       ");
+    printf("%s\n", (BRMapTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRBase58Tests...                    ");
     printf("%s\n", (BRBase58Tests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRBech32Tests...                    ");
@@ -2664,8 +3492,14 @@ int BRRunTests()
     printf("%s\n", (BRWalletTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRBloomFilterTests...               ");
     printf("%s\n", (BRBloomFilterTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRCompactFilterTests...             ");
+    printf("%s\n", (BRCompactFilterTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRMerkleBlockTests...               ");
     printf("%s\n", (BRMerkleBlockTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRHeaderStoreTests...               ");
+    printf("%s\n", (BRHeaderStoreTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRPeerManagerTests...               ");
+    printf("%s\n", (BRPeerManagerTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRPaymentProtocolTests...           ");
     printf("%s\n", (BRPaymentProtocolTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRPaymentProtocolEncryptionTests... ");